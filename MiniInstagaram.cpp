@@ -1,35 +1,569 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <unordered_set>
+#include <unordered_map>
+#include <deque>
+#include <functional>
+#include <cmath>
 #include <ctime>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <new>
+#include <type_traits>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <condition_variable>
+#include <filesystem>
+#include <cstdio>
+#include <csignal>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#ifdef _WIN32
 #include <windows.h>
+#include <psapi.h>
+#include <io.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#endif
 
 using namespace std;
 
 class User;
-class UserBST;
-class HashTable;
+class UserBTree;
+class UserTrie;
+class ShardedPostStore;
+class ShardedLoginTable;
+class UserDirectory;
 
 User* usersList = nullptr; //linked list of users
-HashTable* loginTable = nullptr; //hash table for login
-UserBST* userSearchTree = nullptr; //BST for searching users
+extern UserDirectory usersById; //every registered user, indexed by User::id
+ShardedLoginTable* loginTable = nullptr; //hash table for login
+UserBTree* userSearchTree = nullptr; //B+-tree for searching users
+UserTrie* userNameIndex = nullptr; //trie for typeahead and fuzzy search
+ShardedPostStore* postStore = nullptr; //every post, referenced by id from timelines and feeds
+
+const size_t MIN_PASSWORD_LENGTH = 6;
+const size_t SEARCH_RESULT_LIMIT = 10;
+const int FUZZY_MAX_DISTANCE = 2;
+int fanoutLimit = 1000; //friends above which posts are pulled on read instead of pushed
+int shardCount = 1; //shards the cities are spread over, fixed before initEngine
+const uint32_t MAX_SHARDS = 16;
+int passwordCost = 14; //scrypt log2 N for new password hashes; the console calibrates it at startup
+int passwordBlockSize = 8; //scrypt r, 128*r bytes per table entry
+const double PASSWORD_TARGET_MS = 100; //verify latency the console calibrates for, unless MINSTAGRAM_PASSWORD_MS says otherwise
+
+//locks for concurrent sessions, always taken in this order: the mutation gate,
+//registryLock, one user stripe, then indexLock or a login shard, then one feed or
+//conversation stripe. a thread never holds two stripes of the same array, so two
+//users that share a stripe can't deadlock each other
+const size_t LOCK_STRIPES = 1024;
+const size_t GATE_STRIPES = 64;
+
+struct alignas(64) SharedStripe {
+    shared_mutex lock;
+};
+
+struct alignas(64) Stripe {
+    mutex lock;
+};
+
+mutex registryLock; //signups: ids, usersList and the name indexes
+shared_mutex indexLock; //userSearchTree and userNameIndex
+SharedStripe userLocks[LOCK_STRIPES]; //a user's friends, timeline, pull list and inbox drains
+Stripe feedLocks[LOCK_STRIPES]; //a user's newsfeed ring
+Stripe conversationLocks[LOCK_STRIPES]; //a conversation's message log
+SharedStripe mutationGate[GATE_STRIPES]; //logged mutations share it, a snapshot cut takes all of it
 
 void setColor(int color) {
+#ifdef _WIN32
     SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE), color);
+#else
+    //map windows console attributes (bit 0 blue, 1 green, 2 red, 3 bright) to ansi codes
+    static const int ansi[8] = { 30, 34, 32, 36, 31, 35, 33, 37 };
+    cout << "\033[" << ((color & 8) ? "1;" : "0;") << ansi[color & 7] << "m";
+#endif
 }
 
-template <typename T>
-class Stack {
+void clearScreen() {
+#ifdef _WIN32
+    system("cls");
+#else
+    cout << "\033[2J\033[H";
+#endif
+}
+
+void pauseScreen() {
+#ifdef _WIN32
+    system("pause");
+#else
+    cout << "Press Enter to continue . . . " << flush;
+    //drop the newline left behind by a previous cin >> before waiting
+    if (cin.rdbuf()->in_avail() > 0)
+        cin.ignore(10000, '\n');
+    cin.get();
+#endif
+}
+
+void sleepMillis(int ms) {
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    usleep(ms * 1000);
+#endif
+}
+
+void formatTime(const time_t& t, char* buffer, size_t size) {
+#ifdef _WIN32
+    ctime_s(buffer, size, &t);
+#else
+    (void)size;
+    ctime_r(&t, buffer);
+#endif
+}
+
+//sink for headless callers that don't want the console text
+ostream discardStream(nullptr);
+
+//every operator new in the process, so the harness can report allocations per request
+atomic<uint64_t> heapAllocations(0);
+
+void* operator new(size_t size) {
+    heapAllocations.fetch_add(1, memory_order_relaxed);
+    if (void* memory = malloc(size != 0 ? size : 1))
+        return memory;
+    throw bad_alloc();
+}
+
+//gcc pairs the inlined free with the replaced operator new and warns needlessly
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void operator delete(void* memory) noexcept {
+    free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+    free(memory);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+size_t residentBytes() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+    return counters.WorkingSetSize;
+#else
+    ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+//index of the highest set bit, v != 0
+inline int highestBit(uint64_t v) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, v);
+    return static_cast<int>(index);
+#else
+    return 63 - __builtin_clzll(v);
+#endif
+}
+
+//hot-path measurements, exported by writeMetrics
+enum MetricHistogram {
+    HIST_LOGIN_PROBES,        //login table slots probed per lookup
+    HIST_INDEX_DEPTH,         //B+-tree levels descended per lookup
+    HIST_FAN_OUT_READERS,     //feeds a new post was pushed into
+    HIST_FAN_OUT_NANOS,       //time to push it
+    HIST_FRIEND_CHECK_LENGTH, //friend list length behind an isFollowing check
+    HIST_CONVERSATION_PROBES, //conversation index slots probed per lookup
+    HIST_REQUEST_QUEUE_DEPTH, //friend requests waiting when the inbox is drained
+    HIST_NOTIFICATION_DEPTH,  //notifications waiting when the inbox is drained
+    HIST_COUNT
+};
+
+//log-linear buckets in the manner of HdrHistogram: exact below 32, then 16 per
+//power of two, so a quantile is within 6.25% of the recorded value. each thread
+//owns its own histograms, so a record is a plain load and store with no lock prefix
+class Histogram {
+public:
+    static const int EXACT = 32;
+    static const int SUB_BUCKETS = 16;
+    static const int BUCKETS = EXACT + (64 - 5) * SUB_BUCKETS;
+
+    atomic<uint64_t> counts[BUCKETS];
+    atomic<uint64_t> sum;
+
+    Histogram() : sum(0) {
+        for (atomic<uint64_t>& count : counts)
+            count.store(0, memory_order_relaxed);
+    }
+
+    static int bucketOf(uint64_t value) {
+        if (value < EXACT)
+            return static_cast<int>(value);
+        int magnitude = highestBit(value);
+        return EXACT + (magnitude - 5) * SUB_BUCKETS + static_cast<int>((value >> (magnitude - 4)) - SUB_BUCKETS);
+    }
+
+    //the smallest value that lands in bucket
+    static uint64_t bucketFloor(int bucket) {
+        if (bucket < EXACT)
+            return static_cast<uint64_t>(bucket);
+        int magnitude = (bucket - EXACT) / SUB_BUCKETS + 5;
+        return static_cast<uint64_t>(SUB_BUCKETS + (bucket - EXACT) % SUB_BUCKETS) << (magnitude - 4);
+    }
+
+    //owning thread only
+    void record(uint64_t value) {
+        atomic<uint64_t>& count = counts[bucketOf(value)];
+        count.store(count.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        sum.store(sum.load(memory_order_relaxed) + value, memory_order_relaxed);
+    }
+};
+
+//one thread's histograms. blocks outlive their threads: an exiting thread hands its
+//block back for the next one to continue, so totals keep every thread's counts and
+//the number of blocks stays at the most threads alive at once
+struct ThreadMetrics {
+    Histogram histograms[HIST_COUNT];
+    ThreadMetrics* next;
+};
+
+atomic<bool> metricsEnabled(true);
+mutex metricsLock; //guards the lists, not the counts
+ThreadMetrics* allMetrics = nullptr;
+vector<ThreadMetrics*> idleMetrics;
+thread_local ThreadMetrics* threadMetrics = nullptr; //plain pointer, so the hot path has no init guard
+
+struct ThreadMetricsHandle {
+    ThreadMetrics* block;
+
+    ThreadMetricsHandle() {
+        lock_guard<mutex> guard(metricsLock);
+        if (!idleMetrics.empty()) {
+            block = idleMetrics.back();
+            idleMetrics.pop_back();
+            return;
+        }
+        block = new ThreadMetrics();
+        block->next = allMetrics;
+        allMetrics = block;
+    }
+
+    ~ThreadMetricsHandle() {
+        threadMetrics = nullptr;
+        lock_guard<mutex> guard(metricsLock);
+        idleMetrics.push_back(block);
+    }
+};
+
+ThreadMetrics* attachMetrics() {
+    static thread_local ThreadMetricsHandle handle;
+    threadMetrics = handle.block;
+    return handle.block;
+}
+
+inline void recordMetric(MetricHistogram histogram, uint64_t value) {
+    if (!metricsEnabled.load(memory_order_relaxed))
+        return;
+    ThreadMetrics* block = threadMetrics;
+    if (block == nullptr)
+        block = attachMetrics();
+    block->histograms[histogram].record(value);
+}
+
+//a histogram summed over every thread
+struct HistogramTotals {
+    uint64_t counts[Histogram::BUCKETS];
+    uint64_t sum;
+    uint64_t count;
+
+    uint64_t quantile(double q) const {
+        if (count == 0)
+            return 0;
+        uint64_t rank = static_cast<uint64_t>(q * (count - 1)) + 1, seen = 0;
+        for (int bucket = 0; bucket < Histogram::BUCKETS; bucket++) {
+            seen += counts[bucket];
+            if (seen >= rank)
+                return Histogram::bucketFloor(bucket);
+        }
+        return 0;
+    }
+};
+
+//a consistent-enough view while threads keep recording: each count is read once
+void collectMetrics(HistogramTotals totals[HIST_COUNT]) {
+    for (int h = 0; h < HIST_COUNT; h++)
+        totals[h] = HistogramTotals();
+    lock_guard<mutex> guard(metricsLock);
+    for (ThreadMetrics* block = allMetrics; block != nullptr; block = block->next) {
+        for (int h = 0; h < HIST_COUNT; h++) {
+            const Histogram& histogram = block->histograms[h];
+            for (int bucket = 0; bucket < Histogram::BUCKETS; bucket++) {
+                uint64_t n = histogram.counts[bucket].load(memory_order_relaxed);
+                totals[h].counts[bucket] += n;
+                totals[h].count += n;
+            }
+            totals[h].sum += histogram.sum.load(memory_order_relaxed);
+        }
+    }
+}
+
+//for benches between runs; nothing may be recording
+void resetMetrics() {
+    lock_guard<mutex> guard(metricsLock);
+    for (ThreadMetrics* block = allMetrics; block != nullptr; block = block->next) {
+        for (Histogram& histogram : block->histograms) {
+            for (atomic<uint64_t>& count : histogram.counts)
+                count.store(0, memory_order_relaxed);
+            histogram.sum.store(0, memory_order_relaxed);
+        }
+    }
+}
+
+//fixed-size blocks carved out of 64KB slabs. freed blocks are threaded onto a free
+//list and handed out again first, so steady churn never goes back to malloc and
+//same-typed nodes stay packed together instead of scattered across the heap
+class SlabPool {
 public:
+    static const size_t SLAB_BYTES = 64 * 1024;
+
+    size_t blockSize;
+    void* freeList;
+    char* bump; //next never-used block in the newest slab
+    char* bumpEnd;
+    vector<char*> slabs;
+    size_t liveBlocks;
+
+    explicit SlabPool(size_t size) : freeList(nullptr), bump(nullptr), bumpEnd(nullptr), liveBlocks(0) {
+        size_t align = alignof(max_align_t);
+        blockSize = (max(size, sizeof(void*)) + align - 1) / align * align;
+    }
+
+    ~SlabPool() {
+        for (char* slab : slabs)
+            ::operator delete(slab);
+    }
+
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    void* allocate() {
+        liveBlocks++;
+        if (freeList != nullptr) {
+            void* block = freeList;
+            freeList = *static_cast<void**>(block);
+            return block;
+        }
+        if (bump == bumpEnd) {
+            char* slab = static_cast<char*>(::operator new(SLAB_BYTES));
+            slabs.push_back(slab);
+            bump = slab;
+            bumpEnd = slab + SLAB_BYTES / blockSize * blockSize;
+        }
+        void* block = bump;
+        bump += blockSize;
+        return block;
+    }
+
+    void deallocate(void* block) {
+        liveBlocks--;
+        *static_cast<void**>(block) = freeList;
+        freeList = block;
+    }
+
+    //one pool per node type and thread, so allocating never takes a lock. a block freed
+    //on another thread joins that thread's free list. when a thread exits, blocks from
+    //its slabs may still be live elsewhere, so its pool is parked rather than released
+    //and the next thread to start adopts it
+    template <typename U>
+    static SlabPool& forType() {
+        static mutex parkedLock;
+        static vector<SlabPool*> parked;
+        struct Handle {
+            SlabPool* pool;
+
+            Handle() {
+                lock_guard<mutex> guard(parkedLock);
+                if (parked.empty()) {
+                    pool = new SlabPool(sizeof(U));
+                }
+                else {
+                    pool = parked.back();
+                    parked.pop_back();
+                }
+            }
+
+            ~Handle() {
+                lock_guard<mutex> guard(parkedLock);
+                parked.push_back(pool);
+            }
+        };
+        thread_local Handle handle;
+        return *handle.pool;
+    }
+};
+
+//node allocation policies for the containers and User's linked lists
+struct HeapAllocator {
+    template <typename U, typename... Args>
+    static U* create(Args&&... args) {
+        return new U{ std::forward<Args>(args)... };
+    }
+
+    template <typename U>
+    static void destroy(U* node) {
+        delete node;
+    }
+};
+
+struct PoolAllocator {
+    template <typename U, typename... Args>
+    static U* create(Args&&... args) {
+        return new (SlabPool::forType<U>().allocate()) U{ std::forward<Args>(args)... };
+    }
+
+    template <typename U>
+    static void destroy(U* node) {
+        node->~U();
+        SlabPool::forType<U>().deallocate(node);
+    }
+};
+
+//storage policies for Stack and Queue, picked at compile time:
+//  LinkedNodes<Alloc>      one node per element, unbounded
+//  ChunkedNodes<N, Alloc>  unrolled list of N-element chunks, one emptied chunk kept spare
+//  FixedRing<N>            N elements inline in the container; a push fails when full
+//  LockFreeNodes<Alloc>    pushes from any thread, pops from one consumer at a time
+//elements are moved in and out and emplace builds one in place. the lock-free
+//variants can't be copied; the others copy deeply and keep the order
+template <typename Alloc = PoolAllocator>
+struct LinkedNodes {};
+
+template <size_t CHUNK = 32, typename Alloc = PoolAllocator>
+struct ChunkedNodes {};
+
+template <size_t CAPACITY>
+struct FixedRing {};
+
+template <typename Alloc = PoolAllocator>
+struct LockFreeNodes {};
+
+template <typename T, typename Policy = LinkedNodes<>>
+class Stack;
+
+template <typename T, typename Policy = LinkedNodes<>>
+class Queue;
+
+//builds an element from emplace arguments, with braces for aggregates such as Message
+template <typename T, typename... Args>
+T makeElement(Args&&... args) {
+    if constexpr (is_constructible<T, Args...>::value)
+        return T(std::forward<Args>(args)...);
+    else
+        return T{ std::forward<Args>(args)... };
+}
+
+//raw room for N elements; the owner tracks which ones are live
+template <typename T, size_t N>
+struct SlotArray {
+    alignas(T) unsigned char bytes[N * sizeof(T)];
+
+    T* at(size_t i) {
+        return reinterpret_cast<T*>(bytes) + i;
+    }
+
+    const T* at(size_t i) const {
+        return reinterpret_cast<const T*>(bytes) + i;
+    }
+};
+
+template <typename T, typename Alloc>
+class Stack<T, LinkedNodes<Alloc>> {
     struct Node {
-        T data;
         Node* next;
-    }*top;
+        T data;
 
-    Stack() : top(nullptr) {}
+        template <typename... Args>
+        explicit Node(Node* next, Args&&... args) : next(next), data(makeElement<T>(std::forward<Args>(args)...)) {}
+    };
+    Node* top;
+    size_t count;
+
+public:
+    Stack() : top(nullptr), count(0) {}
+    ~Stack() { clear(); }
+
+    Stack(const Stack& other) : top(nullptr), count(0) {
+        copyFrom(other);
+    }
+
+    Stack& operator=(const Stack& other) {
+        if (this != &other) {
+            clear();
+            copyFrom(other);
+        }
+        return *this;
+    }
+
+    Stack(Stack&& other) noexcept : top(other.top), count(other.count) {
+        other.top = nullptr;
+        other.count = 0;
+    }
+
+    Stack& operator=(Stack&& other) noexcept {
+        swap(top, other.top);
+        swap(count, other.count);
+        return *this;
+    }
 
-    void push(T data) {
-        Node* newNode = new Node{ data, top };
-        top = newNode;
+    bool push(const T& data) {
+        return emplace(data);
+    }
+
+    bool push(T&& data) {
+        return emplace(std::move(data));
+    }
+
+    template <typename... Args>
+    bool emplace(Args&&... args) {
+        top = Alloc::template create<Node>(top, std::forward<Args>(args)...);
+        count++;
+        return true;
     }
 
     bool pop(T& data) {
@@ -37,32 +571,100 @@ public:
             return false;
         }
         Node* temp = top;
-        data = top->data;
+        data = std::move(top->data);
         top = top->next;
-        delete temp;
+        Alloc::destroy(temp);
+        count--;
         return true;
     }
 
-    bool isEmpty() {
+    T* peek() {
+        return top == nullptr ? nullptr : &top->data;
+    }
+
+    void clear() {
+        while (top != nullptr) {
+            Node* temp = top;
+            top = top->next;
+            Alloc::destroy(temp);
+        }
+        count = 0;
+    }
+
+    bool isEmpty() const {
         return top == nullptr;
     }
+
+    size_t size() const {
+        return count;
+    }
+
+private:
+    //appends below the copied nodes so the copy pops in the same order
+    void copyFrom(const Stack& other) {
+        Node** link = &top;
+        for (Node* node = other.top; node != nullptr; node = node->next) {
+            *link = Alloc::template create<Node>(nullptr, node->data);
+            link = &(*link)->next;
+        }
+        count = other.count;
+    }
 };
 
-template <typename T>
-class Queue {
+template <typename T, typename Alloc>
+class Queue<T, LinkedNodes<Alloc>> {
     struct Node {
-        T data;
         Node* next;
+        T data;
+
+        template <typename... Args>
+        explicit Node(Node* next, Args&&... args) : next(next), data(makeElement<T>(std::forward<Args>(args)...)) {}
     };
     Node* front;
     Node* rear;
+    size_t count;
 
 public:
-    Queue() : front(nullptr), rear(nullptr) {}
+    Queue() : front(nullptr), rear(nullptr), count(0) {}
     ~Queue() { clear(); }
 
-    bool enqueue(T value) {
-        Node* newNode = new Node{ value, nullptr };
+    Queue(const Queue& other) : front(nullptr), rear(nullptr), count(0) {
+        for (Node* node = other.front; node != nullptr; node = node->next)
+            emplace(node->data);
+    }
+
+    Queue& operator=(const Queue& other) {
+        if (this != &other) {
+            clear();
+            for (Node* node = other.front; node != nullptr; node = node->next)
+                emplace(node->data);
+        }
+        return *this;
+    }
+
+    Queue(Queue&& other) noexcept : front(other.front), rear(other.rear), count(other.count) {
+        other.front = other.rear = nullptr;
+        other.count = 0;
+    }
+
+    Queue& operator=(Queue&& other) noexcept {
+        swap(front, other.front);
+        swap(rear, other.rear);
+        swap(count, other.count);
+        return *this;
+    }
+
+    bool enqueue(const T& value) {
+        return emplace(value);
+    }
+
+    bool enqueue(T&& value) {
+        return emplace(std::move(value));
+    }
+
+    template <typename... Args>
+    bool emplace(Args&&... args) {
+        Node* newNode = Alloc::template create<Node>(nullptr, std::forward<Args>(args)...);
         if (rear == nullptr) {
             front = rear = newNode;
         }
@@ -70,583 +672,9770 @@ public:
             rear->next = newNode;
             rear = newNode;
         }
+        count++;
         return true;
     }
 
     bool dequeue(T& value) {
-        if (front == nullptr) return false; 
+        if (front == nullptr) return false;
         Node* temp = front;
-        value = front->data;
+        value = std::move(front->data);
         front = front->next;
         if (front == nullptr) rear = nullptr;
-        delete temp;
+        Alloc::destroy(temp);
+        count--;
         return true;
     }
 
+    T* peek() {
+        return front == nullptr ? nullptr : &front->data;
+    }
+
     void clear() {
         while (front != nullptr) {
             Node* temp = front;
             front = front->next;
-            delete temp;
+            Alloc::destroy(temp);
         }
         rear = nullptr;
+        count = 0;
     }
 
-    void display()
-    {
-        Node* temp = front;
-        while (temp != nullptr)
-        {
-            cout << temp->data << endl;
-            temp = temp->next;
-        }
+    void display(ostream& out = cout) const {
+        for (Node* temp = front; temp != nullptr; temp = temp->next)
+            out << temp->data << endl;
     }
 
-    bool isEmpty()
-    {
+    bool isEmpty() const {
         return front == nullptr;
     }
+
+    size_t size() const {
+        return count;
+    }
 };
 
-class User {
-public:
-    string name;
-    string password;
-    string city;
-    time_t lastLoginTimestamp;
+//a stack of chunks: only the top chunk is partly filled, and an emptied chunk is kept
+//as a spare so pushing and popping across a chunk boundary doesn't allocate
+template <typename T, size_t CHUNK, typename Alloc>
+class Stack<T, ChunkedNodes<CHUNK, Alloc>> {
+    struct Chunk {
+        Chunk* below;
+        SlotArray<T, CHUNK> slots;
 
-    struct Post {
-        time_t dateTime;
-        string content;
+        Chunk() {} //leaves the slots unset
     };
+    static_assert(sizeof(Chunk) <= SlabPool::SLAB_BYTES, "a chunk must fit in a slab");
+    Chunk* top;
+    Chunk* spare;
+    size_t topCount; //live elements in the top chunk
+    size_t count;
 
-    Stack<Post> postStack; //user's own posts
-    Stack<Post> newsfeedStack; //posts from followers
-
-    struct FriendNode {
-        User* user;
-        string relationType;
-        string status;
-        FriendNode* next;
-    }*friendList;
+public:
+    Stack() : top(nullptr), spare(nullptr), topCount(0), count(0) {}
 
-    Queue<User*> friendRequestQueue;
+    ~Stack() {
+        clear();
+        if (spare != nullptr)
+            Alloc::destroy(spare);
+    }
 
-    struct Conversation {
-        User* withUser;
-        Stack<string> messageStack;
-        Conversation* next;
-    }*conversations;
+    Stack(const Stack& other) : Stack() {
+        copyFrom(other);
+    }
 
-    Queue<string> notificationQueue;
+    Stack& operator=(const Stack& other) {
+        if (this != &other) {
+            clear();
+            copyFrom(other);
+        }
+        return *this;
+    }
 
-    User* next;
+    Stack(Stack&& other) noexcept : Stack() {
+        *this = std::move(other);
+    }
 
-    User(string name, string password, string city) {
-        this->name = name;
-        this->password = password;
-        this->city = city;
-        time(&this->lastLoginTimestamp);
-        friendList = nullptr;
-        conversations = nullptr;
-        next = nullptr;
+    Stack& operator=(Stack&& other) noexcept {
+        swap(top, other.top);
+        swap(spare, other.spare);
+        swap(topCount, other.topCount);
+        swap(count, other.count);
+        return *this;
     }
 
-    void addPost(string content);
-    void viewOwnPosts();
-    void viewNewsfeed();
+    bool push(const T& data) {
+        return emplace(data);
+    }
 
-    void sendFriendRequest(User* toUser);
-    void acceptFriendRequest();
-    void showPendingFriendRequests();
+    bool push(T&& data) {
+        return emplace(std::move(data));
+    }
 
-    void sendMessage(User* toUser, string message);
-    void viewMessages(User* withUser);
+    template <typename... Args>
+    bool emplace(Args&&... args) {
+        if (top == nullptr || topCount == CHUNK) {
+            Chunk* chunk = spare != nullptr ? spare : Alloc::template create<Chunk>();
+            spare = nullptr;
+            chunk->below = top;
+            top = chunk;
+            topCount = 0;
+        }
+        new (top->slots.at(topCount)) T(makeElement<T>(std::forward<Args>(args)...));
+        topCount++;
+        count++;
+        return true;
+    }
 
-    void addNotification(string notification);
-    void viewNotifications();
+    bool pop(T& data) {
+        if (count == 0) {
+            return false;
+        }
+        T* slot = top->slots.at(topCount - 1);
+        data = std::move(*slot);
+        slot->~T();
+        count--;
+        if (--topCount == 0)
+            dropTop();
+        return true;
+    }
 
-    void addFriend(User* newFriend);
-    bool isFollowing(User* otherUser);
-    void displayFollowers();
-};
+    T* peek() {
+        return count == 0 ? nullptr : top->slots.at(topCount - 1);
+    }
 
-class HashTable {
-public:
-    static const int TABLE_SIZE = 100;
-    struct HashNode {
-        string username;
-        User* user;
-        HashNode* next;
-    }*table[TABLE_SIZE];
+    void clear() {
+        while (count > 0) {
+            top->slots.at(--topCount)->~T();
+            count--;
+            if (topCount == 0)
+                dropTop();
+        }
+    }
 
-    HashTable() {
-        for (int i = 0; i < TABLE_SIZE; i++)
-            table[i] = nullptr;
+    bool isEmpty() const {
+        return count == 0;
     }
 
-    int hashFunction(string username) {
-        int sum = 0;
-        for (char c : username)
-            sum += c;
-        return sum % TABLE_SIZE;
+    size_t size() const {
+        return count;
     }
 
-    void insert(User* user) {
-        int index = hashFunction(user->name);
-        HashNode* newNode = new HashNode{ user->name, user, table[index] };
-        table[index] = newNode;
+private:
+    void dropTop() {
+        Chunk* chunk = top;
+        top = chunk->below;
+        topCount = top == nullptr ? 0 : CHUNK;
+        if (spare != nullptr)
+            Alloc::destroy(spare);
+        spare = chunk;
     }
 
-    User* search(string username) {
-        int index = hashFunction(username);
-        HashNode* current = table[index];
-        while (current != nullptr) {
-            if (current->username == username)
-                return current->user;
-            current = current->next;
+    //bottom chunk first, so the copy keeps the order
+    void copyFrom(const Stack& other) {
+        vector<const Chunk*> chunks;
+        for (const Chunk* chunk = other.top; chunk != nullptr; chunk = chunk->below)
+            chunks.push_back(chunk);
+        for (size_t c = chunks.size(); c-- > 0;) {
+            size_t used = c == 0 ? other.topCount : CHUNK;
+            for (size_t i = 0; i < used; i++)
+                emplace(*chunks[c]->slots.at(i));
         }
-        return nullptr;
     }
 };
 
-struct BSTNode {
-    string username;
-    User* user;
-    BSTNode* left;
-    BSTNode* right;
+//chunks linked oldest first: elements are taken from the front chunk and added to
+//the rear one; an emptied front chunk becomes the spare for the next rear
+template <typename T, size_t CHUNK, typename Alloc>
+class Queue<T, ChunkedNodes<CHUNK, Alloc>> {
+    struct Chunk {
+        Chunk* next;
+        SlotArray<T, CHUNK> slots;
 
-    BSTNode(User* user)
-    {
-        this->username = user->name;
-        this->user = user;
-        left = right = nullptr;
-    }
-};
+        Chunk() {} //leaves the slots unset
+    };
+    static_assert(sizeof(Chunk) <= SlabPool::SLAB_BYTES, "a chunk must fit in a slab");
+    Chunk* front;
+    Chunk* rear;
+    Chunk* spare;
+    size_t head; //first live slot in front
+    size_t tail; //first free slot in rear
+    size_t count;
 
-class UserBST {
 public:
-    BSTNode* root;
+    Queue() : front(nullptr), rear(nullptr), spare(nullptr), head(0), tail(0), count(0) {}
 
-    UserBST() : root(nullptr) {}
+    ~Queue() {
+        clear();
+        if (spare != nullptr)
+            Alloc::destroy(spare);
+    }
 
-    void insert(User* user) {
-        insert(root, user);
+    Queue(const Queue& other) : Queue() {
+        other.forEach([this](const T& value) { emplace(value); });
     }
 
-    void insert(BSTNode*& node, User* user) {
-        if (node == nullptr) {
-            node = new BSTNode(user);
+    Queue& operator=(const Queue& other) {
+        if (this != &other) {
+            clear();
+            other.forEach([this](const T& value) { emplace(value); });
         }
-        else if (user->name < node->username) {
-            insert(node->left, user);
+        return *this;
+    }
+
+    Queue(Queue&& other) noexcept : Queue() {
+        *this = std::move(other);
+    }
+
+    Queue& operator=(Queue&& other) noexcept {
+        swap(front, other.front);
+        swap(rear, other.rear);
+        swap(spare, other.spare);
+        swap(head, other.head);
+        swap(tail, other.tail);
+        swap(count, other.count);
+        return *this;
+    }
+
+    bool enqueue(const T& value) {
+        return emplace(value);
+    }
+
+    bool enqueue(T&& value) {
+        return emplace(std::move(value));
+    }
+
+    template <typename... Args>
+    bool emplace(Args&&... args) {
+        if (rear == nullptr || tail == CHUNK) {
+            Chunk* chunk = spare != nullptr ? spare : Alloc::template create<Chunk>();
+            spare = nullptr;
+            chunk->next = nullptr;
+            if (rear == nullptr) {
+                front = chunk;
+                head = 0;
+            }
+            else {
+                rear->next = chunk;
+            }
+            rear = chunk;
+            tail = 0;
         }
-        else {
-            insert(node->right, user);
+        new (rear->slots.at(tail)) T(makeElement<T>(std::forward<Args>(args)...));
+        tail++;
+        count++;
+        return true;
+    }
+
+    bool dequeue(T& value) {
+        if (count == 0) return false;
+        T* slot = front->slots.at(head);
+        value = std::move(*slot);
+        slot->~T();
+        head++;
+        count--;
+        dropDrained();
+        return true;
+    }
+
+    T* peek() {
+        return count == 0 ? nullptr : front->slots.at(head);
+    }
+
+    void clear() {
+        while (count > 0) {
+            front->slots.at(head++)->~T();
+            count--;
+            dropDrained();
         }
     }
 
-    User* search(string username) {
-        return search(root, username);
+    //oldest first
+    template <typename F>
+    void forEach(F visit) const {
+        size_t i = head;
+        for (const Chunk* chunk = front; chunk != nullptr; chunk = chunk->next, i = 0) {
+            size_t end = chunk == rear ? tail : CHUNK;
+            for (; i < end; i++)
+                visit(*chunk->slots.at(i));
+        }
     }
 
-    User* search(BSTNode* node, string username) {
-        if (node == nullptr)
-            return nullptr;
-        if (node->username == username)
-            return node->user;
-        else if (username < node->username)
-            return search(node->left, username);
-        else
-            return search(node->right, username);
+    void display(ostream& out = cout) const {
+        forEach([&out](const T& value) { out << value << endl; });
+    }
+
+    bool isEmpty() const {
+        return count == 0;
     }
 
-    void inorderTraversal() {
-        inorderTraversal(root);
+    size_t size() const {
+        return count;
+    }
+
+private:
+    //the front chunk is done once it is read to the end, or is also the rear and empty
+    void dropDrained() {
+        if (head < (front == rear ? tail : CHUNK))
+            return;
+        Chunk* chunk = front;
+        front = chunk->next;
+        head = 0;
+        if (front == nullptr) {
+            rear = nullptr;
+            tail = 0;
+        }
+        if (spare != nullptr)
+            Alloc::destroy(spare);
+        spare = chunk;
+    }
+};
+
+//a bounded stack held inside the container itself: no allocation at all
+template <typename T, size_t CAPACITY>
+class Stack<T, FixedRing<CAPACITY>> {
+    SlotArray<T, CAPACITY> slots;
+    size_t count;
+
+public:
+    Stack() : count(0) {}
+    ~Stack() { clear(); }
+
+    Stack(const Stack& other) : count(0) {
+        for (size_t i = 0; i < other.count; i++)
+            emplace(*other.slots.at(i));
+    }
+
+    Stack& operator=(const Stack& other) {
+        if (this != &other) {
+            clear();
+            for (size_t i = 0; i < other.count; i++)
+                emplace(*other.slots.at(i));
+        }
+        return *this;
+    }
+
+    //the elements live inline, so a move moves each one
+    Stack(Stack&& other) noexcept : count(0) {
+        *this = std::move(other);
+    }
+
+    Stack& operator=(Stack&& other) noexcept {
+        if (this != &other) {
+            clear();
+            for (size_t i = 0; i < other.count; i++)
+                emplace(std::move(*other.slots.at(i)));
+            other.clear();
+        }
+        return *this;
+    }
+
+    bool push(const T& data) {
+        return emplace(data);
+    }
+
+    bool push(T&& data) {
+        return emplace(std::move(data));
+    }
+
+    template <typename... Args>
+    bool emplace(Args&&... args) {
+        if (count == CAPACITY)
+            return false;
+        new (slots.at(count)) T(makeElement<T>(std::forward<Args>(args)...));
+        count++;
+        return true;
+    }
+
+    bool pop(T& data) {
+        if (count == 0) {
+            return false;
+        }
+        T* slot = slots.at(--count);
+        data = std::move(*slot);
+        slot->~T();
+        return true;
+    }
+
+    T* peek() {
+        return count == 0 ? nullptr : slots.at(count - 1);
+    }
+
+    void clear() {
+        while (count > 0)
+            slots.at(--count)->~T();
+    }
+
+    bool isEmpty() const {
+        return count == 0;
+    }
+
+    size_t size() const {
+        return count;
+    }
+};
+
+//bounded queue over an inline ring; positions only grow and are masked on use
+template <typename T, size_t CAPACITY>
+class Queue<T, FixedRing<CAPACITY>> {
+    static_assert((CAPACITY & (CAPACITY - 1)) == 0, "ring capacity must be a power of two");
+
+    SlotArray<T, CAPACITY> slots;
+    size_t head;
+    size_t tail;
+
+public:
+    Queue() : head(0), tail(0) {}
+    ~Queue() { clear(); }
+
+    Queue(const Queue& other) : head(0), tail(0) {
+        other.forEach([this](const T& value) { emplace(value); });
+    }
+
+    Queue& operator=(const Queue& other) {
+        if (this != &other) {
+            clear();
+            other.forEach([this](const T& value) { emplace(value); });
+        }
+        return *this;
+    }
+
+    Queue(Queue&& other) noexcept : head(0), tail(0) {
+        *this = std::move(other);
+    }
+
+    Queue& operator=(Queue&& other) noexcept {
+        if (this != &other) {
+            clear();
+            for (size_t i = other.head; i != other.tail; i++)
+                emplace(std::move(*other.slots.at(i & (CAPACITY - 1))));
+            other.clear();
+        }
+        return *this;
+    }
+
+    bool enqueue(const T& value) {
+        return emplace(value);
+    }
+
+    bool enqueue(T&& value) {
+        return emplace(std::move(value));
+    }
+
+    template <typename... Args>
+    bool emplace(Args&&... args) {
+        if (tail - head == CAPACITY)
+            return false;
+        new (slots.at(tail & (CAPACITY - 1))) T(makeElement<T>(std::forward<Args>(args)...));
+        tail++;
+        return true;
+    }
+
+    bool dequeue(T& value) {
+        if (head == tail) return false;
+        T* slot = slots.at(head & (CAPACITY - 1));
+        value = std::move(*slot);
+        slot->~T();
+        head++;
+        return true;
+    }
+
+    T* peek() {
+        return head == tail ? nullptr : slots.at(head & (CAPACITY - 1));
+    }
+
+    void clear() {
+        while (head != tail)
+            slots.at(head++ & (CAPACITY - 1))->~T();
+        head = tail = 0;
+    }
+
+    //oldest first
+    template <typename F>
+    void forEach(F visit) const {
+        for (size_t i = head; i != tail; i++)
+            visit(*slots.at(i & (CAPACITY - 1)));
+    }
+
+    void display(ostream& out = cout) const {
+        forEach([&out](const T& value) { out << value << endl; });
+    }
+
+    bool isEmpty() const {
+        return head == tail;
+    }
+
+    size_t size() const {
+        return tail - head;
+    }
+};
+
+//Treiber stack with a single consumer. producers swing top with a compare-exchange;
+//since only the consumer ever unlinks a node, the node it is popping can't be freed
+//and reused under it, so there is no ABA. the caller makes sure only one thread
+//consumes at a time
+template <typename T, typename Alloc>
+class Stack<T, LockFreeNodes<Alloc>> {
+    struct Node {
+        Node* next;
+        T data;
+
+        template <typename... Args>
+        explicit Node(Node* next, Args&&... args) : next(next), data(makeElement<T>(std::forward<Args>(args)...)) {}
+    };
+    atomic<Node*> top;
+
+public:
+    Stack() : top(nullptr) {}
+
+    ~Stack() {
+        Node* node = top.load(memory_order_relaxed);
+        while (node != nullptr) {
+            Node* next = node->next;
+            Alloc::destroy(node);
+            node = next;
+        }
+    }
+
+    //other threads may hold the address
+    Stack(const Stack&) = delete;
+    Stack& operator=(const Stack&) = delete;
+
+    //any thread
+    bool push(const T& data) {
+        return emplace(data);
+    }
+
+    bool push(T&& data) {
+        return emplace(std::move(data));
+    }
+
+    template <typename... Args>
+    bool emplace(Args&&... args) {
+        Node* node = Alloc::template create<Node>(top.load(memory_order_relaxed), std::forward<Args>(args)...);
+        while (!top.compare_exchange_weak(node->next, node, memory_order_release, memory_order_relaxed)) {
+        }
+        return true;
+    }
+
+    //consumer only
+    bool pop(T& data) {
+        Node* node = top.load(memory_order_acquire);
+        while (node != nullptr && !top.compare_exchange_weak(node, node->next, memory_order_acquire, memory_order_acquire)) {
+        }
+        if (node == nullptr)
+            return false;
+        data = std::move(node->data);
+        Alloc::destroy(node);
+        return true;
+    }
+
+    //consumer only
+    bool isEmpty() const {
+        return top.load(memory_order_acquire) == nullptr;
+    }
+};
+
+//unbounded multi-producer single-consumer queue (Vyukov). producers swap themselves
+//in at head with one atomic exchange and never wait; the consumer pops from tail,
+//where a dummy node keeps head and tail apart. a push that is mid-link is not yet
+//visible to the consumer, it simply shows up on the next drain. the caller makes
+//sure only one thread consumes at a time
+template <typename T, typename Alloc>
+class Queue<T, LockFreeNodes<Alloc>> {
+    struct Node {
+        atomic<Node*> next;
+        T data;
+
+        template <typename... Args>
+        explicit Node(Node* next, Args&&... args) : next(next), data(makeElement<T>(std::forward<Args>(args)...)) {}
+    };
+    atomic<Node*> head;
+    Node* tail;
+
+public:
+    Queue() {
+        Node* dummy = Alloc::template create<Node>(nullptr);
+        head.store(dummy, memory_order_relaxed);
+        tail = dummy;
+    }
+
+    ~Queue() {
+        while (tail != nullptr) {
+            Node* next = tail->next.load(memory_order_relaxed);
+            Alloc::destroy(tail);
+            tail = next;
+        }
+    }
+
+    Queue(const Queue&) = delete;
+    Queue& operator=(const Queue&) = delete;
+
+    //any thread
+    bool enqueue(const T& value) {
+        return emplace(value);
+    }
+
+    bool enqueue(T&& value) {
+        return emplace(std::move(value));
+    }
+
+    template <typename... Args>
+    bool emplace(Args&&... args) {
+        Node* node = Alloc::template create<Node>(nullptr, std::forward<Args>(args)...);
+        Node* prev = head.exchange(node, memory_order_acq_rel);
+        prev->next.store(node, memory_order_release);
+        return true;
+    }
+
+    //consumer only
+    bool dequeue(T& value) {
+        Node* next = tail->next.load(memory_order_acquire);
+        if (next == nullptr)
+            return false;
+        value = std::move(next->data);
+        Alloc::destroy(tail);
+        tail = next; //next is the new dummy
+        return true;
+    }
+
+    //consumer only
+    bool isEmpty() const {
+        return tail->next.load(memory_order_acquire) == nullptr;
+    }
+
+    //consumer only, oldest first
+    template <typename F>
+    void forEach(F visit) const {
+        for (Node* node = tail->next.load(memory_order_acquire); node != nullptr; node = node->next.load(memory_order_acquire))
+            visit(node->data);
+    }
+};
+
+template <typename T, typename Alloc = PoolAllocator>
+using MpscQueue = Queue<T, LockFreeNodes<Alloc>>;
+
+inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+//murmur3 finalizer, every input bit affects every output bit
+inline uint64_t mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+//seeded 64-bit string hash, reads 8 bytes per round
+uint64_t hashBytes(const char* data, size_t length, uint64_t seed) {
+    const uint64_t k = 0x9e3779b97f4a7c15ULL;
+    uint64_t h = seed ^ (length * k);
+    size_t remaining = length;
+    while (remaining >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        h = rotl64(h ^ mix64(word + seed), 27) * k + 0x52dce729;
+        data += 8;
+        remaining -= 8;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data, remaining);
+    h = rotl64(h ^ mix64(tail + seed), 27) * k;
+    return mix64(h ^ length);
+}
+
+//byte-oriented LZ77 in the LZ4 style for cold blocks: each sequence is a token (the
+//literal count in the high nibble, match length - 4 in the low, 15 meaning more
+//length bytes follow), the literals, then a 2-byte distance back to the match. the
+//last sequence has literals only
+void lzCompress(const char* in, size_t length, string& out) {
+    const size_t MIN_MATCH = 4;
+    const int HASH_BITS = 12;
+    static thread_local uint32_t table[1 << HASH_BITS]; //position + 1 of the last 4 bytes seen per hash
+    memset(table, 0, sizeof(table));
+    auto putLength = [&out](size_t n) {
+        for (; n >= 255; n -= 255)
+            out += static_cast<char>(255);
+        out += static_cast<char>(n);
+    };
+    size_t anchor = 0, pos = 0;
+    while (pos + MIN_MATCH <= length) {
+        uint32_t word;
+        memcpy(&word, in + pos, 4);
+        uint32_t slot = (word * 2654435761u) >> (32 - HASH_BITS);
+        size_t candidate = table[slot];
+        table[slot] = static_cast<uint32_t>(pos + 1);
+        if (candidate == 0 || pos + 1 - candidate > 65535 || memcmp(in + candidate - 1, in + pos, MIN_MATCH) != 0) {
+            pos++;
+            continue;
+        }
+        size_t from = candidate - 1;
+        size_t match = MIN_MATCH;
+        while (pos + match < length && in[from + match] == in[pos + match])
+            match++;
+        size_t literals = pos - anchor;
+        out += static_cast<char>(min<size_t>(literals, 15) << 4 | min<size_t>(match - MIN_MATCH, 15));
+        if (literals >= 15)
+            putLength(literals - 15);
+        out.append(in + anchor, literals);
+        size_t distance = pos - from;
+        out += static_cast<char>(distance & 0xff);
+        out += static_cast<char>(distance >> 8);
+        if (match - MIN_MATCH >= 15)
+            putLength(match - MIN_MATCH - 15);
+        pos += match;
+        anchor = pos;
+    }
+    size_t literals = length - anchor;
+    out += static_cast<char>(min<size_t>(literals, 15) << 4);
+    if (literals >= 15)
+        putLength(literals - 15);
+    out.append(in + anchor, literals);
+}
+
+//false if the input is damaged or doesn't expand to exactly rawLength bytes
+bool lzExpand(const char* in, size_t length, char* out, size_t rawLength) {
+    const uint8_t* at = reinterpret_cast<const uint8_t*>(in);
+    const uint8_t* end = at + length;
+    size_t written = 0;
+    auto getLength = [&](size_t& n) {
+        uint8_t more;
+        do {
+            if (at == end)
+                return false;
+            more = *at++;
+            n += more;
+        } while (more == 255);
+        return true;
+    };
+    while (at < end) {
+        uint8_t token = *at++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !getLength(literals))
+            return false;
+        if (literals > static_cast<size_t>(end - at) || literals > rawLength - written)
+            return false;
+        memcpy(out + written, at, literals);
+        at += literals;
+        written += literals;
+        if (at == end)
+            break;
+        if (end - at < 2)
+            return false;
+        size_t distance = at[0] | static_cast<size_t>(at[1]) << 8;
+        at += 2;
+        size_t match = (token & 15) + 4;
+        if ((token & 15) == 15 && !getLength(match))
+            return false;
+        if (distance == 0 || distance > written || match > rawLength - written)
+            return false;
+        //byte by byte, since a match may overlap what it is copying
+        for (size_t i = 0; i < match; i++, written++)
+            out[written] = out[written - distance];
+    }
+    return written == rawLength;
+}
+
+const uint32_t NO_POST = 0xffffffffu;
+const uint32_t FEED_CAPACITY = 1024; //newest feed entries kept per user
+const size_t PAGE_SIZE = 20;
+
+const uint32_t NO_USER = 0xffffffffu;
+
+//every post is stored once; timelines and feeds only hold its id. this is the read
+//side: content points into the store's arena and stays valid as long as the store
+struct Post {
+    time_t dateTime;
+    uint32_t authorId; //NO_USER for an id that was never filled
+    string_view content;
+};
+
+//seconds added to the wall clock for new posts and messages; benches move it ahead
+//to stand in for days of traffic
+atomic<int64_t> clockOffset(0);
+
+inline time_t engineNow() {
+    return time(nullptr) + clockOffset.load(memory_order_relaxed);
+}
+
+inline size_t pageBytes() {
+#ifdef _WIN32
+    return 4096;
+#else
+    static const size_t bytes = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return bytes;
+#endif
+}
+
+#ifndef _WIN32
+//append-only file on local disk for the cold tier. opened with a view, the whole
+//reserved length is mapped read-only up front (the file stays sparse until written),
+//so bytes can be read through view as soon as append returns
+class ColdFile {
+public:
+    static const uint64_t VIEW_BYTES = 1ull << 32;
+    static const uint64_t NO_OFFSET = ~0ull;
+
+    int fd;
+    uint64_t used;
+    const char* view;
+
+    ColdFile() : fd(-1), used(0), view(nullptr) {}
+
+    ~ColdFile() {
+        if (view != nullptr)
+            munmap(const_cast<char*>(view), VIEW_BYTES);
+        if (fd >= 0) {
+            if (ftruncate(fd, static_cast<off_t>(used)) != 0) {
+                //only the reserved tail is left in place
+            }
+            ::close(fd);
+        }
+    }
+
+    ColdFile(const ColdFile&) = delete;
+    ColdFile& operator=(const ColdFile&) = delete;
+
+    bool open(const string& path, bool mapped) {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return false;
+        if (!mapped)
+            return true;
+        if (ftruncate(fd, static_cast<off_t>(VIEW_BYTES)) != 0)
+            return false;
+        void* range = mmap(nullptr, VIEW_BYTES, PROT_READ, MAP_SHARED, fd, 0);
+        if (range == MAP_FAILED)
+            return false;
+        view = static_cast<const char*>(range);
+        return true;
+    }
+
+    bool fits(size_t length) const {
+        return view == nullptr || used + length <= VIEW_BYTES;
+    }
+
+    //where the bytes went in the file, NO_OFFSET if they couldn't be written
+    uint64_t append(const char* bytes, size_t length) {
+        if (fd < 0 || !fits(length))
+            return NO_OFFSET;
+        size_t done = 0;
+        while (done < length) {
+            ssize_t wrote = pwrite(fd, bytes + done, min<size_t>(length - done, 1 << 26), static_cast<off_t>(used + done));
+            if (wrote <= 0)
+                return NO_OFFSET;
+            done += static_cast<size_t>(wrote);
+        }
+        used += length;
+        return used - length;
+    }
+};
+#endif
+
+//append-only byte arena in one reserved range of address space, so content never
+//moves and a view into it stays valid. pages are only backed once written to;
+//writers claim space with one atomic add and copy in unlocked
+class ContentArena {
+public:
+    static const uint64_t RESERVED_BYTES = 1ull << 36; //64GB of address space
+#ifdef _WIN32
+    static const uint64_t COMMIT_STEP = 1 << 20;
+    atomic<uint64_t> committed;
+    mutex commitLock;
+#endif
+
+    char* base;
+    atomic<uint64_t> used;
+
+    ContentArena() : used(0) {
+#ifdef _WIN32
+        committed = 0;
+        base = static_cast<char*>(VirtualAlloc(nullptr, RESERVED_BYTES, MEM_RESERVE, PAGE_NOACCESS));
+        if (base == nullptr)
+            throw bad_alloc();
+#else
+        void* range = mmap(nullptr, RESERVED_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (range == MAP_FAILED)
+            throw bad_alloc();
+        base = static_cast<char*>(range);
+#endif
+    }
+
+    ~ContentArena() {
+#ifdef _WIN32
+        VirtualFree(base, 0, MEM_RELEASE);
+#else
+        munmap(base, RESERVED_BYTES);
+#endif
+    }
+
+    ContentArena(const ContentArena&) = delete;
+    ContentArena& operator=(const ContentArena&) = delete;
+
+    //copies bytes in and returns their offset
+    uint64_t append(const char* bytes, size_t length) {
+        uint64_t offset = used.fetch_add(length, memory_order_relaxed);
+        if (offset + length > RESERVED_BYTES)
+            throw bad_alloc();
+#ifdef _WIN32
+        while (offset + length > committed.load(memory_order_acquire)) {
+            lock_guard<mutex> guard(commitLock);
+            uint64_t have = committed.load(memory_order_relaxed);
+            if (offset + length <= have)
+                break;
+            uint64_t want = min(RESERVED_BYTES, max(have + COMMIT_STEP, (offset + length + COMMIT_STEP - 1) / COMMIT_STEP * COMMIT_STEP));
+            if (VirtualAlloc(base + have, want - have, MEM_COMMIT, PAGE_READWRITE) == nullptr)
+                throw bad_alloc();
+            committed.store(want, memory_order_release);
+        }
+#endif
+        memcpy(base + offset, bytes, length);
+        return offset;
+    }
+};
+
+//post metadata in columns and content in a ContentArena. columns come in fixed
+//chunks, so ids stay valid and nothing moves when the store grows; a scan over
+//dates or authors reads only those arrays. writers reserve an id with one atomic
+//add and fill their row unlocked; the chunk directory is fixed size, so readers
+//index it without a lock while another writer opens a new chunk
+class PostStore {
+public:
+    static const uint32_t CHUNK_SIZE = 4096;
+    static const uint32_t MAX_CHUNKS = 65536; //268M posts
+
+    struct Columns {
+        int64_t dateTime[CHUNK_SIZE];
+        uint64_t offset[CHUNK_SIZE]; //into the arena
+        uint32_t authorId[CHUNK_SIZE];
+        uint32_t length[CHUNK_SIZE];
+    };
+
+    atomic<Columns*>* chunks;
+    atomic<uint32_t> count;
+    mutex chunkLock; //only taken to open a chunk
+    ContentArena arena;
+#ifndef _WIN32
+    Columns* columnRange; //chunk i is columnRange[i], in address space reserved like the arena's
+#endif
+    atomic<uint32_t> coldChunks; //chunks mapped from a cold file
+    atomic<uint64_t> coldBytes; //arena bytes mapped from a cold file
+
+    PostStore() : count(0), coldChunks(0), coldBytes(0) {
+        chunks = new atomic<Columns*>[MAX_CHUNKS];
+        for (uint32_t i = 0; i < MAX_CHUNKS; i++)
+            chunks[i].store(nullptr, memory_order_relaxed);
+#ifndef _WIN32
+        void* range = mmap(nullptr, sizeof(Columns) * MAX_CHUNKS, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (range == MAP_FAILED)
+            throw bad_alloc();
+        columnRange = static_cast<Columns*>(range);
+#endif
+    }
+
+    ~PostStore() {
+#ifdef _WIN32
+        for (uint32_t i = 0; i < MAX_CHUNKS; i++)
+            delete chunks[i].load(memory_order_relaxed);
+#else
+        munmap(columnRange, sizeof(Columns) * MAX_CHUNKS);
+#endif
+        delete[] chunks;
+    }
+
+    PostStore(const PostStore&) = delete;
+    PostStore& operator=(const PostStore&) = delete;
+
+    uint32_t add(uint32_t authorId, string_view content) {
+        return append(authorId, engineNow(), content);
+    }
+
+    uint32_t append(uint32_t authorId, time_t dateTime, string_view content) {
+        uint32_t id = count.fetch_add(1, memory_order_relaxed);
+        fill(id, authorId, dateTime, content);
+        return id;
+    }
+
+    //puts a post back under the id it was logged with; used by recovery, which runs
+    //before any session. ids skipped by a lost log tail stay empty, authorId NO_USER
+    void place(uint32_t id, uint32_t authorId, time_t dateTime, string_view content) {
+        fill(id, authorId, dateTime, content);
+        if (id >= count.load(memory_order_relaxed))
+            count.store(id + 1, memory_order_relaxed);
+    }
+
+    void fill(uint32_t id, uint32_t authorId, time_t dateTime, string_view content) {
+        Columns& columns = chunk(id);
+        uint32_t row = id % CHUNK_SIZE;
+        columns.dateTime[row] = dateTime;
+        columns.offset[row] = arena.append(content.data(), content.size());
+        columns.length[row] = static_cast<uint32_t>(content.size());
+        columns.authorId[row] = authorId;
+    }
+
+    Columns& chunk(uint32_t id) {
+        atomic<Columns*>& slot = chunks[id / CHUNK_SIZE];
+        Columns* columns = slot.load(memory_order_acquire);
+        if (columns == nullptr) {
+            lock_guard<mutex> guard(chunkLock);
+            columns = slot.load(memory_order_relaxed);
+            if (columns == nullptr) {
+#ifdef _WIN32
+                columns = new Columns;
+#else
+                columns = columnRange + id / CHUNK_SIZE;
+#endif
+                fill_n(columns->authorId, CHUNK_SIZE, NO_USER);
+                slot.store(columns, memory_order_release);
+            }
+        }
+        return *columns;
+    }
+
+    //the id must have been handed out by add and published through a lock
+    Post get(uint32_t id) const {
+        const Columns& columns = *chunks[id / CHUNK_SIZE].load(memory_order_acquire);
+        uint32_t row = id % CHUNK_SIZE;
+        return Post{ static_cast<time_t>(columns.dateTime[row]), columns.authorId[row],
+            string_view(arena.base + columns.offset[row], columns.length[row]) };
+    }
+
+    //false for ids past the end and for holes left by recovery
+    bool contains(uint32_t id) const {
+        if (id >= count.load(memory_order_relaxed))
+            return false;
+        const Columns* columns = chunks[id / CHUNK_SIZE].load(memory_order_acquire);
+        return columns != nullptr && columns->authorId[id % CHUNK_SIZE] != NO_USER;
+    }
+
+    uint32_t nextId() const {
+        return count.load(memory_order_relaxed);
+    }
+
+#ifndef _WIN32
+    //moves the columns of whole chunks below row coldRows, and arena bytes below the
+    //content of every later row, to cold files: each range is written out and the
+    //file mapped over it in place. the bytes are the same, so views into them stay
+    //good, but the pages now belong to the file and are read back on the next touch
+    //once dropped. rows and used are the store's count and arena size at a point
+    //where everything below them was written; returns the bytes moved
+    uint64_t cool(uint32_t coldRows, uint32_t rows, uint64_t used, ColdFile& columnFile, ColdFile& contentFile) {
+        uint64_t moved = 0;
+        uint32_t from = coldChunks.load(memory_order_relaxed);
+        uint32_t to = coldRows / CHUNK_SIZE;
+        if (to > from && sizeof(Columns) % pageBytes() == 0) {
+            const char* first = reinterpret_cast<const char*>(columnRange + from);
+            size_t length = sizeof(Columns) * (to - from);
+            uint64_t offset = columnFile.append(first, length);
+            if (offset == ColdFile::NO_OFFSET || mmap(columnRange + from, length, PROT_READ, MAP_PRIVATE | MAP_FIXED, columnFile.fd, static_cast<off_t>(offset)) == MAP_FAILED)
+                return moved;
+            coldChunks.store(to, memory_order_relaxed);
+            moved += length;
+        }
+
+        //a row written alongside a cold one can hold content further down the arena;
+        //a recovery hole holds none
+        uint64_t end = used;
+        for (uint32_t row = coldRows; row < rows; row++) {
+            const Columns* columns = chunks[row / CHUNK_SIZE].load(memory_order_acquire);
+            if (columns->authorId[row % CHUNK_SIZE] != NO_USER)
+                end = min(end, columns->offset[row % CHUNK_SIZE]);
+        }
+        end = end / pageBytes() * pageBytes();
+        uint64_t start = coldBytes.load(memory_order_relaxed);
+        if (end > start) {
+            uint64_t offset = contentFile.append(arena.base + start, end - start);
+            if (offset == ColdFile::NO_OFFSET || mmap(arena.base + start, end - start, PROT_READ, MAP_PRIVATE | MAP_FIXED, contentFile.fd, static_cast<off_t>(offset)) == MAP_FAILED)
+                return moved;
+            coldBytes.store(end, memory_order_relaxed);
+            moved += end - start;
+        }
+        return moved;
+    }
+
+    //lets go of cold pages that reads have brought back in
+    void releaseColdPages() {
+        madvise(columnRange, sizeof(Columns) * coldChunks.load(memory_order_relaxed), MADV_DONTNEED);
+        madvise(arena.base, coldBytes.load(memory_order_relaxed), MADV_DONTNEED);
+    }
+#endif
+};
+
+//ascending run of post ids, read newest first from end - 1 back to first
+struct PostRun {
+    const uint32_t* first;
+    const uint32_t* end;
+};
+
+//the most recent FEED_CAPACITY post ids of a feed in a ring. ids are handed out in
+//time order, so the ring is two ascending runs and a page "older than X" is a
+//binary search plus a backward walk. storage starts small and doubles up to the cap
+class FeedRing {
+public:
+    static const uint32_t INITIAL_CAPACITY = 16;
+
+    uint32_t* ids;
+    uint32_t capacity;
+    uint64_t pushed; //entries ever pushed; the newest sits at (pushed - 1) % capacity
+
+    FeedRing() : ids(nullptr), capacity(0), pushed(0) {}
+    ~FeedRing() { delete[] ids; }
+
+    FeedRing(const FeedRing&) = delete;
+    FeedRing& operator=(const FeedRing&) = delete;
+
+    void push(uint32_t id) {
+        if (pushed == capacity && capacity < FEED_CAPACITY) {
+            //not wrapped yet, so the entries are already in order at the front
+            uint32_t grown = capacity == 0 ? INITIAL_CAPACITY : capacity * 2;
+            uint32_t* larger = new uint32_t[grown];
+            if (capacity > 0)
+                memcpy(larger, ids, capacity * sizeof(uint32_t));
+            delete[] ids;
+            ids = larger;
+            capacity = grown;
+        }
+        //authors posting at once can finish their fan-out out of id order, so a late
+        //id slides back past the newer ones to keep the runs ascending
+        uint64_t oldest = pushed >= capacity ? pushed + 1 - capacity : 0;
+        uint64_t pos = pushed;
+        while (pos > oldest && ids[(pos - 1) % capacity] > id) {
+            ids[pos % capacity] = ids[(pos - 1) % capacity];
+            pos--;
+        }
+        ids[pos % capacity] = id;
+        pushed++;
+    }
+
+    size_t size() const {
+        return static_cast<size_t>(min<uint64_t>(pushed, capacity));
+    }
+
+    //the entries as ascending runs, oldest run first
+    int runs(PostRun out[2]) const {
+        if (pushed <= capacity) {
+            out[0] = PostRun{ ids, ids + pushed };
+            return pushed > 0 ? 1 : 0;
+        }
+        size_t head = pushed % capacity;
+        out[0] = PostRun{ ids + head, ids + capacity };
+        out[1] = PostRun{ ids, ids + head };
+        return head > 0 ? 2 : 1;
+    }
+};
+
+//users by id in fixed chunks under a directory that never moves, so readers index
+//it without a lock while a signup appends. only createUser appends, under
+//registryLock, and a user is published by name after its slot is filled
+class UserDirectory {
+public:
+    static const uint32_t CHUNK_SIZE = 65536;
+    static const uint32_t MAX_CHUNKS = 65536;
+
+    User** chunks[MAX_CHUNKS];
+    atomic<uint32_t> count;
+
+    UserDirectory() : chunks(), count(0) {}
+
+    ~UserDirectory() {
+        clear();
+    }
+
+    UserDirectory(const UserDirectory&) = delete;
+    UserDirectory& operator=(const UserDirectory&) = delete;
+
+    User* operator[](uint32_t id) const {
+        return chunks[id / CHUNK_SIZE][id % CHUNK_SIZE];
+    }
+
+    uint32_t size() const {
+        return count.load(memory_order_acquire);
+    }
+
+    void push_back(User* user) {
+        uint32_t id = count.load(memory_order_relaxed);
+        if (id % CHUNK_SIZE == 0)
+            chunks[id / CHUNK_SIZE] = new User*[CHUNK_SIZE];
+        chunks[id / CHUNK_SIZE][id % CHUNK_SIZE] = user;
+        count.store(id + 1, memory_order_release);
+    }
+
+    void clear() {
+        for (uint32_t i = 0; i * CHUNK_SIZE < count.load(memory_order_relaxed); i++) {
+            delete[] chunks[i];
+            chunks[i] = nullptr;
+        }
+        count.store(0, memory_order_relaxed);
+    }
+};
+
+UserDirectory usersById;
+
+//set of user ids, linear probing with NO_USER marking empty slots. storage is kept
+//as ids come and go, so a busy inbox doesn't reallocate on every batch
+class IdSet {
+public:
+    vector<uint32_t> slots;
+    size_t count;
+
+    IdSet() : count(0) {}
+
+    size_t probeStart(uint32_t id) const {
+        return mix64(id) & (slots.size() - 1);
+    }
+
+    bool contains(uint32_t id) const {
+        if (count == 0)
+            return false;
+        size_t mask = slots.size() - 1;
+        for (size_t pos = probeStart(id);; pos = (pos + 1) & mask) {
+            if (slots[pos] == NO_USER)
+                return false;
+            if (slots[pos] == id)
+                return true;
+        }
+    }
+
+    //false when the id is already present
+    bool insert(uint32_t id) {
+        if ((count + 1) * 2 > slots.size())
+            grow();
+        size_t mask = slots.size() - 1;
+        size_t pos = probeStart(id);
+        while (slots[pos] != NO_USER) {
+            if (slots[pos] == id)
+                return false;
+            pos = (pos + 1) & mask;
+        }
+        slots[pos] = id;
+        count++;
+        return true;
+    }
+
+    //backward-shift delete: later entries of the cluster move up into the hole, so
+    //lookups never need tombstones
+    void erase(uint32_t id) {
+        if (count == 0)
+            return;
+        size_t mask = slots.size() - 1;
+        size_t hole = probeStart(id);
+        while (slots[hole] != id) {
+            if (slots[hole] == NO_USER)
+                return;
+            hole = (hole + 1) & mask;
+        }
+        for (size_t pos = (hole + 1) & mask; slots[pos] != NO_USER; pos = (pos + 1) & mask) {
+            //an entry may fill the hole only if its home is not between the two
+            if (((pos - probeStart(slots[pos])) & mask) >= ((pos - hole) & mask)) {
+                slots[hole] = slots[pos];
+                hole = pos;
+            }
+        }
+        slots[hole] = NO_USER;
+        count--;
+    }
+
+    void grow() {
+        vector<uint32_t> old(max<size_t>(slots.size() * 2, 8), NO_USER);
+        old.swap(slots);
+        count = 0;
+        for (uint32_t id : old) {
+            if (id != NO_USER)
+                insert(id);
+        }
+    }
+};
+
+enum NotificationType : uint8_t { NOTIFY_MESSAGE = 0, NOTIFY_REQUEST_ACCEPTED = 1 };
+
+//a notification as stored: the text is only put together when the inbox is read
+struct Notification {
+    NotificationType type;
+    uint32_t actorId;  //who caused it
+    uint32_t objectId; //what it is about: the first unread message's index for NOTIFY_MESSAGE
+    uint32_t count;    //events folded into this record
+};
+
+//bounded lock-free multi-producer inbox of Notification records (Vyukov's bounded
+//queue with a single consumer). a sender first tries to fold its event into an
+//unread record of the same type and actor, so the inbox holds up to CAPACITY
+//distinct senders however chatty each one is. when it is full the event is only
+//counted. the ring itself is allocated by the first sender
+class NotificationInbox {
+public:
+    static const uint64_t CAPACITY = 16;
+    static const int COUNT_BITS = 20;
+    static const uint64_t COUNT_MASK = (uint64_t(1) << COUNT_BITS) - 1;
+
+    struct Cell {
+        atomic<uint32_t> sequence; //low bits of pos + 1 once published, pos + CAPACITY once read
+        atomic<uint32_t> objectId;
+        atomic<uint64_t> key;      //type << 32 | actorId
+        atomic<uint64_t> tally;    //pos << COUNT_BITS | count; the position tag stops a
+                                   //late fold from landing on a reused cell
+    };
+
+    atomic<Cell*> cells;
+    atomic<uint64_t> enqueuePos;
+    uint64_t dequeuePos; //consumer only
+    atomic<uint32_t> dropped;
+
+    NotificationInbox() : cells(nullptr), enqueuePos(0), dequeuePos(0), dropped(0) {}
+
+    ~NotificationInbox() {
+        delete[] cells.load(memory_order_relaxed);
+    }
+
+    NotificationInbox(const NotificationInbox&) = delete;
+    NotificationInbox& operator=(const NotificationInbox&) = delete;
+
+    static uint64_t keyOf(NotificationType type, uint32_t actorId) {
+        return static_cast<uint64_t>(type) << 32 | actorId;
+    }
+
+    Cell* ring() {
+        Cell* ring = cells.load(memory_order_acquire);
+        if (ring != nullptr)
+            return ring;
+        Cell* fresh = new Cell[CAPACITY];
+        for (uint64_t i = 0; i < CAPACITY; i++) {
+            fresh[i].sequence.store(static_cast<uint32_t>(i), memory_order_relaxed);
+            fresh[i].tally.store(0, memory_order_relaxed);
+        }
+        if (cells.compare_exchange_strong(ring, fresh, memory_order_acq_rel))
+            return fresh;
+        delete[] fresh; //another sender got there first
+        return ring;
+    }
+
+    //any thread
+    void push(NotificationType type, uint32_t actorId, uint32_t objectId) {
+        Cell* ring = this->ring();
+        uint64_t key = keyOf(type, actorId);
+        uint64_t newest = enqueuePos.load(memory_order_acquire);
+        for (uint64_t back = 1; back <= CAPACITY && back <= newest; back++) {
+            uint64_t pos = newest - back;
+            Cell& cell = ring[pos % CAPACITY];
+            if (cell.sequence.load(memory_order_acquire) != static_cast<uint32_t>(pos + 1))
+                break; //not published yet, or already read along with everything older
+            if (cell.key.load(memory_order_relaxed) != key)
+                continue;
+            uint64_t tally = cell.tally.load(memory_order_relaxed);
+            while (tally >> COUNT_BITS == pos && (tally & COUNT_MASK) != 0 && (tally & COUNT_MASK) != COUNT_MASK) {
+                if (cell.tally.compare_exchange_weak(tally, tally + 1, memory_order_acq_rel))
+                    return;
+            }
+        }
+
+        uint64_t pos = enqueuePos.load(memory_order_relaxed);
+        for (;;) {
+            Cell& cell = ring[pos % CAPACITY];
+            int32_t lag = static_cast<int32_t>(cell.sequence.load(memory_order_acquire) - static_cast<uint32_t>(pos));
+            if (lag == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                    break;
+            }
+            else if (lag < 0) {
+                dropped.fetch_add(1, memory_order_relaxed);
+                return;
+            }
+            else {
+                pos = enqueuePos.load(memory_order_relaxed);
+            }
+        }
+        Cell& cell = ring[pos % CAPACITY];
+        cell.key.store(key, memory_order_relaxed);
+        cell.objectId.store(objectId, memory_order_relaxed);
+        cell.tally.store(pos << COUNT_BITS | 1, memory_order_relaxed);
+        cell.sequence.store(static_cast<uint32_t>(pos + 1), memory_order_release);
+    }
+
+    //consumer only, false when nothing is waiting
+    bool pop(Notification& notification) {
+        Cell* ring = cells.load(memory_order_acquire);
+        if (ring == nullptr)
+            return false;
+        Cell& cell = ring[dequeuePos % CAPACITY];
+        if (cell.sequence.load(memory_order_acquire) != static_cast<uint32_t>(dequeuePos + 1))
+            return false;
+        uint64_t key = cell.key.load(memory_order_relaxed);
+        notification.type = static_cast<NotificationType>(key >> 32);
+        notification.actorId = static_cast<uint32_t>(key);
+        notification.objectId = cell.objectId.load(memory_order_relaxed);
+        notification.count = static_cast<uint32_t>(cell.tally.exchange(dequeuePos << COUNT_BITS, memory_order_acq_rel) & COUNT_MASK);
+        cell.sequence.store(static_cast<uint32_t>(dequeuePos + CAPACITY), memory_order_release);
+        dequeuePos++;
+        return true;
+    }
+
+    //consumer only: events that found the inbox full since the last call
+    uint32_t takeDropped() {
+        return dropped.exchange(0, memory_order_relaxed);
+    }
+};
+
+//a message is stored once, "You:" or the sender's name is added when it is shown
+struct Message {
+    uint32_t senderId;
+    time_t sentAt;
+    string text;
+};
+
+//older messages of a conversation, LZ-compressed in a shard's cold file and read
+//through its view
+struct ColdMessages {
+    const char* data;
+    uint32_t bytes;
+    uint32_t rawBytes;
+    uint32_t count;
+};
+
+//append-only message log shared by both users of an unordered pair: the oldest
+//coldCount messages in cold blocks, oldest first, then the hot tail in memory
+struct Conversation {
+    uint32_t lowId;
+    uint32_t highId;
+    uint32_t coldCount;
+    vector<ColdMessages> coldBlocks;
+    vector<Message> messages;
+
+    //index the next message gets
+    uint32_t size() const {
+        return coldCount + static_cast<uint32_t>(messages.size());
+    }
+};
+
+//conversations by unordered user pair: linear probing over packed 64-bit pair
+//keys, kept at most half full. lookups share the lock, only creating a new
+//conversation takes it exclusively; appends to a log are guarded by the
+//conversation's stripe instead
+class ConversationIndex {
+public:
+    static const size_t INITIAL_CAPACITY = 1024;
+    typedef PoolAllocator NodeAllocator; //for Conversation
+
+    struct Slot {
+        uint64_t key;
+        Conversation* conversation; //nullptr marks an empty slot
+    };
+
+    vector<Slot> slots;
+    size_t count;
+    mutable shared_mutex lock;
+
+    ConversationIndex() : slots(INITIAL_CAPACITY, Slot{ 0, nullptr }), count(0) {}
+
+    ~ConversationIndex() {
+        for (const Slot& slot : slots) {
+            if (slot.conversation != nullptr)
+                NodeAllocator::destroy(slot.conversation);
+        }
+    }
+
+    ConversationIndex(const ConversationIndex&) = delete;
+    ConversationIndex& operator=(const ConversationIndex&) = delete;
+
+    static uint64_t pairKey(uint32_t a, uint32_t b) {
+        return a < b ? (static_cast<uint64_t>(a) << 32 | b) : (static_cast<uint64_t>(b) << 32 | a);
+    }
+
+    size_t probeStart(uint64_t key) const {
+        return mix64(key) & (slots.size() - 1);
+    }
+
+    Conversation* find(uint32_t a, uint32_t b) const {
+        shared_lock<shared_mutex> guard(lock);
+        return lookup(pairKey(a, b));
+    }
+
+    Conversation* lookup(uint64_t key) const {
+        size_t mask = slots.size() - 1;
+        size_t probes = 1;
+        for (size_t pos = probeStart(key);; pos = (pos + 1) & mask, probes++) {
+            if (slots[pos].conversation == nullptr || slots[pos].key == key) {
+                recordMetric(HIST_CONVERSATION_PROBES, probes);
+                return slots[pos].conversation;
+            }
+        }
+    }
+
+    Conversation* findOrCreate(uint32_t a, uint32_t b) {
+        Conversation* conversation = find(a, b);
+        if (conversation != nullptr)
+            return conversation;
+        uint64_t key = pairKey(a, b);
+        unique_lock<shared_mutex> guard(lock);
+        //the other participant may have opened it since we looked
+        conversation = lookup(key);
+        if (conversation != nullptr)
+            return conversation;
+        if ((count + 1) * 2 > slots.size())
+            grow();
+        conversation = NodeAllocator::create<Conversation>(min(a, b), max(a, b), 0u, vector<ColdMessages>(), vector<Message>());
+        place(Slot{ key, conversation });
+        count++;
+        return conversation;
+    }
+
+    void place(Slot entry) {
+        size_t mask = slots.size() - 1;
+        size_t pos = probeStart(entry.key);
+        while (slots[pos].conversation != nullptr)
+            pos = (pos + 1) & mask;
+        slots[pos] = entry;
+    }
+
+    void grow() {
+        vector<Slot> old(slots.size() * 2, Slot{ 0, nullptr });
+        old.swap(slots);
+        for (const Slot& slot : old) {
+            if (slot.conversation != nullptr)
+                place(slot);
+        }
+    }
+};
+
+inline mutex& conversationLock(const Conversation* conversation) {
+    uint64_t key = ConversationIndex::pairKey(conversation->lowId, conversation->highId);
+    return conversationLocks[mix64(key) & (LOCK_STRIPES - 1)].lock;
+}
+
+//a change to a user on another shard, applied by the thread serving that shard
+enum ShardTaskType : uint8_t { TASK_FRIEND_REQUEST, TASK_ACCEPTED, TASK_MESSAGE, TASK_MESSAGE_NOTICE, TASK_FAN_OUT };
+
+struct ShardTask {
+    ShardTaskType type;
+    uint32_t userId;   //the receiving user, NO_USER for a fan-out
+    uint32_t actorId;  //the user on the sending shard
+    uint32_t objectId; //message index or post id
+    time_t sentAt;
+    string text; //message body
+    vector<uint32_t> readers; //fan-out: feeds on the receiving shard that take objectId
+};
+
+#ifndef _WIN32
+//a shard's cold files, opened by the first compaction: post columns and content,
+//mapped back over the store in place, and compressed message blocks read through
+//the files' own views, a full one followed by the next
+class ColdStore {
+public:
+    bool opened;
+    ColdFile columns;
+    ColdFile content;
+    vector<ColdFile*> messages;
+    string prefix; //directory and shard, the files add their kind
+    uint64_t messageCount;
+    uint64_t rawMessageBytes; //before compression
+
+    ColdStore() : opened(false), messageCount(0), rawMessageBytes(0) {}
+
+    ~ColdStore() {
+        for (ColdFile* file : messages)
+            delete file;
+    }
+
+    ColdStore(const ColdStore&) = delete;
+    ColdStore& operator=(const ColdStore&) = delete;
+
+    bool open(const string& dir, uint32_t shard) {
+        prefix = dir + "/shard-" + to_string(shard);
+        opened = columns.open(prefix + "-columns.seg", false) && content.open(prefix + "-posts.seg", false);
+        return opened;
+    }
+
+    //where the block can be read from, nullptr if it couldn't be written
+    const char* appendMessages(const string& block) {
+        if (messages.empty() || !messages.back()->fits(block.size())) {
+            ColdFile* file = new ColdFile();
+            if (!file->open(prefix + "-messages-" + to_string(messages.size()) + ".seg", true)) {
+                delete file;
+                return nullptr;
+            }
+            messages.push_back(file);
+        }
+        uint64_t offset = messages.back()->append(block.data(), block.size());
+        return offset == ColdFile::NO_OFFSET ? nullptr : messages.back()->view + offset;
+    }
+
+    uint64_t bytes() const {
+        uint64_t total = columns.used + content.used;
+        for (const ColdFile* file : messages)
+            total += file->used;
+        return total;
+    }
+};
+#endif
+
+//the users of a group of cities (cityId % shardCount), with the posts they write
+//and the conversations whose lower id they hold, in stores of the shard's own so
+//its writes land on its own pages. while shard threads run (runShards) each thread
+//changes only its own users and hands the rest to the owning shard's inbox; reads
+//and rare upkeep (pull author switches, recommendation caches) still go straight
+//through the striped locks
+class CityShard {
+public:
+    uint32_t index;
+    PostStore posts; //rows in arrival order, ShardedPostStore maps post ids to them
+    ConversationIndex conversations;
+    vector<uint32_t> members; //user ids, appended under registryLock
+    MpscQueue<ShardTask> inbox; //drained by the shard's thread only
+    atomic<uint64_t> tasksReceived;
+#ifndef _WIN32
+    ColdStore cold; //only the compaction touches it
+#endif
+
+    explicit CityShard(uint32_t index) : index(index), tasksReceived(0) {}
+
+    CityShard(const CityShard&) = delete;
+    CityShard& operator=(const CityShard&) = delete;
+};
+
+CityShard* cityShards[MAX_SHARDS]; //the first shardCount, while the engine is up
+thread_local CityShard* currentShard = nullptr; //the shard this thread serves, if any
+atomic<long long> shardTasksInFlight(0); //posted and not yet applied
+
+inline uint32_t shardOfCity(uint32_t cityId) {
+    return cityId % static_cast<uint32_t>(shardCount);
+}
+
+void postTask(uint32_t shard, ShardTask task) {
+    shardTasksInFlight++;
+    cityShards[shard]->tasksReceived.fetch_add(1, memory_order_relaxed);
+    cityShards[shard]->inbox.enqueue(std::move(task));
+}
+
+//posts kept by the author's shard. ids stay one global sequence, since feeds rely
+//on them being in time order, and a directory chunked like PostStore's columns
+//maps each id to its shard and row there
+class ShardedPostStore {
+public:
+    static const uint32_t CHUNK_SIZE = PostStore::CHUNK_SIZE;
+    static const uint32_t MAX_CHUNKS = PostStore::MAX_CHUNKS;
+    static const uint8_t NO_SHARD = 0xff;
+
+    struct Locations {
+        uint32_t row[CHUNK_SIZE];
+        uint8_t shard[CHUNK_SIZE]; //NO_SHARD for ids never placed
+    };
+
+    atomic<Locations*>* chunks;
+    atomic<uint32_t> count;
+    mutex chunkLock; //only taken to open a chunk
+
+    ShardedPostStore() : count(0) {
+        chunks = new atomic<Locations*>[MAX_CHUNKS];
+        for (uint32_t i = 0; i < MAX_CHUNKS; i++)
+            chunks[i].store(nullptr, memory_order_relaxed);
+    }
+
+    ~ShardedPostStore() {
+        for (uint32_t i = 0; i < MAX_CHUNKS; i++)
+            delete chunks[i].load(memory_order_relaxed);
+        delete[] chunks;
+    }
+
+    ShardedPostStore(const ShardedPostStore&) = delete;
+    ShardedPostStore& operator=(const ShardedPostStore&) = delete;
+
+    uint32_t add(uint32_t shard, uint32_t authorId, string_view content) {
+        uint32_t id = count.fetch_add(1, memory_order_relaxed);
+        locate(id, shard, cityShards[shard]->posts.add(authorId, content));
+        return id;
+    }
+
+    //recovery's counterpart of PostStore::place; holes stay NO_SHARD
+    void place(uint32_t id, uint32_t shard, uint32_t authorId, time_t dateTime, string_view content) {
+        locate(id, shard, cityShards[shard]->posts.append(authorId, dateTime, content));
+        if (id >= count.load(memory_order_relaxed))
+            count.store(id + 1, memory_order_relaxed);
+    }
+
+    void locate(uint32_t id, uint32_t shard, uint32_t row) {
+        Locations& locations = chunk(id);
+        locations.row[id % CHUNK_SIZE] = row;
+        locations.shard[id % CHUNK_SIZE] = static_cast<uint8_t>(shard);
+    }
+
+    Locations& chunk(uint32_t id) {
+        atomic<Locations*>& slot = chunks[id / CHUNK_SIZE];
+        Locations* locations = slot.load(memory_order_acquire);
+        if (locations == nullptr) {
+            lock_guard<mutex> guard(chunkLock);
+            locations = slot.load(memory_order_relaxed);
+            if (locations == nullptr) {
+                locations = new Locations;
+                memset(locations->shard, NO_SHARD, sizeof(locations->shard));
+                slot.store(locations, memory_order_release);
+            }
+        }
+        return *locations;
+    }
+
+    //the id must have been handed out by add and published through a lock
+    Post get(uint32_t id) const {
+        const Locations& locations = *chunks[id / CHUNK_SIZE].load(memory_order_acquire);
+        uint32_t at = id % CHUNK_SIZE;
+        return cityShards[locations.shard[at]]->posts.get(locations.row[at]);
+    }
+
+    bool contains(uint32_t id) const {
+        if (id >= count.load(memory_order_relaxed))
+            return false;
+        const Locations* locations = chunks[id / CHUNK_SIZE].load(memory_order_acquire);
+        return locations != nullptr && locations->shard[id % CHUNK_SIZE] != NO_SHARD;
+    }
+
+    uint32_t nextId() const {
+        return count.load(memory_order_relaxed);
+    }
+
+    //arena bytes over every shard
+    uint64_t contentBytes() const {
+        uint64_t total = 0;
+        for (int i = 0; i < shardCount; i++)
+            total += cityShards[i]->posts.arena.used.load(memory_order_relaxed);
+        return total;
+    }
+};
+
+//friend edges keep relation and status as one byte, relation in the low nibble
+enum RelationType : uint8_t { RELATION_FRIEND = 0 };
+enum FriendStatus : uint8_t { STATUS_ACTIVE = 0, STATUS_MUTED = 1 };
+
+const char* statusNames[] = { "active", "muted" };
+
+inline uint8_t edgeState(RelationType relation, FriendStatus status) {
+    return static_cast<uint8_t>(relation | (status << 4));
+}
+
+inline FriendStatus edgeStatus(uint8_t state) {
+    return static_cast<FriendStatus>(state >> 4);
+}
+
+inline uint32_t rotl32(uint32_t x, int r) {
+    return (x << r) | (x >> (32 - r));
+}
+
+inline uint32_t load32be(const uint8_t* p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+inline void store32be(uint8_t* p, uint32_t v) {
+    p[0] = uint8_t(v >> 24);
+    p[1] = uint8_t(v >> 16);
+    p[2] = uint8_t(v >> 8);
+    p[3] = uint8_t(v);
+}
+
+inline uint32_t load32le(const uint8_t* p) {
+    return p[0] | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+inline void store32le(uint8_t* p, uint32_t v) {
+    p[0] = uint8_t(v);
+    p[1] = uint8_t(v >> 8);
+    p[2] = uint8_t(v >> 16);
+    p[3] = uint8_t(v >> 24);
+}
+
+//reads every byte whatever the first mismatch, so a compare takes the same time
+//for a near miss as for a total miss
+inline bool equalBytes(const uint8_t* a, const uint8_t* b, size_t length) {
+    uint8_t diff = 0;
+    for (size_t i = 0; i < length; i++)
+        diff |= a[i] ^ b[i];
+    return diff == 0;
+}
+
+//sha-256 (fips 180-4), the building block of the password hash below
+class Sha256 {
+public:
+    uint32_t state[8];
+    uint8_t buffer[64];
+    uint64_t length; //bytes fed so far
+
+    Sha256() {
+        static const uint32_t initial[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+        };
+        memcpy(state, initial, sizeof(state));
+        length = 0;
+    }
+
+    void update(const void* data, size_t size) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        size_t used = length % 64;
+        length += size;
+        if (used > 0) {
+            size_t take = min(size, 64 - used);
+            memcpy(buffer + used, bytes, take);
+            bytes += take;
+            size -= take;
+            if (used + take < 64)
+                return;
+            compress(buffer);
+        }
+        for (; size >= 64; bytes += 64, size -= 64)
+            compress(bytes);
+        memcpy(buffer, bytes, size);
+    }
+
+    void final(uint8_t digest[32]) {
+        uint64_t bits = length * 8;
+        uint8_t pad[72] = { 0x80 };
+        size_t padding = (length % 64 < 56 ? 56 : 120) - length % 64;
+        for (int i = 0; i < 8; i++)
+            pad[padding + i] = uint8_t(bits >> (56 - 8 * i));
+        update(pad, padding + 8);
+        for (int i = 0; i < 8; i++)
+            store32be(digest + 4 * i, state[i]);
+    }
+
+    void compress(const uint8_t block[64]) {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+        };
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+            w[i] = load32be(block + 4 * i);
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotl32(w[i - 15], 25) ^ rotl32(w[i - 15], 14) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotl32(w[i - 2], 15) ^ rotl32(w[i - 2], 13) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotl32(e, 26) ^ rotl32(e, 21) ^ rotl32(e, 7)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotl32(a, 30) ^ rotl32(a, 19) ^ rotl32(a, 10)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+};
+
+//pbkdf2-hmac-sha256 with one iteration, all scrypt asks of it. the padded key
+//blocks are hashed once and their states copied for every output block
+void pbkdf2Sha256(const uint8_t* key, size_t keyLength, const uint8_t* salt, size_t saltLength, uint8_t* out, size_t outLength) {
+    uint8_t block[64] = {};
+    if (keyLength > 64) {
+        Sha256 longKey;
+        longKey.update(key, keyLength);
+        longKey.final(block);
+    }
+    else {
+        memcpy(block, key, keyLength);
+    }
+    uint8_t pad[64];
+    Sha256 inner, outer;
+    for (int i = 0; i < 64; i++)
+        pad[i] = block[i] ^ 0x36;
+    inner.update(pad, 64);
+    for (int i = 0; i < 64; i++)
+        pad[i] = block[i] ^ 0x5c;
+    outer.update(pad, 64);
+    inner.update(salt, saltLength);
+
+    for (uint32_t index = 1; outLength > 0; index++) {
+        uint8_t counter[4], digest[32];
+        store32be(counter, index);
+        Sha256 hash = inner;
+        hash.update(counter, 4);
+        hash.final(digest);
+        hash = outer;
+        hash.update(digest, 32);
+        hash.final(digest);
+        size_t take = min<size_t>(outLength, 32);
+        memcpy(out, digest, take);
+        out += take;
+        outLength -= take;
+    }
+}
+
+//salsa20/8 core on one 64-byte block
+inline void salsa208(uint32_t block[16]) {
+    uint32_t x[16];
+    memcpy(x, block, sizeof(x));
+    for (int round = 0; round < 8; round += 2) {
+        x[4] ^= rotl32(x[0] + x[12], 7);   x[8] ^= rotl32(x[4] + x[0], 9);
+        x[12] ^= rotl32(x[8] + x[4], 13);  x[0] ^= rotl32(x[12] + x[8], 18);
+        x[9] ^= rotl32(x[5] + x[1], 7);    x[13] ^= rotl32(x[9] + x[5], 9);
+        x[1] ^= rotl32(x[13] + x[9], 13);  x[5] ^= rotl32(x[1] + x[13], 18);
+        x[14] ^= rotl32(x[10] + x[6], 7);  x[2] ^= rotl32(x[14] + x[10], 9);
+        x[6] ^= rotl32(x[2] + x[14], 13);  x[10] ^= rotl32(x[6] + x[2], 18);
+        x[3] ^= rotl32(x[15] + x[11], 7);  x[7] ^= rotl32(x[3] + x[15], 9);
+        x[11] ^= rotl32(x[7] + x[3], 13);  x[15] ^= rotl32(x[11] + x[7], 18);
+        x[1] ^= rotl32(x[0] + x[3], 7);    x[2] ^= rotl32(x[1] + x[0], 9);
+        x[3] ^= rotl32(x[2] + x[1], 13);   x[0] ^= rotl32(x[3] + x[2], 18);
+        x[6] ^= rotl32(x[5] + x[4], 7);    x[7] ^= rotl32(x[6] + x[5], 9);
+        x[4] ^= rotl32(x[7] + x[6], 13);   x[5] ^= rotl32(x[4] + x[7], 18);
+        x[11] ^= rotl32(x[10] + x[9], 7);  x[8] ^= rotl32(x[11] + x[10], 9);
+        x[9] ^= rotl32(x[8] + x[11], 13);  x[10] ^= rotl32(x[9] + x[8], 18);
+        x[12] ^= rotl32(x[15] + x[14], 7); x[13] ^= rotl32(x[12] + x[15], 9);
+        x[14] ^= rotl32(x[13] + x[12], 13); x[15] ^= rotl32(x[14] + x[13], 18);
+    }
+    for (int i = 0; i < 16; i++)
+        block[i] += x[i];
+}
+
+//scrypt BlockMix over 2r 64-byte blocks; y is scratch of the same size
+void scryptBlockMix(uint32_t* b, uint32_t* y, int r) {
+    uint32_t x[16];
+    memcpy(x, b + (2 * r - 1) * 16, sizeof(x));
+    for (int i = 0; i < 2 * r; i++) {
+        for (int j = 0; j < 16; j++)
+            x[j] ^= b[i * 16 + j];
+        salsa208(x);
+        memcpy(y + i * 16, x, sizeof(x));
+    }
+    for (int i = 0; i < r; i++) {
+        memcpy(b + i * 16, y + (2 * i) * 16, sizeof(x));
+        memcpy(b + (r + i) * 16, y + (2 * i + 1) * 16, sizeof(x));
+    }
+}
+
+//scrypt (rfc 7914): fills a 128*r*2^logN byte table with a chain of BlockMix
+//outputs, then walks it in an order that depends on the data, so guessing a
+//password costs that much memory as well as time. the table lives in the calling
+//thread's scratch and is reused by its next hash
+void scrypt(string_view password, const uint8_t* salt, size_t saltLength, int logN, int r, int p, uint8_t* out, size_t outLength) {
+    thread_local vector<uint32_t> scratch; //only ever grows
+    size_t n = size_t(1) << logN;
+    size_t words = 32 * static_cast<size_t>(r); //one 128*r byte block
+    if (scratch.size() < words * (n + 2))
+        scratch.resize(words * (n + 2));
+    uint32_t* v = scratch.data();
+    uint32_t* x = v + words * n;
+    uint32_t* y = x + words;
+
+    const uint8_t* key = reinterpret_cast<const uint8_t*>(password.data());
+    thread_local vector<uint8_t> blocks;
+    blocks.resize(words * 4 * p);
+    pbkdf2Sha256(key, password.size(), salt, saltLength, blocks.data(), blocks.size());
+    for (int lane = 0; lane < p; lane++) {
+        uint8_t* block = blocks.data() + lane * words * 4;
+        for (size_t i = 0; i < words; i++)
+            x[i] = load32le(block + 4 * i);
+        for (size_t i = 0; i < n; i++) {
+            memcpy(v + i * words, x, words * 4);
+            scryptBlockMix(x, y, r);
+        }
+        for (size_t i = 0; i < n; i++) {
+            size_t j = x[(2 * r - 1) * 16] & (n - 1);
+            const uint32_t* row = v + j * words;
+            for (size_t k = 0; k < words; k++)
+                x[k] ^= row[k];
+            scryptBlockMix(x, y, r);
+        }
+        for (size_t i = 0; i < words; i++)
+            store32le(block + 4 * i, x[i]);
+    }
+    pbkdf2Sha256(key, password.size(), blocks.data(), blocks.size(), out, outLength);
+}
+
+//a stored password: the scrypt output plus everything needed to recompute it, so
+//the cost can change per deployment without locking out existing users
+struct PasswordHash {
+    uint8_t format; //0; no typed password starts with a nul, older stores hold the plaintext
+    uint8_t logN; //scrypt N = 2^logN
+    uint8_t blockSize; //scrypt r
+    uint8_t parallelism; //scrypt p
+    uint8_t salt[16];
+    uint8_t key[32];
+};
+
+//bounds on a stored hash's parameters, which come from the store or an import: a
+//verify allocates 128 * r * 2^logN bytes of scratch and runs p times over it
+const int PASSWORD_MAX_COST = 20; //2^20 * 1KB = 1GB per verify at r = 8
+const int PASSWORD_MAX_BLOCK_SIZE = 16;
+const int PASSWORD_MAX_PARALLELISM = 4;
+const uint64_t PASSWORD_MAX_MEMORY = 1ull << 30;
+
+//random salt per password, so equal passwords hash differently and a guess has
+//to be tried against every user separately
+PasswordHash hashPassword(string_view password, int logN, int blockSize) {
+    thread_local random_device entropy;
+    PasswordHash hash;
+    hash.format = 0;
+    hash.logN = static_cast<uint8_t>(logN);
+    hash.blockSize = static_cast<uint8_t>(blockSize);
+    hash.parallelism = 1;
+    for (size_t i = 0; i < sizeof(hash.salt); i += 4)
+        store32le(hash.salt + i, entropy());
+    scrypt(password, hash.salt, sizeof(hash.salt), logN, blockSize, 1, hash.key, sizeof(hash.key));
+    return hash;
+}
+
+bool validPasswordHash(const PasswordHash& hash) {
+    return hash.format == 0 && hash.logN >= 1 && hash.logN <= PASSWORD_MAX_COST
+        && hash.blockSize >= 1 && hash.blockSize <= PASSWORD_MAX_BLOCK_SIZE
+        && hash.parallelism >= 1 && hash.parallelism <= PASSWORD_MAX_PARALLELISM
+        && (128ull * hash.blockSize << hash.logN) <= PASSWORD_MAX_MEMORY;
+}
+
+bool verifyPassword(const PasswordHash& stored, string_view password) {
+    if (!validPasswordHash(stored))
+        return false;
+    uint8_t key[sizeof(stored.key)];
+    scrypt(password, stored.salt, sizeof(stored.salt), stored.logN, stored.blockSize, stored.parallelism, key, sizeof(key));
+    return equalBytes(key, stored.key, sizeof(key));
+}
+
+inline string_view passwordField(const PasswordHash& hash) {
+    return string_view(reinterpret_cast<const char*>(&hash), sizeof(hash));
+}
+
+//reads a password field back from the store. a store written before passwords were
+//hashed holds the plaintext, which gets hashed here and written hashed from the
+//next snapshot on. false for a hash whose parameters are out of bounds
+bool storedPassword(string_view field, PasswordHash& hash) {
+    if (field.size() == sizeof(hash) && field[0] == 0) {
+        memcpy(&hash, field.data(), sizeof(hash));
+        return validPasswordHash(hash);
+    }
+    hash = hashPassword(field, passwordCost, passwordBlockSize);
+    return true;
+}
+
+//time of one hash at a cost, in milliseconds
+double passwordHashMillis(int logN, int blockSize) {
+    auto start = chrono::steady_clock::now();
+    hashPassword("calibration", logN, blockSize);
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+//the largest cost whose hash takes at most targetMs here. measured rather than
+//assumed, so every deployment pays what its own hardware affords; the time
+//roughly doubles per step, so this spends about twice the target in total
+int calibratePasswordCost(double targetMs, int blockSize) {
+    int logN = 8;
+    passwordHashMillis(logN, blockSize); //first touch of the scratch table
+    while (logN < PASSWORD_MAX_COST && passwordHashMillis(logN + 1, blockSize) <= targetMs)
+        logN++;
+    return logN;
+}
+
+//fixed set of threads working through a queue of jobs
+class WorkerPool {
+public:
+    vector<thread> workers;
+    deque<function<void()>> jobs;
+    mutex lock;
+    condition_variable wake;
+    bool stopping;
+    uint64_t completed;
+
+    explicit WorkerPool(int threads) : stopping(false), completed(0) {
+        for (int i = 0; i < threads; i++)
+            workers.emplace_back(&WorkerPool::workLoop, this);
+    }
+
+    ~WorkerPool() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (thread& worker : workers)
+            worker.join();
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    void submit(function<void()> job) {
+        {
+            lock_guard<mutex> guard(lock);
+            jobs.push_back(std::move(job));
+        }
+        wake.notify_one();
+    }
+
+    //runs work on a worker and waits for it to finish
+    template <typename F>
+    void run(F work) {
+        mutex doneLock;
+        condition_variable doneSignal;
+        bool done = false;
+        submit([&] {
+            work();
+            lock_guard<mutex> guard(doneLock);
+            done = true;
+            doneSignal.notify_one();
+        });
+        unique_lock<mutex> guard(doneLock);
+        doneSignal.wait(guard, [&] { return done; });
+    }
+
+    //runs work(0) .. work(parts - 1), part 0 on the calling thread and the rest on
+    //the workers, and waits for all of them
+    template <typename F>
+    void runParts(size_t parts, F work) {
+        mutex doneLock;
+        condition_variable doneSignal;
+        size_t pending = parts - 1;
+        for (size_t part = 1; part < parts; part++) {
+            submit([&, part] {
+                work(part);
+                lock_guard<mutex> guard(doneLock);
+                if (--pending == 0)
+                    doneSignal.notify_one();
+            });
+        }
+        work(0);
+        unique_lock<mutex> guard(doneLock);
+        doneSignal.wait(guard, [&] { return pending == 0; });
+    }
+
+    //drains what is queued before stopping
+    void workLoop() {
+        unique_lock<mutex> guard(lock);
+        for (;;) {
+            wake.wait(guard, [&] { return stopping || !jobs.empty(); });
+            if (jobs.empty())
+                return;
+            function<void()> job = std::move(jobs.front());
+            jobs.pop_front();
+            guard.unlock();
+            job();
+            guard.lock();
+            completed++;
+        }
+    }
+};
+
+//password hashes run here, one per core at most: a burst of logins queues instead
+//of every session thread holding a table of up to 128*r*N bytes and fighting over
+//the cores, and a session waiting for its own login holds no engine lock meanwhile
+WorkerPool* passwordWorkers = nullptr;
+WorkerPool* graphWorkers = nullptr; //slices of one friend-of-friend traversal
+
+//recent successful logins, so a user logging in again within VERIFY_CACHE_SECONDS
+//skips the slow hash. an entry is a sha-256 of a per-process secret, the salt and
+//the password, never the password itself. failures are never cached, so every
+//wrong guess still pays the full cost
+class VerifyCache {
+public:
+    static const size_t SLOTS = 1 << 16; //direct-mapped by user id
+    static const int VERIFY_CACHE_SECONDS = 300;
+
+    struct Slot {
+        uint32_t userId;
+        time_t expires;
+        uint8_t digest[32];
+    };
+
+    vector<Slot> slots;
+    Stripe locks[64];
+    uint8_t secret[32];
+
+    VerifyCache() : slots(SLOTS, Slot{ NO_USER, 0, {} }) {
+        random_device entropy;
+        for (size_t i = 0; i < sizeof(secret); i += 4)
+            store32le(secret + i, entropy());
+    }
+
+    void digestOf(const PasswordHash& hash, string_view password, uint8_t digest[32]) const {
+        Sha256 sha;
+        sha.update(secret, sizeof(secret));
+        sha.update(hash.salt, sizeof(hash.salt));
+        sha.update(password.data(), password.size());
+        sha.final(digest);
+    }
+
+    bool check(uint32_t userId, const PasswordHash& hash, string_view password) {
+        uint8_t digest[32];
+        digestOf(hash, password, digest);
+        size_t index = userId & (SLOTS - 1);
+        lock_guard<mutex> guard(locks[index % 64].lock);
+        const Slot& slot = slots[index];
+        return slot.userId == userId && slot.expires > time(nullptr) && equalBytes(slot.digest, digest, sizeof(digest));
+    }
+
+    void remember(uint32_t userId, const PasswordHash& hash, string_view password) {
+        uint8_t digest[32];
+        digestOf(hash, password, digest);
+        size_t index = userId & (SLOTS - 1);
+        lock_guard<mutex> guard(locks[index % 64].lock);
+        Slot& slot = slots[index];
+        slot.userId = userId;
+        slot.expires = time(nullptr) + VERIFY_CACHE_SECONDS;
+        memcpy(slot.digest, digest, sizeof(digest));
+    }
+};
+
+VerifyCache verifyCache;
+
+//failed logins per key in constant memory, however many distinct keys an attacker
+//cycles through: a count-min sketch whose counters are leaky token buckets. a
+//failure raises the key's counter in each row, every counter drains at a fixed
+//rate, and the estimate is the lowest of the rows, so a key is never undercounted.
+//a failure only lifts the rows still below estimate + 1 (conservative update), which
+//keeps keys that share a cell with a busy one from being dragged up with it
+class LoginThrottle {
+public:
+    static const int ROWS = 4;
+    static const uint32_t UNIT = 1024; //one failure, in counter units
+
+    size_t width; //cells per row, a power of two
+    vector<atomic<uint64_t>> cells; //debt in units << 32 | time of the last change in ms
+    uint64_t limit; //debt at which the key is throttled
+    double drainPerMs; //units drained per millisecond
+
+    //burst failures allowed at once, then one more every secondsPerFailure
+    LoginThrottle(size_t width, int burst, double secondsPerFailure)
+        : width(width), cells(ROWS * width), limit(static_cast<uint64_t>(burst) * UNIT),
+        drainPerMs(UNIT / (secondsPerFailure * 1000)) {
+    }
+
+    LoginThrottle(const LoginThrottle&) = delete;
+    LoginThrottle& operator=(const LoginThrottle&) = delete;
+
+    //two halves of one hash give every row its own cell (Kirsch-Mitzenmacher)
+    size_t cellOf(uint64_t hash, int row) const {
+        uint32_t low = static_cast<uint32_t>(hash), high = static_cast<uint32_t>(hash >> 32) | 1;
+        return row * width + ((low + row * high) & (width - 1));
+    }
+
+    uint64_t drained(uint64_t cell, uint32_t now) const {
+        uint64_t debt = cell >> 32;
+        uint64_t drain = static_cast<uint64_t>((now - static_cast<uint32_t>(cell)) * drainPerMs);
+        return debt > drain ? debt - drain : 0;
+    }
+
+    uint64_t estimate(uint64_t hash, uint32_t now) const {
+        uint64_t lowest = UINT64_MAX;
+        for (int row = 0; row < ROWS; row++)
+            lowest = min(lowest, drained(cells[cellOf(hash, row)].load(memory_order_relaxed), now));
+        return lowest;
+    }
+
+    bool allows(uint64_t hash, uint32_t now) const {
+        return estimate(hash, now) < limit;
+    }
+
+    void charge(uint64_t hash, uint32_t now) {
+        uint64_t target = min<uint64_t>(estimate(hash, now) + UNIT, UINT32_MAX);
+        for (int row = 0; row < ROWS; row++) {
+            atomic<uint64_t>& cell = cells[cellOf(hash, row)];
+            uint64_t seen = cell.load(memory_order_relaxed);
+            for (;;) {
+                uint64_t debt = drained(seen, now);
+                if (debt >= target)
+                    break;
+                if (cell.compare_exchange_weak(seen, target << 32 | now, memory_order_relaxed))
+                    break;
+            }
+        }
+    }
+};
+
+//a name gets 10 failures in a row, then one every 6 seconds: slow enough to stop
+//guessing, quick enough that a user locked out by someone else waits a minute. a
+//source gets 50, then 2 a second. the name sketch is wide because a distributed
+//attack spreads over millions of names: its cells drain about 11K failures a second
+//in total, more than the source throttle lets through from a thousand sources
+const uint64_t THROTTLE_SEED = 0x6c6f67696e73ULL;
+LoginThrottle nameThrottle(1 << 16, 10, 6.0);
+LoginThrottle sourceThrottle(1 << 14, 50, 0.5);
+bool loginThrottling = true;
+atomic<uint64_t> loginsThrottled(0);
+
+//a login attempt's sketch keys, hashed once for the check and the charge
+struct LoginKeys {
+    uint64_t name;
+    uint64_t source;
+    uint32_t now; //ms, wraps every 49 days, which only ever drains a counter early
+};
+
+LoginKeys loginKeys(string_view name, string_view source) {
+    auto now = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch());
+    return LoginKeys{ hashBytes(name.data(), name.size(), THROTTLE_SEED),
+        hashBytes(source.data(), source.size(), ~THROTTLE_SEED), static_cast<uint32_t>(now.count()) };
+}
+
+bool loginAllowed(const LoginKeys& keys) {
+    return !loginThrottling || (nameThrottle.allows(keys.name, keys.now) && sourceThrottle.allows(keys.source, keys.now));
+}
+
+void chargeLoginFailure(const LoginKeys& keys) {
+    if (!loginThrottling)
+        return;
+    nameThrottle.charge(keys.name, keys.now);
+    sourceThrottle.charge(keys.source, keys.now);
+}
+
+//distinct strings numbered densely in first-seen order. each is stored once and
+//handed out as a view that stays valid for the life of the table
+class InternTable {
+public:
+    deque<string> strings; //never moves an element, so views and map keys stay put
+    unordered_map<string_view, uint32_t> ids;
+    mutable shared_mutex lock;
+
+    uint32_t intern(string_view value) {
+        {
+            shared_lock<shared_mutex> guard(lock);
+            auto it = ids.find(value);
+            if (it != ids.end())
+                return it->second;
+        }
+        unique_lock<shared_mutex> guard(lock);
+        auto it = ids.find(value);
+        if (it != ids.end())
+            return it->second;
+        uint32_t id = static_cast<uint32_t>(strings.size());
+        strings.emplace_back(value);
+        ids.emplace(strings.back(), id);
+        return id;
+    }
+
+    string_view name(uint32_t id) const {
+        shared_lock<shared_mutex> guard(lock);
+        return strings[id];
+    }
+};
+
+InternTable cityNames; //users share one copy of each city name
+
+//"people you may know": friends of friends, ranked by mutual friends with a shared
+//city as the tie-breaker
+const size_t RECOMMEND_LIMIT = 10;
+const size_t RECOMMEND_DEPTH = 2 * RECOMMEND_LIMIT; //kept per user, so a few graph changes don't force a rebuild
+const uint32_t MUTUAL_WEIGHT = 2;
+const uint32_t CITY_WEIGHT = 1;
+
+struct Recommendation {
+    uint32_t userId;
+    uint32_t mutualFriends;
+    uint32_t score;
+};
+
+//ranking order: higher score, then lower id
+inline bool rankedBefore(const Recommendation& a, const Recommendation& b) {
+    return a.score != b.score ? a.score > b.score : a.userId < b.userId;
+}
+
+//moves bound up to candidate if candidate ranks before it. a bound known only by
+//its score carries user id 0, which no other candidate with that score ranks before
+inline void raiseBound(Recommendation& bound, const Recommendation& candidate) {
+    if (rankedBefore(candidate, bound))
+        bound = candidate;
+}
+
+inline Recommendation scoreBound(uint32_t score) {
+    return Recommendation{ 0, 0, score };
+}
+
+//a user's best candidates, kept exact by addFriend. every candidate missing from
+//the list ranks after outside, so the top k can be served while all k rank before
+//it; a score of 0 means no candidate is missing
+class RecommendationCache {
+public:
+    mutex lock;
+    vector<Recommendation> ranked; //best first, at most RECOMMEND_DEPTH
+    Recommendation outside;
+    uint64_t version; //bumped by every update, so a rebuild that raced one isn't installed
+    bool built;
+
+    RecommendationCache() : outside(scoreBound(0)), version(0), built(false) {}
+
+    bool serves(size_t limit) const {
+        if (!built)
+            return false;
+        if (ranked.size() >= limit)
+            return rankedBefore(ranked[limit - 1], outside);
+        return outside.score == 0;
+    }
+
+    //inserts or moves a candidate to its place, dropping the last past the depth
+    void place(const Recommendation& candidate) {
+        auto at = find_if(ranked.begin(), ranked.end(), [&](const Recommendation& r) { return r.userId == candidate.userId; });
+        if (at != ranked.end())
+            ranked.erase(at);
+        ranked.insert(upper_bound(ranked.begin(), ranked.end(), candidate, rankedBefore), candidate);
+        if (ranked.size() > RECOMMEND_DEPTH) {
+            raiseBound(outside, ranked.back());
+            ranked.pop_back();
+        }
+    }
+};
+
+atomic<uint32_t> recommendationCaches(0); //while none exist addFriend skips the upkeep
+
+//ranked feed: a post scores its author's weight, halved every RANK_HALF_LIFE of age.
+//only the newest RANKED_WINDOW feed entries compete, which bounds a page's cost
+const size_t RANKED_WINDOW = 256;
+const double RANK_HALF_LIFE = 6 * 3600.0; //seconds
+const double MESSAGE_AFFINITY = 1.0; //per doubling of messages exchanged
+const double MUTUAL_AFFINITY = 0.5; //per doubling of friends in common
+const chrono::microseconds RANKED_FEED_BUDGET(500); //past it, authors not yet weighed count as strangers
+
+struct AuthorAffinity {
+    uint32_t authorId;
+    uint32_t messages; //exchanged with the reader, both ways
+    uint32_t mutualFriends;
+    float weight; //of the two above, kept with them
+};
+
+inline float feedWeight(uint32_t messages, uint32_t mutualFriends) {
+    return static_cast<float>(1 + MESSAGE_AFFINITY * log2(1.0 + messages) + MUTUAL_AFFINITY * log2(1.0 + mutualFriends));
+}
+
+//a reader's weights for the authors its ranked feed has shown. an author is
+//weighed the first time one of its posts competes, and appendMessage and addFriend
+//keep the entry current from then on
+class FeedAffinity {
+public:
+    mutex lock;
+    vector<AuthorAffinity> authors; //by authorId
+    uint64_t version; //bumped by every update, so an entry measured across one isn't kept
+
+    FeedAffinity() : version(0) {}
+
+    AuthorAffinity* find(uint32_t authorId) {
+        auto at = lower_bound(authors.begin(), authors.end(), authorId,
+            [](const AuthorAffinity& a, uint32_t id) { return a.authorId < id; });
+        return at != authors.end() && at->authorId == authorId ? &*at : nullptr;
+    }
+
+    void insert(const AuthorAffinity& entry) {
+        auto at = lower_bound(authors.begin(), authors.end(), entry.authorId,
+            [](const AuthorAffinity& a, uint32_t id) { return a.authorId < id; });
+        if (at == authors.end() || at->authorId != entry.authorId)
+            authors.insert(at, entry);
+    }
+};
+
+atomic<uint32_t> feedAffinities(0); //while none exist messages and addFriend skip the upkeep
+
+class User {
+public:
+    uint32_t id; //dense index into usersById, NO_USER until registered
+    string name; //the only copy; every index refers to the user by id
+    PasswordHash password; //never the plaintext; written once at signup
+    uint32_t cityId; //into cityNames
+    uint32_t shard; //into cityShards, by city
+    time_t lastLoginTimestamp;
+    atomic<int> friendCount; //popularity used to rank search results, read by searches without the user's lock
+
+    vector<uint32_t> timeline; //ids of the user's own posts, ascending
+    FeedRing newsfeed; //recent ids pushed by friends who fan out on write
+    vector<User*> pullFriends; //friends with too many followers to push to us, merged on read
+    atomic<uint32_t> firstPulledPost; //own posts from this id on are not pushed, NO_POST while fanning out
+
+    //friend graph as sorted user ids with a parallel state array: membership is a
+    //binary search and fan-out is one contiguous pass over both
+    vector<uint32_t> friendIds;
+    vector<uint8_t> friendStates;
+
+    //inboxes take pushes from any session without a lock; draining one takes the
+    //owner's lock so two sessions of the same user don't both consume
+    MpscQueue<User*> friendRequestQueue;
+    IdSet pendingRequests; //ids sent and not yet drained, so a request is queued once
+
+    NotificationInbox notifications;
+
+    atomic<RecommendationCache*> recommendations; //built on the first request
+    atomic<FeedAffinity*> affinity; //started by the first ranked feed page
+
+    User* next;
+
+    User(string_view name, const PasswordHash& password, string_view city) {
+        this->id = NO_USER;
+        this->name = name;
+        this->password = password;
+        this->cityId = cityNames.intern(city);
+        this->shard = shardOfCity(cityId);
+        time(&this->lastLoginTimestamp);
+        friendCount = 0;
+        firstPulledPost = NO_POST;
+        recommendations = nullptr;
+        affinity = nullptr;
+        next = nullptr;
+    }
+
+    ~User() {
+        delete recommendations.load();
+        delete affinity.load();
+    }
+
+    User(const User&) = delete;
+    User& operator=(const User&) = delete;
+
+    string_view city() const {
+        return cityNames.name(cityId);
+    }
+
+    bool isPullAuthor() const {
+        return firstPulledPost != NO_POST;
+    }
+
+    void addPost(string_view content);
+    void restorePost(uint32_t postId, time_t dateTime, string_view content);
+    void fanOut(uint32_t postId);
+    size_t postsPage(uint32_t before, size_t limit, uint32_t* page);
+    size_t newsfeedPage(uint32_t before, size_t limit, uint32_t* page);
+    uint32_t viewOwnPosts(ostream& out = cout, uint32_t before = NO_POST);
+    uint32_t viewNewsfeed(ostream& out = cout, uint32_t before = NO_POST);
+
+    bool sendFriendRequest(User* toUser, ostream& out = cout);
+    bool queueFriendRequest(User* fromUser);
+    int acceptFriendRequests(ostream& out = cout);
+    int declineFriendRequests(ostream& out = cout);
+    void showPendingFriendRequests(ostream& out = cout);
+
+    bool sendMessage(User* toUser, string_view message, ostream& out = cout);
+    uint32_t appendMessage(User* toUser, time_t sentAt, string_view message);
+    bool viewMessages(User* withUser, ostream& out = cout);
+
+    void notify(NotificationType type, uint32_t actorId, uint32_t objectId = 0);
+    void viewNotifications(ostream& out = cout);
+
+    bool addFriend(User* newFriend, ostream& out = cout);
+    size_t addFriends(const vector<User*>& newFriends, uint64_t* pendingLsn = nullptr);
+    uint64_t joinFriendLists(const vector<User*>& users);
+    void becomePullAuthor();
+    void announcePullAuthor();
+    void addPullFriend(User* author);
+    bool hasFriend(uint32_t friendId) const;
+    bool isFollowing(User* otherUser);
+    void displayFollowers(ostream& out = cout);
+};
+
+inline shared_mutex& userLock(const User* user) {
+    return userLocks[user->id & (LOCK_STRIPES - 1)].lock;
+}
+
+inline mutex& feedLock(const User* user) {
+    return feedLocks[user->id & (LOCK_STRIPES - 1)].lock;
+}
+
+//true on a shard thread for a user of another shard, whose changes go by task
+inline bool remoteUser(const User* user) {
+    return currentShard != nullptr && user->shard != currentShard->index;
+}
+
+//a pair's conversation is kept by the shard of its lower id
+inline ConversationIndex& conversationsOf(uint32_t a, uint32_t b) {
+    return cityShards[usersById[min(a, b)]->shard]->conversations;
+}
+
+//robin hood open addressing keyed by username. the table doubles at 7/8 load and
+//the old array is drained a few slots per insert, so no single insert pays for a
+//full rehash; lookups check both arrays until the drain finishes
+class HashTable {
+public:
+    static const size_t INITIAL_CAPACITY = 64;
+    static const size_t MIGRATE_STEP = 8;
+
+    //8 bytes: the user's id and enough hash bits to skip most name compares. names
+    //are only kept in usersById
+    struct Slot {
+        uint32_t tag; //low hash bits with the top one set; 0 marks an empty slot
+        uint32_t id;
+    };
+
+    Slot* slots;
+    size_t capacity;
+    size_t count;
+    Slot* oldSlots; //previous array while a resize is being drained
+    size_t oldCapacity;
+    size_t migrateCursor;
+    uint64_t seed;
+
+    HashTable() : count(0), oldSlots(nullptr), oldCapacity(0), migrateCursor(0) {
+        random_device rd;
+        seed = (static_cast<uint64_t>(rd()) << 32) ^ rd();
+        capacity = INITIAL_CAPACITY;
+        slots = static_cast<Slot*>(calloc(capacity, sizeof(Slot)));
+    }
+
+    ~HashTable() {
+        free(slots);
+        free(oldSlots);
+    }
+
+    HashTable(const HashTable&) = delete;
+    HashTable& operator=(const HashTable&) = delete;
+
+    uint64_t hashFunction(string_view username) const {
+        return hashBytes(username.data(), username.size(), seed);
+    }
+
+    //the home slot comes from the low bits, which the tag keeps (tables stay far
+    //below 2^31 slots)
+    static uint32_t tagOf(uint64_t hash) {
+        return static_cast<uint32_t>(hash) | 0x80000000u;
+    }
+
+    //the user must already be in usersById
+    bool insert(const User* user) {
+        return insert(user->id, user->name, hashFunction(user->name));
+    }
+
+    bool insert(uint32_t id, string_view username, uint64_t hash);
+
+    //the user's id, NO_USER if the name isn't registered
+    uint32_t search(string_view username) const {
+        return search(username, hashFunction(username));
+    }
+
+    //with a hash the caller already computed for this name
+    uint32_t search(string_view username, uint64_t hash) const {
+        uint32_t id = find(slots, capacity, tagOf(hash), username);
+        if (id == NO_USER && oldSlots != nullptr)
+            id = find(oldSlots, oldCapacity, tagOf(hash), username);
+        return id;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    static uint32_t find(const Slot* table, size_t tableCapacity, uint32_t tag, string_view username) {
+        size_t mask = tableCapacity - 1;
+        size_t pos = tag & mask;
+        for (size_t dist = 0;; dist++) {
+            const Slot& slot = table[pos];
+            //an empty slot, or a resident closer to its home than we are, means the
+            //key is absent
+            bool absent = slot.tag == 0 || ((pos - (slot.tag & mask)) & mask) < dist;
+            if (absent || (slot.tag == tag && usersById[slot.id]->name == username)) {
+                recordMetric(HIST_LOGIN_PROBES, dist + 1);
+                return absent ? NO_USER : slot.id;
+            }
+            pos = (pos + 1) & mask;
+        }
+    }
+
+    static void place(Slot* table, size_t tableCapacity, Slot entry) {
+        size_t mask = tableCapacity - 1;
+        size_t pos = entry.tag & mask;
+        for (size_t dist = 0;; dist++) {
+            Slot& slot = table[pos];
+            if (slot.tag == 0) {
+                slot = entry;
+                return;
+            }
+            size_t residentDist = (pos - (slot.tag & mask)) & mask;
+            if (residentDist < dist) {
+                swap(entry, slot);
+                dist = residentDist;
+            }
+            pos = (pos + 1) & mask;
+        }
+    }
+
+    void migrate(size_t budget) {
+        while (oldSlots != nullptr && budget-- > 0) {
+            if (migrateCursor == oldCapacity) {
+                free(oldSlots);
+                oldSlots = nullptr;
+                oldCapacity = 0;
+                return;
+            }
+            //old slots are left in place so lookups there stay valid mid-drain
+            const Slot& slot = oldSlots[migrateCursor++];
+            if (slot.tag != 0)
+                place(slots, capacity, slot);
+        }
+    }
+
+    //fills an empty table in one pass: sized up front so nothing migrates, and placed
+    //in home-slot order so each entry lands at or just after its home without
+    //displacing another. the names must be distinct
+    void build(vector<Slot>& entries) {
+        size_t wanted = INITIAL_CAPACITY;
+        while (entries.size() * 8 > wanted * 7)
+            wanted *= 2;
+        if (wanted != capacity) {
+            free(slots);
+            capacity = wanted;
+            slots = static_cast<Slot*>(calloc(capacity, sizeof(Slot)));
+        }
+        size_t mask = capacity - 1;
+        sort(entries.begin(), entries.end(), [mask](const Slot& a, const Slot& b) {
+            return (a.tag & mask) < (b.tag & mask);
+        });
+        for (const Slot& entry : entries)
+            place(slots, capacity, entry);
+        count = entries.size();
+    }
+
+    void grow() {
+        migrate(oldCapacity + 1);
+        oldSlots = slots;
+        oldCapacity = capacity;
+        migrateCursor = 0;
+        capacity *= 2;
+        //calloc hands back lazily zeroed pages, so the new array costs nothing up front
+        slots = static_cast<Slot*>(calloc(capacity, sizeof(Slot)));
+    }
+};
+
+bool HashTable::insert(uint32_t id, string_view username, uint64_t hash) {
+    if (search(username, hash) != NO_USER)
+        return false;
+
+    migrate(MIGRATE_STEP);
+    if ((count + 1) * 8 > capacity * 7)
+        grow();
+    place(slots, capacity, Slot{ tagOf(hash), id });
+    count++;
+    return true;
+}
+
+//the login table split into independently locked shards picked by the top bits of
+//the name hash (the shards index their slots with the low bits). a lookup only
+//waits for a signup landing in its own shard, and lookups on different shards
+//touch neither the same lock nor the same cache lines
+class ShardedLoginTable {
+public:
+    static const int SHARD_BITS = 6;
+    static const size_t SHARDS = size_t(1) << SHARD_BITS;
+
+    struct alignas(64) Shard {
+        mutable shared_mutex lock;
+        HashTable table;
+    };
+
+    Shard* shards;
+    uint64_t seed;
+
+    ShardedLoginTable() {
+        random_device rd;
+        seed = (static_cast<uint64_t>(rd()) << 32) ^ rd();
+        shards = new Shard[SHARDS];
+    }
+
+    ~ShardedLoginTable() {
+        delete[] shards;
+    }
+
+    ShardedLoginTable(const ShardedLoginTable&) = delete;
+    ShardedLoginTable& operator=(const ShardedLoginTable&) = delete;
+
+    uint64_t hashFunction(string_view username) const {
+        return hashBytes(username.data(), username.size(), seed);
+    }
+
+    Shard& shardFor(uint64_t hash) const {
+        return shards[hash >> (64 - SHARD_BITS)];
+    }
+
+    bool insert(const User* user) {
+        uint64_t hash = hashFunction(user->name);
+        Shard& shard = shardFor(hash);
+        unique_lock<shared_mutex> guard(shard.lock);
+        return shard.table.insert(user->id, user->name, hash);
+    }
+
+    //loads users [0, users) of usersById into an empty table: names are hashed and
+    //grouped by shard, then every shard is built at once on the workers
+    void build(uint32_t users, WorkerPool& workers) {
+        size_t parts = workers.workers.size() + 1;
+        vector<uint64_t> hashes(users);
+        workers.runParts(parts, [&](size_t part) {
+            for (uint32_t id = static_cast<uint32_t>(users * part / parts); id < users * (part + 1) / parts; id++)
+                hashes[id] = hashFunction(usersById[id]->name);
+        });
+        vector<vector<HashTable::Slot>> grouped(SHARDS);
+        for (uint32_t id = 0; id < users; id++)
+            grouped[hashes[id] >> (64 - SHARD_BITS)].push_back(HashTable::Slot{ HashTable::tagOf(hashes[id]), id });
+        workers.runParts(parts, [&](size_t part) {
+            for (size_t shard = part; shard < SHARDS; shard += parts)
+                shards[shard].table.build(grouped[shard]);
+        });
+    }
+
+    //the dense id a name is registered under, NO_USER if none
+    uint32_t idOf(string_view username) const {
+        uint64_t hash = hashFunction(username);
+        Shard& shard = shardFor(hash);
+        shared_lock<shared_mutex> guard(shard.lock);
+        return shard.table.search(username, hash);
+    }
+
+    User* search(string_view username) const {
+        uint32_t id = idOf(username);
+        return id != NO_USER ? usersById[id] : nullptr;
+    }
+
+    size_t size() const {
+        size_t total = 0;
+        for (size_t i = 0; i < SHARDS; i++) {
+            shared_lock<shared_mutex> guard(shards[i].lock);
+            total += shards[i].table.size();
+        }
+        return total;
+    }
+};
+
+//first 8 bytes of a name packed big-endian, so comparing two prefixes as integers
+//orders them the same way as comparing the strings
+inline uint64_t keyPrefix(string_view name) {
+    uint64_t prefix = 0;
+    size_t n = min<size_t>(name.size(), 8);
+    for (size_t i = 0; i < n; i++)
+        prefix |= static_cast<uint64_t>(static_cast<unsigned char>(name[i])) << (56 - 8 * i);
+    return prefix;
+}
+
+//B+-tree of users ordered by name. nodes are wide and keep the packed prefixes in
+//their own array, so a search mostly compares integers within one or two cache
+//lines and only touches the full name (through usersById) on a prefix tie. leaves
+//are chained for ordered and prefix range scans; every walk is iterative
+class UserBTree {
+public:
+    static const int MAX_KEYS = 32;
+
+    struct Node {
+        bool isLeaf;
+        int count;
+        uint64_t prefixes[MAX_KEYS];
+        uint32_t keys[MAX_KEYS]; //user ids. leaf: the users, inner: smallest user of children[i + 1]
+    };
+
+    struct Leaf : Node {
+        Leaf* next;
+    };
+
+    struct Inner : Node {
+        Node* children[MAX_KEYS + 1];
+    };
+
+    Node* root;
+    Leaf* firstLeaf;
+    size_t count;
+    int height;
+
+    UserBTree() : count(0), height(1) {
+        firstLeaf = newLeaf();
+        root = firstLeaf;
+    }
+
+    ~UserBTree() {
+        destroy(root);
+    }
+
+    UserBTree(const UserBTree&) = delete;
+    UserBTree& operator=(const UserBTree&) = delete;
+
+    static Leaf* newLeaf() {
+        Leaf* leaf = new Leaf;
+        leaf->isLeaf = true;
+        leaf->count = 0;
+        leaf->next = nullptr;
+        return leaf;
+    }
+
+    static Inner* newInner() {
+        Inner* inner = new Inner;
+        inner->isLeaf = false;
+        inner->count = 0;
+        return inner;
+    }
+
+    static void destroy(Node* node) {
+        if (!node->isLeaf) {
+            Inner* inner = static_cast<Inner*>(node);
+            for (int i = 0; i <= inner->count; i++)
+                destroy(inner->children[i]);
+            delete inner;
+        }
+        else {
+            delete static_cast<Leaf*>(node);
+        }
+    }
+
+    static int compare(uint64_t prefix, string_view name, const Node* node, int i) {
+        if (prefix != node->prefixes[i])
+            return prefix < node->prefixes[i] ? -1 : 1;
+        return name.compare(usersById[node->keys[i]]->name);
+    }
+
+    //first key position >= name
+    static int lowerBound(const Node* node, uint64_t prefix, string_view name) {
+        int lo = 0, hi = node->count;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (compare(prefix, name, node, mid) > 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+    //child to follow: separators equal to the name live in the right subtree
+    static int childIndex(const Node* node, uint64_t prefix, string_view name) {
+        int lo = 0, hi = node->count;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (compare(prefix, name, node, mid) >= 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+    Leaf* findLeaf(uint64_t prefix, string_view name) const {
+        Node* node = root;
+        uint64_t depth = 1;
+        for (; !node->isLeaf; depth++)
+            node = static_cast<Inner*>(node)->children[childIndex(node, prefix, name)];
+        recordMetric(HIST_INDEX_DEPTH, depth);
+        return static_cast<Leaf*>(node);
+    }
+
+    //the user must already be in usersById
+    bool insert(const User* user);
+
+    //bottom-up load of an empty tree from ids in name order: leaves packed and
+    //chained, then each level of inner nodes over the one below. a level's remainder
+    //is spread over its nodes, so every inner node has at least two children
+    void build(const vector<uint32_t>& sortedIds) {
+        struct Built {
+            Node* node;
+            uint64_t prefix; //smallest key under node
+            uint32_t key;
+        };
+        size_t n = sortedIds.size();
+        if (n == 0)
+            return;
+        destroy(root);
+        vector<Built> level;
+        size_t leaves = (n + MAX_KEYS - 1) / MAX_KEYS, at = 0;
+        Leaf* previous = nullptr;
+        for (size_t i = 0; i < leaves; i++) {
+            Leaf* leaf = newLeaf();
+            leaf->count = static_cast<int>(n / leaves + (i < n % leaves ? 1 : 0));
+            for (int k = 0; k < leaf->count; k++, at++) {
+                leaf->keys[k] = sortedIds[at];
+                leaf->prefixes[k] = keyPrefix(usersById[sortedIds[at]]->name);
+            }
+            if (previous != nullptr)
+                previous->next = leaf;
+            else
+                firstLeaf = leaf;
+            previous = leaf;
+            level.push_back(Built{ leaf, leaf->prefixes[0], leaf->keys[0] });
+        }
+        height = 1;
+        while (level.size() > 1) {
+            size_t parents = (level.size() + MAX_KEYS) / (MAX_KEYS + 1);
+            vector<Built> above;
+            at = 0;
+            for (size_t i = 0; i < parents; i++) {
+                size_t take = level.size() / parents + (i < level.size() % parents ? 1 : 0);
+                Inner* inner = newInner();
+                inner->children[0] = level[at].node;
+                for (size_t c = 1; c < take; c++) {
+                    inner->prefixes[c - 1] = level[at + c].prefix;
+                    inner->keys[c - 1] = level[at + c].key;
+                    inner->children[c] = level[at + c].node;
+                }
+                inner->count = static_cast<int>(take - 1);
+                above.push_back(Built{ inner, level[at].prefix, level[at].key });
+                at += take;
+            }
+            level.swap(above);
+            height++;
+        }
+        root = level[0].node;
+        count = n;
+    }
+
+    User* search(string_view username) const {
+        uint64_t prefix = keyPrefix(username);
+        Leaf* leaf = findLeaf(prefix, username);
+        int i = lowerBound(leaf, prefix, username);
+        if (i < leaf->count && compare(prefix, username, leaf, i) == 0)
+            return usersById[leaf->keys[i]];
+        return nullptr;
+    }
+
+    //users whose name starts with prefix, in order, at most limit of them
+    void prefixScan(string_view prefix, size_t limit, vector<User*>& results) const {
+        uint64_t packed = keyPrefix(prefix);
+        Leaf* leaf = findLeaf(packed, prefix);
+        int i = lowerBound(leaf, packed, prefix);
+        while (leaf != nullptr && results.size() < limit) {
+            if (i == leaf->count) {
+                leaf = leaf->next;
+                i = 0;
+                continue;
+            }
+            User* user = usersById[leaf->keys[i]];
+            if (user->name.compare(0, prefix.size(), prefix) != 0)
+                return;
+            results.push_back(user);
+            i++;
+        }
+    }
+
+    void inorderTraversal(ostream& out = cout) const {
+        for (Leaf* leaf = firstLeaf; leaf != nullptr; leaf = leaf->next) {
+            for (int i = 0; i < leaf->count; i++)
+                out << usersById[leaf->keys[i]]->name << endl;
+        }
+    }
+
+    size_t size() const {
+        return count;
+    }
+};
+
+bool UserBTree::insert(const User* user) {
+    uint64_t prefix = keyPrefix(user->name);
+    uint32_t id = user->id;
+
+    //remember the path so splits can be pushed upward without recursion
+    Inner* path[64];
+    int pathIndex[64];
+    int depth = 0;
+    Node* node = root;
+    while (!node->isLeaf) {
+        int i = childIndex(node, prefix, user->name);
+        path[depth] = static_cast<Inner*>(node);
+        pathIndex[depth] = i;
+        depth++;
+        node = static_cast<Inner*>(node)->children[i];
+    }
+
+    Leaf* leaf = static_cast<Leaf*>(node);
+    int pos = lowerBound(leaf, prefix, user->name);
+    if (pos < leaf->count && compare(prefix, user->name, leaf, pos) == 0)
+        return false;
+    count++;
+
+    if (leaf->count < MAX_KEYS) {
+        for (int i = leaf->count; i > pos; i--) {
+            leaf->prefixes[i] = leaf->prefixes[i - 1];
+            leaf->keys[i] = leaf->keys[i - 1];
+        }
+        leaf->prefixes[pos] = prefix;
+        leaf->keys[pos] = id;
+        leaf->count++;
+        return true;
+    }
+
+    //split the full leaf. an append to the last leaf (sorted bulk imports) keeps
+    //the old leaf full instead of halving it, so sequential loads pack densely
+    uint64_t allPrefixes[MAX_KEYS + 1];
+    uint32_t allKeys[MAX_KEYS + 1];
+    for (int i = 0, j = 0; i <= MAX_KEYS; i++) {
+        if (i == pos) {
+            allPrefixes[i] = prefix;
+            allKeys[i] = id;
+        }
+        else {
+            allPrefixes[i] = leaf->prefixes[j];
+            allKeys[i] = leaf->keys[j];
+            j++;
+        }
+    }
+    int leftCount = (pos == MAX_KEYS && leaf->next == nullptr) ? MAX_KEYS : (MAX_KEYS + 1) / 2;
+    Leaf* right = newLeaf();
+    leaf->count = leftCount;
+    right->count = MAX_KEYS + 1 - leftCount;
+    for (int i = 0; i < leftCount; i++) {
+        leaf->prefixes[i] = allPrefixes[i];
+        leaf->keys[i] = allKeys[i];
+    }
+    for (int i = 0; i < right->count; i++) {
+        right->prefixes[i] = allPrefixes[leftCount + i];
+        right->keys[i] = allKeys[leftCount + i];
+    }
+    right->next = leaf->next;
+    leaf->next = right;
+
+    uint64_t sepPrefix = right->prefixes[0];
+    uint32_t sepKey = right->keys[0];
+    Node* newChild = right;
+
+    while (depth > 0) {
+        depth--;
+        Inner* parent = path[depth];
+        int at = pathIndex[depth];
+        if (parent->count < MAX_KEYS) {
+            for (int i = parent->count; i > at; i--) {
+                parent->prefixes[i] = parent->prefixes[i - 1];
+                parent->keys[i] = parent->keys[i - 1];
+                parent->children[i + 1] = parent->children[i];
+            }
+            parent->prefixes[at] = sepPrefix;
+            parent->keys[at] = sepKey;
+            parent->children[at + 1] = newChild;
+            parent->count++;
+            return true;
+        }
+
+        //split the full inner node around its middle separator, which moves up
+        uint64_t sepPrefixes[MAX_KEYS + 1];
+        uint32_t sepKeys[MAX_KEYS + 1];
+        Node* children[MAX_KEYS + 2];
+        for (int i = 0, j = 0; i <= MAX_KEYS; i++) {
+            if (i == at) {
+                sepPrefixes[i] = sepPrefix;
+                sepKeys[i] = sepKey;
+            }
+            else {
+                sepPrefixes[i] = parent->prefixes[j];
+                sepKeys[i] = parent->keys[j];
+                j++;
+            }
+        }
+        for (int i = 0, j = 0; i <= MAX_KEYS + 1; i++)
+            children[i] = (i == at + 1) ? newChild : parent->children[j++];
+
+        int mid = (MAX_KEYS + 1) / 2;
+        Inner* sibling = newInner();
+        parent->count = mid;
+        sibling->count = MAX_KEYS - mid;
+        for (int i = 0; i < mid; i++) {
+            parent->prefixes[i] = sepPrefixes[i];
+            parent->keys[i] = sepKeys[i];
+            parent->children[i] = children[i];
+        }
+        parent->children[mid] = children[mid];
+        for (int i = 0; i < sibling->count; i++) {
+            sibling->prefixes[i] = sepPrefixes[mid + 1 + i];
+            sibling->keys[i] = sepKeys[mid + 1 + i];
+            sibling->children[i] = children[mid + 1 + i];
+        }
+        sibling->children[sibling->count] = children[MAX_KEYS + 1];
+
+        sepPrefix = sepPrefixes[mid];
+        sepKey = sepKeys[mid];
+        newChild = sibling;
+    }
+
+    Inner* newRoot = newInner();
+    newRoot->count = 1;
+    newRoot->prefixes[0] = sepPrefix;
+    newRoot->keys[0] = sepKey;
+    newRoot->children[0] = root;
+    newRoot->children[1] = newChild;
+    root = newRoot;
+    height++;
+    return true;
+}
+
+//path-compressed trie over usernames for typeahead and fuzzy search. every node
+//caches the TOP_K most popular users (by friend count) in its subtree, so a
+//prefix query is a walk down the prefix plus a copy of one list. popularity only
+//grows, so updateScore just re-offers the user along its own path. nodes refer to
+//users by id
+class UserTrie {
+public:
+    static const size_t TOP_K = 10;
+
+    struct Node {
+        string label; //edge label from the parent, short enough to sit inline
+        uint32_t user;     //id of the user whose name ends here, NO_USER if none
+        vector<Node*> children;
+        vector<uint32_t> top; //best first, at most TOP_K
+    };
+
+    struct Match {
+        User* user;
+        int distance;
+    };
+
+    Node* root;
+    size_t count;
+
+    UserTrie() : count(0) {
+        root = new Node{ string(), NO_USER, {}, {} };
+    }
+
+    ~UserTrie() {
+        vector<Node*> pending{ root };
+        while (!pending.empty()) {
+            Node* node = pending.back();
+            pending.pop_back();
+            for (Node* child : node->children)
+                pending.push_back(child);
+            delete node;
+        }
+    }
+
+    UserTrie(const UserTrie&) = delete;
+    UserTrie& operator=(const UserTrie&) = delete;
+
+    static bool ranksAbove(const User* a, const User* b) {
+        if (a->friendCount != b->friendCount)
+            return a->friendCount > b->friendCount;
+        return a->name < b->name;
+    }
+
+    static bool ranksAbove(uint32_t a, uint32_t b) {
+        return ranksAbove(usersById[a], usersById[b]);
+    }
+
+    static Node* childFor(const Node* node, char c) {
+        for (Node* child : node->children) {
+            if (child->label[0] == c)
+                return child;
+        }
+        return nullptr;
+    }
+
+    //keeps node->top sorted best first after user joined or climbed in popularity
+    static void offer(Node* node, uint32_t user) {
+        vector<uint32_t>& top = node->top;
+        size_t i = find(top.begin(), top.end(), user) - top.begin();
+        if (i == top.size()) {
+            if (top.size() < TOP_K)
+                top.push_back(user);
+            else if (ranksAbove(user, top.back()))
+                top.back() = user;
+            else
+                return;
+            i = top.size() - 1;
+        }
+        while (i > 0 && ranksAbove(top[i], top[i - 1])) {
+            swap(top[i], top[i - 1]);
+            i--;
+        }
+    }
+
+    //the user must already be in usersById
+    bool insert(const User* user);
+
+    void updateScore(const User* user) {
+        const string& name = user->name;
+        Node* node = root;
+        size_t pos = 0;
+        offer(node, user->id);
+        while (pos < name.size()) {
+            node = childFor(node, name[pos]);
+            if (node == nullptr)
+                return;
+            pos += node->label.size();
+            offer(node, user->id);
+        }
+    }
+
+    //most popular users whose name starts with prefix
+    void topMatches(string_view prefix, size_t k, vector<User*>& results) const {
+        const Node* node = root;
+        size_t pos = 0;
+        while (pos < prefix.size()) {
+            node = childFor(node, prefix[pos]);
+            if (node == nullptr)
+                return;
+            size_t n = min(node->label.size(), prefix.size() - pos);
+            if (node->label.compare(0, n, prefix, pos, n) != 0)
+                return;
+            pos += n;
+        }
+        for (size_t i = 0; i < node->top.size() && i < k; i++)
+            results.push_back(usersById[node->top[i]]);
+    }
+
+    //users within maxDistance edits of query, closest then most popular first
+    void fuzzyMatches(string_view query, int maxDistance, size_t k, vector<Match>& results) const;
+
+    void fuzzyWalk(const Node* node, size_t depth, string_view query, int maxDistance, size_t k,
+        vector<int>& rows, vector<Match>& best) const;
+};
+
+bool UserTrie::insert(const User* user) {
+    string_view name = user->name;
+    vector<Node*> path{ root };
+    Node* node = root;
+    size_t pos = 0;
+    while (pos < name.size()) {
+        Node* child = childFor(node, name[pos]);
+        if (child == nullptr) {
+            child = new Node{ string(name.substr(pos)), NO_USER, {}, {} };
+            node->children.push_back(child);
+            path.push_back(child);
+            node = child;
+            pos = name.size();
+            break;
+        }
+
+        size_t common = 0;
+        while (common < child->label.size() && pos + common < name.size() &&
+            child->label[common] == name[pos + common])
+            common++;
+
+        if (common < child->label.size()) {
+            //split the edge, the new middle node covers exactly the old child's subtree
+            Node* middle = new Node{ child->label.substr(0, common), NO_USER, { child }, child->top };
+            child->label.erase(0, common);
+            *find(node->children.begin(), node->children.end(), child) = middle;
+            child = middle;
+        }
+        path.push_back(child);
+        node = child;
+        pos += common;
+    }
+
+    if (node->user != NO_USER)
+        return false;
+    node->user = user->id;
+    for (Node* onPath : path)
+        offer(onPath, user->id);
+    count++;
+    return true;
+}
+
+void UserTrie::fuzzyMatches(string_view query, int maxDistance, size_t k, vector<Match>& results) const {
+    size_t width = query.size() + 1;
+    vector<int> rows(width * 32);
+    for (size_t j = 0; j < width; j++)
+        rows[j] = min(static_cast<int>(j), maxDistance + 1);
+
+    //every top-level subtree, so a typo in the first letter is found too. the one
+    //under the query's first letter goes first: the matches it fills in tighten
+    //the budget the banded rows prune the others with
+    vector<Match> best;
+    const Node* first = query.empty() ? nullptr : childFor(root, query[0]);
+    if (first != nullptr)
+        fuzzyWalk(first, 0, query, maxDistance, k, rows, best);
+    for (const Node* child : root->children) {
+        if (child != first && !query.empty())
+            fuzzyWalk(child, 0, query, maxDistance, k, rows, best);
+    }
+
+    sort(best.begin(), best.end(), [](const Match& a, const Match& b) {
+        if (a.distance != b.distance)
+            return a.distance < b.distance;
+        return ranksAbove(a.user, b.user);
+    });
+    results.insert(results.end(), best.begin(), best.end());
+}
+
+//levenshtein dp one row per name character, pruning subtrees whose row minimum
+//already exceeds the budget. only the diagonal band |i - j| <= maxDistance can
+//stay within budget, so each row computes 2 * maxDistance + 1 cells and values
+//are capped at maxDistance + 1. best holds at most k matches
+void UserTrie::fuzzyWalk(const Node* node, size_t depth, string_view query, int maxDistance, size_t k,
+    vector<int>& rows, vector<Match>& best) const {
+    size_t width = query.size() + 1;
+    size_t band = static_cast<size_t>(maxDistance);
+    int cap = maxDistance + 1;
+    for (char c : node->label) {
+        if ((depth + 2) * width > rows.size())
+            rows.resize(rows.size() * 2);
+        const int* prev = &rows[depth * width];
+        int* row = &rows[(depth + 1) * width];
+        size_t i = depth + 1;
+        size_t lo = i > band ? i - band : 1;
+        size_t hi = min(query.size(), i + band);
+
+        row[0] = min(static_cast<int>(i), cap);
+        if (lo > 1)
+            row[lo - 1] = cap;
+        int rowMin = row[0];
+        for (size_t j = lo; j <= hi; j++) {
+            int substitute = prev[j - 1] + (query[j - 1] == c ? 0 : 1);
+            row[j] = min(min(min(prev[j] + 1, row[j - 1] + 1), substitute), cap);
+            rowMin = min(rowMin, row[j]);
+        }
+        if (hi + 1 < width)
+            row[hi + 1] = cap;
+
+        //once k matches are held nothing further than the weakest of them can get in
+        int budget = best.size() == k ? best.front().distance : maxDistance;
+        if (rowMin > budget)
+            return;
+        depth++;
+    }
+
+    bool inBand = depth + band >= query.size() && query.size() + band >= depth;
+    int distance = inBand ? rows[depth * width + query.size()] : cap;
+    if (node->user != NO_USER && distance <= maxDistance) {
+        Match match{ usersById[node->user], distance };
+        auto closer = [](const Match& a, const Match& b) {
+            if (a.distance != b.distance)
+                return a.distance < b.distance;
+            return ranksAbove(a.user, b.user);
+        };
+        //max-heap under closer, so front() is the weakest match kept so far
+        if (best.size() < k) {
+            best.push_back(match);
+            push_heap(best.begin(), best.end(), closer);
+        }
+        else if (closer(match, best.front())) {
+            pop_heap(best.begin(), best.end(), closer);
+            best.back() = match;
+            push_heap(best.begin(), best.end(), closer);
+        }
+    }
+    for (const Node* child : node->children)
+        fuzzyWalk(child, depth, query, maxDistance, k, rows, best);
+}
+
+//durability: every logged mutation is appended to a write-ahead log, and a
+//background thread takes periodic snapshots. files are written in host byte order
+enum LogRecordType : uint8_t { LOG_SIGNUP = 1, LOG_POST = 2, LOG_FRIEND = 3, LOG_FRIENDS = 4, LOG_MESSAGE = 5, LOG_FRIEND_OF = 6 };
+
+//false if the buffered bytes didn't reach the disk
+bool syncFile(FILE* file) {
+    if (fflush(file) != 0)
+        return false;
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fdatasync(fileno(file)) == 0;
+#endif
+}
+
+inline uint32_t checksum32(const char* data, size_t length) {
+    return static_cast<uint32_t>(hashBytes(data, length, 0x5eed));
+}
+
+//bounds-checked cursor over a log record or a mapped snapshot; ok turns false on
+//the first short read and every later read returns zero
+struct ByteReader {
+    const char* at;
+    const char* end;
+    bool ok;
+
+    ByteReader(const char* begin, const char* finish) : at(begin), end(finish), ok(true) {}
+
+    const char* raw(size_t length) {
+        if (!ok || static_cast<size_t>(end - at) < length) {
+            ok = false;
+            return nullptr;
+        }
+        const char* data = at;
+        at += length;
+        return data;
+    }
+
+    template <typename T>
+    T get() {
+        T value = 0;
+        if (const char* data = raw(sizeof(T)))
+            memcpy(&value, data, sizeof(T));
+        return value;
+    }
+
+    uint8_t u8() { return get<uint8_t>(); }
+    uint32_t u32() { return get<uint32_t>(); }
+    int64_t i64() { return get<int64_t>(); }
+
+    string str() {
+        return string(view());
+    }
+
+    //points into the buffer being read
+    string_view view() {
+        uint32_t length = u32();
+        const char* data = raw(length);
+        return data != nullptr ? string_view(data, length) : string_view();
+    }
+};
+
+template <typename T>
+void putValue(string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+void putString(string& out, string_view value) {
+    putValue(out, static_cast<uint32_t>(value.size()));
+    out.append(value);
+}
+
+//a cold message block before compression: sender, time sent and text per message,
+//as in the snapshot
+void encodeMessages(const Message* first, size_t count, string& raw) {
+    for (const Message* message = first; message != first + count; message++) {
+        putValue(raw, message->senderId);
+        putValue(raw, static_cast<int64_t>(message->sentAt));
+        putString(raw, message->text);
+    }
+}
+
+//appends a cold block's messages to out, oldest first
+bool expandColdMessages(const ColdMessages& block, vector<Message>& out) {
+    static thread_local string raw;
+    raw.resize(block.rawBytes);
+    if (!lzExpand(block.data, block.bytes, &raw[0], raw.size()))
+        return false;
+    ByteReader in(raw.data(), raw.data() + raw.size());
+    for (uint32_t i = 0; i < block.count && in.ok; i++) {
+        uint32_t senderId = in.u32();
+        time_t sentAt = static_cast<time_t>(in.i64());
+        out.push_back(Message{ senderId, sentAt, in.str() });
+    }
+    return in.ok;
+}
+
+//every message of a conversation oldest first, cold blocks expanded on the way. the
+//caller holds the conversation's stripe
+template <typename F>
+void forEachMessage(const Conversation* conv, F visit) {
+    vector<Message> expanded;
+    for (const ColdMessages& block : conv->coldBlocks) {
+        expanded.clear();
+        expandColdMessages(block, expanded);
+        for (const Message& message : expanded)
+            visit(message);
+    }
+    for (const Message& message : conv->messages)
+        visit(message);
+}
+
+//read-only view of a whole file, mapped so it is parsed straight out of the page
+//cache with no copy into a buffer
+class MappedFile {
+public:
+    const char* data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+
+    MappedFile() : data(nullptr), size(0) {
+#ifdef _WIN32
+        file = INVALID_HANDLE_VALUE;
+        mapping = nullptr;
+#else
+        fd = -1;
+#endif
+    }
+
+    ~MappedFile() {
+        close();
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const string& path) {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER length;
+        GetFileSizeEx(file, &length);
+        size = static_cast<size_t>(length.QuadPart);
+        if (size == 0)
+            return true;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping == nullptr)
+            return false;
+        data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        return data != nullptr;
+#else
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0)
+            return false;
+        size = static_cast<size_t>(info.st_size);
+        if (size == 0)
+            return true;
+        void* view = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (view == MAP_FAILED)
+            return false;
+        madvise(view, size, MADV_SEQUENTIAL);
+        data = static_cast<const char*>(view);
+        return true;
+#endif
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (data != nullptr)
+            UnmapViewOfFile(data);
+        if (mapping != nullptr)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (data != nullptr)
+            munmap(const_cast<char*>(data), size);
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+#endif
+        data = nullptr;
+        size = 0;
+    }
+};
+
+//append-only log split into segments named by the log position (lsn) they start
+//at. appends only copy into a shared buffer; a flusher thread writes and syncs
+//whatever has gathered every FLUSH_INTERVAL_MS, so one fsync commits a whole
+//group. with syncCommits a mutation also waits for its group before returning.
+//a failed write or sync latches failed: nothing after it is made durable, since
+//replay would stop at the gap, and waiting commits are told so
+class WriteAheadLog {
+public:
+    static constexpr int FLUSH_INTERVAL_MS = 2;
+    static const size_t GROUP_BYTES = 1 << 20; //flush early once this much is waiting
+
+    string directory;
+    FILE* segment;
+    string pending; //appended, not yet written
+    string writing; //the group being written by the flusher
+    uint64_t appendedLsn;
+    uint64_t durableLsn;
+    bool flushing;
+    bool stopping;
+    bool failed;
+    bool syncCommits;
+    uint64_t groups;
+    uint64_t records;
+    mutex lock;
+    condition_variable wake;
+    condition_variable flushed;
+    thread flusher;
+
+    WriteAheadLog(const string& dir, uint64_t startLsn)
+        : directory(dir), segment(nullptr), appendedLsn(startLsn), durableLsn(startLsn),
+        flushing(false), stopping(false), failed(false), syncCommits(false), groups(0), records(0) {
+        segment = fopen(segmentPath(directory, startLsn).c_str(), "ab");
+        failed = segment == nullptr;
+        flusher = thread(&WriteAheadLog::flushLoop, this);
+    }
+
+    ~WriteAheadLog() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        flusher.join();
+        if (segment != nullptr)
+            fclose(segment);
+    }
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    static string segmentPath(const string& dir, uint64_t startLsn) {
+        char name[40];
+        snprintf(name, sizeof(name), "wal-%020llu.log", static_cast<unsigned long long>(startLsn));
+        return dir + "/" + name;
+    }
+
+    //returns the lsn just past the record
+    uint64_t append(const string& record) {
+        lock_guard<mutex> guard(lock);
+        pending.append(record);
+        appendedLsn += record.size();
+        records++;
+        if (pending.size() >= GROUP_BYTES)
+            wake.notify_one();
+        return appendedLsn;
+    }
+
+    uint64_t position() {
+        lock_guard<mutex> guard(lock);
+        return appendedLsn;
+    }
+
+    //false if the log failed before lsn was on disk
+    bool waitDurable(uint64_t lsn) {
+        unique_lock<mutex> guard(lock);
+        wake.notify_one();
+        flushed.wait(guard, [&] { return durableLsn >= lsn || failed; });
+        return durableLsn >= lsn;
+    }
+
+    void flushLoop() {
+        unique_lock<mutex> guard(lock);
+        for (;;) {
+            wake.wait_for(guard, chrono::milliseconds(FLUSH_INTERVAL_MS));
+            if (pending.empty() || failed) {
+                pending.clear();
+                if (stopping)
+                    return;
+                continue;
+            }
+            writing.swap(pending);
+            uint64_t end = appendedLsn;
+            FILE* file = segment;
+            flushing = true;
+            guard.unlock();
+            bool written = fwrite(writing.data(), 1, writing.size(), file) == writing.size() && syncFile(file);
+            writing.clear();
+            guard.lock();
+            flushing = false;
+            if (written) {
+                durableLsn = end;
+                groups++;
+            }
+            else
+                failed = true;
+            flushed.notify_all();
+        }
+    }
+
+    //makes the current segment durable, closes it and starts the next one at the
+    //current lsn, stored in lsn. only called while the mutation gate is held, so
+    //nothing is appending. false if the log has failed or the next segment can't be
+    //created; in the second case appends carry on in the current one
+    bool rotate(uint64_t& lsn) {
+        unique_lock<mutex> guard(lock);
+        flushed.wait(guard, [&] { return !flushing; });
+        if (failed)
+            return false;
+        bool written = fwrite(pending.data(), 1, pending.size(), segment) == pending.size() && syncFile(segment);
+        pending.clear();
+        if (!written) {
+            failed = true;
+            flushed.notify_all();
+            return false;
+        }
+        durableLsn = appendedLsn;
+        flushed.notify_all();
+        FILE* next = fopen(segmentPath(directory, appendedLsn).c_str(), "ab");
+        if (next == nullptr)
+            return false;
+        fclose(segment);
+        segment = next;
+        lsn = appendedLsn;
+        return true;
+    }
+};
+
+WriteAheadLog* writeAheadLog = nullptr; //null when running purely in memory
+
+//held shared for the length of every logged mutation, so a snapshot cut, which
+//takes every stripe, never sees one half applied. each thread sticks to one stripe
+//so mutations on different threads don't bounce a shared reader count
+class MutationGuard {
+public:
+    shared_mutex* stripe;
+
+    MutationGuard() : stripe(nullptr) {
+        if (writeAheadLog == nullptr)
+            return;
+        static atomic<size_t> nextStripe(0);
+        thread_local size_t mine = nextStripe++ % GATE_STRIPES;
+        stripe = &mutationGate[mine].lock;
+        stripe->lock_shared();
+    }
+
+    ~MutationGuard() {
+        if (stripe != nullptr)
+            stripe->unlock_shared();
+    }
+
+    MutationGuard(const MutationGuard&) = delete;
+    MutationGuard& operator=(const MutationGuard&) = delete;
+};
+
+//one log record built in a thread-local buffer: [u32 length][u8 type][fields]
+//[u32 checksum of type and fields]. commit returns 0 when nothing is logged
+class LogRecord {
+public:
+    string& bytes;
+
+    explicit LogRecord(LogRecordType type) : bytes(buffer()) {
+        bytes.clear();
+        putValue(bytes, uint32_t(0));
+        putValue(bytes, static_cast<uint8_t>(type));
+    }
+
+    static string& buffer() {
+        static thread_local string scratch;
+        return scratch;
+    }
+
+    LogRecord& u32(uint32_t value) {
+        putValue(bytes, value);
+        return *this;
+    }
+
+    LogRecord& i64(int64_t value) {
+        putValue(bytes, value);
+        return *this;
+    }
+
+    LogRecord& str(string_view value) {
+        putString(bytes, value);
+        return *this;
+    }
+
+    uint64_t commit() {
+        if (writeAheadLog == nullptr)
+            return 0;
+        uint32_t length = static_cast<uint32_t>(bytes.size() - sizeof(uint32_t));
+        memcpy(&bytes[0], &length, sizeof(length));
+        putValue(bytes, checksum32(bytes.data() + sizeof(uint32_t), length));
+        return writeAheadLog->append(bytes);
+    }
+};
+
+//with syncCommits, blocks until the group holding lsn is on disk; called after the
+//mutation has released its locks. false if the log failed first: the change is
+//in memory only and goes with the next restart
+bool awaitCommit(uint64_t lsn) {
+    if (lsn == 0 || writeAheadLog == nullptr || !writeAheadLog->syncCommits || writeAheadLog->waitDurable(lsn))
+        return true;
+    cerr << "Could not write the data log; this change will not survive a restart" << endl;
+    return false;
+}
+
+void printPost(ostream& out, const Post& post) {
+    char timeStr[26];
+    formatTime(post.dateTime, timeStr, sizeof(timeStr));
+
+    out << "Posted on: " << timeStr;
+    out << post.content << endl << endl;
+}
+
+void User::addPost(string_view content) {
+    uint64_t lsn;
+    {
+        //the author's lock keeps its post ids in timeline order; feed stripes are taken
+        //one at a time underneath it
+        MutationGuard gate;
+        unique_lock<shared_mutex> guard(userLock(this));
+        uint32_t postId = postStore->add(shard, id, content);
+        timeline.push_back(postId);
+        lsn = LogRecord(LOG_POST).u32(postId).u32(id).i64(postStore->get(postId).dateTime).str(content).commit();
+        fanOut(postId);
+    }
+    awaitCommit(lsn);
+}
+
+//replays a logged post; one already in the snapshot is skipped
+void User::restorePost(uint32_t postId, time_t dateTime, string_view content) {
+    unique_lock<shared_mutex> guard(userLock(this));
+    if (postStore->contains(postId))
+        return;
+    postStore->place(postId, shard, id, dateTime, content);
+    timeline.insert(upper_bound(timeline.begin(), timeline.end(), postId), postId);
+    fanOut(postId);
+}
+
+//pushes a new post id into our friends' feeds, caller holds our lock. on a shard
+//thread the readers of each other shard go to it as one task
+void User::fanOut(uint32_t postId) {
+    //friends of a pull author merge its posts in when they read their feed
+    if (postId >= firstPulledPost)
+        return;
+
+    static thread_local vector<uint32_t> remote[MAX_SHARDS];
+    bool measured = metricsEnabled.load(memory_order_relaxed);
+    chrono::steady_clock::time_point start;
+    if (measured)
+        start = chrono::steady_clock::now();
+    const uint32_t* ids = friendIds.data();
+    const uint8_t* states = friendStates.data();
+    uint64_t readers = 0;
+    for (size_t i = 0; i < friendIds.size(); i++) {
+        if (edgeStatus(states[i]) == STATUS_ACTIVE) {
+            User* reader = usersById[ids[i]];
+            readers++;
+            if (remoteUser(reader)) {
+                remote[reader->shard].push_back(reader->id);
+                continue;
+            }
+            lock_guard<mutex> feed(feedLock(reader));
+            reader->newsfeed.push(postId);
+        }
+    }
+    if (measured) {
+        recordMetric(HIST_FAN_OUT_READERS, readers);
+        recordMetric(HIST_FAN_OUT_NANOS, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    }
+    if (currentShard == nullptr)
+        return;
+    for (int s = 0; s < shardCount; s++) {
+        if (!remote[s].empty()) {
+            postTask(s, ShardTask{ TASK_FAN_OUT, NO_USER, id, postId, 0, string(), remote[s] });
+            remote[s].clear();
+        }
+    }
+}
+
+//stops fanning out on write once the friend count passes fanoutLimit; everything
+//posted before the switch is already in the friends' feeds. called with our lock
+//held, announcePullAuthor tells the friends once it is released
+void User::becomePullAuthor() {
+    firstPulledPost = postStore->nextId();
+}
+
+void User::announcePullAuthor() {
+    vector<uint32_t> friends;
+    {
+        shared_lock<shared_mutex> guard(userLock(this));
+        friends = friendIds;
+    }
+    for (uint32_t friendId : friends) {
+        User* reader = usersById[friendId];
+        unique_lock<shared_mutex> guard(userLock(reader));
+        reader->addPullFriend(this);
+    }
+}
+
+void User::addPullFriend(User* author) {
+    //both sides of a new friendship can register the same author
+    if (find(pullFriends.begin(), pullFriends.end(), author) == pullFriends.end())
+        pullFriends.push_back(author);
+}
+
+//run of ids from a below b in an ascending array
+PostRun runBetween(const uint32_t* first, const uint32_t* end, uint32_t from, uint32_t before) {
+    return PostRun{ lower_bound(first, end, from), lower_bound(first, end, before) };
+}
+
+//appends the newest limit ids of run to buffer and records where they went
+void copyNewest(PostRun run, size_t limit, vector<uint32_t>& buffer, vector<pair<size_t, size_t>>& spans) {
+    const uint32_t* first = run.end - min<size_t>(limit, run.end - run.first);
+    if (first == run.end)
+        return;
+    spans.push_back(make_pair(buffer.size(), buffer.size() + (run.end - first)));
+    buffer.insert(buffer.end(), first, run.end);
+}
+
+//up to limit of our own post ids older than before, newest first
+size_t User::postsPage(uint32_t before, size_t limit, uint32_t* page) {
+    shared_lock<shared_mutex> guard(userLock(this));
+    const uint32_t* first = timeline.data();
+    const uint32_t* end = lower_bound(first, first + timeline.size(), before);
+    size_t n = 0;
+    while (end != first && n < limit)
+        page[n++] = *--end;
+    return n;
+}
+
+//up to limit feed ids older than before, newest first: a k-way merge of the feed
+//ring and the timelines of pull friends. ids are handed out in time order, so
+//merging by id is merging by dateTime. each source's newest limit candidates are
+//copied out under that source's lock alone, and the merge runs on the copies
+size_t User::newsfeedPage(uint32_t before, size_t limit, uint32_t* page) {
+    static thread_local vector<User*> authors;
+    static thread_local vector<uint32_t> candidates;
+    static thread_local vector<pair<size_t, size_t>> spans;
+    static thread_local vector<PostRun> heap;
+    authors.clear();
+    candidates.clear();
+    spans.clear();
+    heap.clear();
+
+    {
+        shared_lock<shared_mutex> guard(userLock(this));
+        authors.assign(pullFriends.begin(), pullFriends.end());
+    }
+    {
+        lock_guard<mutex> guard(feedLock(this));
+        PostRun ring[2];
+        for (int i = newsfeed.runs(ring) - 1; i >= 0; i--)
+            copyNewest(runBetween(ring[i].first, ring[i].end, 0, before), limit, candidates, spans);
+    }
+    for (User* author : authors) {
+        shared_lock<shared_mutex> guard(userLock(author));
+        const uint32_t* first = author->timeline.data();
+        copyNewest(runBetween(first, first + author->timeline.size(), author->firstPulledPost, before), limit, candidates, spans);
+    }
+
+    for (const pair<size_t, size_t>& span : spans)
+        heap.push_back(PostRun{ candidates.data() + span.first, candidates.data() + span.second });
+    auto older = [](const PostRun& a, const PostRun& b) {
+        return a.end[-1] < b.end[-1];
+    };
+    make_heap(heap.begin(), heap.end(), older);
+    size_t n = 0;
+    while (!heap.empty() && n < limit) {
+        pop_heap(heap.begin(), heap.end(), older);
+        PostRun& run = heap.back();
+        page[n++] = *--run.end;
+        if (run.end != run.first)
+            push_heap(heap.begin(), heap.end(), older);
+        else
+            heap.pop_back();
+    }
+    return n;
+}
+
+//prints one page and returns the cursor for the next one, NO_POST at the end
+uint32_t User::viewOwnPosts(ostream& out, uint32_t before)
+{
+    uint32_t page[PAGE_SIZE];
+    size_t n = postsPage(before, PAGE_SIZE, page);
+    if (before == NO_POST)
+        out << "Your Posts:" << endl;
+    for (size_t i = 0; i < n; i++)
+        printPost(out, postStore->get(page[i]));
+    return n == PAGE_SIZE ? page[n - 1] : NO_POST;
+}
+
+uint32_t User::viewNewsfeed(ostream& out, uint32_t before)
+{
+    uint32_t page[PAGE_SIZE];
+    size_t n = newsfeedPage(before, PAGE_SIZE, page);
+    if (before == NO_POST)
+        out << "Your Newsfeed:" << endl;
+    for (size_t i = 0; i < n; i++)
+        printPost(out, postStore->get(page[i]));
+    return n == PAGE_SIZE ? page[n - 1] : NO_POST;
+}
+
+bool User::sendFriendRequest(User* toUser, ostream& out)
+{
+    if (toUser == nullptr) {
+        out << "User not found." << endl;
+        return false;
+    }
+    bool fresh = !isFollowing(toUser);
+    if (fresh && remoteUser(toUser)) {
+        //the pending set is the other shard's to check, a repeat is dropped there
+        postTask(toUser->shard, ShardTask{ TASK_FRIEND_REQUEST, toUser->id, id, 0, 0, string(), vector<uint32_t>() });
+    }
+    else if (fresh) {
+        fresh = toUser->queueFriendRequest(this);
+    }
+    if (!fresh) {
+        out << "\nFriend request already sent or already friends." << endl;
+        return false;
+    }
+    out << "\nFriend request sent to " << toUser->name << endl;
+    return true;
+}
+
+//our half of a request from fromUser, false if one is already pending
+bool User::queueFriendRequest(User* fromUser) {
+    {
+        unique_lock<shared_mutex> guard(userLock(this));
+        if (!pendingRequests.insert(fromUser->id))
+            return false;
+    }
+    //a drain running between the insert and the push leaves the id in the pending
+    //set, since only drained ids are erased, and the request waits for the next batch
+    friendRequestQueue.enqueue(fromUser);
+    return true;
+}
+
+//accepts every pending request at once: our side of the graph takes all the new
+//edges in one merge, and the result is reported as one "N new friends" line
+int User::acceptFriendRequests(ostream& out) {
+    static thread_local vector<User*> batch;
+    batch.clear();
+    size_t drained = 0;
+    {
+        unique_lock<shared_mutex> guard(userLock(this));
+        User* fromUser;
+        while (friendRequestQueue.dequeue(fromUser)) {
+            pendingRequests.erase(fromUser->id);
+            drained++;
+            //both sent a request and the other side accepted first
+            if (!hasFriend(fromUser->id))
+                batch.push_back(fromUser);
+        }
+    }
+    recordMetric(HIST_REQUEST_QUEUE_DEPTH, drained);
+    if (drained == 0) {
+        out << "\nNo pending friend requests." << endl;
+        return 0;
+    }
+    //our side and the local senders' sides go in as one batch each, and the console
+    //waits for a single group commit covering both
+    static thread_local vector<User*> local;
+    local.clear();
+    uint64_t lsn = 0;
+    addFriends(batch, &lsn);
+    for (User* newFriend : batch) {
+        if (remoteUser(newFriend))
+            postTask(newFriend->shard, ShardTask{ TASK_ACCEPTED, newFriend->id, id, 0, 0, string(), vector<uint32_t>() });
+        else
+            local.push_back(newFriend);
+    }
+    lsn = max(lsn, joinFriendLists(local));
+    for (User* newFriend : local)
+        newFriend->notify(NOTIFY_REQUEST_ACCEPTED, id);
+    awaitCommit(lsn);
+
+    const size_t namesShown = 3;
+    out << "\nYou have " << batch.size() << " new friend" << (batch.size() == 1 ? "" : "s");
+    for (size_t i = 0; i < batch.size() && i < namesShown; i++)
+        out << (i == 0 ? ": " : ", ") << batch[i]->name;
+    if (batch.size() > namesShown)
+        out << " and " << batch.size() - namesShown << " more";
+    out << endl;
+    return static_cast<int>(batch.size());
+}
+
+int User::declineFriendRequests(ostream& out) {
+    int declined = 0;
+    {
+        unique_lock<shared_mutex> guard(userLock(this));
+        User* fromUser;
+        while (friendRequestQueue.dequeue(fromUser)) {
+            pendingRequests.erase(fromUser->id);
+            declined++;
+        }
+    }
+    recordMetric(HIST_REQUEST_QUEUE_DEPTH, declined);
+    if (declined == 0) {
+        out << "\nNo pending friend requests." << endl;
+        return 0;
+    }
+    out << "\nDeclined " << declined << " friend request" << (declined == 1 ? "" : "s") << endl;
+    return declined;
+}
+
+void User::showPendingFriendRequests(ostream& out)
+{
+    unique_lock<shared_mutex> guard(userLock(this));
+    if (friendRequestQueue.isEmpty())
+    {
+        out << "\nNo pending friend requests." << endl;
+        return;
+    }
+    out << "\nPending Friend Requests:" << endl;
+    friendRequestQueue.forEach([&out](User* fromUser) {
+        out << fromUser->name << endl;
+    });
+}
+
+bool User::sendMessage(User* toUser, string_view message, ostream& out) {
+    if (!isFollowing(toUser)) {
+        out << "You can only message to your followers." << endl;
+        return false;
+    }
+
+    //only the shard keeping the conversation appends to it; when that is the
+    //receiver's shard, the append and the notice travel there together
+    User* keeper = id < toUser->id ? this : toUser;
+    if (remoteUser(keeper)) {
+        postTask(keeper->shard, ShardTask{ TASK_MESSAGE, toUser->id, id, 0, engineNow(), string(message), vector<uint32_t>() });
+        return true;
+    }
+    uint32_t index = appendMessage(toUser, engineNow(), message);
+
+    //add notification to receiver
+    if (remoteUser(toUser))
+        postTask(toUser->shard, ShardTask{ TASK_MESSAGE_NOTICE, toUser->id, id, index, 0, string(), vector<uint32_t>() });
+    else
+        toUser->notify(NOTIFY_MESSAGE, id, index);
+    return true;
+}
+
+void affinityMessage(User* a, User* b);
+
+//logs and stores a message from us, returns its index in the conversation
+uint32_t User::appendMessage(User* toUser, time_t sentAt, string_view message) {
+    uint32_t index;
+    uint64_t lsn;
+    {
+        MutationGuard gate;
+        Conversation* conv = conversationsOf(id, toUser->id).findOrCreate(id, toUser->id);
+        lock_guard<mutex> guard(conversationLock(conv));
+        index = conv->size();
+        conv->messages.push_back(Message{ id, sentAt, string(message) });
+        lsn = LogRecord(LOG_MESSAGE).u32(id).u32(toUser->id).u32(index).i64(sentAt).str(message).commit();
+    }
+    affinityMessage(this, toUser);
+    awaitCommit(lsn);
+    return index;
+}
+
+bool User::viewMessages(User* withUser, ostream& out) {
+    Conversation* conv = conversationsOf(id, withUser->id).find(id, withUser->id);
+    if (conv == nullptr) {
+        out << "\nNo messages with " << withUser->name << endl;
+        return false;
+    }
+
+    lock_guard<mutex> guard(conversationLock(conv));
+    out << "\nMessages from user " << withUser->name << ":" << endl;
+    for (size_t i = conv->messages.size(); i-- > 0;) {
+        const Message& message = conv->messages[i];
+        out << (message.senderId == id ? "You" : withUser->name) << ": " << message.text << endl;
+    }
+    //older ones come back from the cold file
+    vector<Message> expanded;
+    for (size_t block = conv->coldBlocks.size(); block-- > 0;) {
+        expanded.clear();
+        expandColdMessages(conv->coldBlocks[block], expanded);
+        for (size_t i = expanded.size(); i-- > 0;)
+            out << (expanded[i].senderId == id ? "You" : withUser->name) << ": " << expanded[i].text << endl;
+    }
+    return true;
+}
+
+void User::notify(NotificationType type, uint32_t actorId, uint32_t objectId) {
+    notifications.push(type, actorId, objectId);
+}
+
+//drains the inbox and renders it: records of the same type and actor fold into one
+//line ("12 new messages from alice"), and acceptances fold into a single line
+void User::viewNotifications(ostream& out) {
+    static thread_local vector<Notification> unread;
+    unread.clear();
+    uint32_t dropped;
+    {
+        unique_lock<shared_mutex> guard(userLock(this));
+        Notification notification;
+        uint64_t waiting = 0;
+        while (notifications.pop(notification)) {
+            waiting++;
+            bool folded = false;
+            for (Notification& seen : unread) {
+                if (seen.type == notification.type && seen.actorId == notification.actorId) {
+                    seen.count += notification.count;
+                    folded = true;
+                    break;
+                }
+            }
+            if (!folded)
+                unread.push_back(notification);
+        }
+        dropped = notifications.takeDropped();
+        recordMetric(HIST_NOTIFICATION_DEPTH, waiting);
+    }
+    if (unread.empty() && dropped == 0) {
+        out << "\nNo new notifications." << endl;
+        return;
+    }
+
+    out << "\nNotifications:" << endl;
+    size_t accepted = 0;
+    for (const Notification& notification : unread) {
+        if (notification.type == NOTIFY_MESSAGE) {
+            const string& sender = usersById[notification.actorId]->name;
+            if (notification.count == 1)
+                out << "New message from " << sender << endl;
+            else
+                out << notification.count << " new messages from " << sender << endl;
+        }
+        else if (notification.type == NOTIFY_REQUEST_ACCEPTED) {
+            accepted++;
+        }
+    }
+    if (accepted > 0) {
+        const size_t namesShown = 3;
+        size_t shown = 0;
+        for (const Notification& notification : unread) {
+            if (notification.type != NOTIFY_REQUEST_ACCEPTED || shown == namesShown)
+                continue;
+            out << (shown == 0 ? "" : ", ") << usersById[notification.actorId]->name;
+            shown++;
+        }
+        if (accepted > namesShown)
+            out << " and " << accepted - namesShown << " more";
+        out << (accepted == 1 ? " accepted your friend request." : " accepted your friend requests.")
+            << " (" << accepted << " new friend" << (accepted == 1 ? ")" : "s)") << endl;
+    }
+    if (dropped > 0)
+        out << dropped << " more arrived while your inbox was full" << endl;
+}
+
+void updateRecommendations(User* user, User* newFriend);
+void updateAffinity(User* user, User* newFriend);
+
+bool User::addFriend(User* newFriend, ostream& out) {
+    if (newFriend == nullptr) {
+        out << "Error: Trying to add a null friend." << endl;
+        return false;
+    }
+    bool becamePullAuthor = false;
+    uint64_t lsn;
+    {
+        MutationGuard gate;
+        unique_lock<shared_mutex> guard(userLock(this));
+        auto at = lower_bound(friendIds.begin(), friendIds.end(), newFriend->id);
+        if (at != friendIds.end() && *at == newFriend->id)
+            return false;
+        friendStates.insert(friendStates.begin() + (at - friendIds.begin()), edgeState(RELATION_FRIEND, STATUS_ACTIVE));
+        friendIds.insert(at, newFriend->id);
+        friendCount++;
+        lsn = LogRecord(LOG_FRIEND).u32(id).u32(newFriend->id).commit();
+        {
+            unique_lock<shared_mutex> index(indexLock);
+            userNameIndex->updateScore(this);
+        }
+
+        if (newFriend->isPullAuthor())
+            addPullFriend(newFriend);
+        else if (!isPullAuthor() && friendCount > fanoutLimit) {
+            becomePullAuthor();
+            becamePullAuthor = true;
+        }
+    }
+    if (becamePullAuthor) {
+        announcePullAuthor();
+    }
+    else if (isPullAuthor()) {
+        //a push author would have fanned out to the new friend, so it pulls from us
+        unique_lock<shared_mutex> guard(userLock(newFriend));
+        newFriend->addPullFriend(this);
+    }
+    updateRecommendations(this, newFriend);
+    updateAffinity(this, newFriend);
+    return awaitCommit(lsn);
+}
+
+//adds a batch of friends with a single backward merge into the sorted arrays, instead
+//of one shifting insert (and one search index update) per friend. returns how many
+//were new. with pendingLsn the commit is left for the caller to await
+size_t User::addFriends(const vector<User*>& newFriends, uint64_t* pendingLsn) {
+    static thread_local vector<uint32_t> ids;
+    ids.clear();
+    for (User* newFriend : newFriends)
+        ids.push_back(newFriend->id);
+    sort(ids.begin(), ids.end());
+    ids.erase(unique(ids.begin(), ids.end()), ids.end());
+
+    bool wasPullAuthor, becamePullAuthor = false;
+    size_t added = 0;
+    uint64_t lsn;
+    if (pendingLsn != nullptr)
+        *pendingLsn = 0;
+    {
+        MutationGuard gate;
+        unique_lock<shared_mutex> guard(userLock(this));
+        size_t existing = friendIds.size();
+        for (uint32_t friendId : ids) {
+            if (!binary_search(friendIds.begin(), friendIds.begin() + existing, friendId))
+                ids[added++] = friendId;
+        }
+        if (added == 0)
+            return 0;
+
+        friendIds.resize(existing + added);
+        friendStates.resize(existing + added);
+        size_t from = existing, to = existing + added;
+        while (added > 0) {
+            to--;
+            if (from > 0 && friendIds[from - 1] > ids[added - 1]) {
+                from--;
+                friendIds[to] = friendIds[from];
+                friendStates[to] = friendStates[from];
+            }
+            else {
+                added--;
+                friendIds[to] = ids[added];
+                friendStates[to] = edgeState(RELATION_FRIEND, STATUS_ACTIVE);
+            }
+        }
+        added = friendIds.size() - existing;
+        friendCount += static_cast<int>(added);
+        LogRecord record(LOG_FRIENDS);
+        record.u32(id).u32(static_cast<uint32_t>(added)); //the merge left the new ids at the front
+        for (size_t i = 0; i < added; i++)
+            record.u32(ids[i]);
+        lsn = record.commit();
+        {
+            unique_lock<shared_mutex> index(indexLock);
+            userNameIndex->updateScore(this);
+        }
+
+        for (User* newFriend : newFriends) {
+            if (newFriend->isPullAuthor())
+                addPullFriend(newFriend);
+        }
+        wasPullAuthor = isPullAuthor();
+        if (!wasPullAuthor && friendCount > fanoutLimit) {
+            becomePullAuthor();
+            becamePullAuthor = true;
+        }
+    }
+    if (becamePullAuthor) {
+        announcePullAuthor();
+    }
+    else if (wasPullAuthor) {
+        for (User* newFriend : newFriends) {
+            unique_lock<shared_mutex> guard(userLock(newFriend));
+            newFriend->addPullFriend(this);
+        }
+    }
+    if (recommendationCaches.load(memory_order_relaxed) > 0 || feedAffinities.load(memory_order_relaxed) > 0) {
+        vector<uint32_t> addedIds(ids.begin(), ids.begin() + added);
+        for (uint32_t friendId : addedIds) {
+            updateRecommendations(this, usersById[friendId]);
+            updateAffinity(this, usersById[friendId]);
+        }
+    }
+    if (pendingLsn != nullptr)
+        *pendingLsn = lsn;
+    else
+        awaitCommit(lsn);
+    return added;
+}
+
+//the other half of a batch of accepts: adds us to each user's friend list, on this
+//shard, with one log record and one pass under indexLock for all of them. returns
+//the record's lsn for the caller to await
+uint64_t User::joinFriendLists(const vector<User*>& users) {
+    static thread_local vector<User*> joined;
+    static thread_local vector<User*> becamePull;
+    joined.clear();
+    becamePull.clear();
+    uint64_t lsn = 0;
+    {
+        MutationGuard gate;
+        for (User* user : users) {
+            unique_lock<shared_mutex> guard(userLock(user));
+            auto at = lower_bound(user->friendIds.begin(), user->friendIds.end(), id);
+            if (at != user->friendIds.end() && *at == id)
+                continue;
+            user->friendStates.insert(user->friendStates.begin() + (at - user->friendIds.begin()), edgeState(RELATION_FRIEND, STATUS_ACTIVE));
+            user->friendIds.insert(at, id);
+            user->friendCount++;
+            joined.push_back(user);
+            if (isPullAuthor())
+                user->addPullFriend(this);
+            else if (!user->isPullAuthor() && user->friendCount > fanoutLimit) {
+                user->becomePullAuthor();
+                becamePull.push_back(user);
+            }
+        }
+        if (joined.empty())
+            return 0;
+        LogRecord record(LOG_FRIEND_OF);
+        record.u32(id).u32(static_cast<uint32_t>(joined.size()));
+        for (User* user : joined)
+            record.u32(user->id);
+        lsn = record.commit();
+        unique_lock<shared_mutex> index(indexLock);
+        for (User* user : joined)
+            userNameIndex->updateScore(user);
+    }
+    for (User* user : becamePull)
+        user->announcePullAuthor();
+    for (User* user : joined) {
+        if (user->isPullAuthor() && find(becamePull.begin(), becamePull.end(), user) == becamePull.end()) {
+            unique_lock<shared_mutex> guard(userLock(this));
+            addPullFriend(user);
+        }
+        updateRecommendations(user, this);
+        updateAffinity(user, this);
+    }
+    return lsn;
+}
+
+//caller holds our lock
+bool User::hasFriend(uint32_t friendId) const {
+    return binary_search(friendIds.begin(), friendIds.end(), friendId);
+}
+
+bool User::isFollowing(User* otherUser) {
+    if (otherUser == nullptr)
+        return false;
+    shared_lock<shared_mutex> guard(userLock(this));
+    recordMetric(HIST_FRIEND_CHECK_LENGTH, friendIds.size());
+    return hasFriend(otherUser->id);
+}
+
+void User::displayFollowers(ostream& out) {
+    shared_lock<shared_mutex> guard(userLock(this));
+    out << "\nYour Followers:" << endl;
+    for (size_t i = 0; i < friendIds.size(); i++) {
+        out << usersById[friendIds[i]]->name << " (" << statusNames[edgeStatus(friendStates[i])] << ")" << endl;
+    }
+}
+
+//applies a change another shard sent to one of our users
+void applyTask(ShardTask& task) {
+    static thread_local ostream sink(nullptr);
+    if (task.type == TASK_FAN_OUT) {
+        for (uint32_t readerId : task.readers) {
+            User* reader = usersById[readerId];
+            lock_guard<mutex> feed(feedLock(reader));
+            reader->newsfeed.push(task.objectId);
+        }
+        return;
+    }
+    User* user = usersById[task.userId];
+    User* actor = usersById[task.actorId];
+    if (task.type == TASK_FRIEND_REQUEST) {
+        user->queueFriendRequest(actor);
+    }
+    else if (task.type == TASK_ACCEPTED) {
+        user->addFriend(actor, sink);
+        user->notify(NOTIFY_REQUEST_ACCEPTED, actor->id);
+    }
+    else if (task.type == TASK_MESSAGE) {
+        uint32_t index = actor->appendMessage(user, task.sentAt, task.text);
+        user->notify(NOTIFY_MESSAGE, actor->id, index);
+    }
+    else if (task.type == TASK_MESSAGE_NOTICE) {
+        user->notify(NOTIFY_MESSAGE, actor->id, task.objectId);
+    }
+}
+
+//applies whatever is waiting in the shard's inbox, on the shard's thread; returns
+//how many tasks that was
+size_t drainShard(CityShard* shard) {
+    ShardTask task;
+    size_t applied = 0;
+    while (shard->inbox.dequeue(task)) {
+        applyTask(task);
+        shardTasksInFlight--;
+        applied++;
+    }
+    return applied;
+}
+
+//size of the intersection of two ascending id lists. a skewed pair gallops the
+//short list through the long one; otherwise a merge that, with sse2, compares four
+//ids against four at once (each rotation of one block against the other) and then
+//moves on whichever block ends lower
+size_t intersectionSize(const uint32_t* a, size_t na, const uint32_t* b, size_t nb) {
+    if (na > nb) {
+        swap(a, b);
+        swap(na, nb);
+    }
+    if (na == 0)
+        return 0;
+    size_t count = 0;
+    if (nb / na >= 32) {
+        const uint32_t* from = b;
+        const uint32_t* end = b + nb;
+        for (size_t i = 0; i < na && from != end; i++) {
+            from = lower_bound(from, end, a[i]);
+            count += from != end && *from == a[i];
+        }
+        return count;
+    }
+    size_t i = 0, j = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    static const uint8_t matches[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+    while (i + 4 <= na && j + 4 <= nb) {
+        __m128i blockA = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i blockB = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + j));
+        __m128i equal = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi32(blockA, blockB), _mm_cmpeq_epi32(blockA, _mm_shuffle_epi32(blockB, _MM_SHUFFLE(0, 3, 2, 1)))),
+            _mm_or_si128(_mm_cmpeq_epi32(blockA, _mm_shuffle_epi32(blockB, _MM_SHUFFLE(1, 0, 3, 2))),
+                _mm_cmpeq_epi32(blockA, _mm_shuffle_epi32(blockB, _MM_SHUFFLE(2, 1, 0, 3)))));
+        count += matches[_mm_movemask_ps(_mm_castsi128_ps(equal))];
+        uint32_t lastA = a[i + 3], lastB = b[j + 3];
+        if (lastA <= lastB)
+            i += 4;
+        if (lastB <= lastA)
+            j += 4;
+    }
+#endif
+    while (i < na && j < nb) {
+        if (a[i] < b[j])
+            i++;
+        else if (b[j] < a[i])
+            j++;
+        else {
+            count++;
+            i++;
+            j++;
+        }
+    }
+    return count;
+}
+
+const size_t RECOMMEND_GRAIN = 32768; //two-hop edges worth handing to another thread
+
+//ranks every friend of a friend of the user. the candidate id space is cut into
+//slices, one per thread: each walks all the user's friends' sorted lists but only
+//the part inside its slice, counting into its own stretch of one dense array, so
+//the threads share nothing and there is no merge of counts. the user and its
+//friends are marked in the array up front, so they are never counted as
+//candidates. each slice keeps a bounded heap of its best, and the heaps are merged
+//at the end. a candidate that can't make its heap even with the city bonus is
+//turned away on its count alone, before its User is touched. outside gets the
+//best candidate left out, or a cap on its score
+void rankCandidates(User* user, size_t depth, vector<Recommendation>& ranked, Recommendation& outside, size_t maxParts = SIZE_MAX) {
+    vector<uint32_t> friends;
+    {
+        shared_lock<shared_mutex> guard(userLock(user));
+        friends = user->friendIds;
+    }
+    uint32_t userCount = usersById.size();
+    thread_local vector<uint32_t> counts; //all zero between calls
+    if (counts.size() < userCount)
+        counts.resize(userCount);
+    uint32_t* countOf = counts.data();
+
+    size_t work = 0;
+    for (uint32_t friendId : friends)
+        work += usersById[friendId]->friendCount.load(memory_order_relaxed);
+    size_t parts = min({ maxParts, graphWorkers->workers.size() + 1, work / RECOMMEND_GRAIN + 1 });
+
+    const uint32_t EXCLUDED = 0x80000000u;
+    vector<vector<Recommendation>> heaps(parts);
+    vector<Recommendation> bounds(parts, scoreBound(0));
+    graphWorkers->runParts(parts, [&](size_t part) {
+        uint32_t low = static_cast<uint32_t>(uint64_t(userCount) * part / parts);
+        uint32_t high = static_cast<uint32_t>(uint64_t(userCount) * (part + 1) / parts);
+        auto firstFriend = lower_bound(friends.begin(), friends.end(), low);
+        auto endFriend = lower_bound(firstFriend, friends.end(), high);
+        for (auto it = firstFriend; it != endFriend; ++it)
+            countOf[*it] = EXCLUDED;
+        if (user->id >= low && user->id < high)
+            countOf[user->id] = EXCLUDED;
+        vector<uint32_t> touched;
+        for (uint32_t friendId : friends) {
+            User* other = usersById[friendId];
+            shared_lock<shared_mutex> guard(userLock(other));
+            auto it = lower_bound(other->friendIds.begin(), other->friendIds.end(), low);
+            for (; it != other->friendIds.end() && *it < high; ++it) {
+                if (countOf[*it]++ == 0)
+                    touched.push_back(*it);
+            }
+        }
+        for (auto it = firstFriend; it != endFriend; ++it)
+            countOf[*it] = 0;
+        if (user->id >= low && user->id < high)
+            countOf[user->id] = 0;
+
+        vector<Recommendation>& heap = heaps[part];
+        for (uint32_t candidate : touched) {
+            uint32_t mutual = countOf[candidate];
+            countOf[candidate] = 0;
+            uint32_t best = mutual * MUTUAL_WEIGHT + CITY_WEIGHT;
+            if (heap.size() == depth && best < heap.front().score) {
+                raiseBound(bounds[part], scoreBound(best));
+                continue;
+            }
+            Recommendation r{ candidate, mutual, mutual * MUTUAL_WEIGHT + (usersById[candidate]->cityId == user->cityId ? CITY_WEIGHT : 0) };
+            if (heap.size() < depth) {
+                heap.push_back(r);
+                push_heap(heap.begin(), heap.end(), rankedBefore);
+            }
+            else if (rankedBefore(r, heap.front())) {
+                raiseBound(bounds[part], heap.front());
+                pop_heap(heap.begin(), heap.end(), rankedBefore);
+                heap.back() = r;
+                push_heap(heap.begin(), heap.end(), rankedBefore);
+            }
+            else {
+                raiseBound(bounds[part], r);
+            }
+        }
+    });
+
+    ranked.clear();
+    outside = scoreBound(0);
+    for (size_t part = 0; part < parts; part++) {
+        ranked.insert(ranked.end(), heaps[part].begin(), heaps[part].end());
+        raiseBound(outside, bounds[part]);
+    }
+    sort(ranked.begin(), ranked.end(), rankedBefore);
+    if (ranked.size() > depth) {
+        raiseBound(outside, ranked[depth]);
+        ranked.resize(depth);
+    }
+}
+
+atomic<uint64_t> recommendationHits(0), recommendationBuilds(0);
+
+//the user's top suggestions, from the cache while it can answer exactly
+void recommendFriends(User* user, size_t limit, vector<Recommendation>& out) {
+    RecommendationCache* cache = user->recommendations.load(memory_order_acquire);
+    if (cache == nullptr) {
+        RecommendationCache* fresh = new RecommendationCache();
+        if (user->recommendations.compare_exchange_strong(cache, fresh, memory_order_acq_rel)) {
+            cache = fresh;
+            recommendationCaches++;
+        }
+        else {
+            delete fresh;
+        }
+    }
+    uint64_t version;
+    {
+        lock_guard<mutex> guard(cache->lock);
+        if (cache->serves(limit)) {
+            out.assign(cache->ranked.begin(), cache->ranked.begin() + min(limit, cache->ranked.size()));
+            recommendationHits.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+        version = cache->version;
+    }
+    vector<Recommendation> ranked;
+    Recommendation outside;
+    rankCandidates(user, max(limit, RECOMMEND_DEPTH), ranked, outside);
+    recommendationBuilds.fetch_add(1, memory_order_relaxed);
+    out.assign(ranked.begin(), ranked.begin() + min(limit, ranked.size()));
+    lock_guard<mutex> guard(cache->lock);
+    if (cache->version == version) {
+        cache->ranked.swap(ranked);
+        cache->outside = outside;
+        cache->built = true;
+    }
+}
+
+//keeps built caches exact after user adds newFriend, without a rebuild:
+//- user's own list drops newFriend, and cached candidates who are newFriend's
+//  friends gain a mutual friend. the rest of newFriend's friends may gain one too,
+//  or appear for the first time, which only raises the outside bound by score
+//- everyone with newFriend as a friend now shares one more friend with user. their
+//  exact count for user is a sorted intersection, and user moves into their list
+//  if it now ranks there
+void updateRecommendations(User* user, User* newFriend) {
+    if (recommendationCaches.load(memory_order_relaxed) == 0)
+        return;
+    RecommendationCache* own = user->recommendations.load(memory_order_acquire);
+    if (own != nullptr) {
+        shared_lock<shared_mutex> guard(userLock(newFriend));
+        lock_guard<mutex> cacheGuard(own->lock);
+        own->version++;
+        vector<Recommendation>& ranked = own->ranked;
+        ranked.erase(remove_if(ranked.begin(), ranked.end(), [&](const Recommendation& r) { return r.userId == newFriend->id; }), ranked.end());
+        for (Recommendation& r : ranked) {
+            if (newFriend->hasFriend(r.userId)) {
+                r.mutualFriends++;
+                r.score += MUTUAL_WEIGHT;
+            }
+        }
+        sort(ranked.begin(), ranked.end(), rankedBefore);
+        if (own->outside.score > 0)
+            own->outside = scoreBound(own->outside.score + MUTUAL_WEIGHT);
+        if (newFriend->friendIds.size() > (newFriend->hasFriend(user->id) ? 1u : 0u))
+            raiseBound(own->outside, scoreBound(MUTUAL_WEIGHT + CITY_WEIGHT));
+    }
+
+    thread_local vector<uint32_t> followers, userFriends;
+    {
+        shared_lock<shared_mutex> guard(userLock(newFriend));
+        followers = newFriend->friendIds;
+    }
+    {
+        shared_lock<shared_mutex> guard(userLock(user));
+        userFriends = user->friendIds;
+    }
+    for (uint32_t followerId : followers) {
+        User* other = usersById[followerId];
+        RecommendationCache* cache = other->recommendations.load(memory_order_acquire);
+        if (other == user || cache == nullptr)
+            continue;
+        uint32_t mutual;
+        {
+            shared_lock<shared_mutex> guard(userLock(other));
+            if (!other->hasFriend(newFriend->id) || other->hasFriend(user->id))
+                continue;
+            mutual = static_cast<uint32_t>(intersectionSize(other->friendIds.data(), other->friendIds.size(), userFriends.data(), userFriends.size()));
+        }
+        Recommendation r{ user->id, mutual, mutual * MUTUAL_WEIGHT + (other->cityId == user->cityId ? CITY_WEIGHT : 0) };
+        lock_guard<mutex> guard(cache->lock);
+        cache->version++;
+        bool listed = any_of(cache->ranked.begin(), cache->ranked.end(), [&](const Recommendation& c) { return c.userId == user->id; });
+        if (listed || cache->ranked.size() < RECOMMEND_DEPTH || rankedBefore(r, cache->ranked.back()))
+            cache->place(r);
+        else
+            raiseBound(cache->outside, r);
+    }
+}
+
+void showRecommendations(User* user, ostream& out) {
+    vector<Recommendation> suggestions;
+    recommendFriends(user, RECOMMEND_LIMIT, suggestions);
+    if (suggestions.empty()) {
+        out << "\nNo suggestions yet. Add a few friends first." << endl;
+        return;
+    }
+    out << "\nPeople you may know:" << endl;
+    for (const Recommendation& r : suggestions) {
+        User* other = usersById[r.userId];
+        out << other->name << " (" << r.mutualFriends << " mutual friend" << (r.mutualFriends == 1 ? "" : "s");
+        if (other->cityId == user->cityId)
+            out << ", also in " << other->city();
+        out << ")" << endl;
+    }
+}
+
+//weighs author for reader from scratch: the length of their conversation and the
+//friends they share. readerFriends is a copy of the reader's list
+AuthorAffinity measureAffinity(User* reader, User* author, const vector<uint32_t>& readerFriends) {
+    uint32_t messages = 0, mutual;
+    Conversation* conv = conversationsOf(reader->id, author->id).find(reader->id, author->id);
+    if (conv != nullptr) {
+        lock_guard<mutex> guard(conversationLock(conv));
+        messages = conv->size();
+    }
+    {
+        shared_lock<shared_mutex> guard(userLock(author));
+        mutual = static_cast<uint32_t>(intersectionSize(author->friendIds.data(), author->friendIds.size(), readerFriends.data(), readerFriends.size()));
+    }
+    return AuthorAffinity{ author->id, messages, mutual, feedWeight(messages, mutual) };
+}
+
+//one more message between a and b, for whichever of them has weighed the other
+void affinityMessage(User* a, User* b) {
+    if (feedAffinities.load(memory_order_relaxed) == 0)
+        return;
+    User* pair[2] = { a, b };
+    for (int i = 0; i < 2; i++) {
+        FeedAffinity* table = pair[i]->affinity.load(memory_order_acquire);
+        if (table == nullptr)
+            continue;
+        lock_guard<mutex> guard(table->lock);
+        table->version++;
+        if (AuthorAffinity* entry = table->find(pair[1 - i]->id)) {
+            entry->messages++;
+            entry->weight = feedWeight(entry->messages, entry->mutualFriends);
+        }
+    }
+}
+
+//user's half of a new friendship with newFriend: user now shares newFriend with
+//every friend of newFriend, so user's entries for them and their entries for user
+//gain a friend in common. newFriend's half does the same from the other side
+void updateAffinity(User* user, User* newFriend) {
+    if (feedAffinities.load(memory_order_relaxed) == 0)
+        return;
+    FeedAffinity* own = user->affinity.load(memory_order_acquire);
+    if (own != nullptr) {
+        shared_lock<shared_mutex> guard(userLock(newFriend));
+        lock_guard<mutex> tableGuard(own->lock);
+        own->version++;
+        for (AuthorAffinity& entry : own->authors) {
+            if (newFriend->hasFriend(entry.authorId)) {
+                entry.mutualFriends++;
+                entry.weight = feedWeight(entry.messages, entry.mutualFriends);
+            }
+        }
+    }
+
+    thread_local vector<uint32_t> followers;
+    {
+        shared_lock<shared_mutex> guard(userLock(newFriend));
+        followers = newFriend->friendIds;
+    }
+    for (uint32_t followerId : followers) {
+        User* other = usersById[followerId];
+        FeedAffinity* table = other->affinity.load(memory_order_acquire);
+        if (other == user || table == nullptr)
+            continue;
+        lock_guard<mutex> guard(table->lock);
+        table->version++;
+        if (AuthorAffinity* entry = table->find(user->id)) {
+            entry->mutualFriends++;
+            entry->weight = feedWeight(entry->messages, entry->mutualFriends);
+        }
+    }
+}
+
+atomic<uint64_t> rankedStrangers(0); //authors left unweighed because a page ran out of budget
+
+inline float rankedScore(float weight, time_t dateTime, time_t now) {
+    return weight * static_cast<float>(exp2(-max<double>(0, static_cast<double>(now - dateTime)) / RANK_HALF_LIFE));
+}
+
+//up to limit feed posts in ranked order after skipping offset. the newest
+//RANKED_WINDOW entries are grouped by author, newest first within each group,
+//which is also that author's score order; a heap over the group heads then pops
+//the top offset + limit without scoring or sorting the feed as a whole. authors
+//not weighed yet are measured until RANKED_FEED_BUDGET runs out
+size_t rankFeed(User* reader, size_t offset, size_t limit, uint32_t* page) {
+    struct Candidate {
+        uint32_t authorId;
+        uint32_t postId;
+        time_t dateTime;
+    };
+    struct Head {
+        float score;
+        float weight;
+        uint32_t next; //into candidates
+        uint32_t end;
+    };
+    static thread_local vector<uint32_t> window, readerFriends;
+    static thread_local vector<Candidate> candidates;
+    static thread_local vector<Head> heads;
+    static thread_local vector<AuthorAffinity> measured;
+    auto deadline = chrono::steady_clock::now() + RANKED_FEED_BUDGET;
+
+    FeedAffinity* table = reader->affinity.load(memory_order_acquire);
+    if (table == nullptr) {
+        FeedAffinity* fresh = new FeedAffinity();
+        if (reader->affinity.compare_exchange_strong(table, fresh, memory_order_acq_rel)) {
+            table = fresh;
+            feedAffinities++;
+        }
+        else {
+            delete fresh;
+        }
+    }
+
+    window.resize(RANKED_WINDOW);
+    window.resize(reader->newsfeedPage(NO_POST, RANKED_WINDOW, window.data()));
+    candidates.clear();
+    for (uint32_t postId : window) {
+        Post post = postStore->get(postId);
+        candidates.push_back(Candidate{ post.authorId, postId, post.dateTime });
+    }
+    sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+        return a.authorId != b.authorId ? a.authorId < b.authorId : a.postId > b.postId;
+    });
+
+    //one group per author; weights come from the table in one pass under its lock,
+    //and a group whose author is missing is marked with a negative weight
+    heads.clear();
+    uint64_t version;
+    {
+        lock_guard<mutex> guard(table->lock);
+        version = table->version;
+        for (size_t i = 0; i < candidates.size();) {
+            size_t end = i;
+            while (end < candidates.size() && candidates[end].authorId == candidates[i].authorId)
+                end++;
+            AuthorAffinity* entry = table->find(candidates[i].authorId);
+            heads.push_back(Head{ 0, entry != nullptr ? entry->weight : -1.0f, static_cast<uint32_t>(i), static_cast<uint32_t>(end) });
+            i = end;
+        }
+    }
+    measured.clear();
+    for (Head& head : heads) {
+        if (head.weight >= 0)
+            continue;
+        if (chrono::steady_clock::now() > deadline) {
+            head.weight = feedWeight(0, 0);
+            rankedStrangers.fetch_add(1, memory_order_relaxed);
+            continue;
+        }
+        if (measured.empty()) {
+            shared_lock<shared_mutex> guard(userLock(reader));
+            readerFriends = reader->friendIds;
+        }
+        measured.push_back(measureAffinity(reader, usersById[candidates[head.next].authorId], readerFriends));
+        head.weight = measured.back().weight;
+    }
+    if (!measured.empty()) {
+        lock_guard<mutex> guard(table->lock);
+        if (table->version == version) {
+            for (const AuthorAffinity& entry : measured)
+                table->insert(entry);
+        }
+    }
+
+    time_t now = engineNow();
+    for (Head& head : heads)
+        head.score = rankedScore(head.weight, candidates[head.next].dateTime, now);
+    auto lower = [&](const Head& a, const Head& b) {
+        return a.score != b.score ? a.score < b.score : candidates[a.next].postId < candidates[b.next].postId;
+    };
+    make_heap(heads.begin(), heads.end(), lower);
+    size_t n = 0, skipped = 0;
+    while (!heads.empty() && n < limit) {
+        pop_heap(heads.begin(), heads.end(), lower);
+        Head& head = heads.back();
+        if (skipped < offset)
+            skipped++;
+        else
+            page[n++] = candidates[head.next].postId;
+        if (++head.next < head.end) {
+            head.score = rankedScore(head.weight, candidates[head.next].dateTime, now);
+            push_heap(heads.begin(), heads.end(), lower);
+        }
+        else {
+            heads.pop_back();
+        }
+    }
+    return n;
+}
+
+//prints one ranked page and returns the offset of the next, 0 at the end
+size_t showRankedFeed(User* reader, ostream& out, size_t offset = 0) {
+    uint32_t page[PAGE_SIZE];
+    size_t n = rankFeed(reader, offset, PAGE_SIZE, page);
+    if (offset == 0)
+        out << "Top Posts:" << endl;
+    for (size_t i = 0; i < n; i++)
+        printPost(out, postStore->get(page[i]));
+    return n == PAGE_SIZE ? offset + n : 0;
+}
+
+void logo()
+{
+    char a = 220;
+    char b = 221;
+    char c = 222;
+    char d = 223;
+    char e = 233;
+    cout << "\n\n\n";
+    setColor(14);
+    cout << "\t" << " INSTAGRAM\n\n";
+    setColor(12);
+    cout << "\t" << a << a << a << a << a << a << a << a << a << a << a << endl;
+    for (int i = 0; i < 2; i++)
+    {
+        if (i == 0)
+        {
+            cout << "\t" << b << "\t";
+            setColor(7);
+            cout << e << " ";
+            setColor(12);
+            cout << c << endl; continue;
+        }
+        if (i == 1)
+        {
+            setColor(9);
+            cout << "\t" << b << "  " << a << a << a << a << a << "  " << c << endl;
+            cout << "\t" << b << "  " << b << "   " << c << "  " << c << endl;
+            cout << "\t" << b << "  " << b << "   " << c << "  " << c << endl;
+            setColor(6);
+            cout << "\t" << b << "  " << d << d << d << d << d << "  " << c << endl;
+        }
+        cout << "\t" << b << "\t  " << c << endl;
+    }
+    cout << "\t" << d << d << d << d << d << d << d << d << d << d << d << endl;
+
+
+}
+
+void loadingScreen() {
+    char a = 177, b = 219;
+    cout << "\n\t Loading...\n";
+    setColor(8);
+    for (int i = 0; i < 25; i++)
+    {
+        cout << a;
+    }
+    cout << "\r   ";
+    setColor(6);
+    for (int i = 0; i < 22; ++i) {
+        cout << b;
+        sleepMillis(100);
+    }
+    cout << endl;
+    setColor(7);
+
+}
+
+void initEngine() {
+    loginTable = new ShardedLoginTable();
+    userSearchTree = new UserBTree();
+    userNameIndex = new UserTrie();
+    for (int i = 0; i < shardCount; i++)
+        cityShards[i] = new CityShard(i);
+    postStore = new ShardedPostStore();
+    passwordWorkers = new WorkerPool(max(1u, thread::hardware_concurrency()));
+    graphWorkers = new WorkerPool(max(1u, thread::hardware_concurrency()) - 1);
+}
+
+void shutdownEngine() {
+    while (usersList != nullptr) {
+        User* temp = usersList;
+        usersList = usersList->next;
+        delete temp;
+    }
+    usersById.clear();
+    delete loginTable;
+    delete userSearchTree;
+    delete userNameIndex;
+    delete postStore;
+    for (int i = 0; i < shardCount; i++) {
+        delete cityShards[i];
+        cityShards[i] = nullptr;
+    }
+    delete passwordWorkers;
+    delete graphWorkers;
+    loginTable = nullptr;
+    userSearchTree = nullptr;
+    userNameIndex = nullptr;
+    postStore = nullptr;
+    passwordWorkers = nullptr;
+    graphWorkers = nullptr;
+    recommendationCaches = 0;
+    feedAffinities = 0;
+}
+
+//registers a user with an already hashed password in every index, nullptr if the
+//name is taken. the login table goes last, so no session can find a
+//half-registered user by name
+User* registerUser(string_view name, const PasswordHash& password, string_view city) {
+    User* newUser;
+    uint64_t lsn;
+    {
+        MutationGuard gate;
+        lock_guard<mutex> registry(registryLock);
+        if (loginTable->search(name) != nullptr)
+            return nullptr;
+
+        newUser = new User(name, password, city);
+
+        newUser->id = static_cast<uint32_t>(usersById.size());
+        usersById.push_back(newUser);
+        cityShards[newUser->shard]->members.push_back(newUser->id);
+        newUser->next = usersList;
+        usersList = newUser;
+
+        {
+            unique_lock<shared_mutex> index(indexLock);
+            userSearchTree->insert(newUser);
+            userNameIndex->insert(newUser);
+        }
+        lsn = LogRecord(LOG_SIGNUP).u32(newUser->id).str(name).str(passwordField(password)).str(city).commit();
+        loginTable->insert(newUser);
+    }
+    awaitCommit(lsn);
+    return newUser;
+}
+
+//nullptr if the name is taken or the password too weak. the hash runs on a password
+//worker before any engine lock is taken
+User* createUser(string_view name, string_view password, string_view city) {
+    if (password.length() < MIN_PASSWORD_LENGTH || loginTable->search(name) != nullptr)
+        return nullptr;
+    PasswordHash hash;
+    passwordWorkers->run([&] { hash = hashPassword(password, passwordCost, passwordBlockSize); });
+    return registerUser(name, hash, city);
+}
+
+//checks the credentials and stamps the login time, nullptr on failure. an attempt
+//for a throttled name or from a throttled source is turned away before the name is
+//looked up; a repeat login answered by the verify cache never reaches the workers
+User* authenticate(string_view name, string_view password, string_view source = "local") {
+    LoginKeys keys = loginKeys(name, source);
+    if (!loginAllowed(keys)) {
+        loginsThrottled.fetch_add(1, memory_order_relaxed);
+        return nullptr;
+    }
+    User* user = loginTable->search(name);
+    if (user == nullptr) {
+        chargeLoginFailure(keys);
+        return nullptr;
+    }
+    if (!verifyCache.check(user->id, user->password, password)) {
+        bool valid = false;
+        passwordWorkers->run([&] { valid = verifyPassword(user->password, password); });
+        if (!valid) {
+            chargeLoginFailure(keys);
+            return nullptr;
+        }
+        verifyCache.remember(user->id, user->password, password);
+    }
+    unique_lock<shared_mutex> guard(userLock(user));
+    time(&user->lastLoginTimestamp);
+    return user;
+}
+
+//name lookups for sessions, under the index read lock
+void listUsers(ostream& out) {
+    shared_lock<shared_mutex> guard(indexLock);
+    userSearchTree->inorderTraversal(out);
+}
+
+void searchByPrefix(string_view prefix, vector<User*>& matches) {
+    shared_lock<shared_mutex> guard(indexLock);
+    userNameIndex->topMatches(prefix, SEARCH_RESULT_LIMIT, matches);
+}
+
+void searchSimilar(string_view query, vector<UserTrie::Match>& matches) {
+    shared_lock<shared_mutex> guard(indexLock);
+    userNameIndex->fuzzyMatches(query, FUZZY_MAX_DISTANCE, SEARCH_RESULT_LIMIT, matches);
+}
+
+//on-disk store: snapshot.bin holds the state up to a log position, wal-*.log
+//segments hold every logged mutation from there on
+const uint32_t SNAPSHOT_MAGIC = 0x504e534d; //"MSNP"
+const uint32_t SNAPSHOT_END = 0x444e4553; //"SEND", written last so a short file is caught
+
+const char* STORE_DIRECTORY = "minstagram-data"; //the console's store
+string storeDirectory; //empty when running purely in memory
+int snapshotIntervalSeconds = 300; //snapshot at least this often while the log grows
+uint64_t snapshotLogBytes = 256ull << 20; //or as soon as the log grows by this much
+atomic<uint64_t> snapshotLsn(0); //log position the newest snapshot covers
+mutex snapshotLock; //one snapshot at a time
+thread snapshotThread;
+mutex snapshotThreadLock;
+condition_variable snapshotWake;
+bool snapshotStopping = false;
+
+struct RecoveryStats {
+    double snapshotSeconds;
+    double replaySeconds;
+    size_t replayedRecords;
+    uint64_t snapshotBytes;
+    uint64_t logBytes;
+};
+
+//log segments in dir by start position
+vector<pair<uint64_t, string>> listLogSegments(const string& dir) {
+    vector<pair<uint64_t, string>> segments;
+    error_code error;
+    for (const filesystem::directory_entry& entry : filesystem::directory_iterator(dir, error)) {
+        string name = entry.path().filename().string();
+        if (name.size() == 28 && name.compare(0, 4, "wal-") == 0 && name.compare(24, 4, ".log") == 0)
+            segments.push_back(make_pair(strtoull(name.c_str() + 4, nullptr, 10), entry.path().string()));
+    }
+    sort(segments.begin(), segments.end());
+    return segments;
+}
+
+//writes the whole engine to dir/snapshot.bin and drops the log segments it covers.
+//the cut is the only pause: with every gate stripe held no logged mutation is in
+//flight, so users below userCount, posts below postCount and the log position
+//describe one state. the rest is written while sessions go on; anything newer that
+//slips into the file is filtered by the cut or replays as a no-op
+bool takeSnapshot() {
+    if (writeAheadLog == nullptr)
+        return false;
+    lock_guard<mutex> serial(snapshotLock);
+
+    uint32_t userCount, postCount;
+    uint64_t lsn;
+    for (SharedStripe& stripe : mutationGate)
+        stripe.lock.lock();
+    userCount = usersById.size();
+    postCount = postStore->nextId();
+    bool rotated = writeAheadLog->rotate(lsn);
+    for (SharedStripe& stripe : mutationGate)
+        stripe.lock.unlock();
+    if (!rotated)
+        return false;
+
+    string partial = storeDirectory + "/snapshot.tmp";
+    FILE* file = fopen(partial.c_str(), "wb");
+    if (file == nullptr)
+        return false;
+    string out;
+    bool written = true;
+    auto spill = [&](size_t threshold) {
+        if (out.size() >= threshold) {
+            written = written && fwrite(out.data(), 1, out.size(), file) == out.size();
+            out.clear();
+        }
+    };
+
+    putValue(out, SNAPSHOT_MAGIC);
+    putValue(out, lsn);
+    putValue(out, userCount);
+    putValue(out, postCount);
+
+    //users: profile, friend edges and feed ring; timelines are rebuilt from the posts
+    for (uint32_t i = 0; i < userCount; i++) {
+        User* user = usersById[i];
+        putString(out, user->name);
+        putString(out, passwordField(user->password));
+        putString(out, user->city());
+        {
+            shared_lock<shared_mutex> guard(userLock(user));
+            putValue(out, static_cast<int64_t>(user->lastLoginTimestamp));
+            putValue(out, user->firstPulledPost.load());
+            size_t friends = lower_bound(user->friendIds.begin(), user->friendIds.end(), userCount) - user->friendIds.begin();
+            putValue(out, static_cast<uint32_t>(friends));
+            out.append(reinterpret_cast<const char*>(user->friendIds.data()), friends * sizeof(uint32_t));
+            out.append(reinterpret_cast<const char*>(user->friendStates.data()), friends);
+        }
+        {
+            lock_guard<mutex> guard(feedLock(user));
+            PostRun ring[2];
+            int runs = user->newsfeed.runs(ring);
+            size_t kept = 0;
+            for (int r = 0; r < runs; r++)
+                kept += lower_bound(ring[r].first, ring[r].end, postCount) - ring[r].first;
+            putValue(out, static_cast<uint32_t>(kept));
+            for (int r = 0; r < runs && kept > 0; r++) {
+                size_t n = min<size_t>(kept, ring[r].end - ring[r].first);
+                out.append(reinterpret_cast<const char*>(ring[r].first), n * sizeof(uint32_t));
+                kept -= n;
+            }
+        }
+        spill(1 << 20);
+    }
+
+    for (uint32_t postId = 0; postId < postCount; postId++) {
+        Post post = postStore->contains(postId) ? postStore->get(postId) : Post{ 0, NO_USER, string_view() };
+        putValue(out, post.authorId);
+        putValue(out, static_cast<int64_t>(post.dateTime));
+        putValue(out, static_cast<uint32_t>(post.content.size()));
+        out.append(post.content.data(), post.content.size());
+        spill(1 << 20);
+    }
+
+    vector<Conversation*> conversations;
+    for (int i = 0; i < shardCount; i++) {
+        ConversationIndex& index = cityShards[i]->conversations;
+        shared_lock<shared_mutex> guard(index.lock);
+        for (const ConversationIndex::Slot& slot : index.slots) {
+            if (slot.conversation != nullptr && slot.conversation->highId < userCount)
+                conversations.push_back(slot.conversation);
+        }
+    }
+    putValue(out, static_cast<uint32_t>(conversations.size()));
+    for (Conversation* conv : conversations) {
+        lock_guard<mutex> guard(conversationLock(conv));
+        putValue(out, conv->lowId);
+        putValue(out, conv->highId);
+        putValue(out, conv->size());
+        forEachMessage(conv, [&out](const Message& message) {
+            putValue(out, message.senderId);
+            putValue(out, static_cast<int64_t>(message.sentAt));
+            putString(out, message.text);
+        });
+        spill(1 << 20);
+    }
+    putValue(out, SNAPSHOT_END);
+    spill(0);
+    written = syncFile(file) && written;
+    written = fclose(file) == 0 && written;
+
+    //a short snapshot must not replace the good one or the log it depends on
+    error_code error;
+    if (!written) {
+        filesystem::remove(partial, error);
+        return false;
+    }
+    filesystem::rename(partial, storeDirectory + "/snapshot.bin", error);
+    if (error)
+        return false;
+    snapshotLsn = lsn;
+    for (const pair<uint64_t, string>& segment : listLogSegments(storeDirectory)) {
+        if (segment.first < lsn)
+            filesystem::remove(segment.second, error);
+    }
+    return true;
+}
+
+//rebuilds users, posts and conversations from a snapshot into an empty engine.
+//false if the file is damaged
+bool loadSnapshot(const string& path, uint64_t& lsn) {
+    MappedFile map;
+    if (!map.open(path))
+        return false;
+    ByteReader in(map.data, map.data + map.size);
+    if (in.u32() != SNAPSHOT_MAGIC)
+        return false;
+    lsn = in.get<uint64_t>();
+    uint32_t userCount = in.u32();
+    uint32_t postCount = in.u32();
+
+    for (uint32_t i = 0; i < userCount && in.ok; i++) {
+        string name = in.str();
+        PasswordHash password;
+        bool valid = storedPassword(in.view(), password);
+        string city = in.str();
+        time_t lastLogin = static_cast<time_t>(in.i64());
+        uint32_t firstPulled = in.u32();
+        uint32_t friends = in.u32();
+        const char* ids = in.raw(static_cast<size_t>(friends) * sizeof(uint32_t));
+        const char* states = in.raw(friends);
+        uint32_t feedSize = in.u32();
+        const char* feed = in.raw(static_cast<size_t>(feedSize) * sizeof(uint32_t));
+        if (!in.ok || !valid)
+            return false;
+
+        User* user = new User(name, password, city);
+        user->id = i;
+        user->lastLoginTimestamp = lastLogin;
+        user->firstPulledPost = firstPulled;
+        user->friendIds.resize(friends);
+        if (friends > 0)
+            memcpy(user->friendIds.data(), ids, friends * sizeof(uint32_t));
+        user->friendStates.assign(states, states + friends);
+        user->friendCount = static_cast<int>(friends);
+        for (uint32_t j = 0; j < feedSize; j++) {
+            uint32_t postId;
+            memcpy(&postId, feed + j * sizeof(uint32_t), sizeof(postId));
+            user->newsfeed.push(postId);
+        }
+
+        usersById.push_back(user);
+        cityShards[user->shard]->members.push_back(user->id);
+        user->next = usersList;
+        usersList = user;
+        userSearchTree->insert(user);
+        userNameIndex->insert(user);
+        loginTable->insert(user);
+    }
+
+    for (uint32_t postId = 0; postId < postCount && in.ok; postId++) {
+        uint32_t authorId = in.u32();
+        time_t dateTime = static_cast<time_t>(in.i64());
+        string_view content = in.view();
+        if (authorId < usersById.size()) {
+            User* author = usersById[authorId];
+            postStore->place(postId, author->shard, authorId, dateTime, content);
+            author->timeline.push_back(postId);
+        }
+    }
+    if (postStore->nextId() < postCount)
+        postStore->count = postCount;
+
+    uint32_t conversations = in.u32();
+    for (uint32_t i = 0; i < conversations && in.ok; i++) {
+        uint32_t lowId = in.u32();
+        uint32_t highId = in.u32();
+        uint32_t messages = in.u32();
+        if (highId >= usersById.size())
+            return false;
+        Conversation* conv = conversationsOf(lowId, highId).findOrCreate(lowId, highId);
+        conv->messages.reserve(messages);
+        for (uint32_t j = 0; j < messages && in.ok; j++) {
+            uint32_t senderId = in.u32();
+            time_t sentAt = static_cast<time_t>(in.i64());
+            conv->messages.push_back(Message{ senderId, sentAt, in.str() });
+        }
+    }
+    if (in.u32() != SNAPSHOT_END || !in.ok)
+        return false;
+
+    //pull lists are derived: a friend of a pull author merges its posts on read
+    for (uint32_t i = 0; i < usersById.size(); i++) {
+        User* user = usersById[i];
+        for (uint32_t friendId : user->friendIds) {
+            User* other = usersById[friendId];
+            if (other->isPullAuthor())
+                user->pullFriends.push_back(other);
+            if (user->isPullAuthor())
+                other->pullFriends.push_back(user);
+        }
+    }
+    for (uint32_t i = 0; i < usersById.size(); i++) {
+        vector<User*>& pulled = usersById[i]->pullFriends;
+        sort(pulled.begin(), pulled.end());
+        pulled.erase(unique(pulled.begin(), pulled.end()), pulled.end());
+    }
+    return true;
+}
+
+User* userById(uint32_t id) {
+    return id < usersById.size() ? usersById[id] : nullptr;
+}
+
+//applies one logged mutation through the normal engine calls; each one is a no-op
+//when the snapshot already holds its effect
+void applyLogRecord(ByteReader& in) {
+    uint8_t type = in.u8();
+    if (type == LOG_SIGNUP) {
+        uint32_t id = in.u32();
+        string name = in.str();
+        PasswordHash password;
+        bool valid = storedPassword(in.view(), password);
+        string city = in.str();
+        if (in.ok && valid && id == usersById.size())
+            registerUser(name, password, city);
+    }
+    else if (type == LOG_POST) {
+        uint32_t postId = in.u32();
+        User* author = userById(in.u32());
+        time_t dateTime = static_cast<time_t>(in.i64());
+        string_view content = in.view();
+        if (in.ok && author != nullptr)
+            author->restorePost(postId, dateTime, content);
+    }
+    else if (type == LOG_FRIEND) {
+        User* user = userById(in.u32());
+        User* newFriend = userById(in.u32());
+        if (in.ok && user != nullptr && newFriend != nullptr)
+            user->addFriend(newFriend, discardStream);
+    }
+    else if (type == LOG_FRIENDS) {
+        User* user = userById(in.u32());
+        uint32_t count = in.u32();
+        vector<User*> newFriends;
+        for (uint32_t i = 0; i < count && in.ok; i++) {
+            if (User* newFriend = userById(in.u32()))
+                newFriends.push_back(newFriend);
+        }
+        if (in.ok && user != nullptr)
+            user->addFriends(newFriends);
+    }
+    else if (type == LOG_FRIEND_OF) {
+        User* newFriend = userById(in.u32());
+        uint32_t count = in.u32();
+        for (uint32_t i = 0; i < count && in.ok; i++) {
+            User* user = userById(in.u32());
+            if (in.ok && user != nullptr && newFriend != nullptr)
+                user->addFriend(newFriend, discardStream);
+        }
+    }
+    else if (type == LOG_MESSAGE) {
+        User* sender = userById(in.u32());
+        User* receiver = userById(in.u32());
+        uint32_t index = in.u32();
+        time_t sentAt = static_cast<time_t>(in.i64());
+        string text = in.str();
+        if (!in.ok || sender == nullptr || receiver == nullptr)
+            return;
+        Conversation* conv = conversationsOf(sender->id, receiver->id).findOrCreate(sender->id, receiver->id);
+        if (index == conv->size())
+            conv->messages.push_back(Message{ sender->id, sentAt, text });
+    }
+}
+
+//replays the segments from fromLsn on and returns the position after the last good
+//record. a torn or corrupt record ends the log: its segment is cut back there and
+//any later segment is unreachable and removed
+uint64_t replayLog(const string& dir, uint64_t fromLsn, size_t& applied, uint64_t& bytes) {
+    uint64_t lsn = fromLsn;
+    bool torn = false;
+    error_code error;
+    for (const pair<uint64_t, string>& segment : listLogSegments(dir)) {
+        if (segment.first < fromLsn)
+            continue;
+        if (torn || segment.first != lsn) {
+            filesystem::remove(segment.second, error);
+            continue;
+        }
+        MappedFile map;
+        if (!map.open(segment.second))
+            break;
+        const char* at = map.data;
+        const char* end = map.data + map.size;
+        while (at < end) {
+            ByteReader frame(at, end);
+            uint32_t length = frame.u32();
+            const char* body = frame.raw(length);
+            uint32_t sum = frame.u32();
+            if (!frame.ok || checksum32(body, length) != sum) {
+                torn = true;
+                break;
+            }
+            ByteReader record(body, body + length);
+            applyLogRecord(record);
+            applied++;
+            at = frame.at;
+        }
+        size_t good = at - map.data;
+        map.close();
+        bytes += good;
+        lsn = segment.first + good;
+        if (torn)
+            filesystem::resize_file(segment.second, good, error);
+    }
+    return lsn;
+}
+
+//retention: what stays in memory. older posts and messages move to cold files under
+//the store's cold/ directory and are read back through mmap when asked for. the
+//files are a memory tier only: the snapshot and log still hold everything, so a
+//restart starts them over. a limit of 0 is off
+struct RetentionPolicy {
+    int64_t hotSeconds;   //by age, from Post::dateTime and Message::sentAt
+    uint32_t hotPosts;    //by count, the newest posts of each shard
+    uint32_t hotMessages; //by count, the newest messages of each conversation
+};
+
+RetentionPolicy retention = { 0, 0, 0 };
+int compactIntervalSeconds = 60;
+const uint32_t MIN_COLD_MESSAGES = 16; //fewer wait, unless they are the whole hot tail or a window past due
+mutex compactLock; //one compaction at a time
+atomic<uint64_t> coldBytesStored(0); //over every shard, as of the last compaction
+
+struct CompactionStats {
+    uint64_t posts;           //rows whose columns went cold
+    uint64_t postBytes;       //columns and content written
+    uint64_t messages;
+    uint64_t messageBytes;    //compressed
+    uint64_t rawMessageBytes;
+};
+
+bool retentionEnabled() {
+    return retention.hotSeconds > 0 || retention.hotPosts > 0 || retention.hotMessages > 0;
+}
+
+//MINSTAGRAM_HOT_DAYS, MINSTAGRAM_HOT_POSTS and MINSTAGRAM_HOT_MESSAGES
+void readRetention() {
+    const char* days = getenv("MINSTAGRAM_HOT_DAYS");
+    const char* posts = getenv("MINSTAGRAM_HOT_POSTS");
+    const char* messages = getenv("MINSTAGRAM_HOT_MESSAGES");
+    retention.hotSeconds = days != nullptr ? static_cast<int64_t>(atof(days) * 86400) : 0;
+    retention.hotPosts = posts != nullptr ? static_cast<uint32_t>(atol(posts)) : 0;
+    retention.hotMessages = messages != nullptr ? static_cast<uint32_t>(atol(messages)) : 0;
+}
+
+#ifndef _WIN32
+//moves each conversation's messages past the retention limits into one compressed
+//block. the stripe is dropped while the block is compressed and written; only
+//appends happen meanwhile, so the oldest hot messages are still the ones encoded
+bool coolMessages(CityShard* shard, time_t now, CompactionStats& stats) {
+    vector<Conversation*> conversations;
+    {
+        ConversationIndex& index = shard->conversations;
+        shared_lock<shared_mutex> guard(index.lock);
+        for (const ConversationIndex::Slot& slot : index.slots) {
+            if (slot.conversation != nullptr)
+                conversations.push_back(slot.conversation);
+        }
+    }
+    string raw, packed;
+    for (Conversation* conv : conversations) {
+        size_t take;
+        {
+            lock_guard<mutex> guard(conversationLock(conv));
+            size_t hot = conv->messages.size();
+            take = retention.hotMessages > 0 && hot > retention.hotMessages ? hot - retention.hotMessages : 0;
+            bool overdue = false;
+            if (retention.hotSeconds > 0) {
+                size_t aged = 0;
+                while (aged < hot && conv->messages[aged].sentAt < now - retention.hotSeconds)
+                    aged++;
+                take = max(take, aged);
+                overdue = aged > 0 && conv->messages[0].sentAt < now - 2 * retention.hotSeconds;
+            }
+            //a quiet conversation would otherwise make a block per message
+            if (take == 0 || (take < MIN_COLD_MESSAGES && take < hot && !overdue))
+                continue;
+            raw.clear();
+            encodeMessages(conv->messages.data(), take, raw);
+        }
+        packed.clear();
+        lzCompress(raw.data(), raw.size(), packed);
+        const char* data = shard->cold.appendMessages(packed);
+        if (data == nullptr)
+            return false;
+        {
+            lock_guard<mutex> guard(conversationLock(conv));
+            conv->messages.erase(conv->messages.begin(), conv->messages.begin() + take);
+            if (conv->messages.empty())
+                vector<Message>().swap(conv->messages);
+            conv->coldBlocks.push_back(ColdMessages{ data, static_cast<uint32_t>(packed.size()), static_cast<uint32_t>(raw.size()), static_cast<uint32_t>(take) });
+            conv->coldCount += static_cast<uint32_t>(take);
+        }
+        shard->cold.messageCount += take;
+        shard->cold.rawMessageBytes += raw.size();
+        stats.messages += take;
+        stats.messageBytes += packed.size();
+        stats.rawMessageBytes += raw.size();
+    }
+    return true;
+}
+#endif
+
+//one pass of the retention policy over every shard as of now: posts first, cut like
+//a snapshot so nothing below the marks is still being written, then messages. the
+//store's background thread runs it every compactIntervalSeconds; false if there is
+//no store or a cold file couldn't be written
+bool compactColdData(time_t now, CompactionStats* stats = nullptr) {
+#ifdef _WIN32
+    (void)now;
+    (void)stats;
+    return false;
+#else
+    if (writeAheadLog == nullptr || !retentionEnabled())
+        return false;
+    lock_guard<mutex> serial(compactLock);
+    CompactionStats local = CompactionStats();
+    CompactionStats& totals = stats != nullptr ? *stats : local;
+    totals = CompactionStats();
+
+    uint32_t rows[MAX_SHARDS];
+    uint64_t used[MAX_SHARDS];
+    for (SharedStripe& stripe : mutationGate)
+        stripe.lock.lock();
+    for (int i = 0; i < shardCount; i++) {
+        rows[i] = cityShards[i]->posts.count.load(memory_order_relaxed);
+        used[i] = cityShards[i]->posts.arena.used.load(memory_order_relaxed);
+    }
+    for (SharedStripe& stripe : mutationGate)
+        stripe.lock.unlock();
+
+    bool ok = true;
+    uint64_t stored = 0;
+    for (int i = 0; i < shardCount; i++) {
+        CityShard* shard = cityShards[i];
+        if (!shard->cold.opened && !shard->cold.open(storeDirectory + "/cold", i)) {
+            ok = false;
+            continue;
+        }
+        PostStore& posts = shard->posts;
+        uint32_t coldRows = retention.hotPosts > 0 && rows[i] > retention.hotPosts ? rows[i] - retention.hotPosts : 0;
+        if (retention.hotSeconds > 0) {
+            //rows arrive in time order, near enough
+            uint32_t row = max(coldRows, posts.coldChunks.load() * PostStore::CHUNK_SIZE);
+            while (row < rows[i] && posts.get(row).dateTime < now - retention.hotSeconds)
+                row++;
+            coldRows = max(coldRows, row);
+        }
+        uint32_t chunksBefore = posts.coldChunks.load();
+        totals.postBytes += posts.cool(coldRows, rows[i], used[i], shard->cold.columns, shard->cold.content);
+        totals.posts += static_cast<uint64_t>(posts.coldChunks.load() - chunksBefore) * PostStore::CHUNK_SIZE;
+        posts.releaseColdPages();
+        ok = coolMessages(shard, now, totals) && ok;
+        stored += shard->cold.bytes();
+    }
+    coldBytesStored = stored;
+    return ok;
+#endif
+}
+
+void snapshotLoop() {
+    unique_lock<mutex> guard(snapshotThreadLock);
+    auto last = chrono::steady_clock::now();
+    auto lastCompaction = last;
+    while (!snapshotStopping) {
+        snapshotWake.wait_for(guard, chrono::seconds(1));
+        if (snapshotStopping)
+            break;
+        if (retentionEnabled() && chrono::steady_clock::now() - lastCompaction >= chrono::seconds(compactIntervalSeconds)) {
+            guard.unlock();
+            compactColdData(engineNow());
+            guard.lock();
+            lastCompaction = chrono::steady_clock::now();
+        }
+        uint64_t grown = writeAheadLog->position() - snapshotLsn;
+        bool due = chrono::steady_clock::now() - last >= chrono::seconds(snapshotIntervalSeconds);
+        if (grown >= snapshotLogBytes || (due && grown > 0)) {
+            guard.unlock();
+            takeSnapshot();
+            guard.lock();
+            last = chrono::steady_clock::now();
+        }
+    }
+}
+
+//recovers the engine from dir (snapshot, then the log tail) and starts logging
+//there, with a background thread taking snapshots. call on a fresh engine before
+//any session starts; false if the directory or the snapshot is unusable
+bool openStore(const string& dir, RecoveryStats* stats = nullptr) {
+    error_code error;
+    filesystem::create_directories(dir, error);
+    if (!filesystem::is_directory(dir))
+        return false;
+
+    RecoveryStats local = RecoveryStats();
+    RecoveryStats& recovery = stats != nullptr ? *stats : local;
+    recovery = RecoveryStats();
+    uint64_t covered = 0;
+    string snapshot = dir + "/snapshot.bin";
+    auto start = chrono::steady_clock::now();
+    if (filesystem::exists(snapshot)) {
+        if (!loadSnapshot(snapshot, covered))
+            return false;
+        recovery.snapshotBytes = filesystem::file_size(snapshot, error);
+    }
+    auto loaded = chrono::steady_clock::now();
+    uint64_t lsn = replayLog(dir, covered, recovery.replayedRecords, recovery.logBytes);
+    auto replayed = chrono::steady_clock::now();
+    recovery.snapshotSeconds = chrono::duration<double>(loaded - start).count();
+    recovery.replaySeconds = chrono::duration<double>(replayed - loaded).count();
+
+    //cold files from an earlier run only held copies of what was just recovered
+    filesystem::remove_all(dir + "/cold", error);
+    filesystem::create_directories(dir + "/cold", error);
+    coldBytesStored = 0;
+    storeDirectory = dir;
+    snapshotLsn = covered;
+    writeAheadLog = new WriteAheadLog(dir, lsn);
+    if (writeAheadLog->segment == nullptr) {
+        delete writeAheadLog;
+        writeAheadLog = nullptr;
+        return false;
+    }
+    snapshotStopping = false;
+    snapshotThread = thread(snapshotLoop);
+    return true;
+}
+
+//stops logging, optionally after a final snapshot so the next start has no tail to
+//replay. everything logged so far is on disk when it returns
+void closeStore(bool snapshot) {
+    if (writeAheadLog == nullptr)
+        return;
+    {
+        lock_guard<mutex> guard(snapshotThreadLock);
+        snapshotStopping = true;
+    }
+    snapshotWake.notify_one();
+    snapshotThread.join();
+    if (snapshot)
+        takeSnapshot();
+    delete writeAheadLog;
+    writeAheadLog = nullptr;
+    storeDirectory.clear();
+}
+
+//bulk files, one directory per data set: users, friends, posts and messages, each
+//either .csv (a header row, then users by name) or .bin (BULK_MAGIC, then users by
+//row number in the users file and strings length-prefixed as in the snapshot).
+//a password is the stored hash ("scrypt$" and hex in CSV) or a plaintext that the
+//import hashes
+//
+//users.csv     name,password,city            users.bin     str name, str password, str city
+//friends.csv   name,name                     friends.bin   u32 row, u32 row
+//posts.csv     author,unix time,content      posts.bin     u32 row, i64 time, str content
+//messages.csv  from,to,unix time,text        messages.bin  u32 row, u32 row, i64 time, str text
+const uint32_t BULK_MAGIC = 0x4b4c424d;
+const string_view HASH_PREFIX = "scrypt$";
+
+struct BulkStats {
+    uint64_t users;
+    uint64_t duplicates; //later rows repeating a name
+    uint64_t friendships;
+    uint64_t posts;
+    uint64_t messages;
+    uint64_t skipped; //rows that are malformed or name an unknown user
+    uint64_t bytes;
+    vector<pair<string, double>> phases; //name, seconds
+};
+
+//dir/name.bin, else dir/name.csv, empty if neither exists
+string bulkPath(const string& dir, const char* name, bool& binary) {
+    string path = dir + "/" + name + ".bin";
+    binary = filesystem::exists(path);
+    if (binary)
+        return path;
+    path = dir + "/" + name + ".csv";
+    return filesystem::exists(path) ? path : string();
+}
+
+//quoted when it holds a comma, quote or line break, with quotes doubled
+void putCsvField(string& out, string_view field) {
+    if (field.find_first_of(",\"\r\n") == string_view::npos) {
+        out.append(field);
+        return;
+    }
+    out += '"';
+    for (char c : field) {
+        if (c == '"')
+            out += '"';
+        out += c;
+    }
+    out += '"';
+}
+
+//reads one record from at into fields and returns its field count, 0 at the end
+//of the input. fields keeps its strings between calls so their storage is reused
+size_t readCsvRecord(const char*& at, const char* end, vector<string>& fields) {
+    if (at >= end)
+        return 0;
+    size_t n = 0;
+    for (;;) {
+        if (fields.size() == n)
+            fields.emplace_back();
+        string& field = fields[n++];
+        field.clear();
+        if (at < end && *at == '"') {
+            for (at++; at < end; at++) {
+                if (*at != '"')
+                    field += *at;
+                else if (at + 1 < end && at[1] == '"')
+                    field += *at++;
+                else {
+                    at++;
+                    break;
+                }
+            }
+        }
+        const char* start = at;
+        while (at < end && *at != ',' && *at != '\n')
+            at++;
+        field.append(start, at - start - (at > start && at[-1] == '\r' ? 1 : 0));
+        if (at < end && *at == ',') {
+            at++;
+            continue;
+        }
+        if (at < end)
+            at++;
+        return n;
+    }
+}
+
+string toHex(string_view bytes) {
+    static const char digits[] = "0123456789abcdef";
+    string hex;
+    for (unsigned char c : bytes) {
+        hex += digits[c >> 4];
+        hex += digits[c & 15];
+    }
+    return hex;
+}
+
+bool fromHex(string_view hex, string& bytes) {
+    auto nibble = [](char c) {
+        return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+    };
+    if (hex.size() % 2 != 0)
+        return false;
+    bytes.clear();
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        int high = nibble(hex[i]), low = nibble(hex[i + 1]);
+        if (high < 0 || low < 0)
+            return false;
+        bytes += static_cast<char>(high << 4 | low);
+    }
+    return true;
+}
+
+//sorts on the graph workers: equal slices sorted in parallel, then merged in pairs,
+//each round of merges also in parallel
+template <typename T, typename Less>
+void parallelSort(vector<T>& items, Less less) {
+    size_t parts = graphWorkers->workers.size() + 1;
+    if (parts == 1 || items.size() < 65536) {
+        sort(items.begin(), items.end(), less);
+        return;
+    }
+    vector<size_t> bounds(parts + 1);
+    for (size_t i = 0; i <= parts; i++)
+        bounds[i] = items.size() * i / parts;
+    graphWorkers->runParts(parts, [&](size_t part) {
+        sort(items.begin() + bounds[part], items.begin() + bounds[part + 1], less);
+    });
+    for (size_t width = 1; width < parts; width *= 2) {
+        size_t merges = (parts + 2 * width - 1) / (2 * width);
+        graphWorkers->runParts(merges, [&](size_t merge) {
+            size_t first = merge * 2 * width;
+            size_t middle = min(first + width, parts), last = min(first + 2 * width, parts);
+            inplace_merge(items.begin() + bounds[first], items.begin() + bounds[middle], items.begin() + bounds[last], less);
+        });
+    }
+}
+
+//the rows of a CSV file split at line starts into parts, the header row dropped
+pair<const char*, const char*> csvSlice(const char* begin, const char* end, size_t part, size_t parts) {
+    auto lineStart = [&](const char* at) {
+        while (at < end && at > begin && at[-1] != '\n')
+            at++;
+        return at;
+    };
+    begin = find(begin, end, '\n');
+    begin = begin < end ? begin + 1 : end;
+    size_t length = end - begin;
+    const char* first = part == 0 ? begin : lineStart(begin + length * part / parts);
+    const char* last = part + 1 == parts ? end : lineStart(begin + length * (part + 1) / parts);
+    return make_pair(first, last);
+}
+
+//loads a bulk directory into an empty engine that no session is using yet. the
+//indexes are built from sorted input instead of one insert per item: the login
+//table shard by shard on the workers, the B+-tree bottom-up from the names in
+//order, friend lists by counting degrees and scattering both ends of every edge
+//into presized lists, and feeds from the newest posts of each reader's friends.
+//the first row of a repeated name wins; edges, posts and messages naming unknown
+//users are skipped. nothing is logged, so a store takes a snapshot afterwards.
+//false if a file is unreadable or damaged
+bool importData(const string& dir, BulkStats& stats) {
+    stats = BulkStats();
+    if (usersById.size() != 0)
+        return false;
+    auto clock = chrono::steady_clock::now();
+    auto phase = [&](const char* name) {
+        auto now = chrono::steady_clock::now();
+        stats.phases.push_back(make_pair(string(name), chrono::duration<double>(now - clock).count()));
+        clock = now;
+    };
+    size_t parts = graphWorkers->workers.size() + 1;
+    auto slice = [parts](size_t count, size_t part) {
+        return make_pair(count * part / parts, count * (part + 1) / parts);
+    };
+
+    //users, staged in row order; a skipped row stays as nullptr to keep the numbering
+    bool binary;
+    string path = bulkPath(dir, "users", binary);
+    MappedFile file;
+    if (path.empty() || !file.open(path))
+        return false;
+    stats.bytes += file.size;
+    vector<User*> staged;
+    vector<pair<uint32_t, string>> plaintext; //row, password
+    //a field starting with a nul is a stored hash, and one that isn't a valid hash
+    //skips the row rather than making an account nobody can log in to
+    auto stage = [&](string_view name, string_view password, string_view city) {
+        bool hashed = !password.empty() && password[0] == 0;
+        if (name.empty() || name.find_first_of(" \t\r\n") != string_view::npos || city.empty()
+            || (hashed && password.size() != sizeof(PasswordHash)) || (!hashed && password.size() < MIN_PASSWORD_LENGTH)) {
+            staged.push_back(nullptr);
+            stats.skipped++;
+            return;
+        }
+        PasswordHash hash = PasswordHash();
+        if (hashed && !storedPassword(password, hash)) {
+            staged.push_back(nullptr);
+            stats.skipped++;
+            return;
+        }
+        if (!hashed)
+            plaintext.push_back(make_pair(static_cast<uint32_t>(staged.size()), string(password)));
+        staged.push_back(new User(name, hash, city));
+    };
+    bool damaged = false;
+    if (binary) {
+        ByteReader in(file.data, file.data + file.size);
+        damaged = in.u32() != BULK_MAGIC;
+        while (!damaged && in.at < in.end) {
+            string_view name = in.view(), password = in.view(), city = in.view();
+            damaged = !in.ok;
+            if (!damaged)
+                stage(name, password, city);
+        }
+    }
+    else {
+        const char* at = file.data;
+        const char* end = at + file.size;
+        vector<string> fields;
+        string decoded;
+        readCsvRecord(at, end, fields);
+        while (size_t n = readCsvRecord(at, end, fields)) {
+            if (n < 3) {
+                staged.push_back(nullptr);
+                stats.skipped++;
+                continue;
+            }
+            string_view password = fields[1];
+            if (password.substr(0, HASH_PREFIX.size()) == HASH_PREFIX) {
+                if (!fromHex(password.substr(HASH_PREFIX.size()), decoded) || decoded.empty() || decoded[0] != 0) {
+                    staged.push_back(nullptr);
+                    stats.skipped++;
+                    continue;
+                }
+                password = decoded;
+            }
+            stage(fields[0], password, fields[2]);
+        }
+    }
+    file.close();
+    if (damaged) {
+        for (User* user : staged)
+            delete user;
+        return false;
+    }
+    graphWorkers->runParts(parts, [&](size_t part) {
+        pair<size_t, size_t> range = slice(plaintext.size(), part);
+        for (size_t i = range.first; i < range.second; i++)
+            staged[plaintext[i].first]->password = hashPassword(plaintext[i].second, passwordCost, passwordBlockSize);
+    });
+    plaintext = vector<pair<uint32_t, string>>();
+
+    //in name order, with the first row of a repeated name first
+    vector<pair<uint64_t, uint32_t>> order;
+    for (uint32_t row = 0; row < staged.size(); row++) {
+        if (staged[row] != nullptr)
+            order.push_back(make_pair(keyPrefix(staged[row]->name), row));
+    }
+    parallelSort(order, [&](const pair<uint64_t, uint32_t>& a, const pair<uint64_t, uint32_t>& b) {
+        if (a.first != b.first)
+            return a.first < b.first;
+        int c = staged[a.second]->name.compare(staged[b.second]->name);
+        return c != 0 ? c < 0 : a.second < b.second;
+    });
+    for (size_t i = 1; i < order.size(); i++) {
+        if (staged[order[i].second]->name == staged[order[i - 1].second]->name) {
+            stats.duplicates++;
+            order[i].second = order[i - 1].second; //points at the kept row, which was compared first
+        }
+    }
+    vector<uint32_t> rowIds(staged.size(), NO_USER);
+    vector<bool> kept(staged.size(), false);
+    for (const pair<uint64_t, uint32_t>& entry : order)
+        kept[entry.second] = true;
+    for (uint32_t row = 0; row < staged.size(); row++) {
+        User* user = staged[row];
+        if (user == nullptr)
+            continue;
+        if (!kept[row]) {
+            delete user;
+            continue;
+        }
+        user->id = usersById.size();
+        usersById.push_back(user);
+        cityShards[user->shard]->members.push_back(user->id);
+        user->next = usersList;
+        usersList = user;
+        rowIds[row] = user->id;
+    }
+    staged = vector<User*>();
+    vector<uint32_t> sortedIds;
+    sortedIds.reserve(usersById.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        if (i == 0 || order[i].second != order[i - 1].second)
+            sortedIds.push_back(rowIds[order[i].second]);
+    }
+    order = vector<pair<uint64_t, uint32_t>>();
+    uint32_t userCount = usersById.size();
+    stats.users = userCount;
+    phase("users");
+
+    thread treeBuild([&] { userSearchTree->build(sortedIds); });
+    loginTable->build(userCount, *graphWorkers);
+    treeBuild.join();
+    phase("login table and B+-tree");
+
+    //a user named by a row number or by name; NO_USER when unknown
+    auto byRow = [&](uint32_t row) {
+        return row < rowIds.size() ? rowIds[row] : NO_USER;
+    };
+
+    path = bulkPath(dir, "friends", binary);
+    if (!path.empty()) {
+        if (!file.open(path))
+            return false;
+        stats.bytes += file.size;
+        const char* begin = file.data;
+        const char* end = begin + file.size;
+        if (binary && (file.size < sizeof(uint32_t) || (file.size - sizeof(uint32_t)) % (2 * sizeof(uint32_t)) != 0
+            || ByteReader(begin, end).u32() != BULK_MAGIC))
+            return false;
+        vector<vector<pair<uint32_t, uint32_t>>> edges(parts);
+        vector<uint64_t> skipped(parts, 0);
+        graphWorkers->runParts(parts, [&](size_t part) {
+            vector<pair<uint32_t, uint32_t>>& out = edges[part];
+            auto add = [&](uint32_t a, uint32_t b) {
+                if (a == NO_USER || b == NO_USER || a == b)
+                    skipped[part]++;
+                else
+                    out.push_back(make_pair(a, b));
+            };
+            if (binary) {
+                const char* pairs = begin + sizeof(uint32_t);
+                pair<size_t, size_t> range = slice((end - pairs) / (2 * sizeof(uint32_t)), part);
+                for (size_t i = range.first; i < range.second; i++) {
+                    uint32_t ends[2];
+                    memcpy(ends, pairs + i * sizeof(ends), sizeof(ends));
+                    add(byRow(ends[0]), byRow(ends[1]));
+                }
+                return;
+            }
+            pair<const char*, const char*> rows = csvSlice(begin, end, part, parts);
+            vector<string> fields;
+            while (size_t n = readCsvRecord(rows.first, rows.second, fields)) {
+                if (n < 2)
+                    skipped[part]++;
+                else
+                    add(loginTable->idOf(fields[0]), loginTable->idOf(fields[1]));
+            }
+        });
+        file.close();
+        for (uint64_t n : skipped)
+            stats.skipped += n;
+        phase("friend edges");
+
+        //counting sort into one flat array: both ends of every edge are counted, the
+        //counts become offsets, and each end is scattered into its user's range. every
+        //worker reads all the edges but only counts and writes the ends in its own id
+        //range, so no counter is shared and nothing needs an atomic
+        vector<uint64_t> offsets(static_cast<size_t>(userCount) + 1, 0);
+        auto eachEnd = [&](size_t part, auto visit) {
+            pair<size_t, size_t> owned = slice(userCount, part);
+            for (const vector<pair<uint32_t, uint32_t>>& list : edges) {
+                for (const pair<uint32_t, uint32_t>& edge : list) {
+                    if (edge.first >= owned.first && edge.first < owned.second)
+                        visit(edge.first, edge.second);
+                    if (edge.second >= owned.first && edge.second < owned.second)
+                        visit(edge.second, edge.first);
+                }
+            }
+        };
+        graphWorkers->runParts(parts, [&](size_t part) {
+            eachEnd(part, [&](uint32_t id, uint32_t) { offsets[id + 1]++; });
+        });
+        for (uint32_t id = 0; id < userCount; id++)
+            offsets[id + 1] += offsets[id];
+        vector<uint32_t> ends(offsets[userCount]);
+        vector<uint64_t> cursors(offsets.begin(), offsets.end() - 1);
+        graphWorkers->runParts(parts, [&](size_t part) {
+            eachEnd(part, [&](uint32_t id, uint32_t other) { ends[cursors[id]++] = other; });
+        });
+        edges = vector<vector<pair<uint32_t, uint32_t>>>();
+        cursors = vector<uint64_t>();
+        vector<uint64_t> listed(parts, 0);
+        vector<vector<User*>> pullAuthors(parts);
+        graphWorkers->runParts(parts, [&](size_t part) {
+            pair<size_t, size_t> range = slice(userCount, part);
+            for (size_t id = range.first; id < range.second; id++) {
+                uint32_t* first = ends.data() + offsets[id];
+                uint32_t* last = ends.data() + offsets[id + 1];
+                sort(first, last);
+                last = unique(first, last);
+                User* user = usersById[id];
+                size_t distinct = last - first;
+                user->friendIds.assign(first, last);
+                user->friendStates.assign(distinct, edgeState(RELATION_FRIEND, STATUS_ACTIVE));
+                user->friendCount = static_cast<int>(distinct);
+                if (static_cast<int>(distinct) > fanoutLimit) {
+                    user->becomePullAuthor(); //no posts yet, so every post is pulled
+                    pullAuthors[part].push_back(user);
+                }
+                listed[part] += distinct;
+            }
+        });
+        ends = vector<uint32_t>();
+        for (uint64_t n : listed)
+            stats.friendships += n;
+        stats.friendships /= 2;
+        //the lists are symmetric, so only the pull authors' own lists need walking
+        for (const vector<User*>& authors : pullAuthors) {
+            for (User* author : authors) {
+                for (uint32_t friendId : author->friendIds)
+                    usersById[friendId]->pullFriends.push_back(author);
+            }
+        }
+        phase("friend lists");
+    }
+
+    //typeahead ranks by friend count, which is final now; the trie fills in the
+    //background while the posts and messages load
+    double trieSeconds = 0;
+    thread trieBuild([&] {
+        auto start = chrono::steady_clock::now();
+        for (uint32_t id : sortedIds)
+            userNameIndex->insert(usersById[id]);
+        trieSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    });
+
+    //rows of the posts and messages files, placed in time order (file order on ties)
+    //since ids are handed out in time order
+    struct Row {
+        int64_t time;
+        uint32_t from;
+        uint32_t to;
+        string text;
+    };
+    auto readRows = [&](const char* name, bool message, vector<Row>& rows) {
+        string rowsPath = bulkPath(dir, name, binary);
+        if (rowsPath.empty())
+            return true;
+        if (!file.open(rowsPath))
+            return false;
+        stats.bytes += file.size;
+        auto add = [&](uint32_t from, uint32_t to, int64_t time, string_view text) {
+            if (from == NO_USER || (message && (to == NO_USER || to == from)))
+                stats.skipped++;
+            else
+                rows.push_back(Row{ time, from, to, string(text) });
+        };
+        if (binary) {
+            ByteReader in(file.data, file.data + file.size);
+            if (in.u32() != BULK_MAGIC)
+                return false;
+            while (in.ok && in.at < in.end) {
+                uint32_t from = byRow(in.u32());
+                uint32_t to = message ? byRow(in.u32()) : NO_USER;
+                int64_t time = in.i64();
+                string_view text = in.view();
+                if (in.ok)
+                    add(from, to, time, text);
+            }
+            file.close();
+            return in.ok;
+        }
+        const char* at = file.data;
+        const char* end = at + file.size;
+        vector<string> fields;
+        readCsvRecord(at, end, fields);
+        size_t columns = message ? 4 : 3;
+        while (size_t n = readCsvRecord(at, end, fields)) {
+            if (n < columns) {
+                stats.skipped++;
+                continue;
+            }
+            add(loginTable->idOf(fields[0]), message ? loginTable->idOf(fields[1]) : NO_USER,
+                strtoll(fields[columns - 2].c_str(), nullptr, 10), fields[columns - 1]);
+        }
+        file.close();
+        return true;
+    };
+    auto timeOrder = [&](const vector<Row>& rows) {
+        vector<uint32_t> order(rows.size());
+        for (uint32_t i = 0; i < order.size(); i++)
+            order[i] = i;
+        parallelSort(order, [&](uint32_t a, uint32_t b) {
+            return rows[a].time != rows[b].time ? rows[a].time < rows[b].time : a < b;
+        });
+        return order;
+    };
+
+    vector<Row> rows;
+    bool readable = readRows("posts", false, rows);
+    if (readable && !rows.empty()) {
+        vector<uint32_t> order = timeOrder(rows);
+        for (uint32_t postId = 0; postId < order.size(); postId++) {
+            const Row& row = rows[order[postId]];
+            User* author = usersById[row.from];
+            postStore->place(postId, author->shard, row.from, static_cast<time_t>(row.time), row.text);
+            author->timeline.push_back(postId);
+        }
+        stats.posts = rows.size();
+        rows = vector<Row>();
+        phase("posts");
+
+        //each reader's ring takes the newest FEED_CAPACITY posts of its push friends
+        graphWorkers->runParts(parts, [&](size_t part) {
+            vector<uint32_t> candidates;
+            pair<size_t, size_t> range = slice(userCount, part);
+            for (size_t id = range.first; id < range.second; id++) {
+                User* reader = usersById[id];
+                candidates.clear();
+                for (uint32_t friendId : reader->friendIds) {
+                    const User* author = usersById[friendId];
+                    if (author->isPullAuthor())
+                        continue;
+                    size_t take = min<size_t>(author->timeline.size(), FEED_CAPACITY);
+                    candidates.insert(candidates.end(), author->timeline.end() - take, author->timeline.end());
+                }
+                if (candidates.size() > FEED_CAPACITY) {
+                    nth_element(candidates.begin(), candidates.end() - FEED_CAPACITY, candidates.end());
+                    candidates.erase(candidates.begin(), candidates.end() - FEED_CAPACITY);
+                }
+                sort(candidates.begin(), candidates.end());
+                for (uint32_t postId : candidates)
+                    reader->newsfeed.push(postId);
+            }
+        });
+        phase("feeds");
+    }
+
+    readable = readable && readRows("messages", true, rows);
+    if (readable && !rows.empty()) {
+        vector<uint32_t> order = timeOrder(rows);
+        for (uint32_t i : order) {
+            Row& row = rows[i];
+            Conversation* conv = conversationsOf(row.from, row.to).findOrCreate(row.from, row.to);
+            conv->messages.push_back(Message{ row.from, static_cast<time_t>(row.time), std::move(row.text) });
+        }
+        stats.messages = rows.size();
+        phase("messages");
+    }
+    trieBuild.join();
+    stats.phases.push_back(make_pair(string("search trie (alongside)"), trieSeconds));
+    return readable;
+}
+
+//streams the engine out in the format importData reads, rows in id order so a
+//binary file's row numbers are the user ids. sessions may keep running: each
+//user's friends and each conversation are copied under their own locks, and users
+//or posts added meanwhile may or may not be included
+bool exportData(const string& dir, bool binary, BulkStats& stats) {
+    stats = BulkStats();
+    error_code error;
+    filesystem::create_directories(dir, error);
+    uint32_t userCount = usersById.size();
+    auto start = chrono::steady_clock::now();
+
+    FILE* file = nullptr;
+    string out;
+    bool written = true;
+    auto spill = [&](size_t threshold) {
+        if (out.size() >= threshold) {
+            written = written && fwrite(out.data(), 1, out.size(), file) == out.size();
+            stats.bytes += out.size();
+            out.clear();
+        }
+    };
+    auto begin = [&](const char* name, const char* header) {
+        file = fopen((dir + "/" + name + (binary ? ".bin" : ".csv")).c_str(), "wb");
+        if (file == nullptr)
+            return false;
+        if (binary)
+            putValue(out, BULK_MAGIC);
+        else
+            out += header;
+        return true;
+    };
+    auto finish = [&]() {
+        spill(0);
+        written = fclose(file) == 0 && written;
+        return written;
+    };
+    auto name = [&](uint32_t id) {
+        putCsvField(out, usersById[id]->name);
+    };
+
+    if (!begin("users", "name,password,city\n"))
+        return false;
+    for (uint32_t id = 0; id < userCount; id++) {
+        User* user = usersById[id];
+        if (binary) {
+            putString(out, user->name);
+            putString(out, passwordField(user->password));
+            putString(out, user->city());
+        }
+        else {
+            name(id);
+            out += ',';
+            out += HASH_PREFIX;
+            out += toHex(passwordField(user->password));
+            out += ',';
+            putCsvField(out, user->city());
+            out += '\n';
+        }
+        spill(1 << 20);
+    }
+    stats.users = userCount;
+    if (!finish() || !begin("friends", "name,name\n"))
+        return false;
+    vector<uint32_t> friends;
+    for (uint32_t id = 0; id < userCount; id++) {
+        User* user = usersById[id];
+        {
+            shared_lock<shared_mutex> guard(userLock(user));
+            auto from = upper_bound(user->friendIds.begin(), user->friendIds.end(), id);
+            friends.assign(from, lower_bound(from, user->friendIds.end(), userCount));
+        }
+        for (uint32_t friendId : friends) {
+            if (binary) {
+                putValue(out, id);
+                putValue(out, friendId);
+            }
+            else {
+                name(id);
+                out += ',';
+                name(friendId);
+                out += '\n';
+            }
+        }
+        stats.friendships += friends.size();
+        spill(1 << 20);
+    }
+    if (!finish() || !begin("posts", "author,time,content\n"))
+        return false;
+    uint32_t postCount = postStore->nextId();
+    for (uint32_t postId = 0; postId < postCount; postId++) {
+        if (!postStore->contains(postId))
+            continue;
+        Post post = postStore->get(postId);
+        if (post.authorId >= userCount)
+            continue;
+        if (binary) {
+            putValue(out, post.authorId);
+            putValue(out, static_cast<int64_t>(post.dateTime));
+            putString(out, post.content);
+        }
+        else {
+            name(post.authorId);
+            out += ',' + to_string(static_cast<int64_t>(post.dateTime)) + ',';
+            putCsvField(out, post.content);
+            out += '\n';
+        }
+        stats.posts++;
+        spill(1 << 20);
+    }
+    if (!finish() || !begin("messages", "from,to,time,text\n"))
+        return false;
+    vector<Conversation*> conversations;
+    for (int i = 0; i < shardCount; i++) {
+        ConversationIndex& index = cityShards[i]->conversations;
+        shared_lock<shared_mutex> guard(index.lock);
+        for (const ConversationIndex::Slot& slot : index.slots) {
+            if (slot.conversation != nullptr && slot.conversation->highId < userCount)
+                conversations.push_back(slot.conversation);
+        }
+    }
+    for (Conversation* conv : conversations) {
+        lock_guard<mutex> guard(conversationLock(conv));
+        forEachMessage(conv, [&](const Message& message) {
+            uint32_t to = message.senderId == conv->lowId ? conv->highId : conv->lowId;
+            if (binary) {
+                putValue(out, message.senderId);
+                putValue(out, to);
+                putValue(out, static_cast<int64_t>(message.sentAt));
+                putString(out, message.text);
+            }
+            else {
+                name(message.senderId);
+                out += ',';
+                name(to);
+                out += ',' + to_string(static_cast<int64_t>(message.sentAt)) + ',';
+                putCsvField(out, message.text);
+                out += '\n';
+            }
+            stats.messages++;
+        });
+        spill(1 << 20);
+    }
+    if (!finish())
+        return false;
+    stats.phases.push_back(make_pair(string("export"), chrono::duration<double>(chrono::steady_clock::now() - start).count()));
+    return true;
+}
+
+void signup() {
+    clearScreen();
+    string name, password, city;
+    logo();
+    setColor(6);
+    cout << "\n\n      === Signup ===\n";
+    setColor(14);
+    cout << "\nEnter username: ";
+    setColor(7);
+    cin >> name;
+
+    if (loginTable->search(name) != nullptr)
+    {
+        cout << "Username already exists." << endl;
+        pauseScreen();
+        return;
+    }
+    setColor(14);
+    cout << "Enter password (6 characters min): ";
+    setColor(7);
+    cin >> password;
+    if (password.length() < MIN_PASSWORD_LENGTH)
+    {
+        cout << "Password too weak." << endl;
+        pauseScreen();
+        return;
+    }
+    setColor(14);
+    cout << "Enter city: ";
+    setColor(7);
+    cin >> city;
+
+    createUser(name, password, city);
+
+    cout << "\nSignup successful!" << endl;
+    pauseScreen();
+}
+
+User* login()
+{
+    clearScreen();
+    string name, password;
+    logo();
+    setColor(6);
+    cout << "\n\n      --- Login ---\n";
+    setColor(14);
+    cout << "\nEnter username: ";
+    setColor(7);
+    cin >> name;
+    LoginKeys keys = loginKeys(name, "console");
+    if (!loginAllowed(keys)) {
+        cout << "\nToo many failed attempts for this account. Try again later." << endl;
+        pauseScreen();
+        return nullptr;
+    }
+    User* user = loginTable->search(name);
+    if (user == nullptr) {
+        chargeLoginFailure(keys);
+        cout << "\nInvalid username." << endl;
+        pauseScreen();
+        return nullptr;
+    }
+
+    int attempts = 0;
+    bool success = false;
+    while (attempts < 3)
+    {
+        setColor(14);
+        cout << "Enter password: ";
+        setColor(7);
+        cin >> password;
+        if (authenticate(name, password, "console") != nullptr)
+        {
+            success = true;
+            break;
+        }
+        else if (!loginAllowed(loginKeys(name, "console"))) {
+            break;
+        }
+        else {
+            cout << "\nIncorrect password. Try again." << endl;
+            attempts++;
+        }
+    }
+
+    if (!success)
+    {
+        cout << "\nToo many failed attempts. Redirecting to main menu." << endl;
+        pauseScreen();
+        return nullptr;
+    }
+
+    loadingScreen();
+    cout << "\nLogin successful!" << endl;
+    pauseScreen();
+    return user;
+}
+
+void searchUsers() {
+    clearScreen();
+    setColor(6);
+    cout << "======= Search Users =======\n";
+    setColor(14);
+    cout << "\nEnter name or prefix (* lists everyone): ";
+    setColor(7);
+    string query;
+    cin >> query;
+    if (query == "*") {
+        cout << "Users in the network:" << endl;
+        listUsers(cout);
+        pauseScreen();
+        return;
+    }
+
+    vector<User*> matches;
+    searchByPrefix(query, matches);
+    if (!matches.empty()) {
+        for (User* user : matches)
+            cout << user->name << " (" << user->city() << ", " << user->friendCount << " friends)" << endl;
+    }
+    else {
+        vector<UserTrie::Match> similar;
+        searchSimilar(query, similar);
+        if (similar.empty()) {
+            cout << "No users matching " << query << endl;
+        }
+        else {
+            cout << "No users starting with " << query << ". Did you mean:" << endl;
+            for (const UserTrie::Match& match : similar)
+                cout << match.user->name << " (" << match.user->city() << ")" << endl;
+        }
+    }
+    pauseScreen();
+}
+
+bool askYesNo(const char* question) {
+    setColor(14);
+    cout << question;
+    setColor(7);
+    char answer;
+    cin >> answer;
+    return answer == 'y' || answer == 'Y';
+}
+
+void menu(User* currentUser)
+{
+
+    setColor(12);
+    cout << "========== Instagram ==========\n";
+    setColor(7);
+    cout << "Welcome ";
+    setColor(13);
+    cout << currentUser->name << endl << endl;
+    setColor(14);
+    cout << "1. View feed\n";
+    cout << "2. View Own Posts\n";
+    cout << "3. Add Post\n";
+    cout << "4. Send Friend Request\n";
+    cout << "5. Accept Friend Requests\n";
+    cout << "6. View Notifications\n";
+    cout << "7. Send Message\n";
+    cout << "8. View Messages\n";
+    cout << "9. Search Users\n";
+    cout << "10. View Followers List\n";
+    cout << "11. People You May Know\n";
+    cout << "12. Logout\n";
+    cout << "\nEnter choice: ";
+}
+
+//menu actions as they appear in a workload trace, one command per line
+enum OpType {
+    OP_SIGNUP,
+    OP_LOGIN,
+    OP_POST,
+    OP_FRIEND_REQUEST,
+    OP_ACCEPT_REQUESTS,
+    OP_MESSAGE,
+    OP_VIEW_FEED,
+    OP_VIEW_POSTS,
+    OP_VIEW_NOTIFICATIONS,
+    OP_VIEW_MESSAGES,
+    OP_SEARCH,
+    OP_VIEW_FOLLOWERS,
+    OP_FUZZY_SEARCH,
+    OP_DECLINE_REQUESTS,
+    OP_RECOMMEND,
+    OP_RANKED_FEED,
+    OP_PENDING_REQUESTS,
+    OP_COUNT
+};
+
+const char* opNames[OP_COUNT] = {
+    "signup", "login", "post", "request", "accept", "message",
+    "feed", "posts", "notifications", "messages", "search", "followers", "fuzzy",
+    "decline", "suggest", "top", "pending"
+};
+
+//signup <name> <password> <city>   login <name> <password>
+//post <name> <text...>             request <from> <to>
+//accept|decline|pending <name>     message <from> <to> <text...>
+//feed|posts|top <name> [cursor]    notifications|followers <name>
+//messages <name> <with>            search [prefix]
+//fuzzy|suggest <name>
+struct Command {
+    int op;
+    string user;   //acting user
+    string target; //other user, or the password for signup/login
+    string text;   //post/message body, or the city for signup
+};
+
+bool parseCommand(const string& line, Command& cmd) {
+    istringstream in(line);
+    string verb;
+    if (!(in >> verb) || verb[0] == '#')
+        return false;
+
+    cmd.op = -1;
+    for (int i = 0; i < OP_COUNT; i++) {
+        if (verb == opNames[i]) {
+            cmd.op = i;
+            break;
+        }
+    }
+    if (cmd.op < 0)
+        return false;
+
+    cmd.user.clear();
+    cmd.target.clear();
+    cmd.text.clear();
+    if (cmd.op == OP_SEARCH) {
+        in >> cmd.user;
+        return true;
+    }
+    if (!(in >> cmd.user))
+        return false;
+
+    if (cmd.op == OP_SIGNUP)
+        return static_cast<bool>(in >> cmd.target >> cmd.text);
+    if (cmd.op == OP_LOGIN || cmd.op == OP_FRIEND_REQUEST || cmd.op == OP_VIEW_MESSAGES)
+        return static_cast<bool>(in >> cmd.target);
+    if (cmd.op == OP_VIEW_FEED || cmd.op == OP_VIEW_POSTS || cmd.op == OP_RANKED_FEED)
+        in >> cmd.target; //optional page cursor, an offset for top
+    if (cmd.op == OP_MESSAGE && !(in >> cmd.target))
+        return false;
+    if (cmd.op == OP_POST || cmd.op == OP_MESSAGE) {
+        in >> ws;
+        getline(in, cmd.text);
+    }
+    return true;
+}
+
+string formatCommand(const Command& cmd) {
+    string line = opNames[cmd.op];
+    if (!cmd.user.empty())
+        line += " " + cmd.user;
+    if (!cmd.target.empty())
+        line += " " + cmd.target;
+    if (!cmd.text.empty())
+        line += " " + cmd.text;
+    return line;
+}
+
+//runs one command against the engine, false when the engine rejected it
+bool executeCommand(const Command& cmd, ostream& out) {
+    if (cmd.op == OP_SIGNUP)
+        return createUser(cmd.user, cmd.target, cmd.text) != nullptr;
+    if (cmd.op == OP_LOGIN)
+        return authenticate(cmd.user, cmd.target) != nullptr;
+    if (cmd.op == OP_SEARCH) {
+        if (cmd.user.empty()) {
+            listUsers(out);
+            return true;
+        }
+        vector<User*> matches;
+        searchByPrefix(cmd.user, matches);
+        for (User* match : matches)
+            out << match->name << endl;
+        return !matches.empty();
+    }
+    if (cmd.op == OP_FUZZY_SEARCH) {
+        vector<UserTrie::Match> matches;
+        searchSimilar(cmd.user, matches);
+        for (const UserTrie::Match& match : matches)
+            out << match.user->name << endl;
+        return !matches.empty();
+    }
+
+    User* user = loginTable->search(cmd.user);
+    if (user == nullptr)
+        return false;
+
+    if (cmd.op == OP_POST) {
+        user->addPost(cmd.text);
+        return true;
+    }
+    else if (cmd.op == OP_FRIEND_REQUEST) {
+        return user->sendFriendRequest(loginTable->search(cmd.target), out);
+    }
+    else if (cmd.op == OP_ACCEPT_REQUESTS) {
+        return user->acceptFriendRequests(out) > 0;
+    }
+    else if (cmd.op == OP_DECLINE_REQUESTS) {
+        return user->declineFriendRequests(out) > 0;
+    }
+    else if (cmd.op == OP_MESSAGE) {
+        User* toUser = loginTable->search(cmd.target);
+        return toUser != nullptr && user->sendMessage(toUser, cmd.text, out);
+    }
+    else if (cmd.op == OP_VIEW_FEED) {
+        user->viewNewsfeed(out, cmd.target.empty() ? NO_POST : static_cast<uint32_t>(strtoul(cmd.target.c_str(), nullptr, 10)));
+    }
+    else if (cmd.op == OP_VIEW_POSTS) {
+        user->viewOwnPosts(out, cmd.target.empty() ? NO_POST : static_cast<uint32_t>(strtoul(cmd.target.c_str(), nullptr, 10)));
+    }
+    else if (cmd.op == OP_VIEW_NOTIFICATIONS) {
+        user->viewNotifications(out);
+    }
+    else if (cmd.op == OP_VIEW_MESSAGES) {
+        User* withUser = loginTable->search(cmd.target);
+        return withUser != nullptr && user->viewMessages(withUser, out);
+    }
+    else if (cmd.op == OP_VIEW_FOLLOWERS) {
+        user->displayFollowers(out);
+    }
+    else if (cmd.op == OP_RECOMMEND) {
+        vector<Recommendation> suggestions;
+        recommendFriends(user, RECOMMEND_LIMIT, suggestions);
+        for (const Recommendation& r : suggestions)
+            out << usersById[r.userId]->name << endl;
+        return !suggestions.empty();
+    }
+    else if (cmd.op == OP_RANKED_FEED) {
+        showRankedFeed(user, out, cmd.target.empty() ? 0 : strtoul(cmd.target.c_str(), nullptr, 10));
+    }
+    else if (cmd.op == OP_PENDING_REQUESTS) {
+        user->showPendingFriendRequests(out);
+    }
+    return true;
+}
+
+//one thread per shard, each running its own users' commands in order and applying
+//what other shards send it in between. a thread out of commands keeps draining
+//until every shard is done and no task is in flight. returns how many commands
+//the engine rejected
+long long runShards(const vector<vector<const Command*>>& commands) {
+    int shards = static_cast<int>(commands.size());
+    atomic<int> finished(0);
+    atomic<long long> rejected(0);
+    vector<thread> workers;
+    for (int s = 0; s < shards; s++) {
+        workers.emplace_back([&, s]() {
+            currentShard = cityShards[s];
+            ostream sink(nullptr);
+            long long failed = 0;
+            for (const Command* cmd : commands[s]) {
+                if (!executeCommand(*cmd, sink))
+                    failed++;
+                drainShard(currentShard);
+            }
+            finished++;
+            while (finished.load() < shards || shardTasksInFlight.load() > 0) {
+                if (drainShard(currentShard) == 0)
+                    this_thread::yield();
+            }
+            currentShard = nullptr;
+            rejected += failed;
+        });
+    }
+    for (thread& worker : workers)
+        worker.join();
+    return rejected.load();
+}
+
+bool loadTrace(const string& path, vector<Command>& commands) {
+    ifstream in(path);
+    if (!in)
+        return false;
+    string line;
+    Command cmd;
+    while (getline(in, line)) {
+        if (parseCommand(line, cmd))
+            commands.push_back(cmd);
+    }
+    return true;
+}
+
+//synthetic trace: every user signs up, then a random mix of menu actions that
+//only requests, accepts and messages between users the trace has made friends.
+//users go round robin over six cities; with a citySkew above 0 they are spread
+//over twelve by a zipf law of that exponent instead, and most requests stay in
+//the sender's city
+vector<Command> generateWorkload(int userCount, long long opCount, unsigned seed, double citySkew = 0) {
+    static const char* cities[] = { "Lahore", "Karachi", "Islamabad", "Peshawar", "Quetta", "Multan",
+        "Faisalabad", "Rawalpindi", "Hyderabad", "Gujranwala", "Sialkot", "Sukkur" };
+    const int skewedCities = 12;
+    const int localRequestPercent = 90;
+    //per-mille weights in OpType order
+    static const int mix[OP_COUNT] = { 0, 30, 250, 150, 100, 250, 86, 30, 50, 30, 10, 9, 5, 0, 0, 0, 0 };
+
+    mt19937_64 rng(seed);
+    mt19937_64 cityRng(seed + 1); //kept apart so an unskewed trace is the same as ever
+    vector<Command> commands;
+    commands.reserve(userCount + opCount);
+
+    vector<int> cityOf(userCount);
+    vector<vector<int>> residents(skewedCities);
+    if (citySkew > 0) {
+        vector<double> weights;
+        for (int c = 0; c < skewedCities; c++)
+            weights.push_back(1.0 / pow(c + 1, citySkew));
+        discrete_distribution<int> pick(weights.begin(), weights.end());
+        for (int i = 0; i < userCount; i++) {
+            cityOf[i] = pick(cityRng);
+            residents[cityOf[i]].push_back(i);
+        }
+    }
+    else {
+        for (int i = 0; i < userCount; i++)
+            cityOf[i] = i % 6;
+    }
+
+    vector<string> names(userCount);
+    for (int i = 0; i < userCount; i++) {
+        names[i] = "user" + to_string(i);
+        commands.push_back(Command{ OP_SIGNUP, names[i], "password" + to_string(i), cities[cityOf[i]] });
+    }
+    if (userCount < 2)
+        return commands;
+
+    vector<vector<int>> friends(userCount);
+    vector<vector<int>> pending(userCount);
+    vector<int> withPending;
+    vector<int> withFriends;
+
+    for (long long n = 0; n < opCount; n++) {
+        int roll = static_cast<int>(rng() % 1000);
+        int op = 0;
+        while (roll >= mix[op]) {
+            roll -= mix[op];
+            op++;
+        }
+        int u = static_cast<int>(rng() % userCount);
+
+        if (op == OP_ACCEPT_REQUESTS) {
+            while (!withPending.empty() && pending[withPending.back()].empty())
+                withPending.pop_back();
+            if (withPending.empty()) {
+                op = OP_FRIEND_REQUEST;
+            }
+            else {
+                size_t pick = rng() % withPending.size();
+                u = withPending[pick];
+                withPending[pick] = withPending.back();
+                withPending.pop_back();
+                for (int from : pending[u]) {
+                    if (find(friends[u].begin(), friends[u].end(), from) != friends[u].end())
+                        continue;
+                    if (friends[u].empty())
+                        withFriends.push_back(u);
+                    if (friends[from].empty())
+                        withFriends.push_back(from);
+                    friends[u].push_back(from);
+                    friends[from].push_back(u);
+                }
+                pending[u].clear();
+            }
+        }
+        if ((op == OP_MESSAGE || op == OP_VIEW_MESSAGES) && withFriends.empty())
+            op = OP_FRIEND_REQUEST;
+
+        Command cmd{ op, names[u], "", "" };
+        if (op == OP_LOGIN) {
+            cmd.target = "password" + to_string(u);
+        }
+        else if (op == OP_POST) {
+            cmd.text = "post " + to_string(n) + " by " + names[u] + ": a day out in " + cities[cityOf[u]] + " with friends and family";
+        }
+        else if (op == OP_FRIEND_REQUEST) {
+            int v = static_cast<int>(rng() % (userCount - 1));
+            if (v >= u)
+                v++;
+            const vector<int>& local = residents[cityOf[u]];
+            if (citySkew > 0 && local.size() > 1 && static_cast<int>(cityRng() % 100) < localRequestPercent) {
+                do {
+                    v = local[cityRng() % local.size()];
+                } while (v == u);
+            }
+            if (pending[v].empty())
+                withPending.push_back(v);
+            pending[v].push_back(u);
+            cmd.target = names[v];
+        }
+        else if (op == OP_MESSAGE || op == OP_VIEW_MESSAGES) {
+            u = withFriends[rng() % withFriends.size()];
+            cmd.user = names[u];
+            cmd.target = names[friends[u][rng() % friends[u].size()]];
+            if (op == OP_MESSAGE)
+                cmd.text = "hey " + cmd.target + ", message " + to_string(n);
+        }
+        else if (op == OP_SEARCH) {
+            cmd.user = "user" + to_string(rng() % 1000);
+        }
+        else if (op == OP_FUZZY_SEARCH) {
+            //a real name with one character swapped for a typo
+            cmd.user[rng() % cmd.user.size()] = static_cast<char>('a' + rng() % 26);
+        }
+        commands.push_back(cmd);
+    }
+    return commands;
+}
+
+//value at quantile q of an ascending sample set
+uint64_t percentile(const vector<uint64_t>& sorted, double q) {
+    if (sorted.empty())
+        return 0;
+    size_t index = static_cast<size_t>(q * sorted.size());
+    return sorted[min(index, sorted.size() - 1)];
+}
+
+//replays the commands and reports throughput and latency per operation type
+void runWorkload(const vector<Command>& commands, ostream& report) {
+    vector<vector<uint64_t>> latencies(OP_COUNT);
+    vector<long long> failures(OP_COUNT, 0);
+    vector<uint64_t> opAllocations(OP_COUNT, 0);
+
+    //size the sample vectors up front so the allocation count is the engine's alone
+    vector<size_t> counts(OP_COUNT, 0);
+    for (const Command& cmd : commands)
+        counts[cmd.op]++;
+    for (int op = 0; op < OP_COUNT; op++)
+        latencies[op].reserve(counts[op]);
+
+    uint64_t allocationsBefore = heapAllocations.load();
+    size_t residentBefore = residentBytes();
+    auto wallStart = chrono::steady_clock::now();
+    for (const Command& cmd : commands) {
+        uint64_t allocated = heapAllocations.load(memory_order_relaxed);
+        auto start = chrono::steady_clock::now();
+        bool ok = executeCommand(cmd, discardStream);
+        auto end = chrono::steady_clock::now();
+        opAllocations[cmd.op] += heapAllocations.load(memory_order_relaxed) - allocated;
+        latencies[cmd.op].push_back(chrono::duration_cast<chrono::nanoseconds>(end - start).count());
+        if (!ok)
+            failures[cmd.op]++;
+    }
+    double wallSeconds = chrono::duration<double>(chrono::steady_clock::now() - wallStart).count();
+    uint64_t allocations = heapAllocations.load() - allocationsBefore;
+    size_t residentAfter = residentBytes();
+
+    report << fixed << setprecision(1);
+    report << left << setw(15) << "operation" << right << setw(10) << "count" << setw(10) << "rejected"
+        << setw(14) << "ops/sec" << setw(11) << "p50 us" << setw(11) << "p99 us" << setw(11) << "p999 us"
+        << setw(12) << "max us" << setw(9) << "allocs" << endl;
+    for (int op = 0; op < OP_COUNT; op++) {
+        vector<uint64_t>& samples = latencies[op];
+        if (samples.empty())
+            continue;
+        sort(samples.begin(), samples.end());
+        double busySeconds = 0;
+        for (uint64_t ns : samples)
+            busySeconds += ns;
+        busySeconds /= 1e9;
+
+        report << left << setw(15) << opNames[op] << right << setw(10) << samples.size()
+            << setw(10) << failures[op]
+            << setw(14) << (busySeconds > 0 ? samples.size() / busySeconds : 0.0)
+            << setw(11) << percentile(samples, 0.50) / 1000.0
+            << setw(11) << percentile(samples, 0.99) / 1000.0
+            << setw(11) << percentile(samples, 0.999) / 1000.0
+            << setw(12) << samples.back() / 1000.0
+            << setw(9) << static_cast<double>(opAllocations[op]) / samples.size() << endl;
+    }
+    report << "\n" << commands.size() << " commands in " << setprecision(3) << wallSeconds << " s ("
+        << setprecision(0) << (wallSeconds > 0 ? commands.size() / wallSeconds : 0.0) << " ops/sec)" << endl;
+    report << allocations << " heap allocations (" << setprecision(2)
+        << (commands.empty() ? 0.0 : static_cast<double>(allocations) / commands.size()) << " per command), resident "
+        << residentBefore / 1048576.0 << " MB before, " << residentAfter / 1048576.0 << " MB after" << endl;
+}
+
+//the hot-path histograms in the Prometheus text format, as summaries, plus the
+//user and post totals and the process's heap allocations
+void writeMetrics(ostream& out) {
+    struct Description {
+        const char* name;
+        const char* help;
+        double scale; //nanoseconds are exported as seconds
+    };
+    static const Description descriptions[HIST_COUNT] = {
+        { "minstagram_login_probe_length", "Login table slots probed per lookup.", 1 },
+        { "minstagram_index_search_depth", "B+-tree levels descended per lookup.", 1 },
+        { "minstagram_fan_out_readers", "Feeds a new post was pushed into.", 1 },
+        { "minstagram_fan_out_seconds", "Time to push a new post into its readers' feeds.", 1e-9 },
+        { "minstagram_friend_check_length", "Friend list length searched per isFollowing check.", 1 },
+        { "minstagram_conversation_probe_length", "Conversation index slots probed per lookup.", 1 },
+        { "minstagram_friend_request_queue_depth", "Friend requests waiting when an inbox is drained.", 1 },
+        { "minstagram_notification_queue_depth", "Notifications waiting when an inbox is drained.", 1 }
+    };
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+    vector<HistogramTotals> totals(HIST_COUNT);
+    collectMetrics(totals.data());
+    ostringstream text;
+    text.precision(9);
+    for (int h = 0; h < HIST_COUNT; h++) {
+        const Description& d = descriptions[h];
+        text << "# HELP " << d.name << ' ' << d.help << '\n' << "# TYPE " << d.name << " summary\n";
+        for (double q : quantiles)
+            text << d.name << "{quantile=\"" << q << "\"} " << totals[h].quantile(q) * d.scale << '\n';
+        text << d.name << "_sum " << totals[h].sum * d.scale << '\n';
+        text << d.name << "_count " << totals[h].count << '\n';
+    }
+    text << "# HELP minstagram_users Registered users.\n# TYPE minstagram_users gauge\n"
+        << "minstagram_users " << usersById.size() << '\n';
+    text << "# HELP minstagram_posts Stored posts.\n# TYPE minstagram_posts gauge\n"
+        << "minstagram_posts " << (postStore != nullptr ? postStore->count.load() : 0) << '\n';
+    text << "# HELP minstagram_heap_allocations_total Calls to operator new.\n# TYPE minstagram_heap_allocations_total counter\n"
+        << "minstagram_heap_allocations_total " << heapAllocations.load(memory_order_relaxed) << '\n';
+    text << "# HELP minstagram_resident_bytes Resident memory of the process.\n# TYPE minstagram_resident_bytes gauge\n"
+        << "minstagram_resident_bytes " << residentBytes() << '\n';
+    text << "# HELP minstagram_cold_bytes Posts and messages moved to cold files by retention.\n# TYPE minstagram_cold_bytes gauge\n"
+        << "minstagram_cold_bytes " << coldBytesStored.load(memory_order_relaxed) << '\n';
+    out << text.str();
+}
+
+//writes the metrics beside path and renames them over it, so a scraper reading
+//the file never sees half of them
+bool dumpMetrics(const string& path) {
+    string temporary = path + ".tmp";
+    {
+        ofstream out(temporary, ios::trunc);
+        if (!out)
+            return false;
+        writeMetrics(out);
+        if (!out.flush())
+            return false;
+    }
+    error_code error;
+    filesystem::rename(temporary, path, error);
+    return !error;
+}
+
+#ifdef __linux__
+//the menu over TCP. a request is one trace line (see Command) and its answer is
+//"OK <n>\n" or "ERR <n>\n" followed by the n bytes the action printed. a
+//connection acts only as the user it logged in as; search and fuzzy need no login,
+//signup logs nobody in, "logout" drops the user, "metrics" answers with
+//writeMetrics and "quit" closes once the answers before it are out. requests may
+//be pipelined: every complete line of a read is served in order and the answers
+//leave in one write. each loop thread has its own epoll set and its own listening
+//socket on the shared port (SO_REUSEPORT), so the kernel spreads connections over
+//the loops. signups and logins wait on scrypt, so they go to the offload pool; the
+//connection reads no further lines until the answer comes back through the loop's
+//completion queue and eventfd
+class RequestServer {
+public:
+    static const size_t READ_CHUNK = 16384;
+    static const size_t MAX_PENDING_INPUT = 1 << 20; //unserved request bytes before a connection is dropped
+
+    struct Connection {
+        int fd;
+        string in;
+        string out;
+        size_t sent; //bytes of out already written
+        User* user;
+        string peer; //the login throttle's source
+        bool waiting; //a signup or login is on the offload pool
+        bool closed; //socket gone, freed once nothing is waiting
+        bool quitting;
+        bool watchingOutput; //EPOLLOUT is registered
+    };
+
+    struct Completion {
+        Connection* connection;
+        bool ok;
+        User* user; //a login's result
+        string body;
+    };
+
+    struct Loop {
+        int epoll;
+        int listener;
+        int wakeup; //eventfd, written when a completion is queued
+        MpscQueue<Completion> completions;
+        thread worker;
+        vector<Connection*> open;
+    };
+
+    vector<Loop*> loops;
+    WorkerPool offload;
+    atomic<int> offloaded; //signups and logins not yet handed back to a loop
+    uint16_t port;
+    atomic<bool> stopping;
+    atomic<uint64_t> requests;
+    atomic<uint64_t> writes;
+    atomic<uint64_t> accepted;
+
+    explicit RequestServer(int offloadThreads) : offload(offloadThreads), offloaded(0), port(0), stopping(false), requests(0), writes(0), accepted(0) {}
+
+    ~RequestServer() {
+        stop();
+    }
+
+    RequestServer(const RequestServer&) = delete;
+    RequestServer& operator=(const RequestServer&) = delete;
+
+    //binds every loop to port (0 picks one, which port then holds) and starts them
+    bool start(uint16_t listenPort, int threads, bool loopbackOnly) {
+        port = listenPort;
+        for (int i = 0; i < threads; i++) {
+            int listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            int on = 1;
+            setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+            sockaddr_in address = {};
+            address.sin_family = AF_INET;
+            address.sin_port = htons(port);
+            address.sin_addr.s_addr = htonl(loopbackOnly ? INADDR_LOOPBACK : INADDR_ANY);
+            if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+                || listen(listener, SOMAXCONN) != 0) {
+                if (listener >= 0)
+                    close(listener);
+                stop();
+                return false;
+            }
+            socklen_t length = sizeof(address);
+            getsockname(listener, reinterpret_cast<sockaddr*>(&address), &length);
+            port = ntohs(address.sin_port);
+
+            Loop* loop = new Loop();
+            loop->listener = listener;
+            loop->epoll = epoll_create1(EPOLL_CLOEXEC);
+            loop->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            watch(loop, listener, &loop->listener, EPOLLIN, EPOLL_CTL_ADD);
+            watch(loop, loop->wakeup, &loop->wakeup, EPOLLIN, EPOLL_CTL_ADD);
+            loops.push_back(loop);
+        }
+        for (Loop* loop : loops)
+            loop->worker = thread(&RequestServer::run, this, loop);
+        return true;
+    }
+
+    void stop() {
+        stopping = true;
+        for (Loop* loop : loops) {
+            wake(loop);
+            if (loop->worker.joinable())
+                loop->worker.join();
+        }
+        //nothing new reaches the pool now; let queued signups and logins finish
+        //before the loops they answer to are freed
+        while (offloaded.load() != 0)
+            this_thread::yield();
+        for (Loop* loop : loops) {
+            Completion done;
+            while (loop->completions.dequeue(done))
+                done.connection->waiting = false;
+            for (Connection* connection : loop->open) {
+                if (!connection->closed)
+                    close(connection->fd);
+                delete connection;
+            }
+            close(loop->listener);
+            close(loop->wakeup);
+            close(loop->epoll);
+            delete loop;
+        }
+        loops.clear();
+    }
+
+    static void watch(Loop* loop, int fd, void* tag, uint32_t events, int op) {
+        epoll_event event = {};
+        event.events = events;
+        event.data.ptr = tag;
+        epoll_ctl(loop->epoll, op, fd, &event);
+    }
+
+    static void wake(Loop* loop) {
+        uint64_t one = 1;
+        ssize_t written = write(loop->wakeup, &one, sizeof(one));
+        (void)written;
+    }
+
+    void run(Loop* loop) {
+        const int batch = 256;
+        epoll_event events[batch];
+        while (!stopping.load(memory_order_relaxed)) {
+            int ready = epoll_wait(loop->epoll, events, batch, 100);
+            for (int i = 0; i < ready; i++) {
+                void* tag = events[i].data.ptr;
+                if (tag == &loop->listener)
+                    acceptAll(loop);
+                else if (tag == &loop->wakeup)
+                    complete(loop);
+                else
+                    onEvent(loop, static_cast<Connection*>(tag), events[i].events);
+            }
+            //connections closed while a signup or login was out are freed here
+            auto gone = [](Connection* connection) {
+                if (!connection->closed || connection->waiting)
+                    return false;
+                delete connection;
+                return true;
+            };
+            loop->open.erase(remove_if(loop->open.begin(), loop->open.end(), gone), loop->open.end());
+        }
+    }
+
+    void acceptAll(Loop* loop) {
+        for (;;) {
+            sockaddr_in address;
+            socklen_t length = sizeof(address);
+            int fd = accept4(loop->listener, reinterpret_cast<sockaddr*>(&address), &length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+                return;
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            char peer[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &address.sin_addr, peer, sizeof(peer));
+            Connection* connection = new Connection{ fd, string(), string(), 0, nullptr, peer, false, false, false, false };
+            loop->open.push_back(connection);
+            watch(loop, fd, connection, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_ADD);
+            accepted.fetch_add(1, memory_order_relaxed);
+        }
+    }
+
+    void onEvent(Loop* loop, Connection* connection, uint32_t events) {
+        if (connection->closed)
+            return;
+        if (events & EPOLLIN) {
+            char buffer[READ_CHUNK];
+            for (;;) {
+                ssize_t n = recv(connection->fd, buffer, sizeof(buffer), 0);
+                if (n > 0) {
+                    connection->in.append(buffer, n);
+                    continue;
+                }
+                if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                    connection->quitting = true; //answer what arrived, then close
+                break;
+            }
+            if (connection->in.size() > MAX_PENDING_INPUT) {
+                drop(loop, connection);
+                return;
+            }
+            serve(loop, connection);
+        }
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            drop(loop, connection);
+            return;
+        }
+        flush(loop, connection);
+    }
+
+    //serves complete lines until one goes to the offload pool
+    void serve(Loop* loop, Connection* connection) {
+        size_t start = 0;
+        while (!connection->waiting) {
+            size_t end = connection->in.find('\n', start);
+            if (end == string::npos)
+                break;
+            string_view line(connection->in.data() + start, end - start);
+            if (!line.empty() && line.back() == '\r')
+                line.remove_suffix(1);
+            start = end + 1;
+            handle(loop, connection, line);
+        }
+        connection->in.erase(0, start);
+    }
+
+    void handle(Loop* loop, Connection* connection, string_view line) {
+        static thread_local ostringstream body;
+        static thread_local Command cmd;
+        requests.fetch_add(1, memory_order_relaxed);
+        if (line == "quit") {
+            connection->quitting = true;
+            connection->in.clear();
+            reply(connection, true, "bye\n");
+            return;
+        }
+        if (line == "logout") {
+            connection->user = nullptr;
+            reply(connection, true, "");
+            return;
+        }
+        if (line == "metrics") {
+            body.str("");
+            writeMetrics(body);
+            reply(connection, true, body.str());
+            return;
+        }
+        if (!parseCommand(string(line), cmd)) {
+            reply(connection, false, "unknown request\n");
+            return;
+        }
+
+        if (cmd.op == OP_SIGNUP || cmd.op == OP_LOGIN) {
+            connection->waiting = true;
+            offloaded.fetch_add(1);
+            offload.submit([this, loop, connection, signup = cmd.op == OP_SIGNUP, name = cmd.user, password = cmd.target, city = cmd.text]() {
+                Completion done{ connection, false, nullptr, string() };
+                if (signup) {
+                    done.ok = createUser(name, password, city) != nullptr;
+                    done.body = done.ok ? "signed up\n" : "name taken or password too short\n";
+                }
+                else {
+                    done.user = authenticate(name, password, connection->peer);
+                    done.ok = done.user != nullptr;
+                    done.body = done.ok ? "logged in\n" : "login failed\n";
+                }
+                loop->completions.enqueue(std::move(done));
+                wake(loop);
+                offloaded.fetch_sub(1);
+            });
+            return;
+        }
+        if (cmd.op != OP_SEARCH && cmd.op != OP_FUZZY_SEARCH && (connection->user == nullptr || connection->user->name != cmd.user)) {
+            reply(connection, false, "log in as " + cmd.user + " first\n");
+            return;
+        }
+        body.str("");
+        bool ok = executeCommand(cmd, body);
+        reply(connection, ok, body.str());
+    }
+
+    static void reply(Connection* connection, bool ok, string_view body) {
+        connection->out += ok ? "OK " : "ERR ";
+        connection->out += to_string(body.size());
+        connection->out += '\n';
+        connection->out.append(body.data(), body.size());
+    }
+
+    void complete(Loop* loop) {
+        uint64_t count;
+        ssize_t n = read(loop->wakeup, &count, sizeof(count));
+        (void)n;
+        Completion done;
+        while (loop->completions.dequeue(done)) {
+            Connection* connection = done.connection;
+            connection->waiting = false;
+            if (connection->closed)
+                continue;
+            if (done.user != nullptr)
+                connection->user = done.user;
+            reply(connection, done.ok, done.body);
+            serve(loop, connection);
+            flush(loop, connection);
+        }
+    }
+
+    void flush(Loop* loop, Connection* connection) {
+        if (connection->closed)
+            return;
+        while (connection->sent < connection->out.size()) {
+            ssize_t n = send(connection->fd, connection->out.data() + connection->sent, connection->out.size() - connection->sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                drop(loop, connection);
+                return;
+            }
+            connection->sent += n;
+            writes.fetch_add(1, memory_order_relaxed);
+        }
+        bool drained = connection->sent == connection->out.size();
+        if (drained) {
+            connection->out.clear();
+            connection->sent = 0;
+            if (connection->quitting && !connection->waiting) {
+                drop(loop, connection);
+                return;
+            }
+        }
+        if (drained == connection->watchingOutput) {
+            connection->watchingOutput = !drained;
+            watch(loop, connection->fd, connection, EPOLLIN | EPOLLRDHUP | (drained ? 0u : uint32_t(EPOLLOUT)), EPOLL_CTL_MOD);
+        }
+    }
+
+    //closes the socket now; the loop frees the connection once nothing waits on it
+    void drop(Loop* loop, Connection* connection) {
+        if (connection->closed)
+            return;
+        epoll_ctl(loop->epoll, EPOLL_CTL_DEL, connection->fd, nullptr);
+        close(connection->fd);
+        connection->closed = true;
+    }
+};
+#endif
+
+//the index benches build their own tables over users that are not signed up. the
+//indexes refer to users by id, so these still get one in usersById
+User* registerDetached(User* user) {
+    user->id = usersById.size();
+    usersById.push_back(user);
+    return user;
+}
+
+void releaseDetached(vector<User*>& users) {
+    usersById.clear();
+    for (User* user : users)
+        delete user;
+    users.clear();
+}
+
+//insert and lookup rates on the login table, from 10K users up by 10x per step
+void benchHashTable(size_t maxUsers, ostream& report) {
+    report << fixed << setprecision(2);
+    report << right << setw(10) << "users" << setw(14) << "insert M/s" << setw(16) << "max insert us"
+        << setw(12) << "hit M/s" << setw(12) << "miss M/s" << endl;
+
+    mt19937_64 rng(7);
+    for (size_t n = 10000; n <= maxUsers; n *= 10) {
+        vector<User*> users;
+        users.reserve(n);
+        for (size_t i = 0; i < n; i++)
+            users.push_back(registerDetached(new User("user" + to_string(i), PasswordHash(), "Lahore")));
+        vector<string> hits(n), misses(n);
+        for (size_t i = 0; i < n; i++) {
+            hits[i] = users[rng() % n]->name;
+            misses[i] = "ghost" + to_string(i);
+        }
+
+        HashTable table;
+        uint64_t maxInsert = 0;
+        auto start = chrono::steady_clock::now();
+        for (User* user : users) {
+            auto before = chrono::steady_clock::now();
+            table.insert(user);
+            uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - before).count();
+            maxInsert = max(maxInsert, ns);
+        }
+        double insertSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        size_t found = 0;
+        start = chrono::steady_clock::now();
+        for (const string& name : hits)
+            found += table.search(name) != NO_USER;
+        double hitSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        start = chrono::steady_clock::now();
+        for (const string& name : misses)
+            found += table.search(name) != NO_USER;
+        double missSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        if (found != n)
+            report << "lookup mismatch: " << found << " of " << n << endl;
+        report << setw(10) << n << setw(14) << n / insertSeconds / 1e6 << setw(16) << maxInsert / 1000.0
+            << setw(12) << n / hitSeconds / 1e6 << setw(12) << n / missSeconds / 1e6 << endl;
+
+        releaseDetached(users);
+    }
+}
+
+//ordered index build, point lookup, prefix scan and full ordered walk for sorted,
+//reversed and random insert orders
+void benchUserIndex(size_t userCount, ostream& report) {
+    vector<User*> users;
+    users.reserve(userCount);
+    for (size_t i = 0; i < userCount; i++)
+        users.push_back(registerDetached(new User("user" + to_string(i), PasswordHash(), "Lahore")));
+    sort(users.begin(), users.end(), [](User* a, User* b) { return a->name < b->name; });
+
+    mt19937_64 rng(11);
+    vector<string> probes(userCount), prefixes(userCount);
+    for (size_t i = 0; i < userCount; i++) {
+        probes[i] = users[rng() % userCount]->name;
+        prefixes[i] = probes[i].substr(0, min<size_t>(probes[i].size(), 7));
+    }
+
+    report << fixed << setprecision(2);
+    report << userCount << " users\n" << left << setw(10) << "order" << right << setw(12) << "insert M/s"
+        << setw(12) << "search M/s" << setw(14) << "prefix K/s" << setw(12) << "walk ms" << setw(8) << "height"
+        << setw(12) << "leaf fill" << endl;
+
+    const char* orders[] = { "sorted", "reversed", "random" };
+    for (int order = 0; order < 3; order++) {
+        vector<User*> insertOrder = users;
+        if (order == 1)
+            reverse(insertOrder.begin(), insertOrder.end());
+        else if (order == 2)
+            shuffle(insertOrder.begin(), insertOrder.end(), rng);
+
+        UserBTree tree;
+        auto start = chrono::steady_clock::now();
+        for (User* user : insertOrder)
+            tree.insert(user);
+        double insertSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        size_t found = 0;
+        start = chrono::steady_clock::now();
+        for (const string& name : probes)
+            found += tree.search(name) != nullptr;
+        double searchSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        size_t scans = min<size_t>(userCount, 100000);
+        vector<User*> matches;
+        start = chrono::steady_clock::now();
+        for (size_t i = 0; i < scans; i++) {
+            matches.clear();
+            tree.prefixScan(prefixes[i], 20, matches);
+            found += matches.empty();
+        }
+        double scanSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        size_t leaves = 0, walked = 0;
+        start = chrono::steady_clock::now();
+        for (UserBTree::Leaf* leaf = tree.firstLeaf; leaf != nullptr; leaf = leaf->next) {
+            leaves++;
+            walked += leaf->count;
+        }
+        double walkSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        if (found != userCount || walked != userCount)
+            report << "index mismatch in " << orders[order] << " order" << endl;
+        report << left << setw(10) << orders[order] << right << setw(12) << userCount / insertSeconds / 1e6
+            << setw(12) << userCount / searchSeconds / 1e6 << setw(14) << scans / scanSeconds / 1e3
+            << setw(12) << walkSeconds * 1e3 << setw(8) << tree.height
+            << setw(11) << 100.0 * walked / (leaves * UserBTree::MAX_KEYS) << "%" << endl;
+    }
+
+    releaseDetached(users);
+}
+
+//pronounceable names so the trie sees realistic shared prefixes, not "userN" runs
+string randomUsername(mt19937_64& rng) {
+    static const char* syllables[] = { "al", "ba", "chi", "da", "el", "fa", "gul", "ha", "im", "ja", "ka",
+        "li", "ma", "na", "or", "pa", "qa", "ra", "sa", "ta", "um", "va", "wa", "ya", "za", "an", "ee", "oo" };
+    string name;
+    int parts = 2 + static_cast<int>(rng() % 3);
+    for (int i = 0; i < parts; i++)
+        name += syllables[rng() % 28];
+    if (rng() % 2)
+        name += to_string(rng() % 1000);
+    return name;
+}
+
+//typeahead and fuzzy query latency as the trie grows from 10K users by 10x
+void benchSearch(size_t maxUsers, ostream& report) {
+    mt19937_64 rng(5);
+    const size_t queries = 20000;
+
+    report << fixed << setprecision(2);
+    report << right << setw(10) << "users" << setw(12) << "build s" << setw(14) << "prefix p50"
+        << setw(12) << "p99" << setw(12) << "p999" << setw(14) << "fuzzy p50" << setw(12) << "p99"
+        << setw(12) << "p999" << "   (us)" << endl;
+
+    for (size_t n = 10000; n <= maxUsers; n *= 10) {
+        vector<User*> users;
+        users.reserve(n);
+        while (users.size() < n) {
+            User* user = registerDetached(new User(randomUsername(rng), PasswordHash(), "Lahore"));
+            user->friendCount = static_cast<int>(rng() % 1000);
+            users.push_back(user);
+        }
+
+        UserTrie trie;
+        auto start = chrono::steady_clock::now();
+        for (User* user : users)
+            trie.insert(user);
+        double buildSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        vector<uint64_t> prefixLatency, fuzzyLatency;
+        vector<User*> top;
+        vector<UserTrie::Match> similar;
+        for (size_t q = 0; q < queries; q++) {
+            const string& name = users[rng() % n]->name;
+            string prefix = name.substr(0, 1 + rng() % min<size_t>(name.size(), 6));
+            string typo = name;
+            typo[rng() % typo.size()] = static_cast<char>('a' + rng() % 26);
+
+            top.clear();
+            auto before = chrono::steady_clock::now();
+            trie.topMatches(prefix, SEARCH_RESULT_LIMIT, top);
+            auto middle = chrono::steady_clock::now();
+            similar.clear();
+            trie.fuzzyMatches(typo, FUZZY_MAX_DISTANCE, SEARCH_RESULT_LIMIT, similar);
+            auto after = chrono::steady_clock::now();
+
+            prefixLatency.push_back(chrono::duration_cast<chrono::nanoseconds>(middle - before).count());
+            fuzzyLatency.push_back(chrono::duration_cast<chrono::nanoseconds>(after - middle).count());
+        }
+        sort(prefixLatency.begin(), prefixLatency.end());
+        sort(fuzzyLatency.begin(), fuzzyLatency.end());
+
+        report << setw(10) << n << setw(12) << buildSeconds
+            << setw(14) << percentile(prefixLatency, 0.50) / 1000.0
+            << setw(12) << percentile(prefixLatency, 0.99) / 1000.0
+            << setw(12) << percentile(prefixLatency, 0.999) / 1000.0
+            << setw(14) << percentile(fuzzyLatency, 0.50) / 1000.0
+            << setw(12) << percentile(fuzzyLatency, 0.99) / 1000.0
+            << setw(12) << percentile(fuzzyLatency, 0.999) / 1000.0 << endl;
+
+        releaseDetached(users);
+    }
+}
+
+//post latency, feed read latency and feed memory for push-only vs hybrid fan-out on a
+//uniform and a celebrity-heavy (log-uniform endpoint) friend graph
+void benchFeed(int userCount, int postCount, ostream& report) {
+    const int degree = 10;
+    const int reads = 2000;
+
+    report << fixed << setprecision(2);
+    report << userCount << " users, " << postCount << " posts, " << degree << " avg friends\n";
+    report << left << setw(12) << "graph" << setw(8) << "mode" << right << setw(10) << "max deg"
+        << setw(12) << "post p50" << setw(10) << "p99" << setw(12) << "max" << setw(12) << "feed p99"
+        << setw(14) << "feed entries" << setw(12) << "MB" << setw(12) << "old MB" << "   (us)" << endl;
+
+    for (int graph = 0; graph < 2; graph++) {
+        for (int mode = 0; mode < 2; mode++) {
+            mt19937_64 rng(3);
+            initEngine();
+            fanoutLimit = mode == 0 ? INT32_MAX : 1000;
+
+            vector<User*> users;
+            for (int i = 0; i < userCount; i++)
+                users.push_back(createUser("member" + to_string(i), "password", "Lahore"));
+
+            //endpoints of every edge, drawn again to pick degree-weighted post authors
+            vector<int> endpoints;
+            unordered_set<uint64_t> edges;
+            long long wanted = static_cast<long long>(userCount) * degree / 2;
+            while (static_cast<long long>(edges.size()) < wanted) {
+                int a = static_cast<int>(rng() % userCount);
+                int b = graph == 0 ? static_cast<int>(rng() % userCount)
+                    : static_cast<int>(pow(static_cast<double>(userCount), uniform_real_distribution<double>(0, 1)(rng))) - 1;
+                if (a == b || !edges.insert(static_cast<uint64_t>(min(a, b)) << 32 | max(a, b)).second)
+                    continue;
+                users[a]->addFriend(users[b], discardStream);
+                users[b]->addFriend(users[a], discardStream);
+                endpoints.push_back(a);
+                endpoints.push_back(b);
+            }
+            int maxDegree = 0;
+            for (User* user : users)
+                maxDegree = max(maxDegree, user->friendCount.load());
+
+            vector<uint64_t> postLatency;
+            for (int i = 0; i < postCount; i++) {
+                User* author = users[endpoints[rng() % endpoints.size()]];
+                auto start = chrono::steady_clock::now();
+                author->addPost("a day out with friends and family, post " + to_string(i));
+                postLatency.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+            }
+            vector<uint64_t> readLatency;
+            for (int i = 0; i < reads; i++) {
+                User* reader = users[rng() % userCount];
+                auto start = chrono::steady_clock::now();
+                reader->viewNewsfeed(discardStream);
+                readLatency.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+            }
+            sort(postLatency.begin(), postLatency.end());
+            sort(readLatency.begin(), readLatency.end());
+
+            size_t feedEntries = 0, contentBytes = 0;
+            for (User* user : users) {
+                feedEntries += user->newsfeed.size();
+            }
+            for (uint32_t id = 0; id < postStore->nextId(); id++)
+                contentBytes += postStore->get(id).content.size() + 1;
+            //what the old layout paid: a full post node (and string) per own post and per feed entry
+            size_t oldNode = sizeof(void*) + sizeof(time_t) + sizeof(string);
+            size_t row = (sizeof(PostStore::Columns) + sizeof(ShardedPostStore::Locations)) / PostStore::CHUNK_SIZE;
+            double megabytes = (feedEntries * sizeof(uint32_t) + postStore->nextId() * row + postStore->contentBytes()) / 1048576.0;
+            double oldMegabytes = (feedEntries + postStore->nextId()) * (oldNode + static_cast<double>(contentBytes) / postCount) / 1048576.0;
+
+            report << left << setw(12) << (graph == 0 ? "uniform" : "celebrity") << setw(8) << (mode == 0 ? "push" : "hybrid")
+                << right << setw(10) << maxDegree
+                << setw(12) << percentile(postLatency, 0.50) / 1000.0
+                << setw(10) << percentile(postLatency, 0.99) / 1000.0
+                << setw(12) << postLatency.back() / 1000.0
+                << setw(12) << percentile(readLatency, 0.99) / 1000.0
+                << setw(14) << feedEntries << setw(12) << megabytes << setw(12) << oldMegabytes << endl;
+            shutdownEngine();
+        }
+    }
+    fanoutLimit = 1000;
+}
+
+//message stack and inbox churn with the node allocator as the only difference
+template <typename Alloc>
+void allocationChurn(const char* label, size_t ops, ostream& report) {
+    const size_t lists = 10000;
+    mt19937_64 rng(9);
+    uint64_t allocationsBefore = heapAllocations.load();
+    size_t residentBefore = residentBytes();
+    auto start = chrono::steady_clock::now();
+    {
+        vector<Stack<uint64_t, LinkedNodes<Alloc>>> messages(lists);
+        vector<Queue<uint64_t, LinkedNodes<Alloc>>> inboxes(lists);
+        uint64_t value = 0;
+        for (size_t i = 0; i < ops; i++) {
+            size_t list = rng() % lists;
+            //grow for the first half, then drain as fast as we fill
+            int action = static_cast<int>(rng() % (i < ops / 2 ? 3 : 4));
+            if (action == 0)
+                messages[list].push(i);
+            else if (action == 1)
+                inboxes[list].enqueue(i);
+            else if (action == 2)
+                inboxes[list].dequeue(value);
+            else
+                messages[list].pop(value);
+        }
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    report << left << setw(8) << label << right << setw(12) << ops / seconds / 1e6
+        << setw(16) << heapAllocations.load() - allocationsBefore
+        << setw(14) << (static_cast<double>(residentBytes()) - residentBefore) / 1048576.0 << endl;
+}
+
+//slab pool against plain new/delete for the container nodes
+void benchAllocators(size_t ops, ostream& report) {
+    report << fixed << setprecision(2) << ops << " stack/queue operations over 10000 lists\n";
+    report << left << setw(8) << "nodes" << right << setw(12) << "M ops/s" << setw(16) << "allocations"
+        << setw(14) << "RSS grow MB" << endl;
+    //pool first: its slabs are never handed back, so the heap run can't reuse them
+    allocationChurn<PoolAllocator>("pool", ops, report);
+    allocationChurn<HeapAllocator>("heap", ops, report);
+}
+
+//Stack and Queue policies on the element types a User keeps: post ids, friend request
+//senders, notifications and messages
+template <typename T, typename Policy>
+bool containerPut(Stack<T, Policy>& stack, T&& value) { return stack.push(std::move(value)); }
+template <typename T, typename Policy>
+bool containerPut(Stack<T, Policy>& stack, const T& value) { return stack.push(value); }
+template <typename T, typename Policy>
+bool containerPut(Queue<T, Policy>& queue, T&& value) { return queue.enqueue(std::move(value)); }
+template <typename T, typename Policy>
+bool containerPut(Queue<T, Policy>& queue, const T& value) { return queue.enqueue(value); }
+template <typename T, typename Policy>
+bool containerTake(Stack<T, Policy>& stack, T& value) { return stack.pop(value); }
+template <typename T, typename Policy>
+bool containerTake(Queue<T, Policy>& queue, T& value) { return queue.dequeue(value); }
+
+template <typename T>
+T sampleElement(uint64_t i);
+
+template <>
+uint32_t sampleElement<uint32_t>(uint64_t i) { return static_cast<uint32_t>(i); }
+
+//never dereferenced, only its size matters
+template <>
+User* sampleElement<User*>(uint64_t i) { return reinterpret_cast<User*>(static_cast<uintptr_t>(i + 1) * 64); }
+
+template <>
+Notification sampleElement<Notification>(uint64_t i) {
+    return Notification{ NOTIFY_MESSAGE, static_cast<uint32_t>(i), static_cast<uint32_t>(i), 1 };
+}
+
+//long enough that the text lives on the heap, as most messages do
+template <>
+Message sampleElement<Message>(uint64_t i) {
+    return Message{ static_cast<uint32_t>(i), static_cast<time_t>(i), "message number " + to_string(i) + " with some words in it" };
+}
+
+//elements move between a hand and 1024 containers picked at random, half puts and half
+//takes, so each container holds a few at a time like an inbox. returns M ops/s
+template <typename Container, typename T>
+double containerChurn(size_t ops, bool copyIn, uint64_t& allocations) {
+    const size_t lists = 1024;
+    vector<T> hand;
+    for (size_t i = 0; i < lists * 8; i++)
+        hand.push_back(sampleElement<T>(i));
+    mt19937_64 rng(17);
+    uint64_t allocationsBefore = heapAllocations.load();
+    auto start = chrono::steady_clock::now();
+    {
+        vector<Container> containers(lists);
+        for (size_t i = 0; i < ops; i++) {
+            uint64_t r = rng();
+            Container& container = containers[r % lists];
+            if ((r >> 32 & 1) != 0 && !hand.empty()) {
+                //a copied-in element is dropped from the hand, as the caller's copy would be
+                bool stored = copyIn ? containerPut(container, static_cast<const T&>(hand.back())) : containerPut(container, std::move(hand.back()));
+                if (stored)
+                    hand.pop_back();
+            }
+            else {
+                hand.emplace_back();
+                if (!containerTake(container, hand.back()))
+                    hand.pop_back();
+            }
+        }
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    allocations += heapAllocations.load() - allocationsBefore;
+    return ops / seconds / 1e6;
+}
+
+template <typename T, typename Policy>
+void containerRow(const char* label, size_t ops, bool copyIn, ostream& report) {
+    uint64_t allocations = 0;
+    double stackRate = containerChurn<Stack<T, Policy>, T>(ops, copyIn, allocations);
+    double queueRate = containerChurn<Queue<T, Policy>, T>(ops, copyIn, allocations);
+    report << left << setw(20) << label << right << setw(12) << stackRate << setw(12) << queueRate
+        << setw(16) << allocations * 1000.0 / (2 * ops) << endl;
+}
+
+template <typename T>
+void benchElementType(const char* type, size_t ops, ostream& report) {
+    report << type << " (" << sizeof(T) << " bytes)\n";
+    report << left << setw(20) << "policy" << right << setw(12) << "stack M/s" << setw(12) << "queue M/s"
+        << setw(16) << "allocs/1K ops" << endl;
+    //the containers before policies: a heap node per element, filled by copy
+    containerRow<T, LinkedNodes<HeapAllocator>>("heap nodes, copied", ops, true, report);
+    containerRow<T, LinkedNodes<>>("linked", ops, false, report);
+    containerRow<T, ChunkedNodes<>>("chunked 32", ops, false, report);
+    containerRow<T, FixedRing<64>>("ring 64", ops, false, report);
+    containerRow<T, LockFreeNodes<>>("lock-free", ops, false, report);
+    report << endl;
+}
+
+void benchContainers(size_t ops, ostream& report) {
+    report << fixed << setprecision(2) << ops << " puts and takes per container over 1024 containers, one thread\n\n";
+    benchElementType<uint32_t>("post id", ops, report);
+    benchElementType<User*>("friend request", ops, report);
+    benchElementType<Notification>("notification", ops, report);
+    benchElementType<Message>("message", ops, report);
+}
+
+//friend graph on a power-law (log-uniform endpoint) graph: build, membership tests
+//weighted toward busy users, full adjacency scans and bytes per edge, against a
+//replica of the old linked FriendNode list
+//userCount * degree / 2 distinct friendships with a power-law spread: one end of
+//each is drawn log-uniformly, so low ids collect most of the edges
+vector<pair<int, int>> powerLawEdges(int userCount, int degree, mt19937_64& rng) {
+    vector<pair<int, int>> edges;
+    unordered_set<uint64_t> seen;
+    long long wanted = static_cast<long long>(userCount) * degree / 2;
+    while (static_cast<long long>(edges.size()) < wanted) {
+        int a = static_cast<int>(pow(static_cast<double>(userCount), uniform_real_distribution<double>(0, 1)(rng))) - 1;
+        int b = static_cast<int>(rng() % userCount);
+        if (a != b && seen.insert(static_cast<uint64_t>(min(a, b)) << 32 | max(a, b)).second)
+            edges.push_back(make_pair(a, b));
+    }
+    return edges;
+}
+
+void benchFriendGraph(int userCount, int degree, ostream& report) {
+    struct OldFriendNode {
+        User* user;
+        string relationType;
+        string status;
+        OldFriendNode* next;
+    };
+
+    mt19937_64 rng(13);
+    initEngine();
+    vector<User*> users;
+    for (int i = 0; i < userCount; i++)
+        users.push_back(createUser("member" + to_string(i), "password", "Lahore"));
+    vector<OldFriendNode*> oldLists(userCount, nullptr);
+    vector<pair<int, int>> edges = powerLawEdges(userCount, degree, rng);
+
+    auto start = chrono::steady_clock::now();
+    for (const pair<int, int>& edge : edges) {
+        users[edge.first]->addFriend(users[edge.second], discardStream);
+        users[edge.second]->addFriend(users[edge.first], discardStream);
+    }
+    double buildSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    for (const pair<int, int>& edge : edges) {
+        oldLists[edge.first] = new OldFriendNode{ users[edge.second], "friend", "active", oldLists[edge.first] };
+        oldLists[edge.second] = new OldFriendNode{ users[edge.first], "friend", "active", oldLists[edge.second] };
+    }
+
+    //half real friendships, half random pairs, asked by users in proportion to their degree
+    const size_t queries = 200000;
+    vector<pair<int, int>> probes;
+    for (size_t i = 0; i < queries; i++) {
+        const pair<int, int>& edge = edges[rng() % edges.size()];
+        probes.push_back(i % 2 == 0 ? edge : make_pair(edge.first, static_cast<int>(rng() % userCount)));
+    }
+
+    size_t hits = 0, oldHits = 0, subsetHits = 0;
+    start = chrono::steady_clock::now();
+    for (const pair<int, int>& probe : probes)
+        hits += users[probe.first]->isFollowing(users[probe.second]);
+    double lookupSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    //the list walk is orders of magnitude slower, so it only gets a sample of the probes
+    size_t oldQueries = queries / 100;
+    for (size_t i = 0; i < oldQueries; i++)
+        subsetHits += users[probes[i].first]->isFollowing(users[probes[i].second]);
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < oldQueries; i++) {
+        const pair<int, int>& probe = probes[i];
+        for (OldFriendNode* node = oldLists[probe.first]; node != nullptr; node = node->next) {
+            if (node->user == users[probe.second]) {
+                oldHits++;
+                break;
+            }
+        }
+    }
+    double oldLookupSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    uint64_t checksum = 0, oldChecksum = 0;
+    start = chrono::steady_clock::now();
+    for (User* user : users) {
+        for (size_t i = 0; i < user->friendIds.size(); i++) {
+            if (edgeStatus(user->friendStates[i]) == STATUS_ACTIVE)
+                checksum += user->friendIds[i];
+        }
+    }
+    double scanSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    start = chrono::steady_clock::now();
+    for (OldFriendNode* list : oldLists) {
+        for (OldFriendNode* node = list; node != nullptr; node = node->next) {
+            if (node->status == "active")
+                oldChecksum += node->user->id;
+        }
+    }
+    double oldScanSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    size_t bytes = 0;
+    for (User* user : users)
+        bytes += user->friendIds.capacity() * sizeof(uint32_t) + user->friendStates.capacity();
+    int maxDegree = 0;
+    for (User* user : users)
+        maxDegree = max(maxDegree, user->friendCount.load());
+    double directed = 2.0 * edges.size();
+
+    if (subsetHits != oldHits || checksum != oldChecksum)
+        report << "layout mismatch: " << subsetHits << "/" << oldHits << " hits" << endl;
+    report << fixed << setprecision(2);
+    report << userCount << " users, " << edges.size() << " friendships, max degree " << maxDegree
+        << ", built in " << buildSeconds << " s\n";
+    report << hits << " of " << queries << " probes are friends\n";
+    report << left << setw(12) << "layout" << right << setw(16) << "lookups K/s" << setw(16) << "scan M edges/s"
+        << setw(16) << "bytes/edge" << endl;
+    report << left << setw(12) << "sorted ids" << right << setw(16) << queries / lookupSeconds / 1e3
+        << setw(16) << directed / scanSeconds / 1e6 << setw(16) << bytes / directed << endl;
+    report << left << setw(12) << "linked" << right << setw(16) << oldQueries / oldLookupSeconds / 1e3
+        << setw(16) << directed / oldScanSeconds / 1e6 << setw(16) << static_cast<double>(sizeof(OldFriendNode)) << endl;
+
+    for (OldFriendNode* list : oldLists) {
+        while (list != nullptr) {
+            OldFriendNode* next = list->next;
+            delete list;
+            list = next;
+        }
+    }
+    shutdownEngine();
+}
+
+//accepting a queue of requests with the batch path against the old one-at-a-time
+//drain, once with every request aimed at one user and once spread over many
+//friend-of-friend suggestions on a power-law graph with some users planted at 5K
+//friends: cold ranking latency on one thread and on all of them, cached answers,
+//and what keeping every cache exact adds to addFriend. targets for a 5K-friend
+//user: cold p99 under 20 ms, cached p99 under 10 us
+void benchRecommend(int userCount, int degree, ostream& report) {
+    static const char* cities[] = { "Lahore", "Karachi", "Islamabad", "Peshawar", "Quetta", "Multan" };
+    const int heavyUsers = 100, heavyDegree = 5000, typicalUsers = 1000, cachedUsers = 10000, newEdges = 2000;
+    mt19937_64 rng(18);
+    vector<User*> users;
+    for (int i = 0; i < userCount; i++)
+        users.push_back(createUser("member" + to_string(i), "password", cities[i % 6]));
+
+    vector<vector<User*>> adjacency(userCount);
+    for (const pair<int, int>& edge : powerLawEdges(userCount, degree, rng)) {
+        adjacency[edge.first].push_back(users[edge.second]);
+        adjacency[edge.second].push_back(users[edge.first]);
+    }
+    vector<User*> heavy, typical;
+    for (int i = 0; i < heavyUsers; i++) {
+        int u = userCount / 2 + static_cast<int>(rng() % (userCount / 2));
+        heavy.push_back(users[u]);
+        for (int j = 0; j < heavyDegree; j++) {
+            int v = static_cast<int>(rng() % userCount);
+            if (v != u) {
+                adjacency[u].push_back(users[v]);
+                adjacency[v].push_back(users[u]);
+            }
+        }
+    }
+    for (int i = 0; i < typicalUsers; i++)
+        typical.push_back(users[rng() % userCount]);
+    for (int i = 0; i < userCount; i++)
+        users[i]->addFriends(adjacency[i]);
+    adjacency.clear();
+    adjacency.shrink_to_fit();
+
+    size_t threads = graphWorkers->workers.size() + 1;
+    report << fixed << setprecision(2) << userCount << " users, average " << degree << " friends, " << heavyUsers
+        << " planted with " << heavyDegree << ", " << threads << " ranking thread" << (threads == 1 ? "" : "s") << "\n\n";
+    report << left << setw(26) << "query" << right << setw(14) << "2-hop edges" << setw(10) << "p50 us"
+        << setw(10) << "p99 us" << setw(12) << "max us" << endl;
+    auto row = [&](const string& label, vector<uint64_t>& nanos, double edges) {
+        sort(nanos.begin(), nanos.end());
+        report << left << setw(26) << label << right << setw(14) << edges << setw(10) << percentile(nanos, 0.50) / 1e3
+            << setw(10) << percentile(nanos, 0.99) / 1e3 << setw(12) << nanos.back() / 1e3 << endl;
+    };
+    auto twoHopEdges = [&](const vector<User*>& group) {
+        double total = 0;
+        for (User* user : group)
+            for (uint32_t friendId : user->friendIds)
+                total += usersById[friendId]->friendIds.size();
+        return total / group.size();
+    };
+
+    vector<Recommendation> ranked, served;
+    Recommendation bound;
+    for (size_t parts : { static_cast<size_t>(1), threads }) {
+        for (int group = 0; group < 2; group++) {
+            const vector<User*>& sample = group == 0 ? typical : heavy;
+            vector<uint64_t> nanos;
+            for (User* user : sample) {
+                auto start = chrono::steady_clock::now();
+                rankCandidates(user, RECOMMEND_DEPTH, ranked, bound, parts);
+                nanos.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+            }
+            row(string(group == 0 ? "cold, typical" : "cold, 5K friends") + ", " + to_string(parts) + " thr", nanos, twoHopEdges(sample));
+        }
+        if (threads == 1)
+            break;
+    }
+
+    //time addFriend before any cache exists, then with caches for a sample of users
+    auto addEdges = [&](vector<uint64_t>& nanos) {
+        for (int i = 0; i < newEdges; i++) {
+            User* a = users[rng() % userCount];
+            User* b = users[rng() % userCount];
+            if (a == b || a->isFollowing(b))
+                continue;
+            auto start = chrono::steady_clock::now();
+            a->addFriend(b, discardStream);
+            b->addFriend(a, discardStream);
+            nanos.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count() / 2);
+        }
+    };
+    vector<uint64_t> plainAdds, trackedAdds;
+    addEdges(plainAdds);
+    vector<User*> cached = typical;
+    cached.insert(cached.end(), heavy.begin(), heavy.end());
+    while (cached.size() < static_cast<size_t>(min(cachedUsers, userCount)))
+        cached.push_back(users[rng() % userCount]);
+    auto start = chrono::steady_clock::now();
+    for (User* user : cached)
+        recommendFriends(user, RECOMMEND_LIMIT, served);
+    double buildSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    for (int group = 0; group < 2; group++) {
+        const vector<User*>& sample = group == 0 ? typical : heavy;
+        vector<uint64_t> nanos;
+        for (User* user : sample) {
+            auto begin = chrono::steady_clock::now();
+            recommendFriends(user, RECOMMEND_LIMIT, served);
+            nanos.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - begin).count());
+        }
+        row(group == 0 ? "cached, typical" : "cached, 5K friends", nanos, twoHopEdges(sample));
+    }
+    addEdges(trackedAdds);
+    row("addFriend, no caches", plainAdds, 0);
+    row("addFriend, with caches", trackedAdds, 0);
+
+    //after the new edges, every cache that still answers must match a fresh ranking
+    uint64_t hitsBefore = recommendationHits.load();
+    size_t mismatches = 0;
+    for (User* user : cached) {
+        recommendFriends(user, RECOMMEND_LIMIT, served);
+        rankCandidates(user, RECOMMEND_LIMIT, ranked, bound);
+        bool same = served.size() == ranked.size();
+        for (size_t i = 0; same && i < served.size(); i++)
+            same = served[i].userId == ranked[i].userId && served[i].score == ranked[i].score;
+        mismatches += !same;
+    }
+    report << "\n" << cached.size() << " caches built in " << buildSeconds << " s; after " << newEdges
+        << " more friendships " << 100.0 * (recommendationHits.load() - hitsBefore) / cached.size()
+        << "% still answered from cache, " << mismatches << " differ from a fresh ranking\n";
+}
+
+//ranked feed pages against the chronological page and against scoring and sorting
+//the whole window from scratch, cold (no author weighed yet) and warm, then the
+//upkeep that messages and friendships pay and whether the kept weights stay exact
+void benchRankedFeed(int userCount, int degree, ostream& report) {
+    static const char* cities[] = { "Lahore", "Karachi", "Islamabad", "Peshawar", "Quetta", "Multan" };
+    const int postsPerUser = 8, messagesPerUser = 4, readers = 1000, changes = 2000;
+    mt19937_64 rng(20);
+    vector<User*> users;
+    for (int i = 0; i < userCount; i++)
+        users.push_back(createUser("member" + to_string(i), "password", cities[i % 6]));
+    vector<vector<User*>> adjacency(userCount);
+    for (const pair<int, int>& edge : powerLawEdges(userCount, degree, rng)) {
+        adjacency[edge.first].push_back(users[edge.second]);
+        adjacency[edge.second].push_back(users[edge.first]);
+    }
+    for (int i = 0; i < userCount; i++)
+        users[i]->addFriends(adjacency[i]);
+    adjacency.clear();
+    adjacency.shrink_to_fit();
+
+    auto randomFriend = [&](User* user) {
+        return user->friendIds.empty() ? nullptr : usersById[user->friendIds[rng() % user->friendIds.size()]];
+    };
+    for (long long i = 0; i < static_cast<long long>(userCount) * postsPerUser; i++) {
+        User* author = users[rng() % userCount];
+        author->addPost("post " + to_string(i) + " by " + author->name);
+    }
+    for (long long i = 0; i < static_cast<long long>(userCount) * messagesPerUser; i++) {
+        User* sender = users[rng() % userCount];
+        if (User* receiver = randomFriend(sender))
+            sender->sendMessage(receiver, "hello", discardStream);
+    }
+    vector<User*> sample;
+    while (sample.size() < static_cast<size_t>(min(readers, userCount))) {
+        User* user = users[rng() % userCount];
+        if (!user->friendIds.empty())
+            sample.push_back(user);
+    }
+
+    //the way without the kept weights: weigh every author in the window, score every
+    //post and sort them all
+    vector<uint32_t> window;
+    vector<pair<float, uint32_t>> scored;
+    unordered_map<uint32_t, float> weights;
+    auto sortWhole = [&](User* reader, size_t limit, uint32_t* page) {
+        window.resize(RANKED_WINDOW);
+        window.resize(reader->newsfeedPage(NO_POST, RANKED_WINDOW, window.data()));
+        vector<uint32_t> readerFriends = reader->friendIds;
+        weights.clear();
+        scored.clear();
+        time_t now = engineNow();
+        for (uint32_t postId : window) {
+            Post post = postStore->get(postId);
+            auto at = weights.find(post.authorId);
+            if (at == weights.end())
+                at = weights.emplace(post.authorId, measureAffinity(reader, usersById[post.authorId], readerFriends).weight).first;
+            scored.push_back(make_pair(rankedScore(at->second, post.dateTime, now), postId));
+        }
+        sort(scored.begin(), scored.end(), [](const pair<float, uint32_t>& a, const pair<float, uint32_t>& b) {
+            return a.first != b.first ? a.first > b.first : a.second > b.second;
+        });
+        size_t n = min(limit, scored.size());
+        for (size_t i = 0; i < n; i++)
+            page[i] = scored[i].second;
+        return n;
+    };
+
+    report << fixed << setprecision(2) << userCount << " users, average " << degree << " friends, "
+        << postsPerUser << " posts and " << messagesPerUser << " messages per user, window " << RANKED_WINDOW
+        << ", budget " << RANKED_FEED_BUDGET.count() << " us\n\n";
+    report << left << setw(28) << "page" << right << setw(10) << "p50 us" << setw(10) << "p99 us"
+        << setw(12) << "max us" << setw(12) << "in budget" << endl;
+    auto row = [&](const string& label, vector<uint64_t>& nanos) {
+        sort(nanos.begin(), nanos.end());
+        size_t within = upper_bound(nanos.begin(), nanos.end(), static_cast<uint64_t>(RANKED_FEED_BUDGET.count()) * 1000) - nanos.begin();
+        report << left << setw(28) << label << right << setw(10) << percentile(nanos, 0.50) / 1e3
+            << setw(10) << percentile(nanos, 0.99) / 1e3 << setw(12) << nanos.back() / 1e3
+            << setw(11) << 100.0 * within / nanos.size() << "%" << endl;
+    };
+    uint32_t page[PAGE_SIZE], expected[PAGE_SIZE];
+    auto timePages = [&](const string& label, const function<size_t(User*)>& fetch) {
+        vector<uint64_t> nanos;
+        for (User* reader : sample) {
+            auto start = chrono::steady_clock::now();
+            fetch(reader);
+            nanos.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+        }
+        row(label, nanos);
+    };
+    timePages("chronological", [&](User* reader) { return reader->newsfeedPage(NO_POST, PAGE_SIZE, page); });
+    timePages("score all + sort", [&](User* reader) { return sortWhole(reader, PAGE_SIZE, page); });
+    uint64_t strangersBefore = rankedStrangers.load();
+    timePages("ranked, cold", [&](User* reader) { return rankFeed(reader, 0, PAGE_SIZE, page); });
+    uint64_t strangers = rankedStrangers.load() - strangersBefore;
+    timePages("ranked, warm", [&](User* reader) { return rankFeed(reader, 0, PAGE_SIZE, page); });
+    timePages("ranked, warm, 3rd page", [&](User* reader) { return rankFeed(reader, 2 * PAGE_SIZE, PAGE_SIZE, page); });
+
+    //messages and friendships with every reader's weights kept current
+    vector<uint64_t> messageNanos, friendNanos;
+    for (int i = 0; i < changes; i++) {
+        User* reader = sample[rng() % sample.size()];
+        if (User* other = randomFriend(reader)) {
+            auto start = chrono::steady_clock::now();
+            reader->sendMessage(other, "again", discardStream);
+            messageNanos.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+        }
+        User* a = users[rng() % userCount];
+        User* b = users[rng() % userCount];
+        if (a == b || a->isFollowing(b))
+            continue;
+        auto start = chrono::steady_clock::now();
+        a->addFriend(b, discardStream);
+        b->addFriend(a, discardStream);
+        friendNanos.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count() / 2);
+    }
+    row("sendMessage, with weights", messageNanos);
+    row("addFriend, with weights", friendNanos);
+
+    size_t entries = 0, stale = 0, differ = 0;
+    for (User* reader : sample) {
+        FeedAffinity* table = reader->affinity.load();
+        vector<uint32_t> readerFriends = reader->friendIds;
+        for (const AuthorAffinity& entry : table->authors) {
+            AuthorAffinity fresh = measureAffinity(reader, usersById[entry.authorId], readerFriends);
+            entries++;
+            stale += fresh.messages != entry.messages || fresh.mutualFriends != entry.mutualFriends;
+        }
+        size_t n = rankFeed(reader, 0, PAGE_SIZE, page);
+        size_t m = sortWhole(reader, PAGE_SIZE, expected);
+        differ += n != m || !equal(page, page + n, expected);
+    }
+    report << "\n" << strangers << " authors left unweighed by cold pages over budget; after " << changes
+        << " messages and friendships " << stale << " of " << entries << " kept weights are stale, "
+        << differ << " of " << sample.size() << " top pages differ from a full sort\n";
+}
+
+void benchFriendRequests(int requests, ostream& report) {
+    const int spreadReceivers = 1000;
+
+    report << fixed << setprecision(2) << requests << " queued friend requests\n";
+    report << left << setw(12) << "receivers" << setw(10) << "accept" << right << setw(14) << "K accepts/s"
+        << setw(16) << "allocs/accept" << setw(14) << "duplicates" << endl;
+
+    for (int shape = 0; shape < 2; shape++) {
+        int receivers = shape == 0 ? 1 : spreadReceivers;
+        for (int batched = 1; batched >= 0; batched--) {
+            mt19937_64 rng(21);
+            initEngine();
+            vector<User*> users;
+            for (int i = 0; i < receivers + requests; i++)
+                users.push_back(createUser("member" + to_string(i), "password", "Lahore"));
+
+            //every sender asks twice, the second request should be turned away
+            vector<int> senders;
+            for (int i = 0; i < requests; i++)
+                senders.push_back(receivers + i);
+            shuffle(senders.begin(), senders.end(), rng);
+            int duplicates = 0;
+            for (int round = 0; round < 2; round++) {
+                for (int i = 0; i < requests; i++) {
+                    if (!users[senders[i]]->sendFriendRequest(users[i % receivers], discardStream))
+                        duplicates++;
+                }
+            }
+
+            uint64_t allocationsBefore = heapAllocations.load();
+            auto start = chrono::steady_clock::now();
+            int accepted = 0;
+            for (int r = 0; r < receivers; r++) {
+                User* receiver = users[r];
+                if (batched) {
+                    accepted += receiver->acceptFriendRequests(discardStream);
+                    continue;
+                }
+                User* fromUser;
+                while (receiver->friendRequestQueue.dequeue(fromUser)) {
+                    receiver->pendingRequests.erase(fromUser->id);
+                    receiver->addFriend(fromUser, discardStream);
+                    fromUser->addFriend(receiver, discardStream);
+                    fromUser->notify(NOTIFY_REQUEST_ACCEPTED, receiver->id);
+                    accepted++;
+                }
+            }
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            uint64_t allocations = heapAllocations.load() - allocationsBefore;
+
+            report << left << setw(12) << receivers << setw(10) << (batched ? "batch" : "single")
+                << right << setw(14) << accepted / seconds / 1e3
+                << setw(16) << static_cast<double>(allocations) / max(accepted, 1)
+                << setw(14) << duplicates << endl;
+            shutdownEngine();
+        }
+    }
+}
+
+//the synthetic workload served by 1..maxThreads concurrent sessions: signups are
+//replayed on one thread, then each worker takes a round-robin share of the rest,
+//so commands keep roughly their global order and few lose a race with the
+//request or accept they depend on
+void benchThreads(int userCount, long long opCount, int maxThreads, ostream& report) {
+    vector<Command> commands = generateWorkload(userCount, opCount, 42);
+    size_t signups = min(commands.size(), static_cast<size_t>(userCount));
+
+    report << fixed << setprecision(2);
+    report << userCount << " users, " << opCount << " operations, " << thread::hardware_concurrency()
+        << " hardware threads\n";
+    report << left << setw(10) << "threads" << right << setw(14) << "K ops/s" << setw(12) << "speedup"
+        << setw(12) << "rejected" << endl;
+
+    double baseline = 0;
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        initEngine();
+        for (size_t i = 0; i < signups; i++)
+            executeCommand(commands[i], discardStream);
+
+        atomic<long long> rejected(0);
+        auto start = chrono::steady_clock::now();
+        vector<thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t]() {
+                ostream sink(nullptr); //a stream per session, discardStream's state isn't shared safely
+                long long failed = 0;
+                for (size_t i = signups + t; i < commands.size(); i += threads) {
+                    if (!executeCommand(commands[i], sink))
+                        failed++;
+                }
+                rejected += failed;
+            });
+        }
+        for (thread& worker : workers)
+            worker.join();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        double rate = (commands.size() - signups) / seconds;
+        if (threads == 1)
+            baseline = rate;
+        report << left << setw(10) << threads << right << setw(14) << rate / 1e3
+            << setw(12) << rate / baseline << setw(12) << rejected.load() << endl;
+        shutdownEngine();
+    }
+}
+
+//a city-skewed workload on 1..maxShards shards, one thread each. signups run on
+//one thread first, then every command goes to its acting user's shard (searches,
+//which have none, round robin). busiest is the largest shard's share of the
+//commands, tasks the cross-shard handoffs per 1000 commands
+void benchShards(int userCount, long long opCount, int maxShards, ostream& report) {
+    const double citySkew = 1.0;
+    vector<Command> commands = generateWorkload(userCount, opCount, 42, citySkew);
+    size_t signups = min(commands.size(), static_cast<size_t>(userCount));
+    maxShards = min(maxShards, static_cast<int>(MAX_SHARDS));
+
+    report << fixed << setprecision(2);
+    report << userCount << " users over 12 cities (zipf " << citySkew << "), " << opCount << " operations, "
+        << thread::hardware_concurrency() << " hardware threads\n";
+    report << left << setw(10) << "shards" << right << setw(14) << "K ops/s" << setw(12) << "speedup"
+        << setw(12) << "busiest %" << setw(14) << "tasks/K ops" << setw(12) << "rejected" << endl;
+
+    double baseline = 0;
+    for (int shards = 1; shards <= maxShards; shards *= 2) {
+        shardCount = shards;
+        initEngine();
+        for (size_t i = 0; i < signups; i++)
+            executeCommand(commands[i], discardStream);
+        vector<vector<const Command*>> perShard(shards);
+        for (size_t i = signups; i < commands.size(); i++) {
+            User* user = loginTable->search(commands[i].user);
+            perShard[user != nullptr ? user->shard : i % shards].push_back(&commands[i]);
+        }
+
+        auto start = chrono::steady_clock::now();
+        long long rejected = runShards(perShard);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        size_t ops = commands.size() - signups, busiest = 0;
+        uint64_t tasks = 0;
+        for (int i = 0; i < shards; i++) {
+            busiest = max(busiest, perShard[i].size());
+            tasks += cityShards[i]->tasksReceived.load();
+        }
+        double rate = ops / seconds;
+        if (shards == 1)
+            baseline = rate;
+        report << left << setw(10) << shards << right << setw(14) << rate / 1e3 << setw(12) << rate / baseline
+            << setw(12) << 100.0 * busiest / max<size_t>(ops, 1) << setw(14) << 1e3 * tasks / max<size_t>(ops, 1)
+            << setw(12) << rejected << endl;
+        shutdownEngine();
+    }
+    shardCount = 1;
+}
+
+//write throughput with the log on, snapshot cost, and restart time from snapshot
+//plus log tail. only the store's own files in dir are touched
+void benchPersist(int userCount, int postCount, const string& dir, ostream& report) {
+    const int degree = 4;
+    const int syncSeconds = 2;
+    error_code error;
+    filesystem::create_directories(dir, error);
+    for (const pair<uint64_t, string>& segment : listLogSegments(dir))
+        filesystem::remove(segment.second, error);
+    filesystem::remove(dir + "/snapshot.bin", error);
+    filesystem::remove(dir + "/snapshot.tmp", error);
+
+    mt19937_64 rng(13);
+    initEngine();
+    if (!openStore(dir)) {
+        report << "Cannot open store in " << dir << endl;
+        shutdownEngine();
+        return;
+    }
+    snapshotLogBytes = ~0ull; //only the snapshots taken below
+    auto walCounters = [](uint64_t& groups, uint64_t& records, uint64_t& bytes) {
+        lock_guard<mutex> guard(writeAheadLog->lock);
+        groups = writeAheadLog->groups;
+        records = writeAheadLog->records;
+        bytes = writeAheadLog->appendedLsn;
+    };
+
+    report << fixed << setprecision(2);
+    report << userCount << " users, " << degree << " friends each, " << postCount << " posts, store in " << dir << "\n\n";
+    report << left << setw(26) << "phase" << right << setw(14) << "K records/s" << setw(10) << "MB/s"
+        << setw(12) << "recs/group" << setw(10) << "seconds" << endl;
+    auto row = [&](const char* phase, uint64_t records, uint64_t bytes, uint64_t groups, double seconds) {
+        report << left << setw(26) << phase << right << setw(14) << records / seconds / 1e3
+            << setw(10) << bytes / seconds / 1048576.0 << setw(12) << static_cast<double>(records) / max<uint64_t>(groups, 1)
+            << setw(10) << seconds << endl;
+    };
+
+    //bulk load with asynchronous group commit: writers never wait for the disk
+    uint64_t groups0, records0, bytes0, groups1, records1, bytes1;
+    walCounters(groups0, records0, bytes0);
+    auto start = chrono::steady_clock::now();
+    vector<User*> users;
+    users.reserve(userCount);
+    for (int i = 0; i < userCount; i++)
+        users.push_back(createUser("member" + to_string(i), "password", "Lahore"));
+    vector<User*> batch;
+    for (int i = 0; i < userCount; i++) {
+        batch.clear();
+        for (int j = 0; j < degree; j++)
+            batch.push_back(users[rng() % userCount]);
+        users[i]->addFriends(batch);
+    }
+    string content(48, 'x');
+    for (int i = 0; i < postCount; i++)
+        users[rng() % userCount]->addPost(content);
+    writeAheadLog->waitDurable(writeAheadLog->position());
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    walCounters(groups1, records1, bytes1);
+    row("async bulk load", records1 - records0, bytes1 - bytes0, groups1 - groups0, seconds);
+
+    //synchronous commits: each post returns once its group is on disk, so
+    //concurrent sessions share fsyncs
+    writeAheadLog->syncCommits = true;
+    for (int threads = 1; threads <= 64; threads *= 8) {
+        walCounters(groups0, records0, bytes0);
+        atomic<bool> stop(false);
+        vector<thread> workers;
+        start = chrono::steady_clock::now();
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t]() {
+                mt19937_64 local(t);
+                while (!stop)
+                    users[local() % userCount]->addPost(content);
+            });
+        }
+        this_thread::sleep_for(chrono::seconds(syncSeconds));
+        stop = true;
+        for (thread& worker : workers)
+            worker.join();
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        walCounters(groups1, records1, bytes1);
+        string phase = "sync, " + to_string(threads) + " session" + (threads == 1 ? "" : "s");
+        row(phase.c_str(), records1 - records0, bytes1 - bytes0, groups1 - groups0, seconds);
+    }
+    writeAheadLog->syncCommits = false;
+
+    start = chrono::steady_clock::now();
+    takeSnapshot();
+    double snapshotSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    //a tail the next start has to replay
+    int tail = max(postCount / 10, 1);
+    for (int i = 0; i < tail; i++)
+        users[rng() % userCount]->addPost(content);
+    uint32_t posts = postStore->nextId();
+    uint32_t registered = usersById.size();
+    closeStore(false);
+    shutdownEngine();
+
+    initEngine();
+    RecoveryStats recovery;
+    start = chrono::steady_clock::now();
+    bool recovered = openStore(dir, &recovery);
+    double restartSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    bool intact = recovered && usersById.size() == registered && postStore->nextId() == posts;
+    report << "\nsnapshot: " << snapshotSeconds << " s to write " << recovery.snapshotBytes / 1048576.0 << " MB\n";
+    report << "restart: " << restartSeconds << " s (snapshot " << recovery.snapshotSeconds << " s, replay of "
+        << recovery.replayedRecords << " records / " << recovery.logBytes / 1048576.0 << " MB "
+        << recovery.replaySeconds << " s), " << (intact ? "all users and posts back" : "STATE MISMATCH") << endl;
+    report << "resident after restart: " << residentBytes() / 1048576.0 << " MB" << endl;
+    closeStore(false);
+    shutdownEngine();
+}
+
+#ifndef _WIN32
+//a month of posts and messages, one simulated day at a time, with a retention window
+//and with everything kept hot: resident memory as the days go by, what went cold, and
+//the cost of reading it back. each run is a child process, so pages the allocator
+//keeps after one can't flatter or penalize the other
+void benchRetention(int userCount, int days, int postsPerDay, int messagesPerDay, double hotDays, const string& dir, ostream& report) {
+    const int degree = 8;
+    const char* words[] = { "coffee", "sunset", "weekend", "campus", "exam", "cricket", "biryani", "rain",
+        "road trip", "new phone", "lecture", "friends", "late night", "deadline", "concert", "family" };
+
+    struct Day {
+        double residentMB;
+        double hotContentMB;
+        double coldMB;
+    };
+    struct Outcome {
+        CompactionStats last;
+        double passSeconds, coldPostFirst, coldPostAgain, coldChatFirst, coldChatAgain;
+        uint64_t coldMessages, rawMessageBytes, coldMessageBytes;
+    };
+    auto runMonth = [&](bool retained, vector<Day>& results, Outcome& outcome) {
+        outcome = Outcome();
+        snapshotIntervalSeconds = 1 << 30; //no snapshot in the middle of a day
+        snapshotLogBytes = ~0ull;
+        retention = RetentionPolicy{ retained ? static_cast<int64_t>(hotDays * 86400) : 0, 0, 0 };
+        mt19937_64 rng(29);
+        error_code error;
+        filesystem::remove_all(dir, error);
+        initEngine();
+        if (!openStore(dir)) {
+            shutdownEngine();
+            return false;
+        }
+        vector<User*> users;
+        users.reserve(userCount);
+        for (int i = 0; i < userCount; i++)
+            users.push_back(createUser("member" + to_string(i), "password", "Lahore"));
+        vector<User*> batch;
+        for (int i = 0; i < userCount; i++) {
+            batch.clear();
+            for (int j = 0; j < degree / 2; j++)
+                batch.push_back(users[rng() % userCount]);
+            users[i]->addFriends(batch);
+        }
+
+        auto sentence = [&](int wordCount) {
+            string text;
+            for (int w = 0; w < wordCount; w++)
+                text += string(w == 0 ? "" : " ") + words[rng() % 16];
+            return text + " #" + to_string(rng() % 1000);
+        };
+        uint32_t firstDayEnd = 0;
+        for (int day = 0; day < days; day++) {
+            clockOffset = static_cast<int64_t>(day) * 86400;
+            for (int i = 0; i < postsPerDay; i++)
+                users[rng() % userCount]->addPost(sentence(8 + static_cast<int>(rng() % 8)));
+            for (int i = 0; i < messagesPerDay; i++) {
+                User* from = users[rng() % userCount];
+                if (!from->friendIds.empty())
+                    from->sendMessage(usersById[from->friendIds[rng() % from->friendIds.size()]], sentence(3 + static_cast<int>(rng() % 6)), discardStream);
+            }
+            if (day == 0)
+                firstDayEnd = postStore->nextId();
+            if (retained) {
+                auto start = chrono::steady_clock::now();
+                compactColdData(engineNow(), &outcome.last);
+                outcome.passSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            }
+            uint64_t hot = 0;
+            for (int i = 0; i < shardCount; i++)
+                hot += cityShards[i]->posts.arena.used - cityShards[i]->posts.coldBytes;
+            results.push_back(Day{ residentBytes() / 1048576.0, hot / 1048576.0, coldBytesStored / 1048576.0 });
+        }
+
+        if (retained) {
+            //a page of someone's first-day posts and a conversation gone cold
+            User* reader = usersById[postStore->get(firstDayEnd / 2).authorId];
+            auto start = chrono::steady_clock::now();
+            reader->viewOwnPosts(discardStream, firstDayEnd);
+            outcome.coldPostFirst = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            start = chrono::steady_clock::now();
+            reader->viewOwnPosts(discardStream, firstDayEnd);
+            outcome.coldPostAgain = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            User* talker = users[0];
+            for (User* user : users) {
+                if (!user->friendIds.empty()) {
+                    talker = user;
+                    break;
+                }
+            }
+            User* other = usersById[talker->friendIds[0]];
+            start = chrono::steady_clock::now();
+            talker->viewMessages(other, discardStream);
+            outcome.coldChatFirst = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            start = chrono::steady_clock::now();
+            talker->viewMessages(other, discardStream);
+            outcome.coldChatAgain = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            for (int i = 0; i < shardCount; i++) {
+                outcome.coldMessages += cityShards[i]->cold.messageCount;
+                outcome.rawMessageBytes += cityShards[i]->cold.rawMessageBytes;
+                for (const ColdFile* file : cityShards[i]->cold.messages)
+                    outcome.coldMessageBytes += file->used;
+            }
+        }
+        closeStore(false);
+        shutdownEngine();
+        filesystem::remove_all(dir, error);
+        return true;
+    };
+
+    vector<Day> results[2];
+    Outcome outcome = Outcome();
+    for (int run = 0; run < 2; run++) {
+        int channel[2];
+        if (pipe(channel) != 0) {
+            report << "Cannot create a pipe" << endl;
+            return;
+        }
+        pid_t child = fork();
+        if (child == 0) {
+            close(channel[0]);
+            vector<Day> days;
+            Outcome result;
+            if (runMonth(run == 0, days, result)) {
+                ssize_t written = write(channel[1], &result, sizeof(result));
+                written = write(channel[1], days.data(), days.size() * sizeof(Day));
+                (void)written;
+            }
+            _exit(0);
+        }
+        close(channel[1]);
+        Outcome result = Outcome();
+        bool complete = child > 0 && read(channel[0], &result, sizeof(result)) == static_cast<ssize_t>(sizeof(result));
+        Day day;
+        while (complete && read(channel[0], &day, sizeof(day)) == static_cast<ssize_t>(sizeof(day)))
+            results[run].push_back(day);
+        close(channel[0]);
+        if (child > 0)
+            waitpid(child, nullptr, 0);
+        if (run == 0)
+            outcome = result;
+    }
+    if (results[0].size() != static_cast<size_t>(days) || results[1].size() != static_cast<size_t>(days)) {
+        report << "Cannot open store in " << dir << endl;
+        return;
+    }
+
+    report << fixed << setprecision(2);
+    report << userCount << " users, " << degree << " friends each, " << days << " days of " << postsPerDay << " posts and "
+        << messagesPerDay << " messages, " << hotDays << " days kept hot, store in " << dir << "\n\n";
+    report << left << setw(6) << "day" << right << setw(16) << "RSS all hot MB" << setw(16) << "RSS retained MB"
+        << setw(16) << "hot content MB" << setw(14) << "cold disk MB" << endl;
+    int step = max(1, days / 10);
+    for (int day = 0; day < days; day++) {
+        if ((day + 1) % step != 0 && day != days - 1)
+            continue;
+        report << left << setw(6) << day + 1 << right << setw(16) << results[1][day].residentMB << setw(16) << results[0][day].residentMB
+            << setw(16) << results[0][day].hotContentMB << setw(14) << results[0][day].coldMB << endl;
+    }
+    const CompactionStats& last = outcome.last;
+    report << "\nlast compaction: " << outcome.passSeconds * 1000 << " ms, " << last.posts << " post rows and "
+        << last.messages << " messages moved, " << (last.postBytes + last.messageBytes) / 1048576.0 << " MB written\n";
+    report << "cold messages: " << outcome.coldMessages << ", " << outcome.rawMessageBytes / 1048576.0 << " MB compressed to "
+        << outcome.coldMessageBytes / 1048576.0 << " MB (" << outcome.rawMessageBytes / max(1.0, static_cast<double>(outcome.coldMessageBytes)) << "x)\n";
+    report << "cold reads: first-day posts page " << outcome.coldPostFirst * 1e6 << " us, again " << outcome.coldPostAgain * 1e6
+        << " us; conversation " << outcome.coldChatFirst * 1e6 << " us, again " << outcome.coldChatAgain * 1e6 << " us" << endl;
+}
+#endif
+
+//the columnar store against the layout it replaced, a node per post holding the
+//date, an author pointer and a heap string: resident bytes per post, a scan over
+//metadata only (posts by a set of authors since a date) and a scan over every
+//content byte
+void benchPostStore(int postCount, ostream& report) {
+    struct LegacyPost {
+        time_t dateTime;
+        User* author;
+        string content;
+    };
+    const uint32_t CHUNK = PostStore::CHUNK_SIZE;
+    const uint32_t authors = 100000;
+
+    mt19937_64 rng(14);
+    vector<string> samples;
+    for (int i = 0; i < 1024; i++) {
+        string text = "post " + to_string(i) + ":";
+        size_t length = 16 + rng() % 225;
+        while (text.size() < length)
+            text += " a day out with friends";
+        text.resize(length);
+        samples.push_back(text);
+    }
+    vector<uint32_t> picks(postCount);
+    for (uint32_t& pick : picks)
+        pick = static_cast<uint32_t>(rng());
+    time_t now = time(nullptr);
+
+    report << fixed << setprecision(2) << postCount << " posts, 16..240 byte content\n";
+    report << left << setw(12) << "layout" << right << setw(14) << "bytes/post" << setw(14) << "fill K/s"
+        << setw(16) << "meta M posts/s" << setw(16) << "content GB/s" << setw(12) << "matches" << endl;
+    auto row = [&](const char* layout, size_t bytes, double fillSeconds, double metaSeconds, double contentSeconds,
+        uint64_t contentBytes, size_t matches) {
+        report << left << setw(12) << layout << right << setw(14) << static_cast<double>(bytes) / postCount
+            << setw(14) << postCount / fillSeconds / 1e3 << setw(16) << postCount / metaSeconds / 1e6
+            << setw(16) << contentBytes / contentSeconds / 1e9 << setw(12) << matches << endl;
+    };
+
+    {
+        size_t before = residentBytes();
+        auto start = chrono::steady_clock::now();
+        PostStore* store = new PostStore();
+        for (int i = 0; i < postCount; i++)
+            store->add(picks[i] % authors, samples[picks[i] % samples.size()]);
+        double fillSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        size_t bytes = residentBytes() - before;
+
+        start = chrono::steady_clock::now();
+        size_t matches = 0;
+        for (uint32_t id = 0; id < store->nextId(); id++) {
+            Post post = store->get(id);
+            if (post.authorId % 64 == 0 && post.dateTime >= now)
+                matches++;
+        }
+        double metaSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        start = chrono::steady_clock::now();
+        uint64_t contentBytes = 0;
+        for (uint32_t id = 0; id < store->nextId(); id++) {
+            string_view content = store->get(id).content;
+            contentBytes += content.size();
+            matches += count(content.begin(), content.end(), '!');
+        }
+        double contentSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        row("columnar", bytes, fillSeconds, metaSeconds, contentSeconds, contentBytes, matches);
+        delete store;
+    }
+
+    {
+        vector<User*> users;
+        for (uint32_t i = 0; i < authors; i++) {
+            users.push_back(new User("author" + to_string(i), PasswordHash(), "Lahore"));
+            users.back()->id = i;
+        }
+        size_t before = residentBytes();
+        auto start = chrono::steady_clock::now();
+        vector<LegacyPost*> chunks;
+        for (int i = 0; i < postCount; i++) {
+            if (i % CHUNK == 0)
+                chunks.push_back(new LegacyPost[CHUNK]);
+            LegacyPost& post = chunks.back()[i % CHUNK];
+            time(&post.dateTime);
+            post.author = users[picks[i] % authors];
+            post.content = samples[picks[i] % samples.size()];
+        }
+        double fillSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        size_t bytes = residentBytes() - before;
+
+        //the old node held a pointer, so the author's id is one more load away
+        start = chrono::steady_clock::now();
+        size_t matches = 0;
+        for (int i = 0; i < postCount; i++) {
+            const LegacyPost& post = chunks[i / CHUNK][i % CHUNK];
+            if (post.author->id % 64 == 0 && post.dateTime >= now)
+                matches++;
+        }
+        double metaSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        start = chrono::steady_clock::now();
+        uint64_t contentBytes = 0;
+        for (int i = 0; i < postCount; i++) {
+            const string& content = chunks[i / CHUNK][i % CHUNK].content;
+            contentBytes += content.size();
+            matches += count(content.begin(), content.end(), '!');
+        }
+        double contentSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        row("node+string", bytes, fillSeconds, metaSeconds, contentSeconds, contentBytes, matches);
+        for (LegacyPost* chunk : chunks)
+            delete[] chunk;
+        for (User* user : users)
+            delete user;
+    }
+}
+
+//logins per second per core at each scrypt cost, verified on the password workers
+//the way authenticate() does, then the cache hit path and the cost calibrated for a
+//few target latencies
+void benchPasswords(int maxCost, ostream& report) {
+    static const uint8_t rfcVector[64] = {
+        0xfd, 0xba, 0xbe, 0x1c, 0x9d, 0x34, 0x72, 0x00, 0x78, 0x56, 0xe7, 0x19, 0x0d, 0x01, 0xe9, 0xfe,
+        0x7c, 0x6a, 0xd7, 0xcb, 0xc8, 0x23, 0x78, 0x30, 0xe7, 0x73, 0x76, 0x63, 0x4b, 0x37, 0x31, 0x62,
+        0x2e, 0xaf, 0x30, 0xd9, 0x2e, 0x22, 0xa3, 0x88, 0x6f, 0xf1, 0x09, 0x27, 0x9d, 0x98, 0x30, 0xda,
+        0xc7, 0x27, 0xaf, 0xb9, 0x4a, 0x83, 0xee, 0x6d, 0x83, 0x60, 0xcb, 0xdf, 0xa2, 0xcc, 0x06, 0x40
+    };
+    uint8_t key[64];
+    scrypt("password", reinterpret_cast<const uint8_t*>("NaCl"), 4, 10, 8, 16, key, sizeof(key));
+    report << "scrypt rfc 7914 test vector: " << (memcmp(key, rfcVector, sizeof(key)) == 0 ? "ok" : "MISMATCH") << "\n";
+
+    size_t workers = passwordWorkers->workers.size();
+    size_t cores = max(1u, thread::hardware_concurrency());
+    size_t clients = workers * 4;
+    report << "r=" << passwordBlockSize << " p=1, " << workers << " password workers, " << clients
+        << " client threads, " << cores << " cores\n\n";
+    report << fixed << setprecision(2);
+    report << right << setw(6) << "logN" << setw(12) << "memory KB" << setw(12) << "hash ms"
+        << setw(12) << "logins/s" << setw(16) << "logins/s/core" << endl;
+
+    for (int logN = 8; logN <= maxCost; logN++) {
+        PasswordHash stored = hashPassword("correct horse", logN, passwordBlockSize);
+        double single = passwordHashMillis(logN, passwordBlockSize);
+        //about a second of work per level
+        long long logins = max<long long>(clients, static_cast<long long>(1000.0 / single * workers));
+        atomic<long long> next(0);
+        atomic<long long> failed(0);
+        auto start = chrono::steady_clock::now();
+        vector<thread> threads;
+        for (size_t t = 0; t < clients; t++) {
+            threads.emplace_back([&] {
+                while (next.fetch_add(1) < logins) {
+                    bool valid = false;
+                    passwordWorkers->run([&] { valid = verifyPassword(stored, "correct horse"); });
+                    if (!valid)
+                        failed++;
+                }
+            });
+        }
+        for (thread& t : threads)
+            t.join();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        double rate = logins / seconds;
+        report << right << setw(6) << logN << setw(12) << (128.0 * passwordBlockSize * (size_t(1) << logN)) / 1024
+            << setw(12) << single << setw(12) << rate << setw(16) << rate / min(workers, cores);
+        if (failed > 0)
+            report << "  " << failed << " FAILED";
+        report << endl;
+    }
+
+    //a repeat login inside the cache window: one sha-256, no worker handoff
+    User* user = registerUser("bench-user", hashPassword("correct horse", passwordCost, passwordBlockSize), "Lahore");
+    authenticate("bench-user", "correct horse");
+    const int repeats = 200000;
+    auto start = chrono::steady_clock::now();
+    int accepted = 0;
+    for (int i = 0; i < repeats; i++)
+        accepted += authenticate("bench-user", "correct horse") == user;
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    report << "\ncached repeat login: " << repeats / seconds / 1e3 << " K/s (" << accepted << "/" << repeats << " accepted)\n";
+
+    report << "\ntarget ms   calibrated logN   hash ms\n";
+    for (double target : { 50.0, 100.0, 250.0 }) {
+        int logN = calibratePasswordCost(target, passwordBlockSize);
+        report << setw(9) << target << setw(18) << logN << setw(10) << passwordHashMillis(logN, passwordBlockSize) << endl;
     }
+}
+
+//legitimate logins alone, then beside a credential-stuffing run with the throttle
+//off and on: what the real users pay for the check, and how much of the attack is
+//turned away before the lookup. real users log in as the first half of the members
+//from their own sources; the attack guesses at the second half and at names that
+//were never registered, spread over 1024 sources
+void benchLoginThrottle(int userCount, double seconds, ostream& report) {
+    for (int i = 0; i < userCount; i++)
+        createUser("member" + to_string(i), "password" + to_string(i), "Lahore");
+    int legitUsers = max(1, userCount / 2);
+    for (int i = 0; i < legitUsers; i++)
+        authenticate("member" + to_string(i), "password" + to_string(i)); //warm the verify cache
+    vector<string> sources;
+    for (int i = 0; i < 1024; i++)
+        sources.push_back("10.66." + to_string(i / 256) + "." + to_string(i % 256));
 
-    void inorderTraversal(BSTNode* node) {
-        if (node != nullptr) {
-            inorderTraversal(node->left);
-            cout << node->username << endl;
-            inorderTraversal(node->right);
+    const int legitThreads = 2, attackThreads = 2;
+    report << fixed << setprecision(2) << userCount << " users, " << legitThreads << " legitimate and "
+        << attackThreads << " attacking threads, " << seconds << " s per phase, sketches "
+        << (nameThrottle.cells.size() + sourceThrottle.cells.size()) * sizeof(uint64_t) / 1024 << " KB\n\n";
+    report << left << setw(18) << "phase" << right << setw(12) << "logins/s" << setw(10) << "p50 us"
+        << setw(10) << "p99 us" << setw(10) << "refused" << setw(14) << "attempts/s" << setw(14) << "pre-lookup %" << endl;
+
+    auto phase = [&](const char* label, bool attack, bool throttle) {
+        loginThrottling = throttle;
+        for (LoginThrottle* sketch : { &nameThrottle, &sourceThrottle })
+            for (atomic<uint64_t>& cell : sketch->cells)
+                cell.store(0, memory_order_relaxed);
+        uint64_t throttledBefore = loginsThrottled.load();
+        atomic<bool> stop(false);
+        atomic<long long> attempts(0), refused(0);
+        vector<vector<uint64_t>> latencies(legitThreads);
+        vector<thread> threads;
+        for (int t = 0; t < legitThreads; t++) {
+            threads.emplace_back([&, t] {
+                mt19937 rng(t);
+                string source = "192.168.1." + to_string(t);
+                while (!stop.load(memory_order_relaxed)) {
+                    int i = rng() % legitUsers;
+                    string name = "member" + to_string(i), password = "password" + to_string(i);
+                    auto start = chrono::steady_clock::now();
+                    User* user = authenticate(name, password, source);
+                    latencies[t].push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+                    if (user == nullptr)
+                        refused++;
+                }
+            });
         }
-    }
-};
+        for (int t = 0; attack && t < attackThreads; t++) {
+            threads.emplace_back([&, t] {
+                mt19937 rng(100 + t);
+                while (!stop.load(memory_order_relaxed)) {
+                    string name = rng() % 2 ? "member" + to_string(legitUsers + rng() % (userCount - legitUsers + 1))
+                        : "ghost" + to_string(rng());
+                    authenticate(name, "hunter22", sources[rng() % sources.size()]);
+                    attempts++;
+                }
+            });
+        }
+        this_thread::sleep_for(chrono::duration<double>(seconds));
+        stop = true;
+        for (thread& t : threads)
+            t.join();
 
-void User::addPost(string content) {
-    Post newPost;
-    time(&newPost.dateTime);
-    newPost.content = content;
-    postStack.push(newPost);
+        vector<uint64_t> all;
+        for (vector<uint64_t>& samples : latencies)
+            all.insert(all.end(), samples.begin(), samples.end());
+        sort(all.begin(), all.end());
+        uint64_t throttled = loginsThrottled.load() - throttledBefore;
+        report << left << setw(18) << label << right << setw(12) << all.size() / seconds
+            << setw(10) << percentile(all, 0.50) / 1e3 << setw(10) << percentile(all, 0.99) / 1e3
+            << setw(10) << refused.load() << setw(14) << attempts.load() / seconds
+            << setw(14) << (attempts > 0 ? 100.0 * throttled / attempts.load() : 0.0) << endl;
+    };
+    phase("legit, no limit", false, false);
+    phase("legit, limited", false, true);
+    phase("attack, no limit", true, false);
+    phase("attack, limited", true, true);
+    loginThrottling = true;
+}
 
-    FriendNode* currentFriend = friendList;
-    while (currentFriend != nullptr) {
-        if (currentFriend->status == "active") {
-            currentFriend->user->newsfeedStack.push(newPost);
+//the workload with the hot-path histograms off and on, alternating and keeping each
+//side's best run, then the cost of one record and the metrics of the last run,
+//written to path, or to the report when path is empty
+void benchMetrics(int userCount, long long opCount, const string& path, ostream& report) {
+    vector<Command> commands = generateWorkload(userCount, opCount, 42);
+    const int rounds = 5;
+    double best[2] = { 1e300, 1e300 };
+    for (int round = 0; round < rounds; round++) {
+        for (int side = 0; side < 2; side++) {
+            int enabled = (round + side) % 2; //neither side always runs first
+            shutdownEngine();
+            initEngine();
+            resetMetrics();
+            metricsEnabled = enabled != 0;
+            auto start = chrono::steady_clock::now();
+            for (const Command& cmd : commands)
+                executeCommand(cmd, discardStream);
+            best[enabled] = min(best[enabled], chrono::duration<double>(chrono::steady_clock::now() - start).count());
         }
-        currentFriend = currentFriend->next;
     }
-}
+    metricsEnabled = true;
 
-void User::viewOwnPosts()
-{
-    cout << "Your Posts:" << endl;
-    Stack<Post> tempStack = postStack;
-    Post post;
-    while (tempStack.pop(post)) {
+    const int records = 10000000;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < records; i++)
+        recordMetric(HIST_LOGIN_PROBES, i & 7);
+    double recordNanos = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / records;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < records / 10; i++)
+        (void)chrono::steady_clock::now();
+    double clockNanos = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / (records / 10);
+    shutdownEngine();
+    initEngine();
+    resetMetrics();
+    for (const Command& cmd : commands)
+        executeCommand(cmd, discardStream);
 
-        char timeStr[26];
-        ctime_s(timeStr, sizeof(timeStr), &post.dateTime);
+    //the wall-clock difference is within run-to-run noise on a busy machine, so the
+    //cost is also worked out from what the instrumentation did: every record, plus
+    //two clock reads per timed fan-out
+    vector<HistogramTotals> totals(HIST_COUNT);
+    collectMetrics(totals.data());
+    uint64_t recorded = 0;
+    for (const HistogramTotals& histogram : totals)
+        recorded += histogram.count;
+    double perCommand = (recorded * recordNanos + totals[HIST_FAN_OUT_NANOS].count * 2 * clockNanos) / commands.size();
 
-        cout << "Posted on: " << timeStr;
-        cout << post.content << endl << endl;
+    report << fixed << setprecision(2);
+    report << "Workload: " << userCount << " users, " << commands.size() << " commands, best of " << rounds << " runs\n";
+    report << left << setw(12) << "metrics" << right << setw(12) << "seconds" << setw(14) << "K ops/s" << endl;
+    for (int enabled = 0; enabled < 2; enabled++) {
+        report << left << setw(12) << (enabled ? "on" : "off") << right << setw(12) << best[enabled]
+            << setw(14) << commands.size() / best[enabled] / 1000.0 << endl;
     }
+    report << "measured overhead: " << (best[1] / best[0] - 1) * 100 << "%\n";
+    report << static_cast<double>(recorded) / commands.size() << " records per command at " << recordNanos
+        << " ns, clock read " << clockNanos << " ns: " << perCommand << " ns of " << best[0] * 1e9 / commands.size()
+        << " ns per command (" << perCommand * commands.size() / (best[0] * 1e9) * 100 << "%)\n\n";
+    if (path.empty())
+        writeMetrics(report);
+    else if (dumpMetrics(path))
+        report << "metrics written to " << path << endl;
+    else
+        report << "cannot write " << path << endl;
 }
 
-void User::viewNewsfeed()
-{
-    cout << "Your Newsfeed:" << endl;
-    Stack<Post> tempStack = newsfeedStack;
-    Post post;
-    while (tempStack.pop(post)) {
-        char timeStr[26];
-        ctime_s(timeStr, sizeof(timeStr), &post.dateTime);
+//a synthetic binary data set: users sharing one stored hash, about degree friends
+//each with skewed endpoints (repeats and self-loops included, for the import to
+//drop), and postsPerUser posts and one message per user at random times; false if
+//a file couldn't be written
+bool writeBulkDataSet(const string& dir, int userCount, int degree, int postsPerUser) {
+    static const char* cities[] = { "Lahore", "Karachi", "Islamabad", "Peshawar", "Quetta", "Multan" };
+    error_code error;
+    filesystem::create_directories(dir, error);
+    mt19937_64 rng(23);
+    PasswordHash hash = hashPassword("password", 1, 1);
+    const time_t base = 1700000000;
+    const int span = 30 * 24 * 3600;
+    string out;
+    FILE* file = nullptr;
+    bool written = true;
+    auto begin = [&](const char* name) {
+        file = fopen((dir + "/" + name + ".bin").c_str(), "wb");
+        putValue(out, BULK_MAGIC);
+        return file != nullptr;
+    };
+    auto spill = [&](size_t threshold) {
+        if (out.size() >= threshold) {
+            written = written && fwrite(out.data(), 1, out.size(), file) == out.size();
+            out.clear();
+        }
+    };
+    auto finish = [&]() {
+        spill(0);
+        written = fclose(file) == 0 && written;
+        return written;
+    };
+    auto skewed = [&]() {
+        return static_cast<uint32_t>(pow(static_cast<double>(userCount), uniform_real_distribution<double>(0, 1)(rng))) - 1;
+    };
 
-        cout << "Posted on: " << timeStr;
-        cout << post.content << endl << endl;
+    if (!begin("users"))
+        return false;
+    for (int i = 0; i < userCount; i++) {
+        putString(out, "user" + to_string(i));
+        putString(out, passwordField(hash));
+        putString(out, cities[i % 6]);
+        spill(1 << 20);
+    }
+    if (!finish())
+        return false;
+    if (!begin("friends"))
+        return false;
+    for (long long i = 0; i < static_cast<long long>(userCount) * degree / 2; i++) {
+        putValue(out, skewed());
+        putValue(out, static_cast<uint32_t>(rng() % userCount));
+        spill(1 << 20);
+    }
+    if (!finish())
+        return false;
+    if (!begin("posts"))
+        return false;
+    for (long long i = 0; i < static_cast<long long>(userCount) * postsPerUser; i++) {
+        putValue(out, static_cast<uint32_t>(rng() % userCount));
+        putValue(out, static_cast<int64_t>(base + static_cast<time_t>(rng() % span)));
+        putString(out, "post " + to_string(i));
+        spill(1 << 20);
     }
+    if (!finish())
+        return false;
+    if (!begin("messages"))
+        return false;
+    for (int i = 0; i < userCount; i++) {
+        putValue(out, static_cast<uint32_t>(i));
+        putValue(out, static_cast<uint32_t>(rng() % userCount));
+        putValue(out, static_cast<int64_t>(base + static_cast<time_t>(rng() % span)));
+        putString(out, "hello");
+        spill(1 << 20);
+    }
+    return finish();
 }
 
-void User::sendFriendRequest(User* toUser)
-{
-    if (toUser == nullptr) {
-        cout << "User not found." << endl;
+//bulk import of a synthetic binary data set phase by phase, the export in both
+//formats and the CSV import, against signing up and befriending the first users one
+//at a time
+void benchImport(int userCount, int degree, int postsPerUser, const string& dir, ostream& report) {
+    const int perItemUsers = min(userCount, 100000);
+    string binaryDir = dir + "/bin", csvDir = dir + "/csv";
+    if (!writeBulkDataSet(binaryDir, userCount, degree, postsPerUser)) {
+        report << "Cannot write the data set to " << binaryDir << endl;
         return;
     }
-    if (isFollowing(toUser)) {
-        cout << "\nFriend request already sent or already friends." << endl;
+
+    report << fixed << setprecision(2);
+    report << userCount << " users, ~" << degree << " friends each, " << postsPerUser << " posts each, "
+        << graphWorkers->workers.size() + 1 << " threads\n";
+    //seconds spent in the phases whose names start with any of prefixes
+    auto spent = [](const BulkStats& stats, initializer_list<const char*> prefixes) {
+        double seconds = 0;
+        for (const pair<string, double>& phase : stats.phases) {
+            for (const char* prefix : prefixes)
+                seconds += phase.first.compare(0, strlen(prefix), prefix) == 0 ? phase.second : 0;
+        }
+        return seconds;
+    };
+    auto summary = [&](const char* label, const BulkStats& stats) {
+        double seconds = spent(stats, { "users", "login", "friend", "posts", "feeds", "messages", "export" });
+        double userSeconds = spent(stats, { "users", "login" }), edgeSeconds = spent(stats, { "friend" });
+        report << left << setw(16) << label << right << setw(9) << seconds << " s" << setw(9)
+            << stats.bytes / seconds / 1048576.0 << " MB/s";
+        if (userSeconds > 0)
+            report << setw(10) << stats.users / userSeconds / 1000.0 << " K users/s" << setw(10)
+                << stats.friendships / edgeSeconds / 1000.0 << " K friendships/s";
+        report << endl;
+    };
+
+    BulkStats stats;
+    shutdownEngine();
+    initEngine();
+    if (!importData(binaryDir, stats)) {
+        report << "import failed" << endl;
         return;
     }
-    toUser->friendRequestQueue.enqueue(this);
-    cout << "\nFriend request sent to " << toUser->name << endl;
-}
+    report << stats.users << " users, " << stats.friendships << " friendships, " << stats.posts << " posts, "
+        << stats.messages << " messages, " << stats.skipped << " rows skipped, "
+        << stats.bytes / 1048576.0 << " MB read\n\n";
+    report << left << setw(30) << "binary import phase" << right << setw(10) << "seconds" << endl;
+    for (const pair<string, double>& phase : stats.phases)
+        report << left << setw(30) << phase.first << right << setw(10) << phase.second << endl;
+    report << endl;
+    summary("binary import", stats);
 
-void User::acceptFriendRequest() {
-    if (friendRequestQueue.isEmpty()) {
-        cout << "\nNo pending friend requests." << endl;
+    BulkStats exported;
+    if (!exportData(csvDir, false, exported)) {
+        report << "csv export failed" << endl;
         return;
     }
-    User* fromUser;
-    while (friendRequestQueue.dequeue(fromUser)) {
-        addFriend(fromUser);                     
-        fromUser->addFriend(this);                
-        fromUser->addNotification("Your friend request to " + name + " has been accepted.");
-        cout << "\nYou are now friends with " << fromUser->name << endl;
-    }
-}
-
-void User::showPendingFriendRequests()
-{
-    if (friendRequestQueue.isEmpty())
-    {
-        cout << "\nNo pending friend requests." << endl;
+    summary("csv export", exported);
+    if (!exportData(dir + "/export", true, exported)) {
+        report << "binary export failed" << endl;
         return;
     }
-    cout << "\nPending Friend Requests:" << endl;
-    friendRequestQueue.display();
-}
+    summary("binary export", exported);
 
-void User::sendMessage(User* toUser, string message) {
-    if (!isFollowing(toUser)) {
-        cout << "You can only message to your followers." << endl;
+    shutdownEngine();
+    initEngine();
+    if (!importData(csvDir, stats)) {
+        report << "csv import failed" << endl;
         return;
     }
+    summary("csv import", stats);
 
-    //add message to conversation stack
-    Conversation* conv = conversations;
-    while (conv != nullptr && conv->withUser != toUser)
-        conv = conv->next;
-
-    if (conv == nullptr) {
-        conv = new Conversation{ toUser, Stack<string>(), conversations };
-        conversations = conv;
+    //one signup and one addFriend per edge, as onboarding through the menu does
+    shutdownEngine();
+    initEngine();
+    vector<User*> users;
+    auto start = chrono::steady_clock::now();
+    {
+        MappedFile file;
+        file.open(binaryDir + "/users.bin");
+        ByteReader in(file.data + sizeof(uint32_t), file.data + file.size);
+        for (int i = 0; i < perItemUsers; i++) {
+            string name = in.str();
+            PasswordHash hash;
+            storedPassword(in.view(), hash);
+            users.push_back(registerUser(name, hash, in.view()));
+        }
     }
-    conv->messageStack.push("You: " + message);
-
-    //add message to receiver's conversation stack
-    Conversation* recvConv = toUser->conversations;
-    while (recvConv != nullptr && recvConv->withUser != this)
-        recvConv = recvConv->next;
-
-    if (recvConv == nullptr) {
-        recvConv = new Conversation{ this, Stack<string>(), toUser->conversations };
-        toUser->conversations = recvConv;
+    double signupSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    start = chrono::steady_clock::now();
+    uint64_t added = 0;
+    {
+        MappedFile file;
+        file.open(binaryDir + "/friends.bin");
+        ByteReader in(file.data + sizeof(uint32_t), file.data + file.size);
+        while (in.at < in.end) {
+            uint32_t a = in.u32(), b = in.u32();
+            if (a < static_cast<uint32_t>(perItemUsers) && b < static_cast<uint32_t>(perItemUsers) && a != b
+                && users[a]->addFriend(users[b], discardStream)) {
+                users[b]->addFriend(users[a], discardStream);
+                added++;
+            }
+        }
     }
-    recvConv->messageStack.push(name + ": " + message);
+    double friendSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    report << "\none at a time, first " << perItemUsers << " users: " << perItemUsers / signupSeconds / 1000.0
+        << " K signups/s, " << added / friendSeconds / 1000.0 << " K friendships/s (" << added << " edges)" << endl;
 
-    //add notification to receiver
-    toUser->notificationQueue.enqueue("New message from " + name);
+    error_code error;
+    filesystem::remove_all(binaryDir, error);
+    filesystem::remove_all(csvDir, error);
+    filesystem::remove_all(dir + "/export", error);
 }
 
-void User::viewMessages(User* withUser) {
-    Conversation* conv = conversations;
-    while (conv != nullptr && conv->withUser != withUser)
-        conv = conv->next;
+#ifdef __linux__
+//one client of the load generator: a connection logged in as its own user,
+//keeping depth requests in flight and timing each from send to answer
+struct LoadConnection {
+    int fd;
+    int userIndex;
+    string in;
+    deque<uint64_t> sentAt; //ns, one per request in flight
+};
 
-    if (conv == nullptr || conv->messageStack.isEmpty()) {
-        cout << "\nNo messages with " << withUser->name << endl;
-        return;
+//the request a load connection sends next, drawn from a read-heavy mix
+string loadRequest(int userIndex, int userCount, mt19937& rng) {
+    static const int weights[] = { 30, 10, 10, 10, 10, 5, 5, 10, 5, 3, 2 };
+    static discrete_distribution<int> pick(begin(weights), end(weights));
+    string self = "load" + to_string(userIndex);
+    string other = "load" + to_string(static_cast<int>(rng() % userCount));
+    switch (pick(rng)) {
+    case 0: return "feed " + self + "\n";
+    case 1: return "top " + self + "\n";
+    case 2: return "posts " + self + "\n";
+    case 3: return "post " + self + " load test post " + to_string(rng() % 1000) + "\n";
+    case 4: return "notifications " + self + "\n";
+    case 5: return "request " + self + " " + other + "\n";
+    case 6: return "accept " + self + "\n";
+    case 7: return "message " + self + " " + other + " hello\n";
+    case 8: return "search load" + to_string(rng() % 100) + "\n";
+    case 9: return "followers " + self + "\n";
+    default: return "suggest " + self + "\n";
     }
+}
 
-    cout << "\nMessages from user " << withUser->name << ":" << endl;
-    Stack<string> tempStack = conv->messageStack;
-    string message;
-    while (tempStack.pop(message)) {
-        cout << message << endl;
+//loopback load against an in-process server: connections logged-in clients, each
+//pipelining depth requests, for the given seconds at depth 1 and at depth
+void benchServer(int connections, double seconds, int depth, ostream& report) {
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    //both ends of every connection live in this process
+    int fit = static_cast<int>(min<rlim_t>((limit.rlim_cur - 64) / 2, 1 << 20));
+    if (connections > fit) {
+        report << "open file limit " << limit.rlim_cur << " fits " << fit << " connections" << endl;
+        connections = fit;
     }
-}
+    for (int i = 0; i < connections; i++)
+        createUser("load" + to_string(i), "password" + to_string(i), "Lahore");
 
-void User::addNotification(string notification) {
-    notificationQueue.enqueue(notification);
-}
+    unsigned hardware = max(1u, thread::hardware_concurrency());
+    int generators = max(1u, hardware / 2);
+    int loops = max(1, static_cast<int>(hardware) - generators);
 
-void User::viewNotifications() {
-    if (notificationQueue.isEmpty()) {
-        cout << "\nNo new notifications." << endl;
-        return;
-    }
-    cout << "\nNotifications:" << endl;
-    string notification;
-    while (notificationQueue.dequeue(notification)) {
-        cout << notification << endl;
+    report << fixed << setprecision(2);
+    report << connections << " loopback connections, " << loops << " server loops, " << generators
+        << " generator threads, " << seconds << " s per run\n";
+    report << left << setw(8) << "depth" << right << setw(12) << "requests" << setw(12) << "K req/s"
+        << setw(11) << "p50 us" << setw(11) << "p99 us" << setw(11) << "p999 us" << setw(12) << "max us"
+        << setw(10) << "rejected" << setw(14) << "answers/send" << endl;
+
+    for (int runDepth : { 1, depth }) {
+        RequestServer server(static_cast<int>(hardware));
+        if (!server.start(0, loops, true)) {
+            report << "cannot listen on loopback" << endl;
+            return;
+        }
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(server.port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        vector<LoadConnection> clients(connections);
+        int opened = 0;
+        for (int i = 0; i < connections; i++) {
+            int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+                if (fd >= 0)
+                    close(fd);
+                break;
+            }
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            clients[i].fd = fd;
+            clients[i].userIndex = i;
+            opened++;
+        }
+        clients.resize(opened);
+
+        atomic<bool> measuring(true);
+        vector<vector<uint64_t>> latencies(generators);
+        vector<long long> rejected(generators, 0);
+        auto now = [] {
+            return static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count());
+        };
+        auto generate = [&](int g) {
+            mt19937 rng(1000 + g);
+            int epoll = epoll_create1(EPOLL_CLOEXEC);
+            for (int i = g; i < opened; i += generators) {
+                LoadConnection& client = clients[i];
+                //the login and the first requests behind it go out together
+                string burst = "login load" + to_string(i) + " password" + to_string(i) + "\n";
+                uint64_t sent = now();
+                client.sentAt.push_back(sent);
+                for (int d = 1; d < runDepth; d++) {
+                    burst += loadRequest(i, connections, rng);
+                    client.sentAt.push_back(sent);
+                }
+                ssize_t written = send(client.fd, burst.data(), burst.size(), MSG_NOSIGNAL);
+                (void)written;
+                epoll_event event = {};
+                event.events = EPOLLIN;
+                event.data.ptr = &client;
+                epoll_ctl(epoll, EPOLL_CTL_ADD, client.fd, &event);
+            }
+            epoll_event events[256];
+            char buffer[16384];
+            while (measuring.load(memory_order_relaxed)) {
+                int ready = epoll_wait(epoll, events, 256, 50);
+                for (int e = 0; e < ready; e++) {
+                    LoadConnection& client = *static_cast<LoadConnection*>(events[e].data.ptr);
+                    ssize_t n;
+                    while ((n = recv(client.fd, buffer, sizeof(buffer), 0)) > 0)
+                        client.in.append(buffer, n);
+                    uint64_t received = now();
+                    string next;
+                    size_t pos = 0;
+                    for (;;) {
+                        size_t eol = client.in.find('\n', pos);
+                        if (eol == string::npos)
+                            break;
+                        bool ok = client.in.compare(pos, 3, "OK ") == 0;
+                        size_t length = strtoul(client.in.c_str() + pos + (ok ? 3 : 4), nullptr, 10);
+                        if (client.in.size() < eol + 1 + length)
+                            break;
+                        pos = eol + 1 + length;
+                        if (!ok)
+                            rejected[g]++;
+                        latencies[g].push_back(received - client.sentAt.front());
+                        client.sentAt.pop_front();
+                        next += loadRequest(client.userIndex, connections, rng);
+                        client.sentAt.push_back(received);
+                    }
+                    client.in.erase(0, pos);
+                    if (!next.empty()) {
+                        ssize_t written = send(client.fd, next.data(), next.size(), MSG_NOSIGNAL);
+                        (void)written;
+                    }
+                }
+            }
+            close(epoll);
+        };
+
+        vector<thread> threads;
+        auto start = chrono::steady_clock::now();
+        for (int g = 0; g < generators; g++)
+            threads.emplace_back(generate, g);
+        this_thread::sleep_for(chrono::duration<double>(seconds));
+        measuring = false;
+        for (thread& t : threads)
+            t.join();
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        for (LoadConnection& client : clients)
+            close(client.fd);
+        server.stop();
+
+        vector<uint64_t> all;
+        long long errors = 0;
+        for (int g = 0; g < generators; g++) {
+            all.insert(all.end(), latencies[g].begin(), latencies[g].end());
+            errors += rejected[g];
+        }
+        sort(all.begin(), all.end());
+        report << left << setw(8) << runDepth << right << setw(12) << all.size()
+            << setw(12) << all.size() / elapsed / 1000.0
+            << setw(11) << percentile(all, 0.50) / 1000.0
+            << setw(11) << percentile(all, 0.99) / 1000.0
+            << setw(11) << percentile(all, 0.999) / 1000.0
+            << setw(12) << (all.empty() ? 0 : all.back()) / 1000.0
+            << setw(10) << errors
+            << setw(14) << static_cast<double>(server.requests.load()) / max<uint64_t>(1, server.writes.load()) << endl;
+        if (opened < connections)
+            report << "  only " << opened << " of " << connections << " connections opened" << endl;
     }
 }
 
-void User::addFriend(User* newFriend) {
-    if (newFriend == nullptr) {
-        cout << "Error: Trying to add a null friend." << endl;
-        return;
-    }
-    FriendNode* newNode = new FriendNode{ newFriend, "friend", "active", friendList };
-    friendList = newNode;
+//set by SIGINT/SIGTERM to stop --serve
+volatile sig_atomic_t stopServing = 0;
+
+void onStopSignal(int) {
+    stopServing = 1;
 }
+#endif
 
-bool User::isFollowing(User* otherUser) {
-    FriendNode* current = friendList;
-    while (current != nullptr) {
-        if (current->user == otherUser)
-            return true;
-        current = current->next;
-    }
-    return false;
+void printUsage(const char* program) {
+    cout << "Usage:\n"
+        << "  " << program << "                                       interactive console\n"
+        << "  " << program << " --replay <trace>                      replay a recorded trace\n"
+        << "  " << program << " --generate <trace> [users] [ops] [seed]  write a synthetic trace\n"
+        << "  " << program << " --serve [port] [threads]              serve trace lines over TCP (Linux)\n"
+        << "  " << program << " --import <dir> [store]                 bulk load CSV or binary files into an empty store\n"
+        << "  " << program << " --export <dir> [csv|bin] [store]       write a store out as bulk files\n"
+        << "  " << program << " --bench [users] [ops] [seed]           generate and replay in memory\n"
+        << "  " << program << " --bench-hashtable [max users]          login table insert/lookup rates\n"
+        << "  " << program << " --bench-index [users]                  ordered index by insert order\n"
+        << "  " << program << " --bench-search [max users]             typeahead/fuzzy latency by index size\n"
+        << "  " << program << " --bench-feed [users] [posts]           push vs hybrid fan-out cost\n"
+        << "  " << program << " --bench-alloc [ops]                    slab pool vs heap node churn\n"
+        << "  " << program << " --bench-containers [ops]               stack/queue policies on each element type\n"
+        << "  " << program << " --bench-graph [users] [avg friends]    friend graph on a power-law graph\n"
+        << "  " << program << " --bench-recommend [users] [avg friends]  friend-of-friend suggestion latency and upkeep\n"
+        << "  " << program << " --bench-ranked [users] [avg friends]  ranked feed pages vs a full sort, and their upkeep\n"
+        << "  " << program << " --bench-requests [requests]            batched vs single request accepts\n"
+        << "  " << program << " --bench-threads [users] [ops] [max threads]  concurrent sessions, 1..64 threads\n"
+        << "  " << program << " --bench-shards [users] [ops] [max shards]  city shards on a city-skewed workload, 1..16\n"
+        << "  " << program << " --bench-persist [users] [posts] [dir]  log throughput, snapshot and restart time\n"
+        << "  " << program << " --bench-retention [users] [days] [posts/day] [messages/day] [hot days] [dir]  resident memory over a month with cold storage\n"
+        << "  " << program << " --bench-posts [posts]                  columnar post store vs node-per-post layout\n"
+        << "  " << program << " --bench-passwords [max log2 N]         logins/s per core at each scrypt cost\n"
+        << "  " << program << " --bench-throttle [users] [seconds]     legitimate logins during a credential-stuffing run\n"
+        << "  " << program << " --bench-server [connections] [seconds] [depth]  loopback load on the TCP server\n"
+        << "  " << program << " --bench-metrics [users] [ops] [file]   instrumentation overhead, then the metrics\n"
+        << "  " << program << " --bench-import [users] [avg friends] [posts each] [dir]  bulk import/export vs one at a time\n";
 }
 
-void User::displayFollowers() {
-    cout << "\nYour Followers:" << endl;
-    FriendNode* current = friendList;
-    while (current != nullptr) {
-        cout << current->user->name << " (" << current->status << ")" << endl;
-        current = current->next;
+//headless entry point, never touches the console helpers
+int runDriver(int argc, char* argv[]) {
+    string mode = argv[1];
+    initEngine();
+    //the other modes sign up thousands of users; at the minimum cost their numbers
+    //measure the engine rather than scrypt. the store modes keep real accounts
+    if (mode != "--bench-passwords" && mode != "--serve" && mode != "--import" && mode != "--export") {
+        passwordCost = 1;
+        passwordBlockSize = 1;
     }
-}
 
-void logo()
-{
-    char a = 220;
-    char b = 221;
-    char c = 222;
-    char d = 223;
-    char e = 233;
-    cout << "\n\n\n";
-    setColor(14);
-    cout << "\t" << " INSTAGRAM\n\n";
-    setColor(12);
-    cout << "\t" << a << a << a << a << a << a << a << a << a << a << a << endl;
-    for (int i = 0; i < 2; i++)
-    {
-        if (i == 0)
-        {
-            cout << "\t" << b << "\t";
-            setColor(7);
-            cout << e << " ";
-            setColor(12);
-            cout << c << endl; continue;
+    if (mode == "--replay" && argc >= 3) {
+        vector<Command> commands;
+        if (!loadTrace(argv[2], commands)) {
+            cerr << "Cannot open trace " << argv[2] << endl;
+            return 1;
         }
-        if (i == 1)
-        {
-            setColor(9);
-            cout << "\t" << b << "  " << a << a << a << a << a << "  " << c << endl;
-            cout << "\t" << b << "  " << b << "   " << c << "  " << c << endl;
-            cout << "\t" << b << "  " << b << "   " << c << "  " << c << endl;
-            setColor(6);
-            cout << "\t" << b << "  " << d << d << d << d << d << "  " << c << endl;
+        runWorkload(commands, cout);
+        return 0;
+    }
+    if (mode == "--generate" && argc >= 3) {
+        int users = argc > 3 ? atoi(argv[3]) : 10000;
+        long long ops = argc > 4 ? atoll(argv[4]) : 100000;
+        unsigned seed = argc > 5 ? static_cast<unsigned>(atoi(argv[5])) : 42;
+        ofstream out(argv[2]);
+        if (!out) {
+            cerr << "Cannot write trace " << argv[2] << endl;
+            return 1;
         }
-        cout << "\t" << b << "\t  " << c << endl;
+        for (const Command& cmd : generateWorkload(users, ops, seed))
+            out << formatCommand(cmd) << '\n';
+        return 0;
+    }
+    if (mode == "--serve") {
+#ifdef __linux__
+        uint16_t port = static_cast<uint16_t>(argc > 2 ? atoi(argv[2]) : 7070);
+        int threads = argc > 3 ? max(1, atoi(argv[3])) : max(1, static_cast<int>(thread::hardware_concurrency()));
+        const char* targetMs = getenv("MINSTAGRAM_PASSWORD_MS");
+        passwordCost = calibratePasswordCost(targetMs != nullptr ? atof(targetMs) : PASSWORD_TARGET_MS, passwordBlockSize);
+        readRetention();
+        if (!openStore(STORE_DIRECTORY)) {
+            cerr << "Cannot open the data directory " << STORE_DIRECTORY << endl;
+            return 1;
+        }
+        //unlike the console, a loop thread never waits for fsync: an answer can leave
+        //before its log group is on disk
+        RequestServer server(threads);
+        if (!server.start(port, threads, false)) {
+            cerr << "Cannot listen on port " << port << endl;
+            closeStore(false);
+            return 1;
+        }
+        signal(SIGINT, onStopSignal);
+        signal(SIGTERM, onStopSignal);
+        cout << "Serving on port " << server.port << " with " << threads << " loops, Ctrl+C to stop" << endl;
+        //for a node exporter's textfile collector; "metrics" over the socket is live
+        string metricsPath = string(STORE_DIRECTORY) + "/metrics.prom";
+        auto lastDump = chrono::steady_clock::now();
+        while (!stopServing) {
+            this_thread::sleep_for(chrono::milliseconds(200));
+            if (chrono::steady_clock::now() - lastDump >= chrono::seconds(10)) {
+                dumpMetrics(metricsPath);
+                lastDump = chrono::steady_clock::now();
+            }
+        }
+        server.stop();
+        dumpMetrics(metricsPath);
+        closeStore(true);
+        cout << server.requests.load() << " requests from " << server.accepted.load() << " connections" << endl;
+        return 0;
+#else
+        cerr << "--serve needs epoll (Linux)" << endl;
+        return 1;
+#endif
+    }
+    if ((mode == "--import" || mode == "--export") && argc >= 3) {
+        bool importing = mode == "--import";
+        bool binary = !importing && argc > 3 && string(argv[3]) == "bin";
+        string store = argc > (importing ? 3 : 4) ? argv[importing ? 3 : 4] : STORE_DIRECTORY;
+        const char* targetMs = getenv("MINSTAGRAM_PASSWORD_MS");
+        passwordCost = calibratePasswordCost(targetMs != nullptr ? atof(targetMs) : PASSWORD_TARGET_MS, passwordBlockSize);
+        if (!openStore(store)) {
+            cerr << "Cannot open the data directory " << store << endl;
+            return 1;
+        }
+        if (importing && usersById.size() != 0) {
+            cerr << store << " already holds users; import into an empty store" << endl;
+            closeStore(false);
+            return 1;
+        }
+        BulkStats stats;
+        bool done = importing ? importData(argv[2], stats) : exportData(argv[2], binary, stats);
+        //the import logged nothing, so the snapshot is what makes it durable
+        closeStore(importing && done);
+        if (!done) {
+            cerr << (importing ? "Cannot import " : "Cannot export to ") << argv[2] << endl;
+            return 1;
+        }
+        cout << stats.users << " users, " << stats.friendships << " friendships, " << stats.posts << " posts, "
+            << stats.messages << " messages";
+        if (importing)
+            cout << ", " << stats.duplicates << " repeated names and " << stats.skipped << " bad rows skipped";
+        cout << endl;
+        for (const pair<string, double>& phase : stats.phases)
+            cout << "  " << phase.first << ": " << fixed << setprecision(2) << phase.second << " s" << endl;
+        return 0;
+    }
+    if (mode == "--bench") {
+        int users = argc > 2 ? atoi(argv[2]) : 10000;
+        long long ops = argc > 3 ? atoll(argv[3]) : 100000;
+        unsigned seed = argc > 4 ? static_cast<unsigned>(atoi(argv[4])) : 42;
+        cout << "Workload: " << users << " users, " << ops << " operations, seed " << seed << "\n\n";
+        runWorkload(generateWorkload(users, ops, seed), cout);
+        return 0;
     }
-    cout << "\t" << d << d << d << d << d << d << d << d << d << d << d << endl;
 
+    if (mode == "--bench-hashtable") {
+        size_t maxUsers = argc > 2 ? static_cast<size_t>(atoll(argv[2])) : 1000000;
+        benchHashTable(maxUsers, cout);
+        return 0;
+    }
 
-}
+    if (mode == "--bench-index") {
+        size_t users = argc > 2 ? static_cast<size_t>(atoll(argv[2])) : 1000000;
+        benchUserIndex(users, cout);
+        return 0;
+    }
 
-void loadingScreen() {
-    char a = 177, b = 219;
-    cout << "\n\t Loading...\n";
-    setColor(8);
-    for (int i = 0; i < 25; i++)
-    {
-        cout << a;
+    if (mode == "--bench-search") {
+        size_t maxUsers = argc > 2 ? static_cast<size_t>(atoll(argv[2])) : 1000000;
+        benchSearch(maxUsers, cout);
+        return 0;
     }
-    cout << "\r   ";
-    setColor(6);
-    for (int i = 0; i < 22; ++i) {
-        cout << b;
-        Sleep(100);
+
+    if (mode == "--bench-feed") {
+        int users = argc > 2 ? atoi(argv[2]) : 20000;
+        int posts = argc > 3 ? atoi(argv[3]) : 20000;
+        benchFeed(users, posts, cout);
+        return 0;
     }
-    cout << endl;
-    setColor(7);
 
-}
+    if (mode == "--bench-alloc") {
+        size_t ops = argc > 2 ? static_cast<size_t>(atoll(argv[2])) : 10000000;
+        benchAllocators(ops, cout);
+        return 0;
+    }
 
-void signup() {
-    system("cls");
-    string name, password, city;
-    logo();
-    setColor(6);
-    cout << "\n\n      === Signup ===\n";
-    setColor(14);
-    cout << "\nEnter username: ";
-    setColor(7);
-    cin >> name;
+    if (mode == "--bench-containers") {
+        size_t ops = argc > 2 ? static_cast<size_t>(atoll(argv[2])) : 5000000;
+        benchContainers(ops, cout);
+        return 0;
+    }
 
-    if (loginTable->search(name) != nullptr)
-    {
-        cout << "Username already exists." << endl;
-        system("pause");
-        return;
+    if (mode == "--bench-graph") {
+        int users = argc > 2 ? atoi(argv[2]) : 100000;
+        int degree = argc > 3 ? atoi(argv[3]) : 20;
+        benchFriendGraph(users, degree, cout);
+        return 0;
     }
-    setColor(14);
-    cout << "Enter password (6 characters min): ";
-    setColor(7);
-    cin >> password;
-    if (password.length() < 6)
-    {
-        cout << "Password too weak." << endl;
-        system("pause");
-        return;
+
+    if (mode == "--bench-recommend") {
+        int users = argc > 2 ? atoi(argv[2]) : 100000;
+        int degree = argc > 3 ? atoi(argv[3]) : 20;
+        benchRecommend(users, degree, cout);
+        return 0;
     }
-    setColor(14);
-    cout << "Enter city: ";
-    setColor(7);
-    cin >> city;
 
-    User* newUser = new User(name, password, city);
+    if (mode == "--bench-ranked") {
+        int users = argc > 2 ? atoi(argv[2]) : 100000;
+        int degree = argc > 3 ? atoi(argv[3]) : 20;
+        benchRankedFeed(users, degree, cout);
+        return 0;
+    }
 
-    newUser->next = usersList;
-    usersList = newUser;
+    if (mode == "--bench-requests") {
+        int requests = argc > 2 ? atoi(argv[2]) : 100000;
+        benchFriendRequests(requests, cout);
+        return 0;
+    }
 
-    loginTable->insert(newUser);
-    userSearchTree->insert(newUser);
+    if (mode == "--bench-threads") {
+        int users = argc > 2 ? atoi(argv[2]) : 100000;
+        long long ops = argc > 3 ? atoll(argv[3]) : 1000000;
+        int maxThreads = argc > 4 ? atoi(argv[4]) : 64;
+        benchThreads(users, ops, maxThreads, cout);
+        return 0;
+    }
 
-    cout << "\nSignup successful!" << endl;
-    system("pause");
-}
+    if (mode == "--bench-shards") {
+        int users = argc > 2 ? atoi(argv[2]) : 100000;
+        long long ops = argc > 3 ? atoll(argv[3]) : 1000000;
+        int maxShards = argc > 4 ? atoi(argv[4]) : 8;
+        benchShards(users, ops, maxShards, cout);
+        return 0;
+    }
 
-User* login()
-{
-    system("cls");
-    string name, password;
-    logo();
-    setColor(6);
-    cout << "\n\n      --- Login ---\n";
-    setColor(14);
-    cout << "\nEnter username: ";
-    setColor(7);
-    cin >> name;
-    User* user = loginTable->search(name);
-    if (user == nullptr) {
-        cout << "\nInvalid username." << endl;
-        system("pause");
-        return nullptr;
+    if (mode == "--bench-persist") {
+        int users = argc > 2 ? atoi(argv[2]) : 1000000;
+        int posts = argc > 3 ? atoi(argv[3]) : 10000000;
+        string dir = argc > 4 ? argv[4] : "bench-store";
+        benchPersist(users, posts, dir, cout);
+        return 0;
     }
 
-    int attempts = 0;
-    bool success = false;
-    while (attempts < 3)
-    {
-        setColor(14);
-        cout << "Enter password: ";
-        setColor(7);
-        cin >> password;
-        if (user->password == password)
-        {
-            success = true;
-            break;
-        }
-        else {
-            cout << "\nIncorrect password. Try again." << endl;
-            attempts++;
-        }
+    if (mode == "--bench-retention") {
+#ifndef _WIN32
+        int users = argc > 2 ? atoi(argv[2]) : 20000;
+        int days = argc > 3 ? max(1, atoi(argv[3])) : 30;
+        int posts = argc > 4 ? atoi(argv[4]) : 40000;
+        int messages = argc > 5 ? atoi(argv[5]) : 80000;
+        double hotDays = argc > 6 ? atof(argv[6]) : 7;
+        string dir = argc > 7 ? argv[7] : "bench-retention";
+        benchRetention(users, days, posts, messages, hotDays, dir, cout);
+        return 0;
+#else
+        cerr << "--bench-retention needs mmap over files (POSIX)" << endl;
+        return 1;
+#endif
     }
 
-    if (!success)
-    {
-        cout << "\nToo many failed attempts. Redirecting to main menu." << endl;
-        system("pause");
-        return nullptr;
+    if (mode == "--bench-posts") {
+        int posts = argc > 2 ? atoi(argv[2]) : 10000000;
+        benchPostStore(posts, cout);
+        return 0;
     }
 
-    time(&user->lastLoginTimestamp);
-    loadingScreen();
-    cout << "\nLogin successful!" << endl;
-    system("pause");
-    return user;
-}
+    if (mode == "--bench-passwords") {
+        int maxCost = argc > 2 ? min(atoi(argv[2]), PASSWORD_MAX_COST) : 16;
+        benchPasswords(maxCost, cout);
+        return 0;
+    }
 
-void searchUsers() {
-    system("cls");
-    setColor(6);
-    cout << "======= Search Users =======\n";
-    setColor(7);
-    cout << "Users in the network:" << endl;
-    userSearchTree->inorderTraversal();
-    system("pause");
-}
+    if (mode == "--bench-throttle") {
+        int users = argc > 2 ? atoi(argv[2]) : 100000;
+        double seconds = argc > 3 ? atof(argv[3]) : 3;
+        benchLoginThrottle(users, seconds, cout);
+        return 0;
+    }
 
-void menu(User* currentUser)
-{
+    if (mode == "--bench-import") {
+        int users = argc > 2 ? atoi(argv[2]) : 1000000;
+        int degree = argc > 3 ? atoi(argv[3]) : 50;
+        int posts = argc > 4 ? atoi(argv[4]) : 2;
+        string dir = argc > 5 ? argv[5] : "bench-import";
+        benchImport(users, degree, posts, dir, cout);
+        return 0;
+    }
 
-    setColor(12);
-    cout << "========== Instagram ==========\n";
-    setColor(7);
-    cout << "Welcome ";
-    setColor(13);
-    cout << currentUser->name << endl << endl;
-    setColor(14);
-    cout << "1. View feed\n";
-    cout << "2. View Own Posts\n";
-    cout << "3. Add Post\n";
-    cout << "4. Send Friend Request\n";
-    cout << "5. Accept Friend Requests\n";
-    cout << "6. View Notifications\n";
-    cout << "7. Send Message\n";
-    cout << "8. View Messages\n";
-    cout << "9. Search Users\n";
-    cout << "10. View Followers List\n";
-    cout << "11. Logout\n";
-    cout << "\nEnter choice: ";
+    if (mode == "--bench-metrics") {
+        int users = argc > 2 ? atoi(argv[2]) : 10000;
+        long long ops = argc > 3 ? atoll(argv[3]) : 1000000;
+        string path = argc > 4 ? argv[4] : "";
+        benchMetrics(users, ops, path, cout);
+        return 0;
+    }
+
+#ifdef __linux__
+    if (mode == "--bench-server") {
+        int connections = argc > 2 ? atoi(argv[2]) : 10000;
+        double seconds = argc > 3 ? atof(argv[3]) : 5;
+        int depth = argc > 4 ? max(1, atoi(argv[4])) : 16;
+        benchServer(connections, seconds, depth, cout);
+        return 0;
+    }
+#endif
+
+    printUsage(argv[0]);
+    return 1;
 }
 
-int main()
+int main(int argc, char* argv[])
 {
-    loginTable = new HashTable();
-    userSearchTree = new UserBST();
+    if (argc > 1)
+        return runDriver(argc, argv);
+
+    initEngine();
+    const char* targetMs = getenv("MINSTAGRAM_PASSWORD_MS");
+    passwordCost = calibratePasswordCost(targetMs != nullptr ? atof(targetMs) : PASSWORD_TARGET_MS, passwordBlockSize);
+    readRetention();
+    if (!openStore(STORE_DIRECTORY)) {
+        cerr << "Cannot open the data directory " << STORE_DIRECTORY << endl;
+        return 1;
+    }
+    writeAheadLog->syncCommits = true; //an action the console confirms is on disk
 
     int choice;
     User* currentUser = nullptr;
     do
     {
-        system("cls");
+        clearScreen();
         logo();
         setColor(8);
         cout << "\n\t1. Sign-up: ";
@@ -666,7 +10455,7 @@ int main()
             currentUser = login();
             while (currentUser != nullptr)
             {
-                system("cls");
+                clearScreen();
                 menu(currentUser);
                 setColor(7);
                 cin >> choice;
@@ -674,13 +10463,24 @@ int main()
 
                 if (choice == 1)
                 {
-                    currentUser->viewNewsfeed();
-                    system("pause");
+                    if (askYesNo("Show top posts first? (y/n): ")) {
+                        size_t offset = showRankedFeed(currentUser, cout);
+                        while (offset != 0 && askYesNo("Show more posts? (y/n): "))
+                            offset = showRankedFeed(currentUser, cout, offset);
+                    }
+                    else {
+                        uint32_t cursor = currentUser->viewNewsfeed();
+                        while (cursor != NO_POST && askYesNo("Show older posts? (y/n): "))
+                            cursor = currentUser->viewNewsfeed(cout, cursor);
+                    }
+                    pauseScreen();
                 }
                 else if (choice == 2)
                 {
-                    currentUser->viewOwnPosts();
-                    system("pause");
+                    uint32_t cursor = currentUser->viewOwnPosts();
+                    while (cursor != NO_POST && askYesNo("Show older posts? (y/n): "))
+                        cursor = currentUser->viewOwnPosts(cout, cursor);
+                    pauseScreen();
                 }
 
                 else if (choice == 3)
@@ -691,7 +10491,7 @@ int main()
                     getline(cin, content);
                     currentUser->addPost(content);
                     cout << "Post added." << endl;
-                    system("pause");
+                    pauseScreen();
                 }
 
                 else if (choice == 4)
@@ -701,19 +10501,24 @@ int main()
                     cin >> username;
                     User* toUser = loginTable->search(username);
                     currentUser->sendFriendRequest(toUser);
-                    system("pause");
+                    pauseScreen();
                 }
 
                 else if (choice == 5)
                 {
                     currentUser->showPendingFriendRequests();
-                    currentUser->acceptFriendRequest();
-                    system("pause");
+                    if (!currentUser->friendRequestQueue.isEmpty()) {
+                        if (askYesNo("\nAccept all pending requests? (y/n): "))
+                            currentUser->acceptFriendRequests();
+                        else if (askYesNo("Decline them instead? (y/n): "))
+                            currentUser->declineFriendRequests();
+                    }
+                    pauseScreen();
                 }
                 else if (choice == 6)
                 {
                     currentUser->viewNotifications();
-                    system("pause");
+                    pauseScreen();
                 }
 
                 else if (choice == 7)
@@ -734,7 +10539,7 @@ int main()
                         getline(cin, message);
                         currentUser->sendMessage(toUser, message);
                     }
-                    system("pause");
+                    pauseScreen();
                 }
 
                 else if (choice == 8)
@@ -752,7 +10557,7 @@ int main()
                     {
                         currentUser->viewMessages(withUser);
                     }
-                    system("pause");
+                    pauseScreen();
                 }
                 else if (choice == 9)
                 {
@@ -761,18 +10566,23 @@ int main()
                 else if (choice == 10)
                 {
                     currentUser->displayFollowers();
-                    system("pause");
+                    pauseScreen();
                 }
                 else if (choice == 11)
+                {
+                    showRecommendations(currentUser, cout);
+                    pauseScreen();
+                }
+                else if (choice == 12)
                 {
                     cout << "Logged out from " << currentUser->name << endl;
                     currentUser = nullptr;
-                    system("pause");
+                    pauseScreen();
                 }
                 else
                 {
                     cout << "\nInvalid choice." << endl;
-                    system("pause");
+                    pauseScreen();
                 }
             }
         }
@@ -783,11 +10593,12 @@ int main()
         else
         {
             cout << "\nInvalid choice." << endl;
-            system("pause");
+            pauseScreen();
         }
     } while (choice != 0);
 
+    closeStore(true);
     cout << endl;
-    system("pause");
+    pauseScreen();
     return 0;
-}
\ No newline at end of file
+}
\ No newline at end of file